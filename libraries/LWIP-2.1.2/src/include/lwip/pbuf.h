@@ -223,10 +223,11 @@ struct pbuf {
 #if LWIP_PTPD
   /**
    * a fields that contains the timestamp for when this packet was
-   * received.
+   * received. The subseconds are in the 2^-31 second units of the
+   * Ethernet MAC and are converted to nanoseconds only where needed.
    */
   s32_t time_sec;
-  s32_t time_nsec;
+  u32_t time_subsec;
 #endif
 };
 
@@ -0,0 +1,186 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include "discipline.h"
+#include "test.h"
+
+// Clock Discipline Benchmark
+//
+// Runs every estimator and controller pair of discipline.c against the same
+// simulated clocks, so a servo change can be compared on equal terms for the
+// GPS master and the PTP slave. Each scenario is a local oscillator with a
+// frequency error and random walk wander, measured against the reference with
+// white timestamp noise and occasional delayed samples. The simulation applies
+// each adjustment to the local clock until the next sample, as the servos do.
+//
+// The table lists the rms and largest true offset once settled, the samples
+// to settle within the settle bound and the error of the drift estimate. Each
+// pair must settle and stay within the bounds of the scenario.
+
+// Samples simulated per scenario.
+#define BENCH_SAMPLES           2000
+
+// Samples before the offset is expected to have settled.
+#define BENCH_SETTLE_SAMPLES    200
+
+// Simulated servo scenario.
+typedef struct
+{
+  const char *name;
+  int8_t log_interval;          // Log2 seconds between samples.
+  double freq_ppb;              // Frequency error of the local oscillator.
+  double wander_ppb;            // Random walk of the frequency per sample.
+  double noise_ns;              // Standard deviation of the timestamp noise.
+  uint32_t outlier_rate;        // One in this many samples is delayed.
+  double outlier_ns;            // Largest delay of an outlier.
+  double initial_ns;            // Offset of the first sample.
+  double settle_ns;             // Bound on the offset once settled.
+  double max_rms_ns;            // Bound on the settled rms offset.
+  double max_drift_ppb;         // Bound on the settled drift error.
+  uint32_t expect_steps;        // Steps expected from the initial offset.
+} scenario_t;
+
+// Result of a run.
+typedef struct
+{
+  double rms_ns;
+  double max_ns;
+  double drift_error_ppb;
+  uint32_t settled_at;
+  discipline_stats_t stats;
+} result_t;
+
+// Deterministic pseudo random numbers.
+static uint32_t rand_state;
+static double rand_uniform(void)
+{
+  rand_state = rand_state * 1664525u + 1013904223u;
+  return (double) (rand_state >> 8) / (double) (1u << 24);
+}
+
+// Approximately normal with unit variance.
+static double rand_normal(void)
+{
+  double sum = 0.0;
+  for (int i = 0; i < 12; ++i) sum += rand_uniform();
+  return sum - 6.0;
+}
+
+// Run a scenario with an estimator and controller. Every pair sees the same
+// noise so the results compare directly.
+static void run(const scenario_t *scenario, const discipline_estimator_t *estimator,
+                const discipline_controller_t *controller, result_t *result)
+{
+  discipline_config_t config;
+  discipline_t disc;
+  discipline_sample_t sample;
+  discipline_action_t action;
+  double interval = ldexp(1.0, scenario->log_interval);
+  double offset = scenario->initial_ns;
+  double freq = scenario->freq_ppb;
+  double sum_sq = 0.0;
+  double measured;
+  int32_t adj_ppb = 0;
+  uint32_t settled = 0;
+
+  rand_state = 12345;
+
+  discipline_config_default(&config);
+  config.estimator = estimator;
+  config.controller = controller;
+  discipline_init(&disc, &config);
+  discipline_reset_stats(&disc);
+
+  result->max_ns = 0.0;
+  result->settled_at = BENCH_SAMPLES;
+
+  for (uint32_t i = 0; i < BENCH_SAMPLES; ++i)
+  {
+    // Sample the offset with timestamp noise and the odd delayed sample.
+    measured = offset + scenario->noise_ns * rand_normal();
+    if (scenario->outlier_rate && ((rand_state % scenario->outlier_rate) == 0))
+      measured += scenario->outlier_ns * rand_uniform();
+
+    sample.offset_ns = (int64_t) llround(measured);
+    sample.log_interval = scenario->log_interval;
+    action = discipline_update(&disc, &sample, &adj_ppb);
+
+    // A step removes the measured offset from the clock.
+    if (action == DISCIPLINE_STEP) offset -= (double) sample.offset_ns;
+
+    // Account for the true offset once settled.
+    if (i >= BENCH_SETTLE_SAMPLES)
+    {
+      sum_sq += offset * offset;
+      if (fabs(offset) > result->max_ns) result->max_ns = fabs(offset);
+    }
+
+    // Samples since the offset was last outside the settle bound.
+    settled = (fabs(offset) <= scenario->settle_ns) ? (settled + 1) : 0;
+    if (settled == 1) result->settled_at = i;
+
+    // Run the local clock to the next sample with the adjustment applied.
+    freq += scenario->wander_ppb * rand_normal();
+    offset += (freq + adj_ppb) * interval;
+  }
+
+  discipline_get_stats(&disc, &result->stats);
+  result->rms_ns = sqrt(sum_sq / (BENCH_SAMPLES - BENCH_SETTLE_SAMPLES));
+  result->drift_error_ppb = result->stats.drift_ppb - freq;
+}
+
+int main(void)
+{
+  static const scenario_t scenarios[] =
+  {
+    // GPS PPS capture with the receiver quantization error removed.
+    { "gps pps",           0,  20000.0, 0.5,   20.0,  0,     0.0,     50000.0,  500.0,  100.0,  50.0, 0 },
+    // PTP slave at one sync per second across a quiet switch.
+    { "ptp 1s",            0, -35000.0, 0.5,   50.0,  0,     0.0,    -80000.0, 1000.0,  200.0, 100.0, 0 },
+    // PTP slave at four syncs per second with queueing delay outliers.
+    { "ptp 250ms loaded", -2,  12000.0, 0.2,  100.0, 20, 20000.0,     20000.0, 5000.0, 1500.0, 500.0, 0 },
+    // Start far enough off to be stepped.
+    { "ptp 1s stepped",    0,   5000.0, 0.5,   50.0,  0,     0.0, 250000000.0, 1000.0,  200.0, 100.0, 1 },
+  };
+  static const discipline_estimator_t *estimators[] =
+  {
+    &discipline_estimator_none,
+    &discipline_estimator_exponential
+  };
+  static const discipline_controller_t *controllers[] =
+  {
+    &discipline_controller_pi,
+    &discipline_controller_pid
+  };
+  result_t result;
+
+  printf("%-18s %-12s %-4s %9s %9s %8s %7s %6s %6s\n",
+         "scenario", "estimator", "ctrl", "rms ns", "max ns", "drift", "settle", "steps", "clamps");
+
+  for (uint32_t s = 0; s < sizeof(scenarios) / sizeof(scenarios[0]); ++s)
+  {
+    for (uint32_t e = 0; e < sizeof(estimators) / sizeof(estimators[0]); ++e)
+    {
+      for (uint32_t c = 0; c < sizeof(controllers) / sizeof(controllers[0]); ++c)
+      {
+        run(&scenarios[s], estimators[e], controllers[c], &result);
+
+        printf("%-18s %-12s %-4s %9.1f %9.1f %8.1f %7u %6u %6u\n", scenarios[s].name,
+               estimators[e]->name, controllers[c]->name, result.rms_ns, result.max_ns,
+               result.drift_error_ppb, (unsigned) result.settled_at,
+               (unsigned) result.stats.steps, (unsigned) result.stats.clamps);
+
+        CHECK(result.stats.samples == BENCH_SAMPLES);
+        CHECK(result.stats.steps == scenarios[s].expect_steps);
+        CHECK(result.settled_at < BENCH_SETTLE_SAMPLES);
+        CHECK(result.rms_ns <= scenarios[s].max_rms_ns);
+        CHECK(result.max_ns <= scenarios[s].settle_ns);
+        CHECK(fabs(result.drift_error_ppb) <= scenarios[s].max_drift_ppb);
+      }
+    }
+  }
+
+  return test_report("discipline_bench");
+}
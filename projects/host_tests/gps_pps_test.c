@@ -0,0 +1,345 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <math.h>
+#include "gps_pps.h"
+#include "test.h"
+
+// GPS PPS Capture Mapping Test
+//
+// Drives gps_pps.c against a mock of the TIM2 registers used by the capture
+// path in gps.c. The mock counter runs off its nominal rate by a crystal
+// error and latches CCR1 on each PPS edge and CCR4 on each PTP second of a
+// PTP clock running off true time by a frequency and phase error. The
+// interrupt handlers that read the captures run after an injected latency,
+// as does the GPS thread that maps the edge onto the system time.
+//
+// The mapped edge must match the PTP clock at the true edge to within a few
+// timer counts no matter the latency, where a timestamp taken in the
+// interrupt is off by the latency itself.
+
+// Nominal TIM2 frequency of the NUCLEO-F429ZI (APB1 timer clock).
+#define TIMER_HZ                90000000u
+
+// Largest error of a mapped edge in nanoseconds. A timer count is 11 ns and
+// the counter rate is measured to a count per second, so the mapping is good
+// to a couple of counts over the up to two seconds it is applied.
+#define MAX_EDGE_ERROR_NS       40
+
+// Seconds simulated per scenario. Long enough to wrap the 32-bit counter.
+#define SIM_SECONDS             120
+
+// TIM2 status register flags.
+#define TIM_SR_CC1IF            0x02u
+#define TIM_SR_CC4IF            0x10u
+
+// Mock of the TIM2 registers read by the capture path.
+typedef struct
+{
+  double hz;                    // Actual counter rate.
+  uint32_t base;                // Count at true time zero.
+  uint32_t CCR1;
+  uint32_t CCR4;
+  uint32_t SR;
+} tim_mock_t;
+
+// PTP clock as a frequency and phase error from true time.
+typedef struct
+{
+  double ppb;
+  int64_t phase_ns;
+} ptp_mock_t;
+
+// Simulation events in the order they happen within a second.
+typedef enum
+{
+  EV_CAPTURE_PPS = 0,           // PPS edge latched into CCR1.
+  EV_CAPTURE_PTP,               // PTP trigger output latched into CCR4.
+  EV_TIM_IRQ,                   // TIM2 interrupt reads CCR1.
+  EV_TARGET_IRQ,                // ETH target time interrupt reads CCR4.
+  EV_THREAD                     // GPS thread maps the edge.
+} event_type_t;
+
+typedef struct
+{
+  int64_t time;                 // True time of the event.
+  event_type_t type;
+  int64_t edge_time;            // True time of the PPS edge of the event.
+  int64_t ptp_second;           // PTP second of the event.
+  int64_t latency;              // Injected interrupt latency.
+} event_t;
+
+// Scenario to simulate.
+typedef struct
+{
+  const char *name;
+  double timer_ppm;             // Crystal error of the timer.
+  double ptp_ppb;               // Frequency error of the PTP clock.
+  int64_t ptp_phase_ns;         // Phase of the PTP clock ahead of true time.
+  uint32_t timer_base;          // Counter at true time zero.
+  int64_t max_latency_ns;       // Largest injected interrupt latency.
+} scenario_t;
+
+// Deterministic pseudo random numbers.
+static uint32_t rand_state = 12345;
+static uint32_t rand_next(void)
+{
+  rand_state = rand_state * 1664525u + 1013904223u;
+  return rand_state >> 8;
+}
+
+// Interrupt latency with a long tail. Most interrupts are taken within a few
+// microseconds but some wait for a critical section or a higher priority
+// interrupt.
+static int64_t rand_latency(int64_t max_ns)
+{
+  uint32_t r = rand_next();
+  if ((r % 8) == 0) return (int64_t) (rand_next() % (uint32_t) max_ns);
+  return 200 + (int64_t) (rand_next() % 5000);
+}
+
+// Timer count at a true time.
+static uint32_t tim_mock_count(const tim_mock_t *tim, int64_t time)
+{
+  double ticks = floor(((double) time * tim->hz) / 1e9);
+  return tim->base + (uint32_t) (uint64_t) (int64_t) ticks;
+}
+
+// Latch a capture channel at a true time.
+static void tim_mock_capture(tim_mock_t *tim, uint32_t flag, int64_t time)
+{
+  if (flag == TIM_SR_CC1IF) tim->CCR1 = tim_mock_count(tim, time);
+  if (flag == TIM_SR_CC4IF) tim->CCR4 = tim_mock_count(tim, time);
+  tim->SR |= flag;
+}
+
+// Reading a capture register clears its flag as on the hardware.
+static uint32_t tim_mock_read_ccr1(tim_mock_t *tim)
+{
+  tim->SR &= ~TIM_SR_CC1IF;
+  return tim->CCR1;
+}
+
+static uint32_t tim_mock_read_ccr4(tim_mock_t *tim)
+{
+  tim->SR &= ~TIM_SR_CC4IF;
+  return tim->CCR4;
+}
+
+// PTP clock reading at a true time.
+static int64_t ptp_mock_time(const ptp_mock_t *ptp, int64_t time)
+{
+  return time + ptp->phase_ns + (int64_t) llround((double) time * ptp->ppb / 1e9);
+}
+
+// True time the PTP clock reads a time.
+static int64_t ptp_mock_inverse(const ptp_mock_t *ptp, int64_t systime)
+{
+  return (int64_t) llround((double) (systime - ptp->phase_ns) / (1.0 + ptp->ppb / 1e9));
+}
+
+static int event_compare(const void *a, const void *b)
+{
+  const event_t *ea = (const event_t *) a;
+  const event_t *eb = (const event_t *) b;
+  if (ea->time != eb->time) return (ea->time < eb->time) ? -1 : 1;
+  return (int) ea->type - (int) eb->type;
+}
+
+// Run a scenario and check each mapped edge.
+static void run_scenario(const scenario_t *scenario)
+{
+  static event_t events[SIM_SECONDS * 5];
+  uint32_t event_count = 0;
+  tim_mock_t tim;
+  ptp_mock_t ptp;
+  gps_pps_map_t map;
+  gps_pps_map_t map_copy;
+  uint32_t capture_count = 0;
+  uint32_t capture_seen = 0;
+  uint32_t mapped = 0;
+  int64_t max_error = 0;
+  int64_t max_exti_error = 0;
+  int64_t max_latency = 0;
+  int64_t edge_systime;
+  int64_t error;
+  int64_t exti_error;
+  int64_t qerr_ns;
+  int64_t offset;
+  int32_t correction_ps;
+  int64_t s;
+
+  tim.hz = TIMER_HZ * (1.0 + scenario->timer_ppm / 1e6);
+  tim.base = scenario->timer_base;
+  tim.CCR1 = tim.CCR4 = tim.SR = 0;
+  ptp.ppb = scenario->ptp_ppb;
+  ptp.phase_ns = scenario->ptp_phase_ns;
+
+  gps_pps_map_init(&map, TIMER_HZ);
+
+  // Schedule the events of each second.
+  for (s = 1; s < SIM_SECONDS; ++s)
+  {
+    int64_t edge = s * 1000000000 + (int64_t) (rand_next() % 40000) - 20000;
+    int64_t latency = rand_latency(scenario->max_latency_ns);
+    int64_t target = ptp_mock_inverse(&ptp, s * 1000000000);
+
+    events[event_count++] = (event_t) { edge, EV_CAPTURE_PPS, edge, 0, latency };
+    events[event_count++] = (event_t) { edge + latency, EV_TIM_IRQ, edge, 0, latency };
+    events[event_count++] = (event_t) { edge + latency + 1000000 + (rand_next() % 100000000), EV_THREAD, edge, 0, latency };
+    events[event_count++] = (event_t) { target, EV_CAPTURE_PTP, 0, s, 0 };
+    events[event_count++] = (event_t) { target + rand_latency(scenario->max_latency_ns), EV_TARGET_IRQ, 0, s, 0 };
+  }
+  qsort(events, event_count, sizeof(event_t), event_compare);
+
+  for (uint32_t i = 0; i < event_count; ++i)
+  {
+    const event_t *ev = &events[i];
+
+    switch (ev->type)
+    {
+      case EV_CAPTURE_PPS:
+        tim_mock_capture(&tim, TIM_SR_CC1IF, ev->time);
+        break;
+
+      case EV_CAPTURE_PTP:
+        tim_mock_capture(&tim, TIM_SR_CC4IF, ev->time);
+        break;
+
+      case EV_TIM_IRQ:
+        // As TIM2_IRQHandler. The count marks the edge however late this runs.
+        if (tim.SR & TIM_SR_CC1IF)
+        {
+          capture_count = tim_mock_read_ccr1(&tim);
+          capture_seen += 1;
+        }
+        break;
+
+      case EV_TARGET_IRQ:
+        // As gps_capture_target_callback.
+        if (tim.SR & TIM_SR_CC4IF)
+          gps_pps_map_reference(&map, tim_mock_read_ccr4(&tim), ev->ptp_second * 1000000000);
+        break;
+
+      case EV_THREAD:
+        // As gps_time_sync. The mapping is copied as with the interrupt masked.
+        map_copy = map;
+        if (!gps_pps_map_edge(&map_copy, capture_count, &edge_systime)) break;
+        mapped += 1;
+
+        // The capture path maps the edge onto the PTP clock at the true edge.
+        error = edge_systime - ptp_mock_time(&ptp, ev->edge_time);
+        if (llabs(error) > max_error) max_error = llabs(error);
+        CHECK(llabs(error) <= MAX_EDGE_ERROR_NS);
+
+        // A timestamp taken in the interrupt is late by the latency.
+        exti_error = ptp_mock_time(&ptp, ev->edge_time + ev->latency) - ptp_mock_time(&ptp, ev->edge_time);
+        if (exti_error > max_exti_error) max_exti_error = exti_error;
+        if (ev->latency > max_latency) max_latency = ev->latency;
+
+        // The servo input removes the receiver quantization error. The edge
+        // came qErr after the second so the offset is the PTP clock error at
+        // the second it marks.
+        qerr_ns = ev->edge_time - (ev->edge_time + 500000000) / 1000000000 * 1000000000;
+        correction_ps = (int32_t) (qerr_ns * 1000);
+        offset = gps_pps_offset(ev->edge_time - qerr_ns, correction_ps, edge_systime);
+        error = offset + (ptp_mock_time(&ptp, ev->edge_time) - ev->edge_time);
+        CHECK(llabs(error) <= MAX_EDGE_ERROR_NS);
+        break;
+    }
+  }
+
+  // All but the first couple of seconds map once the rate is measured.
+  CHECK(capture_seen == (SIM_SECONDS - 1));
+  CHECK(mapped >= (SIM_SECONDS - 4));
+
+  // The capture error is independent of a latency far larger than it.
+  CHECK(max_latency > 100 * MAX_EDGE_ERROR_NS);
+  CHECK(max_exti_error > 100 * MAX_EDGE_ERROR_NS);
+
+  printf("%-24s mapped %3u  capture error %3d ns  exti error %6d ns  max latency %6d ns\n",
+         scenario->name, (unsigned) mapped, (int) max_error, (int) max_exti_error, (int) max_latency);
+}
+
+// Reference and edge mapping corner cases.
+static void test_map(void)
+{
+  gps_pps_map_t map;
+  int64_t systime;
+
+  // No mapping until the rate is measured between two references.
+  gps_pps_map_init(&map, TIMER_HZ);
+  CHECK(!gps_pps_map_edge(&map, 0, &systime));
+  gps_pps_map_reference(&map, 1000, 5000000000);
+  CHECK(!gps_pps_map_edge(&map, 1000, &systime));
+  gps_pps_map_reference(&map, 1000 + TIMER_HZ, 6000000000);
+  CHECK(gps_pps_map_edge(&map, 1000 + TIMER_HZ, &systime) && (systime == 6000000000));
+
+  // Half a second either side of the reference, rounded to the nanosecond.
+  CHECK(gps_pps_map_edge(&map, 1000 + TIMER_HZ + TIMER_HZ / 2, &systime) && (systime == 6500000000));
+  CHECK(gps_pps_map_edge(&map, 1000 + TIMER_HZ / 2, &systime) && (systime == 5500000000));
+  CHECK(gps_pps_map_edge(&map, 1000 + TIMER_HZ + 1, &systime) && (systime == 6000000011));
+
+  // Edges more than two seconds from the reference are not mapped.
+  CHECK(!gps_pps_map_edge(&map, 1000 + TIMER_HZ + 3 * TIMER_HZ, &systime));
+  CHECK(!gps_pps_map_edge(&map, 1000 + TIMER_HZ - 3 * TIMER_HZ, &systime));
+
+  // A missed second is measured over the two seconds since the reference.
+  gps_pps_map_reference(&map, 1000 + 3 * TIMER_HZ, 8000000000);
+  CHECK((map.refs == 3) && (map.ref_rate == TIMER_HZ));
+
+  // A spurious capture starts the mapping over.
+  gps_pps_map_reference(&map, 1000 + 3 * TIMER_HZ + TIMER_HZ / 2, 9000000000);
+  CHECK(map.refs == 1);
+  CHECK(!gps_pps_map_edge(&map, 1000 + 3 * TIMER_HZ + TIMER_HZ / 2, &systime));
+
+  // As does a reference that is not whole seconds after the last.
+  gps_pps_map_reference(&map, 1000 + 4 * TIMER_HZ + TIMER_HZ / 2, 10000000000);
+  gps_pps_map_reference(&map, 1000 + 5 * TIMER_HZ + TIMER_HZ / 2, 11000000001);
+  CHECK(map.refs == 1);
+
+  // References across the counter wrap.
+  gps_pps_map_init(&map, TIMER_HZ);
+  gps_pps_map_reference(&map, 0xffffffffu - TIMER_HZ / 2, 1000000000);
+  gps_pps_map_reference(&map, 0xffffffffu - TIMER_HZ / 2 + TIMER_HZ, 2000000000);
+  CHECK((map.refs == 2) && (map.ref_rate == TIMER_HZ));
+  CHECK(gps_pps_map_edge(&map, 0xffffffffu - TIMER_HZ / 2 + TIMER_HZ + TIMER_HZ / 4, &systime) && (systime == 2250000000));
+}
+
+// Servo input arithmetic.
+static void test_offset(void)
+{
+  // The edge marks the second of the PPS time.
+  CHECK(gps_pps_offset(10000000000, 0, 10000000000) == 0);
+  CHECK(gps_pps_offset(10000000000, 0, 10000000250) == -250);
+  CHECK(gps_pps_offset(10000000000, 0, 9999999750) == 250);
+
+  // The correction is rounded to the nearest nanosecond.
+  CHECK(gps_pps_offset(10000000000, 499, 10000000000) == 0);
+  CHECK(gps_pps_offset(10000000000, 500, 10000000000) == 1);
+  CHECK(gps_pps_offset(10000000000, 1499, 10000000000) == 1);
+  CHECK(gps_pps_offset(10000000000, -499, 10000000000) == 0);
+  CHECK(gps_pps_offset(10000000000, -500, 10000000000) == -1);
+  CHECK(gps_pps_offset(10000000000, -1500, 10000000000) == -2);
+
+  // An edge late by its correction is on time.
+  CHECK(gps_pps_offset(10000000000, 12000, 10000000012) == 0);
+  CHECK(gps_pps_offset(10000000000, -12000, 9999999988) == 0);
+}
+
+int main(void)
+{
+  static const scenario_t scenarios[] =
+  {
+    { "ptp second after edge",   20.0, -15000.0, -300000000, 0x10000000u, 500000 },
+    { "ptp second before edge", -35.0,  80000.0,  300000000, 0xf0000000u, 500000 },
+    { "edge near ptp second",     5.0,   -500.0,     -25000, 0x80000000u, 900000 },
+  };
+
+  test_map();
+  test_offset();
+  for (uint32_t i = 0; i < sizeof(scenarios) / sizeof(scenarios[0]); ++i) run_scenario(&scenarios[i]);
+
+  return test_report("gps_pps_test");
+}
@@ -0,0 +1,361 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include "lwip/tcpip.h"
+#include "lwip/udp.h"
+#include "lwip/ip4.h"
+#include "lwip/netif.h"
+#include "lwip/apps/lwiperf.h"
+#include "ptpd.h"
+#include "ethernetif.h"
+#include "tick.h"
+#include "syslog.h"
+#include "shell.h"
+#include "loadbench.h"
+#include "test.h"
+
+// Load Benchmark Host Test
+//
+// Builds loadbench.c against lwIP on the unix port and runs it over a
+// loopback interface against a stand-in peer in the same stack. The peer
+// plays "iperf -s -u" with a UDP pcb that checks the iperf2 stream of each
+// UDP level, and "iperf -s" with the lwiperf TCP server.
+//
+// The lwIP loopback interface feeds looped frames back within a single poll,
+// so a TCP session over it never lets the tcpip thread get to its timeouts.
+// The test interface instead posts each frame to the tcpip thread as the
+// Ethernet interface does, so the pacer and sampling timeouts run between
+// frames as on the node.
+//
+// The PTP statistics are simulated with one servo update a second and an
+// offset that alternates between plus and minus the simulated offset, so the
+// statistics of each level are known. The receive queue drops follow the
+// datagrams the peer receives to check the counts are taken over each level.
+
+// Address of the node and the peer on the loopback interface.
+#define TEST_ADDRESS            "10.0.0.1"
+
+// Seconds of each level.
+#define TEST_LEVEL_SECONDS      2
+
+// Simulated PTP offset in nanoseconds.
+#define TEST_OFFSET_NS          100
+
+// Simulated CPU idle percentage.
+#define TEST_IDLE_PERCENT       75
+
+// Datagrams received by the peer per simulated receive queue drop.
+#define TEST_DATAGRAMS_PER_DROP 16
+
+// Longest time to wait for the run in seconds.
+#define TEST_TIMEOUT_SECONDS    60
+
+// Iperf2 UDP stream seen by the stand-in peer.
+typedef struct
+{
+  uint32_t datagrams;
+  uint32_t bytes;
+  uint32_t first_ms;
+  uint32_t last_ms;
+  int32_t next_id;
+  uint32_t out_of_order;
+  int32_t end_id;
+  bool ended;
+} peer_stream_t;
+
+// Stand-in peer state. Only accessed in the tcpip thread or with the core locked.
+static peer_stream_t peer_streams[LOADBENCH_LEVEL_COUNT];
+static uint32_t peer_stream_count = 0;
+static uint32_t peer_datagrams = 0;
+static uint32_t peer_tcp_bytes = 0;
+static uint32_t peer_tcp_sessions = 0;
+
+// Simulated PTP statistics.
+void ptpd_get_stats(ptpd_stats_t *stats)
+{
+  memset(stats, 0, sizeof(ptpd_stats_t));
+  stats->servo_updates = sys_now() / 1000u;
+  stats->offset_nsec = (stats->servo_updates & 1) ? TEST_OFFSET_NS : -TEST_OFFSET_NS;
+  stats->event_drops = peer_datagrams / TEST_DATAGRAMS_PER_DROP;
+  stats->tx_timestamp_timeouts = stats->servo_updates;
+}
+
+// Simulated Ethernet interface counts.
+void ethernetif_drops(uint32_t *no_buffer, uint32_t *missed, uint32_t *overflow)
+{
+  *no_buffer = 0;
+  *missed = 0;
+  *overflow = 0;
+}
+
+uint32_t ethernetif_get_tx_completion_drops(void)
+{
+  return 0;
+}
+
+uint32_t tick_get_percent_idle(void)
+{
+  return TEST_IDLE_PERCENT;
+}
+
+// Syslog and shell output go to the console.
+void syslog_printf(int severity, const char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+  printf("\n");
+}
+
+// The shell command of the benchmark.
+static shell_func_t test_shell_func = NULL;
+
+int shell_add_command(const char *name, shell_func_t func)
+{
+  test_shell_func = func;
+  return 0;
+}
+
+void shell_puts(const char *str)
+{
+  fputs(str, stdout);
+}
+
+void shell_printf(const char *fmt, ...)
+{
+  va_list args;
+
+  va_start(args, fmt);
+  vprintf(fmt, args);
+  va_end(args);
+}
+
+// Stand-in "iperf -s -u". A datagram id of zero starts a stream and a
+// negative id ends it.
+static void peer_udp_recv(void *arg, struct udp_pcb *pcb, struct pbuf *p, const ip_addr_t *addr, u16_t port)
+{
+  uint8_t header[4];
+  peer_stream_t *stream;
+  int32_t id;
+
+  if (pbuf_copy_partial(p, header, sizeof(header), 0) != sizeof(header))
+  {
+    pbuf_free(p);
+    return;
+  }
+  id = (int32_t) (((uint32_t) header[0] << 24) | ((uint32_t) header[1] << 16) |
+                  ((uint32_t) header[2] << 8) | (uint32_t) header[3]);
+
+  if ((id == 0) && (peer_stream_count < LOADBENCH_LEVEL_COUNT))
+  {
+    stream = &peer_streams[peer_stream_count++];
+    stream->first_ms = sys_now();
+  }
+
+  if (peer_stream_count > 0)
+  {
+    stream = &peer_streams[peer_stream_count - 1];
+    if (id < 0)
+    {
+      stream->ended = true;
+      stream->end_id = id;
+    }
+    else
+    {
+      if (id != stream->next_id) stream->out_of_order += 1;
+      stream->next_id = id + 1;
+      stream->datagrams += 1;
+      stream->bytes += p->tot_len;
+      stream->last_ms = sys_now();
+      peer_datagrams += 1;
+    }
+  }
+
+  pbuf_free(p);
+}
+
+// Stand-in "iperf -s" session report.
+static void peer_tcp_report(void *arg, enum lwiperf_report_type report_type,
+                            const ip_addr_t *local_addr, u16_t local_port,
+                            const ip_addr_t *remote_addr, u16_t remote_port,
+                            u32_t bytes_transferred, u32_t ms_duration, u32_t bandwidth_kbitpsec)
+{
+  peer_tcp_bytes += bytes_transferred;
+  peer_tcp_sessions += 1;
+}
+
+static void peer_start(void)
+{
+  struct udp_pcb *pcb = udp_new();
+
+  if ((pcb == NULL) || (udp_bind(pcb, IP_ADDR_ANY, 5001) != ERR_OK))
+  {
+    printf("cannot start udp peer\n");
+    exit(1);
+  }
+  udp_recv(pcb, peer_udp_recv, NULL);
+
+  if (lwiperf_start_tcp_server_default(peer_tcp_report, NULL) == NULL)
+  {
+    printf("cannot start tcp peer\n");
+    exit(1);
+  }
+}
+
+// Loop a frame back to the stack through the tcpip thread.
+static err_t link_output(struct netif *netif, struct pbuf *p, const ip4_addr_t *ipaddr)
+{
+  struct pbuf *q = pbuf_clone(PBUF_RAW, PBUF_RAM, p);
+
+  if (q == NULL) return ERR_MEM;
+
+  // A full mailbox drops the frame as a full receive ring would.
+  if (tcpip_inpkt(q, netif, ip4_input) != ERR_OK) pbuf_free(q);
+
+  return ERR_OK;
+}
+
+static err_t link_init(struct netif *netif)
+{
+  netif->name[0] = 'l';
+  netif->name[1] = 'k';
+  netif->output = link_output;
+  netif->mtu = 1500;
+
+  return ERR_OK;
+}
+
+static void link_start(void)
+{
+  static struct netif link_netif;
+  ip4_addr_t addr;
+  ip4_addr_t netmask;
+  ip4_addr_t gw;
+
+  ip4addr_aton(TEST_ADDRESS, &addr);
+  IP4_ADDR(&netmask, 255, 255, 255, 0);
+  ip4_addr_set_zero(&gw);
+  netif_add(&link_netif, &addr, &netmask, &gw, NULL, link_init, tcpip_input);
+  netif_set_default(&link_netif);
+  netif_set_link_up(&link_netif);
+  netif_set_up(&link_netif);
+}
+
+static void tcpip_init_done(void *arg)
+{
+  sys_sem_signal((sys_sem_t *) arg);
+}
+
+int main(void)
+{
+  static const uint32_t rates[] = { 2000, 20000 };
+  loadbench_result_t results[LOADBENCH_LEVEL_COUNT];
+  peer_stream_t streams[LOADBENCH_LEVEL_COUNT];
+  uint32_t stream_count;
+  uint32_t peer_kbps;
+  uint32_t count;
+  uint32_t waited;
+  sys_sem_t init_sem;
+
+  // Start lwIP with the stand-in peer on the loopback interface.
+  sys_sem_new(&init_sem, 0);
+  tcpip_init(tcpip_init_done, &init_sem);
+  sys_sem_wait(&init_sem);
+  LOCK_TCPIP_CORE();
+  link_start();
+  peer_start();
+  UNLOCK_TCPIP_CORE();
+
+  loadbench_init();
+
+  // Requests that cannot start a run.
+  CHECK(!loadbench_run("not an address", TEST_LEVEL_SECONDS, NULL, 0));
+  CHECK(!loadbench_is_running());
+
+  // Idle, each UDP rate and TCP against the peer.
+  CHECK(loadbench_run(TEST_ADDRESS, TEST_LEVEL_SECONDS, rates, 2));
+  CHECK(!loadbench_run(TEST_ADDRESS, TEST_LEVEL_SECONDS, rates, 2));
+  for (waited = 0; loadbench_is_running() && (waited < (TEST_TIMEOUT_SECONDS * 10)); ++waited) usleep(100000);
+  CHECK(!loadbench_is_running());
+
+  // Print the results with the shell command.
+  if (test_shell_func)
+  {
+    char *argv[] = { "loadbench", NULL };
+    test_shell_func(1, argv);
+  }
+  CHECK(test_shell_func != NULL);
+
+  LOCK_TCPIP_CORE();
+  count = loadbench_get_results(results, LOADBENCH_LEVEL_COUNT);
+  stream_count = peer_stream_count;
+  memcpy(streams, peer_streams, sizeof(streams));
+  UNLOCK_TCPIP_CORE();
+
+  CHECK(count == 4);
+  if (count != 4) return 1;
+  CHECK(results[0].load == LOADBENCH_LOAD_IDLE);
+  CHECK((results[1].load == LOADBENCH_LOAD_UDP) && (results[1].rate_kbps == rates[0]));
+  CHECK((results[2].load == LOADBENCH_LOAD_UDP) && (results[2].rate_kbps == rates[1]));
+  CHECK(results[3].load == LOADBENCH_LOAD_TCP);
+
+  // The statistics of each level follow the simulated PTP clock.
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    printf("level %u: load %u rate %u sent %u kbps samples %u mean %d rms %u min %d max %d qdrop %u txto %u idle %u%%\n",
+           (unsigned) i, (unsigned) results[i].load, (unsigned) results[i].rate_kbps,
+           (unsigned) results[i].sent_kbps, (unsigned) results[i].samples, (int) results[i].offset_mean,
+           (unsigned) results[i].offset_rms, (int) results[i].offset_min, (int) results[i].offset_max,
+           (unsigned) results[i].queue_drops, (unsigned) results[i].tx_timestamp_timeouts,
+           (unsigned) results[i].idle_percent);
+
+    CHECK(results[i].samples + 1 >= TEST_LEVEL_SECONDS);
+    CHECK(results[i].offset_rms == TEST_OFFSET_NS);
+    CHECK(abs(results[i].offset_mean) <= TEST_OFFSET_NS);
+    CHECK((results[i].samples < 2) || (results[i].offset_min == -TEST_OFFSET_NS));
+    CHECK((results[i].samples < 2) || (results[i].offset_max == TEST_OFFSET_NS));
+    CHECK(results[i].tx_timestamp_timeouts + 1 >= results[i].samples);
+    CHECK(results[i].tx_timestamp_timeouts <= results[i].samples + 1);
+    CHECK(results[i].tx_timestamp_drops == 0);
+    CHECK(results[i].rx_drops == 0);
+    CHECK(results[i].idle_percent == TEST_IDLE_PERCENT);
+  }
+  CHECK(results[0].queue_drops == 0);
+  CHECK(results[3].samples + 1 >= 10);
+
+  // The peer sees a whole iperf2 stream at the rate of each UDP level.
+  CHECK(stream_count == 2);
+  for (uint32_t i = 0; (i < stream_count) && (i < 2); ++i)
+  {
+    const loadbench_result_t *result = &results[i + 1];
+    const peer_stream_t *stream = &streams[i];
+
+    peer_kbps = (stream->last_ms > stream->first_ms) ?
+                (uint32_t) (((uint64_t) stream->bytes * 8u) / (stream->last_ms - stream->first_ms)) : 0;
+    printf("stream %u: datagrams %u peer %u kbps out of order %u end %d\n", (unsigned) i,
+           (unsigned) stream->datagrams, (unsigned) peer_kbps, (unsigned) stream->out_of_order,
+           (int) stream->end_id);
+
+    CHECK(stream->out_of_order == 0);
+    CHECK(stream->ended && (stream->end_id == -(int32_t) stream->datagrams));
+    CHECK(result->sent_kbps >= (result->rate_kbps * 90u) / 100u);
+    CHECK(result->sent_kbps <= (result->rate_kbps * 105u) / 100u);
+    CHECK(peer_kbps >= (result->rate_kbps * 85u) / 100u);
+    CHECK(peer_kbps <= (result->rate_kbps * 110u) / 100u);
+
+    // The drops of the level follow the datagrams the peer received in it.
+    CHECK(result->queue_drops + 2 >= stream->datagrams / TEST_DATAGRAMS_PER_DROP);
+    CHECK(result->queue_drops <= stream->datagrams / TEST_DATAGRAMS_PER_DROP + 2);
+  }
+
+  // The TCP level ran lwiperf client sessions against the peer.
+  CHECK(results[3].sent_kbps > 0);
+  CHECK(peer_tcp_sessions > 0);
+  CHECK(peer_tcp_bytes > 0);
+
+  return test_report("loadbench_test");
+}
@@ -0,0 +1,25 @@
+#ifndef _HAL_SYSTEM_H
+#define _HAL_SYSTEM_H
+
+// Host stand-in for the HAL system header. Only the HAL definitions used by
+// the headers of the sources built on the host are provided.
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "cmsis_compiler.h"
+
+#define UNUSED(X) (void)X
+
+typedef enum
+{
+  DISABLE = 0,
+  ENABLE = !DISABLE
+} FunctionalState;
+
+typedef enum
+{
+  RESET = 0,
+  SET = !RESET
+} FlagStatus, ITStatus;
+
+#endif /* _HAL_SYSTEM_H */
@@ -0,0 +1,57 @@
+#ifndef __LWIPOPTS_H__
+#define __LWIPOPTS_H__
+
+/* lwIP options for the host tests. The stack runs on the unix port with the
+ * tcpip thread and a test interface that loops each frame back through the
+ * tcpip thread, so traffic between the node and a stand-in peer never leaves
+ * the process. */
+#define LWIP_PTPD                       1
+
+#define NO_SYS                          0
+#define LWIP_TIMERS                     1
+#define LWIP_TCPIP_CORE_LOCKING         1
+#define SYS_LIGHTWEIGHT_PROT            1
+#define LWIP_TIMEVAL_PRIVATE            0
+
+#define MEM_ALIGNMENT                   4
+#define MEM_SIZE                        (512 * 1024)
+#define MEMP_NUM_PBUF                   128
+#define MEMP_NUM_UDP_PCB                8
+#define MEMP_NUM_TCP_PCB                8
+#define MEMP_NUM_TCP_PCB_LISTEN         4
+#define MEMP_NUM_TCP_SEG                128
+#define MEMP_NUM_SYS_TIMEOUT            32
+#define MEMP_NUM_TCPIP_MSG_INPKT        128
+#define PBUF_POOL_SIZE                  64
+
+#define LWIP_ARP                        0
+#define LWIP_ETHERNET                   0
+#define LWIP_IPV4                       1
+#define LWIP_IPV6                       0
+#define LWIP_DHCP                       0
+#define LWIP_IGMP                       0
+#define LWIP_DNS                        0
+#define IP_REASSEMBLY                   0
+#define IP_FRAG                         0
+
+#define LWIP_UDP                        1
+#define LWIP_TCP                        1
+#define TCP_MSS                         1460
+#define TCP_WND                         (16 * TCP_MSS)
+#define TCP_SND_BUF                     (16 * TCP_MSS)
+#define TCP_SND_QUEUELEN                64
+
+#define LWIP_NETIF_LOOPBACK             0
+#define LWIP_HAVE_LOOPIF                0
+
+#define TCPIP_MBOX_SIZE                 256
+#define DEFAULT_RAW_RECVMBOX_SIZE       16
+#define DEFAULT_UDP_RECVMBOX_SIZE       16
+#define DEFAULT_TCP_RECVMBOX_SIZE       16
+#define DEFAULT_ACCEPTMBOX_SIZE         16
+
+#define LWIP_NETCONN                    0
+#define LWIP_SOCKET                     0
+#define LWIP_STATS                      0
+
+#endif /* __LWIPOPTS_H__ */
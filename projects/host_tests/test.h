@@ -0,0 +1,33 @@
+#ifndef __TEST_H__
+#define __TEST_H__
+
+#include <stdio.h>
+
+// Host Test Harness
+//
+// Shared by the host tests. Each CHECK counts a check and reports a failed
+// one with its location, and test_report() ends the test with the count of
+// failed checks and the exit status for the test target.
+
+static int test_failures = 0;
+static int test_checks = 0;
+
+#define CHECK(cond) \
+  do \
+  { \
+    test_checks += 1; \
+    if (!(cond)) \
+    { \
+      test_failures += 1; \
+      printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+    } \
+  } while (0)
+
+// Report the checks of the named test and return its exit status.
+static inline int test_report(const char *name)
+{
+  printf("%s: %d of %d checks failed\n", name, test_failures, test_checks);
+  return test_failures ? 1 : 0;
+}
+
+#endif // __TEST_H__
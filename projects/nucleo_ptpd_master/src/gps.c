@@ -1,37 +1,39 @@
 #include <stdio.h>
-#include <ctype.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <stdbool.h>
 #include <string.h>
-#include <time.h>
 #include "cmsis_os2.h"
 #include "rtx_os.h"
 #include "hal_system.h"
+#include "clocks.h"
+#include "discipline.h"
+#include "ethptp.h"
 #include "systime.h"
 #include "syslog.h"
-#include "outputf.h"
 #include "extint.h"
 #include "shell.h"
 #include "gps.h"
+#include "gps_driver.h"
+#include "gps_pps.h"
 
-// Venus638FLPx GPS Receiver
+// GPS Receiver Timing
 //
-// https://www.talkunafraid.co.uk/2012/12/the-ntpi-accurate-time-with-a-raspberry-pi-and-venus638flpx/
+// The receiver independent timing core. The receiver reports the time of day
+// of each second over the serial port and marks the start of the next second
+// with its pulse-per-second (PPS) output. The PPS edge is timestamped against
+// the system time and the system time is disciplined to the reported time.
 //
-// https://www.sparkfun.com/products/retired/11058
+// The receiver driver parses its binary protocol and configures the receiver.
+// NMEA sentences are parsed for all receivers. Drivers able to report the
+// quantization error of the next PPS edge have it applied before the system
+// time is disciplined to the edge.
 //
-// This is the latest version of the SparkFun Venus GPS board; the smallest, most powerful,
-// and most versatile GPS receiver SparkFun carries. It's based on the Venus638FLPx, the
-// successor to the Venus634LPx. The Venus638FLPx outputs standard NMEA-0183 or SkyTraq Binary
-// sentences at a default rate of 9600bps (adjustable to 115200bps), with update rates up to
-// 20Hz!
-//
-// This board includes a SMA connector to attach an external antenna, headers for 3.3V
-// serial data, NAV (lock) indication, Pulse-Per-Second output, and external Flash support.
-// We've also provided solder jumpers to easily configure the power consumption, boot memory,
-// and backup supply. This board requires a regulated 3.3V supply to operate; at full power
-// the board uses up to 90mA, at reduced power it requires up to 60mA.
+// The PPS edge is timestamped either in its EXTI interrupt or by the TIM2
+// input capture. The capture path latches the edge in hardware and maps it
+// onto the system time through the PTP trigger output, which TIM2 captures
+// on its internal trigger input at each PTP second. It is free of interrupt
+// latency but needs the PPS signal wired to the capture pin.
 //
 // GPS Peripheral Configuration
 //
@@ -39,13 +41,12 @@
 //
 // PG14       USART6_TX      GPS_RX
 // PG9        USART6_RX      GPS_TX
-// PF15                      GPS_PPS
+// PF15                      GPS_PPS (EXTI)
+// PA15       TIM2_CH1       GPS_PPS (capture)
 //
 
 #define RX_BUFFER_SIZE          128
 #define TX_BUFFER_SIZE          64
-#define SEND_BUFFER_SIZE        64
-#define PARSE_BUFFER_SIZE       256
 
 #define GPS_EVENT_DATA          0x01u
 #define GPS_EVENT_PPS           0x02u
@@ -53,13 +54,6 @@
 #define GPS_EVENT_TIMER         0x08u
 #define GPS_EVENT_MASK          0x0fu
 
-// Information structure for sending data.
-typedef struct gps_send_info_s
-{
-  uint8_t *buffer;
-  uint16_t count;
-} gps_send_info_t;
-
 // Flag that indicates initial setting of the system clock.
 static volatile bool gps_init_systime = false;
 
@@ -73,18 +67,14 @@ static uint8_t gps_tx_buffer[TX_BUFFER_SIZE];
 static volatile uint16_t gps_tx_tail = 0;
 static volatile uint16_t gps_tx_head = 0;
 
-// GPS NMEA and binary message parsing buffer.
-static uint8_t gps_parse_buffer[PARSE_BUFFER_SIZE];
-static uint16_t gps_parse_count = 0;
-static uint32_t gps_parse_state = 0;
-static uint8_t gps_binary_chksum = 0;
-static uint16_t gps_binary_count = 0;
-
-// GPS binary message send buffer.
-static uint8_t gps_send_buffer[SEND_BUFFER_SIZE];
+// Receiver driver and whether it is within a binary message.
+static const gps_driver_t *gps_driver = &gps_nmea_driver;
+static bool gps_binary_active = false;
 
-// GPS initialization state.
-static uint32_t gps_init_state = 0;
+// GPS configuration state.
+static bool gps_config_started = false;
+static bool gps_config_sent = false;
+static uint32_t gps_config_index = 0;
 
 // Thread for GPS processing.
 static osMutexId_t gps_thread_id = NULL;
@@ -92,46 +82,33 @@ static osMutexId_t gps_thread_id = NULL;
 // Timer for GPS processing.
 static osTimerId_t gps_timer_id = NULL;
 
-// Message ack and nack values.
-static uint8_t gps_message_ack = 0;
-// XXX static uint8_t gps_message_nack = 0;
-
-// Define the maximum rate at which we can adjust the system clock.
-#define GPS_ADJ_FREQ_MAX      5120000
+// Minimum time in the future the PTP trigger output is armed.
+#define GPS_CAPTURE_MARGIN_NS 100000
 
 // Most recent GPS system time (GPS epoch -- nanoseconds since 1980).
 static int64_t gps_sys_time = 0;
 static int64_t gps_pps_time = 0;
 static int64_t gps_start_time = 0;
 static int64_t gps_parse_time = 0;
+static int32_t gps_pps_correction = 0;
+static int32_t gps_next_correction = 0;
+static int32_t gps_last_correction = 0;
 static int64_t gps_time_offset = 0;
-static int32_t gps_clock_adjust = 0;
-static int32_t gps_time_drift = 0;
-static int32_t gps_sync_pgain = 2;
-static int32_t gps_sync_igain = 16;
+
+// Discipline of the system clock to the PPS.
+static discipline_t gps_discipline;
 
 // Flag that indicates GPS configuration is complete.
 static bool gps_configured = false;
 
-// Configure NMEA binary message (Interval in seconds - 0 is disabled)
-//  GGA   01    Fix information
-//  GSA   01    Overall satellite data
-//  GSV   00    Detailed satellite data
-//  GLL   00    Latitue/longitude data
-//  RMC   01    Recommended minimum data for GPS
-//  VTG   01    Vector track and speed over the ground
-//  ZDA   01    Date and time
-static uint8_t gps_msg_config_nmea[9] =
-{
-  //    GGA   GSA   GSV   GLL   RMC   VTG   ZDA
-  0x08, 0x01, 0x01, 0x00, 0x00, 0x01, 0x01, 0x01, 0x00
-};
+// PPS timestamping path.
+static gps_pps_source_t gps_pps_source = GPS_PPS_EXTI;
 
-// Set 1PPS mode to the GPS receiver.
-static uint8_t gps_msg_config_1pps[3] =
-{
-  0x3E, 0x01, 0x00
-};
+// Capture path state. The mapping and the armed PTP second are only written
+// in the Ethernet interrupt.
+static gps_pps_map_t gps_capture_map;
+static int32_t gps_capture_second = 0;
+static volatile uint32_t gps_capture_count = 0;
 
 void USART6_IRQHandler(void)
 {
@@ -221,30 +198,103 @@ void DMA2_Stream1_IRQHandler(void)
   }
 }
 
-// External interrupt line 5-9 handler.
-static void gps_extint_handler(uint32_t extint_line)
+// Handle a PPS edge once it is timestamped.
+static void gps_pps_edge(void)
 {
-  UNUSED(extint_line);
-
-  // Set the time of the interrupt.
-  gps_sys_time = systime_get();
-
   // Was time parsed?
   if (gps_parse_time != 0)
   {
-    // Copy it as the PPS time.
+    // Copy it as the PPS time along with the correction of this edge.
     gps_pps_time = gps_parse_time;
+    gps_pps_correction = gps_next_correction;
 
-    // Reset the parse time.
+    // Reset the parse time and the correction.
     gps_parse_time = 0;
+    gps_next_correction = 0;
 
     // Signal the PPS signal was timestamped.
     osThreadFlagsSet(gps_thread_id, GPS_EVENT_PPS);
   }
 }
 
+// External interrupt line 15 handler.
+static void gps_extint_handler(uint32_t extint_line)
+{
+  UNUSED(extint_line);
+
+  // Set the time of the interrupt.
+  gps_sys_time = systime_get();
+
+  // Handle the timestamped edge.
+  gps_pps_edge();
+}
+
+// TIM2 interrupt handler for the PPS input capture.
+void TIM2_IRQHandler(void)
+{
+  // Was the PPS edge captured?
+  if (LL_TIM_IsActiveFlag_CC1(TIM2))
+  {
+    // Reading the capture clears the flag. The count marks the edge itself,
+    // so it is mapped onto the system time later in the GPS thread.
+    gps_capture_count = LL_TIM_IC_GetCaptureCH1(TIM2);
+
+    // Handle the captured edge.
+    gps_pps_edge();
+  }
+}
+
+// System time of a PTP second. The two clocks differ by whole seconds of
+// epoch, which rounding removes along with the time between the two reads.
+static int64_t gps_capture_systime(int32_t ptp_second)
+{
+  int64_t ptp_ns;
+  int64_t epoch;
+  ptptime_t now;
+
+  ethptp_get_time(&now);
+  ptp_ns = ((int64_t) now.tv_sec * 1000000000) + now.tv_nsec;
+  epoch = systime_get() - ptp_ns;
+  epoch = (epoch + ((epoch < 0) ? -500000000 : 500000000)) / 1000000000;
+
+  return ((int64_t) ptp_second + epoch) * 1000000000;
+}
+
+// PTP second reached or PTP time stepped.
+static void gps_capture_target_callback(bool time_stepped);
+
+// Arm the PTP trigger output for the next PTP second far enough in the future.
+static void gps_capture_arm(void)
+{
+  ptptime_t target;
+
+  ethptp_get_time(&target);
+  target.tv_sec += (target.tv_nsec < (1000000000 - GPS_CAPTURE_MARGIN_NS)) ? 1 : 2;
+  target.tv_nsec = 0;
+  gps_capture_second = target.tv_sec;
+  ethptp_set_target_time(&target, gps_capture_target_callback);
+}
+
+// PTP second reached or PTP time stepped. Called in the Ethernet interrupt.
+static void gps_capture_target_callback(bool time_stepped)
+{
+  if (time_stepped)
+  {
+    // Seconds captured before the step no longer map onto the system time.
+    gps_pps_map_init(&gps_capture_map, gps_capture_map.timer_hz);
+  }
+  else if (LL_TIM_IsActiveFlag_CC4(TIM2))
+  {
+    // TIM2 latched the trigger output at the PTP second.
+    gps_pps_map_reference(&gps_capture_map, LL_TIM_IC_GetCaptureCH4(TIM2), gps_capture_systime(gps_capture_second));
+  }
+
+  // The trigger is one shot so arm the next second.
+  gps_capture_arm();
+}
+
 // Write data to GPS device. Overflows are silently ignored.
-static void gps_write_data(uint8_t *buffer, uint16_t count)
+void gps_write_data(const uint8_t *buffer, uint16_t count)
 {
   uint16_t next;
 
@@ -272,6 +322,65 @@ static void gps_write_data(uint8_t *buffer, uint16_t count)
   LL_USART_EnableIT_TXE(USART6);
 }
 
+// Initialize the TIM2 input capture of the PPS signal and the PTP trigger output.
+static void gps_capture_init(void)
+{
+  LL_GPIO_InitTypeDef gpio_init;
+  LL_TIM_InitTypeDef tbase_init;
+  LL_TIM_IC_InitTypeDef ic_init;
+
+  // Enable peripheral clocks.
+  LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_GPIOA);
+  LL_APB1_GRP1_EnableClock(LL_APB1_GRP1_PERIPH_TIM2);
+
+  // Configure GPIO pin for the PPS signal as TIM2_CH1.
+  LL_GPIO_StructInit(&gpio_init);
+  gpio_init.Pin = LL_GPIO_PIN_15;
+  gpio_init.Mode = LL_GPIO_MODE_ALTERNATE;
+  gpio_init.Pull = LL_GPIO_PULL_DOWN;
+  gpio_init.Alternate = LL_GPIO_AF_1;
+  LL_GPIO_Init(GPIOA, &gpio_init);
+
+  // Start the mapping at the timer base frequency.
+  gps_pps_map_init(&gps_capture_map, clocks_timer_base_frequency(TIM2));
+
+  // Free running 32-bit counter at the timer base frequency.
+  LL_TIM_StructInit(&tbase_init);
+  tbase_init.Prescaler = 0;
+  tbase_init.Autoreload = 0xffffffff;
+  LL_TIM_Init(TIM2, &tbase_init);
+
+  // Channel 1 captures the rising edge of the PPS signal.
+  LL_TIM_IC_StructInit(&ic_init);
+  ic_init.ICPolarity = LL_TIM_IC_POLARITY_RISING;
+  ic_init.ICActiveInput = LL_TIM_ACTIVEINPUT_DIRECTTI;
+  ic_init.ICPrescaler = LL_TIM_ICPSC_DIV1;
+  ic_init.ICFilter = LL_TIM_IC_FILTER_FDIV1;
+  LL_TIM_IC_Init(TIM2, LL_TIM_CHANNEL_CH1, &ic_init);
+
+  // Channel 4 captures the PTP trigger output routed to the internal trigger.
+  LL_TIM_SetRemap(TIM2, LL_TIM_TIM2_ITR1_RMP_ETH_PTP);
+  LL_TIM_SetTriggerInput(TIM2, LL_TIM_TS_ITR1);
+  ic_init.ICActiveInput = LL_TIM_ACTIVEINPUT_TRC;
+  LL_TIM_IC_Init(TIM2, LL_TIM_CHANNEL_CH4, &ic_init);
+
+  // Enable global interrupts for the PPS capture.
+  uint32_t grouping = NVIC_GetPriorityGrouping();
+  uint32_t priority = NVIC_EncodePriority(grouping, 3, 0);
+  NVIC_SetPriority(TIM2_IRQn, priority);
+  NVIC_EnableIRQ(TIM2_IRQn);
+
+  // Interrupt on the PPS edge only. The PTP second is read in the
+  // Ethernet interrupt of the trigger.
+  LL_TIM_EnableIT_CC1(TIM2);
+  LL_TIM_EnableCounter(TIM2);
+
+  // Start the PTP trigger output.
+  NVIC_DisableIRQ(ETH_IRQn);
+  gps_capture_arm();
+  NVIC_EnableIRQ(ETH_IRQn);
+}
+
 // Initialize GPS GPIO, UART and DMA peripherals.
 static void gps_peripheral_init(void)
 {
@@ -305,19 +414,27 @@ static void gps_peripheral_init(void)
   gpio_init.Alternate = LL_GPIO_AF_0;
   LL_GPIO_Init(GPIOF, &gpio_init);
 
-  // Set the EXTI_Line15 callback function.
-  extint_set_callback(LL_EXTI_LINE_15, gps_extint_handler);
-
-  // GPIOC will be used for for EXTI_Line15.
-  LL_SYSCFG_SetEXTISource(LL_SYSCFG_EXTI_PORTF, LL_SYSCFG_EXTI_LINE15);
-
-  // Enable EXTI_Line8 for rising edge change.
-  LL_EXTI_StructInit(&exti_init);
-  exti_init.Line_0_31 = LL_EXTI_LINE_15;
-  exti_init.Mode = LL_EXTI_MODE_IT;
-  exti_init.Trigger = LL_EXTI_TRIGGER_RISING;
-  exti_init.LineCommand = ENABLE;
-  LL_EXTI_Init(&exti_init);
+  // Timestamp the PPS signal by input capture or in its EXTI interrupt.
+  if (gps_pps_source == GPS_PPS_CAPTURE)
+  {
+    gps_capture_init();
+  }
+  else
+  {
+    // Set the EXTI_Line15 callback function.
+    extint_set_callback(LL_EXTI_LINE_15, gps_extint_handler);
+
+    // GPIOF will be used for for EXTI_Line15.
+    LL_SYSCFG_SetEXTISource(LL_SYSCFG_EXTI_PORTF, LL_SYSCFG_EXTI_LINE15);
+
+    // Enable EXTI_Line15 for rising edge change.
+    LL_EXTI_StructInit(&exti_init);
+    exti_init.Line_0_31 = LL_EXTI_LINE_15;
+    exti_init.Mode = LL_EXTI_MODE_IT;
+    exti_init.Trigger = LL_EXTI_TRIGGER_RISING;
+    exti_init.LineCommand = ENABLE;
+    LL_EXTI_Init(&exti_init);
+  }
 
   // Configure GPIO pin for USART6 TX.
   LL_GPIO_StructInit(&gpio_init);
@@ -397,56 +514,18 @@ static void gps_peripheral_init(void)
   LL_USART_Enable(USART6);
 }
 
-// Process the GPS GPZDA NMEA sentence.
-static void gps_process_gpzda_sentence(int argc, char **argv)
+// Set the GPS time of the second just reported by the receiver in nanoseconds
+// since 1980. Called by the receiver driver from the GPS thread.
+void gps_set_parse_time(int64_t gps_time)
 {
-  int hour;
-  int min;
-  int sec;
-  int msec;
-  struct tm gps_tm;
-  time_t seconds1970;
-
-  // Make sure we have the time value.
-  if (argc < 7) return;
-
-  // Parse the hours, minutes, seconds and milliseconds field.
-  if (sinputf(argv[1], "%2u%2u%2u.%3u", &hour, &min, &sec, &msec) != 4) return;
-
-  // Fill in the time structure.
-  memset(&gps_tm, 0, sizeof(gps_tm));
-  gps_tm.tm_sec = sec;
-  gps_tm.tm_min = min;
-  gps_tm.tm_hour = hour;
-  gps_tm.tm_mday = atoi(argv[2]);
-  gps_tm.tm_mon = atoi(argv[3]) - 1;
-  gps_tm.tm_year = atoi(argv[4]) - 1900;
-
-  // Sanity check the date values.  This is to avoid a parsing error
-  // causing the clock to be set to an insane value.  Members tm_wday
-  // and tm_yday are ignored by mktime.
-  if ((gps_tm.tm_sec < 0) || (gps_tm.tm_sec > 59)) return;
-  if ((gps_tm.tm_min < 0) || (gps_tm.tm_min > 59)) return;
-  if ((gps_tm.tm_hour < 0) || (gps_tm.tm_hour > 23)) return;
-  if ((gps_tm.tm_mday < 1) || (gps_tm.tm_mday > 31)) return;
-  if ((gps_tm.tm_mon < 0) || (gps_tm.tm_mon > 11)) return;
-  if ((gps_tm.tm_year < 100) || (gps_tm.tm_year > 140)) return;
-
-  // Get the seconds since 1970 using mktime().
-  seconds1970 = mktime(&gps_tm);
-
-  // Determine the GPS parsed time using mktime().
-  gps_parse_time = ((((int64_t) seconds1970) - 315964800) * 1000000000) + (msec * 1000000);
-
   // We actually want the time of the next PPS so we add 1 second to the PPS time.
-  gps_parse_time += 1000000000;
+  gps_parse_time = gps_time + 1000000000;
 
   // If system time is not yet initialized, we want to capture the next time data
-  // starts so we can initialize the system time from the parsed time. 
-  // Note: There is an important assumption here that GPZDA is the last sentence
-  // in the group of NMEA sentences passed from the GPS device each second. This
-  // assumption seems to hold true for the Venus638FLPx GPS Receiver, but may not
-  // for other receivers.
+  // starts so we can initialize the system time from the parsed time.
+  // Note: There is an important assumption here that the time of day is
+  // reported last in the group of messages passed from the GPS device each
+  // second. Receiver drivers configure their receiver so this holds.
   if (!gps_init_systime)
   {
     // Enable the next RXNE interrupt.
@@ -454,268 +533,31 @@ static void gps_process_gpzda_sentence(int argc, char **argv)
   }
 }
 
-// Parse out the next comma delinated word from a string.
-// str    Pointer to pointer to the string
-// word   Pointer to pointer of next word.
-// Returns 0:Failed, 1:Successful
-static int gps_nmea_parse(char **str, char **word)
-{
-  // Skip leading spaces.
-  while (**str && isspace((unsigned char) **str)) (*str)++;
-
-  // Set the word.
-  *word = *str;
-
-  // Skip non-comma characters.
-  while (**str && (**str != ',')) (*str)++;
-
-  // Null terminate the word.
-  if (**str) *(*str)++ = 0;
-
-  return (*str != *word) ? 1 : 0;
-}
-
-// Process the GPS NMEA sentence.
-static void gps_process_nmea_sentence(char *sentence)
-{
-  int i;
-  int argc = 0;
-  char *argv[16];
-
-  // XXX outputf("%s\n", sentence);
-
-  // We avoid further processing non-GPZDA sentences.
-  if (strncmp(sentence, "$GPZDA", 6) == 0)
-  {
-    // Parse the NMEA sentence into comma deliminated fields.
-    for (i = 0; i < (sizeof(argv) / sizeof(char *)); ++i)
-    {
-      gps_nmea_parse(&sentence, &argv[i]);
-      if (*argv[i] != 0) ++argc;
-    }
-
-    // Is this an NMEA sentence we care about?
-    if (strcmp(argv[0], "$GPZDA") == 0)
-    {
-      // Process teh GPZDA sentence.
-      gps_process_gpzda_sentence(argc, argv);
-    }
-  }
-}
-
-// Process the binary message.
-static void gps_process_binary_message(uint8_t *buffer, uint16_t count)
+// Set the correction in picoseconds of the next PPS edge. This is the time of
+// the actual edge less the time it marks. Called by the receiver driver from
+// the GPS thread between two edges.
+void gps_set_pulse_correction(int32_t correction_ps)
 {
-  // Determine the message type.
-  if ((count == 2) && (buffer[0] == 0x83))
-  {
-    // ACK message. Set the request message ID.
-    gps_message_ack = buffer[1];
-    // XXX outputf("ack received 0x%02x\n", buffer[1]);
-  }
-#if 0
-  else if ((count == 2) && (buffer[0] == 0x84))
-  {
-    // NACK message. Set the request message ID.
-    gps_message_nack = buffer[1];
-    // XXX outputf("nack received 0x%02x\n", buffer[1]);
-  }
-#endif
-  else
-  {
-    // XXX outputf("unknown message received 0x%02x %d\n", buffer[0], count);
-  }
+  gps_next_correction = correction_ps;
 }
 
 // Parse the GPS data buffer looking for known data.
 static void gps_parse(uint8_t *buffer, uint16_t count)
 {
+  bool binary_active;
+
   // Parse the buffer a single character at a time.
   while (count)
   {
-    // Handle the parsing state.
-    switch (gps_parse_state)
-    {
-      case 0:
-        // Is this the start of an NMEA sentence or binary message?
-        if (*buffer == '$')
-        {
-          // Reset the NMEA sentence parsing information.
-          gps_parse_buffer[0] = *buffer;
-          gps_parse_count = 1;
-
-          // Move to the next state to parse the NMEA sentence.
-          gps_parse_state = 1;
-        }
-        else if (*buffer == 0xA0)
-        {
-          // Reset the binary parsing information.
-          gps_binary_count = 0;
-          gps_binary_chksum = 0;
-          gps_parse_count = 0;
-
-          // Move to the next state to parse the binary message.
-          gps_parse_state = 2;
-        }
-        break;
-
-      case 1:
-        // Is this the end the NMEA sentence?
-        if ((*buffer == '\n') || (*buffer == '\r'))
-        {
-          // Null terminate the buffer.
-          gps_parse_buffer[gps_parse_count] = 0;
-
-          // Process the NMEA statement as a string buffer.
-          gps_process_nmea_sentence((char *) gps_parse_buffer);
-
-          // Return to the start state.
-          gps_parse_state = 0;
-        }
-        else if (*buffer == 0xA0)
-        {
-          // Reset the binary parsing information.
-          gps_binary_count = 0;
-          gps_binary_chksum = 0;
-
-          // Move to the next state to parse the binary message.
-          gps_parse_state = 2;
-        }
-        else
-        {
-          // Make sure we are parsing a properly formatted NMEA sentence.
-          if ((*buffer > ' ') && (*buffer <= '~'))
-          {
-            // Be careful not to overflow the buffer.
-            if (gps_parse_count < (PARSE_BUFFER_SIZE - 1))
-            {
-              // Insert the character into the NMEA buffer.
-              gps_parse_buffer[gps_parse_count] = *buffer;
-              gps_parse_count += 1;
-            }
-            else
-            {
-              // Buffer overflow! Return to the start state.
-              gps_parse_state = 0;
-            }
-          }
-          else
-          {
-            // Invalid character. Return to the start state.
-            gps_parse_state = 0;
-          }
-        }
-        break;
+    // Give the character to the binary parser of the receiver first.
+    binary_active = gps_binary_active;
+    if (gps_driver->parse) gps_binary_active = gps_driver->parse(*buffer);
 
-      case 2:
-        // Is this the second binary message byte?
-        if (*buffer == 0xA1)
-        {
-          // Move to the next state.
-          gps_parse_state = 3;
-        }
-        else
-        {
-          // Return to default state:
-          gps_parse_state = 0;
-        }
-        break;
-
-      case 3:
-        // Get the first byte of the payload length.
-        gps_binary_count = ((uint16_t) *buffer) << 8;
-
-        // Move to the next state.
-        gps_parse_state = 4;
-        break;
-
-      case 4:
-        // Get the next byte of the payload length.
-        gps_binary_count |= (uint16_t) *buffer;
-
-        // Can we parse a binary message of this length?
-        if (gps_binary_count > (PARSE_BUFFER_SIZE - 1))
-        {
-          // Buffer overflow. Return to default state:
-          gps_parse_state = 0;
-        }
-        else
-        {
-          // Move to the next state.
-          gps_parse_state = 5;
-        }
-        break;
-
-      case 5:
-        // Be careful not to overflow the parse buffer.
-        if (gps_parse_count < (PARSE_BUFFER_SIZE - 1))
-        {
-          // Add the character to the parse buffer.
-          gps_parse_buffer[gps_parse_count] = *buffer;
-
-          // Include the character in the checksum.
-          gps_binary_chksum ^= *buffer;
-
-          // Increment the parse count.
-          gps_parse_count += 1;
-
-          // Decrement the count.
-          gps_binary_count -= 1;
-
-          // Have we reached the end?
-          if (gps_binary_count == 0)
-          {
-            // Move to the next state.
-            gps_parse_state = 6;
-          }
-        }
-        else
-        {
-          // Buffer overflow. Return to default state:
-          gps_parse_state = 0;
-        }
-        break;
-
-      case 6:
-        // Does the checksum match?
-        if (gps_binary_chksum == *buffer)
-        {
-          // Move to the next state.
-          gps_parse_state = 7;
-        }
-        else
-        {
-          // Return to default state:
-          gps_parse_state = 0;
-        }
-        break;
-
-      case 7:
-        // Is the byte before the end of the binary message byte?
-        if (*buffer == 0x0D)
-        {
-          // Move to the next state.
-          gps_parse_state = 8;
-        }
-        else
-        {
-          // Return to default state:
-          gps_parse_state = 0;
-        }
-        break;
-
-      case 8:
-        // Is this end of the binary message byte?
-        if (*buffer == 0x0A)
-        {
-          // Everything looks good, process the binary data.
-          gps_process_binary_message(gps_parse_buffer, gps_parse_count);
-        }
-
-        // Return to default state:
-        gps_parse_state = 0;
-        break;
-    }
+    // Characters not part of a binary message are NMEA sentences.
+    if (!binary_active && !gps_binary_active)
+      gps_nmea_parse(*buffer);
+    else
+      gps_nmea_reset();
 
     // Decrement the count and increment the buffer.
     count -= 1;
@@ -733,110 +575,38 @@ static void gps_process_data(uint8_t *buffer, uint16_t count)
   gps_parse(buffer, count);
 }
 
-// Send a properly formatted binary message to the GPS device.
-static void gps_send_message(uint8_t *buffer, uint16_t count)
-{
-  uint16_t i;
-  uint8_t chksum = 0;
-
-  // Make sure the message isn't too big.
-  if (count > (SEND_BUFFER_SIZE - 7)) return;
-
-  // Fill in the first part of the binary message.
-  gps_send_buffer[0] = 0xA0;
-  gps_send_buffer[1] = 0xA1;
-
-  // Fill in the message length.
-  gps_send_buffer[2] = (uint8_t) ((count >> 8) & 0xFF);
-  gps_send_buffer[3] = (uint8_t) (count & 0xFF);
-
-  // Fill in the buffer and compute the checksum.
-  for (i = 0; i < count; ++i)
-  {
-    // Put the data in the checksum.
-    chksum ^= buffer[i];
-
-    // Put in the buffer.
-    gps_send_buffer[4 + i] = buffer[i];
-  }
-
-  // Fill in the payload checksum.
-  gps_send_buffer[4 + count] = chksum;
-
-  // Fill in the last part of the binary message.
-  gps_send_buffer[4 + count + 1] = 0x0D;
-  gps_send_buffer[4 + count + 2] = 0x0A;
-
-  // Write the message to the GPS serial port.
-  gps_write_data(gps_send_buffer, count + 7);
-}
-
 // Process the GPS timer.
 static void gps_process_timer(void)
 {
-  // Handle the init state.
-  switch (gps_init_state)
+  // Give the receiver a second before the first configuration message.
+  if (!gps_config_started)
   {
-    case 0:
-      // Move to the next state.
-      gps_init_state = 1;
-      break;
-
-    case 1:
-      // Configure the GPS NMEA messages.
-      gps_send_message(gps_msg_config_nmea, sizeof(gps_msg_config_nmea));
-
-      // Move to the next state.
-      gps_init_state = 2;
-      break;
-
-    case 2:
-      // Did we receive an ACK for the configure GPS NMEA messages?
-      if (gps_message_ack == 0x08)
-      {
-        // Yes. Move to the next init state.
-        gps_init_state = 3;
-      }
-      else
-      {
-        // No. Try configuration again.
-        gps_init_state = 1;
-      }
-      break;
-
-    case 3:
-      // Configure the GPS 1PPS signal.
-      gps_send_message(gps_msg_config_1pps, sizeof(gps_msg_config_1pps));
+    gps_config_started = true;
+    return;
+  }
 
-      // Move to the next state.
-      gps_init_state = 4;
-      break;
+  // Move on once the last configuration message was acknowledged.
+  if (gps_config_sent && gps_driver->config_acked(gps_config_index))
+  {
+    gps_config_index += 1;
+  }
 
-    case 4:
-      // Did we receive an ACK for the configure GPS 1PPS signal?
-      if (gps_message_ack == 0x3E)
-      {
-        // Yes. Move to the next init state.
-        gps_init_state = 5;
-      }
-      else
-      {
-        // No. Try configuration again.
-        gps_init_state = 3;
-      }
-      break;
+  // Send the next configuration message or send the last one again.
+  if (gps_config_index < gps_driver->config_count)
+  {
+    gps_driver->config_send(gps_config_index);
+    gps_config_sent = true;
+    return;
+  }
 
-    case 5:
-      // We are configured so stop the periodic timer.
-      osTimerStop(gps_timer_id);
+  // We are configured so stop the periodic timer.
+  osTimerStop(gps_timer_id);
 
-      // Set the GPS configured flag.
-      gps_configured = true;
+  // Set the GPS configured flag.
+  gps_configured = true;
 
-      // Log that GPS is now initialized.
-      syslog_printf(SYSLOG_NOTICE, "GPS: successfully configured");
-      break;
-  }
+  // Log that GPS is now initialized.
+  syslog_printf(SYSLOG_NOTICE, "GPS: %s receiver successfully configured", gps_driver->name);
 }
 
 // GPS periodic timer handler. This is processed on the timer thread.
@@ -890,9 +660,21 @@ static void gps_time_init(void)
 // Synchronize the high-precision system clock against the GPS PPS signal.
 static void gps_time_sync(void)
 {
-  int32_t seconds;
-  int32_t nseconds;
+  int32_t adjust;
   char buffer[32];
+  gps_pps_map_t map;
+  discipline_sample_t sample;
+
+  // Map a captured edge onto the system time. The mapping is copied with the
+  // Ethernet interrupt masked as it is updated there. Edges before the
+  // counter rate is known are skipped.
+  if (gps_pps_source == GPS_PPS_CAPTURE)
+  {
+    NVIC_DisableIRQ(ETH_IRQn);
+    map = gps_capture_map;
+    NVIC_EnableIRQ(ETH_IRQn);
+    if (!gps_pps_map_edge(&map, gps_capture_count, &gps_sys_time)) gps_sys_time = 0;
+  }
 
   // Sanity check we have both system and GPS time at time of the PPS.
   if ((gps_sys_time == 0) || (gps_pps_time == 0))
@@ -901,60 +683,47 @@ static void gps_time_sync(void)
   // Count GPS PPS processing.
   // XXX count_add(COUNT_GPS_PPS);
 
-  // Determine clock offset from PPS.
-  gps_time_offset = gps_pps_time - gps_sys_time;
+  // Determine clock offset from PPS corrected for the quantization error.
+  gps_last_correction = gps_pps_correction;
+  gps_time_offset = gps_pps_offset(gps_pps_time, gps_pps_correction, gps_sys_time);
 
-  // Determine the seconds and nanoseconds components of the time offset.
-  seconds = (int32_t) (gps_time_offset / 1000000000);
-  nseconds = (int32_t) (gps_time_offset - (seconds * 1000000000));
+  // The system clock is behind the PPS by the offset.
+  sample.offset_ns = -gps_time_offset;
+  sample.log_interval = 0;
 
-  // Is clock offset from PPS greater than 100 milliseconds?
-  if ((seconds != 0) || (abs(nseconds) > 100000000))
+  // Step or slew the system clock.
+  switch (discipline_update(&gps_discipline, &sample, &adjust))
   {
-    // Determine the current delta from the system time.
-    int64_t delta = systime_get() - gps_sys_time;
-
-    // Apply the delta to the GPS time of the PPS.
-    gps_pps_time += delta;
-
-    // Set the clock to the actual time. Hopefully it should now
-    // be less than 100ms off so synchronization can commence.
-    systime_set(gps_pps_time);
-
-    // Mark the time as initialized.
-    gps_init_systime = true;
-
-    // Get the date from system time.
-    systime_str(buffer, sizeof(buffer));
+    case DISCIPLINE_STEP:
+    {
+      // Determine the current delta from the system time.
+      int64_t delta = systime_get() - gps_sys_time;
 
-    // Log the time being set.
-    syslog_printf(SYSLOG_NOTICE, "GPS: setting %s", buffer);
+      // Apply the delta to the corrected GPS time of the PPS.
+      gps_pps_time = gps_sys_time + gps_time_offset + delta;
 
-    // XXX outputf("offset: %d secs %d nsecs\n", seconds, nseconds);
-    // XXX outputf("resetting system time\n", nseconds);
-  }
-  else
-  {
-    // Implement the PI controller to synchronize time.
+      // Set the clock to the actual time. Hopefully it should now
+      // be less than 100ms off so synchronization can commence.
+      systime_set(gps_pps_time);
 
-    // Keep track of accumulated offset (aka drift).
-    gps_time_drift += nseconds / gps_sync_igain;
+      // Mark the time as initialized.
+      gps_init_systime = true;
 
-    // Clamp the accumlated offset to maximum adjustment frequency.
-    if (gps_time_drift > GPS_ADJ_FREQ_MAX)
-      gps_time_drift = GPS_ADJ_FREQ_MAX;
-    else if (gps_time_drift < -GPS_ADJ_FREQ_MAX)
-      gps_time_drift = -GPS_ADJ_FREQ_MAX;
+      // Get the date from system time.
+      systime_str(buffer, sizeof(buffer));
 
-    // Determine clock adjustment from PI controller output.  The
-    // clock adjustment is a value that represents the frequency
-    // adjustment of the clock (in parts per billion, ppb).
-    gps_clock_adjust = (nseconds / gps_sync_pgain) + gps_time_drift;
+      // Log the time being set.
+      syslog_printf(SYSLOG_NOTICE, "GPS: setting %s", buffer);
+      break;
+    }
 
-    // Adjust the system clock.
-    systime_adjust(gps_clock_adjust);
+    case DISCIPLINE_SLEW:
+      // Adjust the system clock frequency (in parts per billion, ppb).
+      systime_adjust(adjust);
+      break;
 
-    // XXX outputf("offset: %d adjust: %d\n", nseconds, clock_adjust);
+    default:
+      break;
   }
 
   // Reset the GPS and SYS time.
@@ -966,12 +735,16 @@ static bool gps_shell_gps(int argc, char **argv)
 {
   char sign;
   char buffer[32];
+  int32_t correction;
   int64_t offset_secs;
+  discipline_stats_t stats;
 
   // Get the date from system time.
   systime_str(buffer, sizeof(buffer));
 
-  // Print the date.
+  // Print the receiver and the date.
+  shell_printf("RECEIVER: %s%s\n", gps_driver->name, gps_configured ? "" : " (configuring)");
+  shell_printf("PPS: %s\n", (gps_pps_source == GPS_PPS_CAPTURE) ? "capture" : "exti");
   shell_printf("DATE: %s\n", buffer);
 
   // Offset from PPS.
@@ -985,11 +758,24 @@ static bool gps_shell_gps(int argc, char **argv)
     shell_printf("OFFSET: %d nsec\n", (int32_t) gps_time_offset);
   }
 
-  // Drift from PPS.
+  // Drift from PPS shown as the frequency correction of the system clock.
+  correction = -discipline_get_drift(&gps_discipline);
   sign = ' ';
-  if (gps_time_drift > 0) sign = '+';
-  if (gps_time_drift < 0) sign = '-';
-  shell_printf("DRIFT: %c%d.%03d ppm\n", sign, abs(gps_time_drift / 1000), abs(gps_time_drift % 1000));
+  if (correction > 0) sign = '+';
+  if (correction < 0) sign = '-';
+  shell_printf("DRIFT: %c%d.%03d ppm\n", sign, abs(correction / 1000), abs(correction % 1000));
+
+  // Servo statistics.
+  discipline_get_stats(&gps_discipline, &stats);
+  shell_printf("SERVO: %s/%s, %u samples, %u steps, %u clamped\n",
+               gps_discipline.config.estimator->name, gps_discipline.config.controller->name,
+               (unsigned) stats.samples, (unsigned) stats.steps, (unsigned) stats.clamps);
+
+  // Quantization error correction of the last PPS edge.
+  if (gps_driver->pulse_correction)
+  {
+    shell_printf("SAWTOOTH: %d psec\n", (int) gps_last_correction);
+  }
 
   return true;
 }
@@ -1066,9 +852,32 @@ static void gps_thread(void *arg)
 // Initialize GPS UART peripheral.
 void gps_init(void)
 {
+  discipline_config_t config;
+
   // Reset the GPS configured flag.
   gps_configured = false;
 
+  // Select the PPS timestamping path.
+  gps_pps_source = gps_config_pps_source();
+
+  // Discipline the system clock with the shared servo defaults.
+  discipline_config_default(&config);
+  discipline_init(&gps_discipline, &config);
+
+  // Select the receiver driver.
+  switch (gps_config_receiver())
+  {
+    case GPS_RECEIVER_SKYTRAQ:
+      gps_driver = &gps_skytraq_driver;
+      break;
+    case GPS_RECEIVER_UBLOX:
+      gps_driver = &gps_ubx_driver;
+      break;
+    default:
+      gps_driver = &gps_nmea_driver;
+      break;
+  }
+
   // Static control blocks.
   static uint32_t gps_timer_cb[osRtxTimerCbSize/4U] __attribute__((section(".bss.os.timer.cb")));
   static uint32_t gps_thread_cb[osRtxThreadCbSize/4U] __attribute__((section(".bss.os.thread.cb")));
@@ -1120,3 +929,15 @@ bool gps_is_init(void)
   return gps_configured;
 }
 
+// System configurable GPS receiver. The Venus638FLPx is a SkyTraq receiver.
+__WEAK gps_receiver_t gps_config_receiver(void)
+{
+  return GPS_RECEIVER_SKYTRAQ;
+}
+
+// System configurable PPS timestamping path. The PPS signal is wired to the
+// EXTI pin unless a board moves it to the capture pin.
+__WEAK gps_pps_source_t gps_config_pps_source(void)
+{
+  return GPS_PPS_EXTI;
+}
@@ -3,7 +3,27 @@
 
 #include <stdbool.h>
 
+// Supported GPS receivers.
+typedef enum
+{
+  GPS_RECEIVER_NMEA = 0,
+  GPS_RECEIVER_SKYTRAQ,
+  GPS_RECEIVER_UBLOX
+} gps_receiver_t;
+
+// PPS timestamping. The EXTI path reads the system time in the interrupt of
+// the edge. The capture path latches the edge with a timer input capture.
+typedef enum
+{
+  GPS_PPS_EXTI = 0,
+  GPS_PPS_CAPTURE
+} gps_pps_source_t;
+
 void gps_init(void);
 bool gps_is_init(void);
 
+// System configurable functions. Implemented as weak functions.
+gps_receiver_t gps_config_receiver(void);
+gps_pps_source_t gps_config_pps_source(void);
+
 #endif /* __GPS_H__ */
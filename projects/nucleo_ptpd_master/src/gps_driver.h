@@ -0,0 +1,36 @@
+#ifndef __GPS_DRIVER_H__
+#define __GPS_DRIVER_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// GPS receiver driver. The binary parser is given each received byte and
+// returns true while the byte belongs to a binary message. Other bytes go to
+// the NMEA parser shared by all receivers. Configuration messages are sent
+// one at a time each second until the receiver acknowledges them. Drivers
+// with pulse correction report the quantization error of each PPS edge.
+typedef struct gps_driver_s
+{
+  const char *name;
+  bool pulse_correction;
+  bool (*parse)(uint8_t c);
+  uint32_t config_count;
+  void (*config_send)(uint32_t index);
+  bool (*config_acked)(uint32_t index);
+} gps_driver_t;
+
+// Receiver drivers.
+extern const gps_driver_t gps_nmea_driver;
+extern const gps_driver_t gps_skytraq_driver;
+extern const gps_driver_t gps_ubx_driver;
+
+// NMEA sentence parser.
+void gps_nmea_parse(uint8_t c);
+void gps_nmea_reset(void);
+
+// Timing core services for the receiver drivers.
+void gps_write_data(const uint8_t *buffer, uint16_t count);
+void gps_set_parse_time(int64_t gps_time);
+void gps_set_pulse_correction(int32_t correction_ps);
+
+#endif /* __GPS_DRIVER_H__ */
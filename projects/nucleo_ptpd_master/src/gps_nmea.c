@@ -0,0 +1,195 @@
+#include <ctype.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "outputf.h"
+#include "gps_driver.h"
+
+// NMEA-0183 Sentences
+//
+// Sentences are parsed for all receivers. Only the ZDA sentence with the
+// time and date is used, from any talker so GPS and multi-constellation
+// receivers are handled alike. A receiver of this driver alone is expected to
+// send ZDA last each second and needs no configuration.
+
+#define PARSE_BUFFER_SIZE       128
+
+// GPS NMEA sentence parsing buffer.
+static char gps_nmea_buffer[PARSE_BUFFER_SIZE];
+static uint16_t gps_nmea_count = 0;
+static bool gps_nmea_active = false;
+
+// Convert a hex character to its value or -1 if not a hex character.
+static int gps_nmea_hex(char c)
+{
+  if ((c >= '0') && (c <= '9')) return c - '0';
+  if ((c >= 'A') && (c <= 'F')) return c - 'A' + 10;
+  if ((c >= 'a') && (c <= 'f')) return c - 'a' + 10;
+  return -1;
+}
+
+// Process the GPS ZDA NMEA sentence.
+static void gps_nmea_process_zda(int argc, char **argv)
+{
+  int hour;
+  int min;
+  int sec;
+  int msec;
+  int scale;
+  char *fraction;
+  struct tm gps_tm;
+  time_t seconds1970;
+
+  // Make sure we have the time value.
+  if (argc < 7) return;
+
+  // Parse the hours, minutes and seconds field.
+  if (sinputf(argv[1], "%2u%2u%2u", &hour, &min, &sec) != 3) return;
+
+  // Parse the milliseconds from the decimals. Receivers report from none to
+  // three decimals.
+  msec = 0;
+  fraction = strchr(argv[1], '.');
+  if (fraction != NULL)
+  {
+    for (scale = 100, ++fraction; (scale > 0) && isdigit((unsigned char) *fraction); scale /= 10, ++fraction)
+      msec += (*fraction - '0') * scale;
+  }
+
+  // Fill in the time structure.
+  memset(&gps_tm, 0, sizeof(gps_tm));
+  gps_tm.tm_sec = sec;
+  gps_tm.tm_min = min;
+  gps_tm.tm_hour = hour;
+  gps_tm.tm_mday = atoi(argv[2]);
+  gps_tm.tm_mon = atoi(argv[3]) - 1;
+  gps_tm.tm_year = atoi(argv[4]) - 1900;
+
+  // Sanity check the date values.  This is to avoid a parsing error
+  // causing the clock to be set to an insane value.  Members tm_wday
+  // and tm_yday are ignored by mktime.
+  if ((gps_tm.tm_sec < 0) || (gps_tm.tm_sec > 59)) return;
+  if ((gps_tm.tm_min < 0) || (gps_tm.tm_min > 59)) return;
+  if ((gps_tm.tm_hour < 0) || (gps_tm.tm_hour > 23)) return;
+  if ((gps_tm.tm_mday < 1) || (gps_tm.tm_mday > 31)) return;
+  if ((gps_tm.tm_mon < 0) || (gps_tm.tm_mon > 11)) return;
+  if ((gps_tm.tm_year < 100) || (gps_tm.tm_year > 140)) return;
+
+  // Get the seconds since 1970 using mktime().
+  seconds1970 = mktime(&gps_tm);
+
+  // Pass on the GPS time since 1980.
+  gps_set_parse_time(((((int64_t) seconds1970) - 315964800) * 1000000000) + (msec * 1000000));
+}
+
+// Parse out the next comma delinated word from a string.
+// str    Pointer to pointer to the string
+// word   Pointer to pointer of next word.
+// Returns 0:Failed, 1:Successful
+static int gps_nmea_word(char **str, char **word)
+{
+  // Skip leading spaces.
+  while (**str && isspace((unsigned char) **str)) (*str)++;
+
+  // Set the word.
+  *word = *str;
+
+  // Skip non-comma characters.
+  while (**str && (**str != ',')) (*str)++;
+
+  // Null terminate the word.
+  if (**str) *(*str)++ = 0;
+
+  return (*str != *word) ? 1 : 0;
+}
+
+// Process the GPS NMEA sentence.
+static void gps_nmea_process_sentence(char *sentence)
+{
+  int i;
+  int argc = 0;
+  char *argv[16];
+  char *star;
+  uint8_t chksum = 0;
+
+  // Verify the checksum if the sentence has one and strip it.
+  star = strchr(sentence, '*');
+  if (star != NULL)
+  {
+    for (i = 1; (sentence + i) < star; ++i) chksum ^= (uint8_t) sentence[i];
+    if ((gps_nmea_hex(star[1]) < 0) || (gps_nmea_hex(star[2]) < 0)) return;
+    if (chksum != (uint8_t) ((gps_nmea_hex(star[1]) << 4) | gps_nmea_hex(star[2]))) return;
+    *star = 0;
+  }
+
+  // We avoid further processing non-ZDA sentences from any talker.
+  if ((strlen(sentence) >= 6) && (strncmp(sentence + 3, "ZDA,", 4) == 0))
+  {
+    // Parse the NMEA sentence into comma deliminated fields.
+    for (i = 0; i < (sizeof(argv) / sizeof(char *)); ++i)
+    {
+      gps_nmea_word(&sentence, &argv[i]);
+      if (*argv[i] != 0) ++argc;
+    }
+
+    // Process the ZDA sentence.
+    gps_nmea_process_zda(argc, argv);
+  }
+}
+
+// Parse the next character of an NMEA sentence.
+void gps_nmea_parse(uint8_t c)
+{
+  // Is this the start of an NMEA sentence?
+  if (c == '$')
+  {
+    // Reset the NMEA sentence parsing information.
+    gps_nmea_buffer[0] = (char) c;
+    gps_nmea_count = 1;
+    gps_nmea_active = true;
+  }
+  else if (!gps_nmea_active)
+  {
+    // Wait for the start of a sentence.
+  }
+  else if ((c == '\n') || (c == '\r'))
+  {
+    // Null terminate the buffer.
+    gps_nmea_buffer[gps_nmea_count] = 0;
+
+    // Process the NMEA statement as a string buffer.
+    gps_nmea_process_sentence(gps_nmea_buffer);
+
+    // Return to the start state.
+    gps_nmea_active = false;
+  }
+  else if ((c > ' ') && (c <= '~') && (gps_nmea_count < (PARSE_BUFFER_SIZE - 1)))
+  {
+    // Insert the character into the NMEA buffer.
+    gps_nmea_buffer[gps_nmea_count] = (char) c;
+    gps_nmea_count += 1;
+  }
+  else
+  {
+    // Invalid character or buffer overflow. Return to the start state.
+    gps_nmea_active = false;
+  }
+}
+
+// Abandon the NMEA sentence being parsed.
+void gps_nmea_reset(void)
+{
+  gps_nmea_active = false;
+}
+
+// Receiver sending NMEA sentences only.
+const gps_driver_t gps_nmea_driver =
+{
+  .name = "NMEA",
+  .pulse_correction = false,
+  .parse = NULL,
+  .config_count = 0,
+  .config_send = NULL,
+  .config_acked = NULL
+};
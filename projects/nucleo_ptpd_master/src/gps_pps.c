@@ -0,0 +1,111 @@
+#include <stdint.h>
+#include <stdbool.h>
+#include "gps_pps.h"
+
+// GPS PPS Capture Mapping
+//
+// A timestamp taken in the PPS interrupt carries the interrupt latency, which
+// varies with whatever the processor is doing and masking when the edge comes.
+// A timer input capture latches the free running counter on the edge itself.
+// The same timer latches the PTP trigger output at each PTP second, so the
+// count of an edge converts to system time from the nearest second before it
+// at the counter rate measured over the last second. The result is good to a
+// timer count no matter when the capture is read.
+//
+// This file only does arithmetic on captured counts so it can be exercised on
+// a host against simulated counts.
+
+// The counter rate may differ from nominal by the crystal error and the
+// largest PTP clock adjustment. Anything further off is a missed or spurious
+// capture.
+#define GPS_PPS_RATE_TOLERANCE(hz)    ((hz) / 64)
+
+// Longest gap between two references for the counter rate to be measured.
+#define GPS_PPS_MAX_GAP_SECS          16
+
+// Start the mapping over for a timer running at the nominal frequency.
+void gps_pps_map_init(gps_pps_map_t *map, uint32_t timer_hz)
+{
+  map->timer_hz = timer_hz;
+  map->refs = 0;
+  map->ref_count = 0;
+  map->ref_rate = 0;
+  map->ref_time = 0;
+}
+
+// Add the count captured at a PTP second along with the system time of the
+// second. The time is expected to be whole seconds after the last reference.
+void gps_pps_map_reference(gps_pps_map_t *map, uint32_t count, int64_t systime)
+{
+  int64_t elapsed;
+  uint32_t seconds;
+  uint32_t rate;
+  uint32_t max_gap;
+
+  if (map->refs > 0)
+  {
+    // The counter must not have wrapped more than once since the last reference.
+    max_gap = map->timer_hz ? (0xffffffffu / map->timer_hz) : 0;
+    if (max_gap > GPS_PPS_MAX_GAP_SECS) max_gap = GPS_PPS_MAX_GAP_SECS;
+
+    // Measure the counter rate over the whole seconds since the last reference.
+    elapsed = systime - map->ref_time;
+    seconds = (uint32_t) (elapsed / 1000000000);
+    if ((elapsed > 0) && ((elapsed % 1000000000) == 0) && (seconds <= max_gap))
+    {
+      rate = (count - map->ref_count) / seconds;
+      if ((rate > (map->timer_hz - GPS_PPS_RATE_TOLERANCE(map->timer_hz))) &&
+          (rate < (map->timer_hz + GPS_PPS_RATE_TOLERANCE(map->timer_hz))))
+      {
+        map->ref_rate = rate;
+        map->ref_count = count;
+        map->ref_time = systime;
+        map->refs += 1;
+        return;
+      }
+    }
+  }
+
+  // Start over from this reference.
+  map->ref_rate = 0;
+  map->ref_count = count;
+  map->ref_time = systime;
+  map->refs = 1;
+}
+
+// Convert the count captured at an edge to system time. Edges up to two
+// seconds either side of the last reference are mapped. Returns false until
+// the counter rate is known.
+bool gps_pps_map_edge(const gps_pps_map_t *map, uint32_t count, int64_t *systime)
+{
+  int64_t delta;
+  int64_t ticks;
+
+  if ((map->refs < 2) || (map->ref_rate == 0)) return false;
+
+  // Counts since the reference. The edge may be captured just before the
+  // reference of the same second is added.
+  ticks = (int32_t) (count - map->ref_count);
+  if ((ticks > (2 * (int64_t) map->ref_rate)) || (ticks < -(2 * (int64_t) map->ref_rate))) return false;
+
+  // Scale to nanoseconds rounding to the nearest.
+  delta = ticks * 1000000000;
+  delta = (delta + ((delta < 0) ? -(int64_t) (map->ref_rate / 2) : (int64_t) (map->ref_rate / 2))) / map->ref_rate;
+
+  *systime = map->ref_time + delta;
+
+  return true;
+}
+
+// Offset of the system clock from the PPS edge as used by the servo. The PPS
+// time is the time the edge marks and the correction in picoseconds is the
+// time of the actual edge less the time it marks. The edge time is the system
+// time of the edge.
+int64_t gps_pps_offset(int64_t pps_time, int32_t correction_ps, int64_t edge_time)
+{
+  // The edge came the correction after the time it marks, so the PPS time is
+  // moved by the correction rounded to nanoseconds.
+  pps_time += (correction_ps + ((correction_ps < 0) ? -500 : 500)) / 1000;
+
+  return pps_time - edge_time;
+}
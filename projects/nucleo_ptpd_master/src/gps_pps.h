@@ -0,0 +1,26 @@
+#ifndef __GPS_PPS_H__
+#define __GPS_PPS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// Mapping of free running timer capture counts onto the system time. Each
+// reference pairs the count captured at a PTP second with the system time of
+// that second. The counter rate is measured between references, so the
+// mapping follows the frequency adjustments of the PTP clock.
+typedef struct gps_pps_map_s
+{
+  uint32_t timer_hz;
+  uint32_t refs;
+  uint32_t ref_count;
+  uint32_t ref_rate;
+  int64_t ref_time;
+} gps_pps_map_t;
+
+// Timer independent mapping and servo input. These do not touch the hardware.
+void gps_pps_map_init(gps_pps_map_t *map, uint32_t timer_hz);
+void gps_pps_map_reference(gps_pps_map_t *map, uint32_t count, int64_t systime);
+bool gps_pps_map_edge(const gps_pps_map_t *map, uint32_t count, int64_t *systime);
+int64_t gps_pps_offset(int64_t pps_time, int32_t correction_ps, int64_t edge_time);
+
+#endif /* __GPS_PPS_H__ */
@@ -0,0 +1,233 @@
+#include <stdbool.h>
+#include <string.h>
+#include "gps_driver.h"
+
+// Venus638FLPx GPS Receiver
+//
+// https://www.talkunafraid.co.uk/2012/12/the-ntpi-accurate-time-with-a-raspberry-pi-and-venus638flpx/
+//
+// https://www.sparkfun.com/products/retired/11058
+//
+// This is the latest version of the SparkFun Venus GPS board; the smallest, most powerful,
+// and most versatile GPS receiver SparkFun carries. It's based on the Venus638FLPx, the
+// successor to the Venus634LPx. The Venus638FLPx outputs standard NMEA-0183 or SkyTraq Binary
+// sentences at a default rate of 9600bps (adjustable to 115200bps), with update rates up to
+// 20Hz!
+//
+// This board includes a SMA connector to attach an external antenna, headers for 3.3V
+// serial data, NAV (lock) indication, Pulse-Per-Second output, and external Flash support.
+// We've also provided solder jumpers to easily configure the power consumption, boot memory,
+// and backup supply. This board requires a regulated 3.3V supply to operate; at full power
+// the board uses up to 90mA, at reduced power it requires up to 60mA.
+//
+// SkyTraq binary messages are framed by 0xA0 0xA1, a 16-bit big endian payload length,
+// the payload, an XOR checksum of the payload and 0x0D 0x0A.
+
+#define PARSE_BUFFER_SIZE       64
+#define SEND_BUFFER_SIZE        64
+
+// GPS binary message parsing buffer.
+static uint8_t gps_skytraq_buffer[PARSE_BUFFER_SIZE];
+static uint16_t gps_skytraq_count = 0;
+static uint32_t gps_skytraq_state = 0;
+static uint8_t gps_skytraq_chksum = 0;
+static uint16_t gps_skytraq_length = 0;
+
+// GPS binary message send buffer.
+static uint8_t gps_skytraq_send_buffer[SEND_BUFFER_SIZE];
+
+// Message ack value.
+static uint8_t gps_skytraq_ack = 0;
+
+// Configure NMEA binary message (Interval in seconds - 0 is disabled)
+//  GGA   01    Fix information
+//  GSA   01    Overall satellite data
+//  GSV   00    Detailed satellite data
+//  GLL   00    Latitue/longitude data
+//  RMC   01    Recommended minimum data for GPS
+//  VTG   01    Vector track and speed over the ground
+//  ZDA   01    Date and time
+static const uint8_t gps_skytraq_config_nmea[9] =
+{
+  //    GGA   GSA   GSV   GLL   RMC   VTG   ZDA
+  0x08, 0x01, 0x01, 0x00, 0x00, 0x01, 0x01, 0x01, 0x00
+};
+
+// Set 1PPS mode to the GPS receiver.
+static const uint8_t gps_skytraq_config_1pps[3] =
+{
+  0x3E, 0x01, 0x00
+};
+
+// Configuration messages in the order sent.
+static const uint8_t * const gps_skytraq_config[] =
+{
+  gps_skytraq_config_nmea,
+  gps_skytraq_config_1pps
+};
+static const uint16_t gps_skytraq_config_size[] =
+{
+  sizeof(gps_skytraq_config_nmea),
+  sizeof(gps_skytraq_config_1pps)
+};
+
+// Process the binary message.
+static void gps_skytraq_process_message(uint8_t *buffer, uint16_t count)
+{
+  // Determine the message type.
+  if ((count == 2) && (buffer[0] == 0x83))
+  {
+    // ACK message. Set the request message ID.
+    gps_skytraq_ack = buffer[1];
+  }
+}
+
+// Parse the next character of a binary message. Returns true while the
+// character belongs to a binary message.
+static bool gps_skytraq_parse(uint8_t c)
+{
+  // Handle the parsing state.
+  switch (gps_skytraq_state)
+  {
+    case 0:
+      // Is this the start of a binary message?
+      if (c != 0xA0) return false;
+
+      // Reset the binary parsing information.
+      gps_skytraq_length = 0;
+      gps_skytraq_chksum = 0;
+      gps_skytraq_count = 0;
+
+      // Move to the next state to parse the binary message.
+      gps_skytraq_state = 1;
+      return true;
+
+    case 1:
+      // Is this the second binary message byte?
+      if (c != 0xA1) break;
+
+      // Move to the next state.
+      gps_skytraq_state = 2;
+      return true;
+
+    case 2:
+      // Get the first byte of the payload length.
+      gps_skytraq_length = ((uint16_t) c) << 8;
+
+      // Move to the next state.
+      gps_skytraq_state = 3;
+      return true;
+
+    case 3:
+      // Get the next byte of the payload length.
+      gps_skytraq_length |= (uint16_t) c;
+
+      // Can we parse a binary message of this length?
+      if ((gps_skytraq_length == 0) || (gps_skytraq_length > PARSE_BUFFER_SIZE)) break;
+
+      // Move to the next state.
+      gps_skytraq_state = 4;
+      return true;
+
+    case 4:
+      // Add the character to the parse buffer and the checksum.
+      gps_skytraq_buffer[gps_skytraq_count] = c;
+      gps_skytraq_chksum ^= c;
+      gps_skytraq_count += 1;
+
+      // Have we reached the end?
+      if (gps_skytraq_count == gps_skytraq_length) gps_skytraq_state = 5;
+      return true;
+
+    case 5:
+      // Does the checksum match?
+      if (gps_skytraq_chksum != c) break;
+
+      // Move to the next state.
+      gps_skytraq_state = 6;
+      return true;
+
+    case 6:
+      // Is the byte before the end of the binary message byte?
+      if (c != 0x0D) break;
+
+      // Move to the next state.
+      gps_skytraq_state = 7;
+      return true;
+
+    case 7:
+      // Is this end of the binary message byte?
+      if (c == 0x0A)
+      {
+        // Everything looks good, process the binary data.
+        gps_skytraq_process_message(gps_skytraq_buffer, gps_skytraq_count);
+      }
+      break;
+  }
+
+  // Return to default state.
+  gps_skytraq_state = 0;
+  return false;
+}
+
+// Send a properly formatted binary message to the GPS device.
+static void gps_skytraq_send_message(const uint8_t *buffer, uint16_t count)
+{
+  uint16_t i;
+  uint8_t chksum = 0;
+
+  // Make sure the message isn't too big.
+  if (count > (SEND_BUFFER_SIZE - 7)) return;
+
+  // Fill in the first part of the binary message.
+  gps_skytraq_send_buffer[0] = 0xA0;
+  gps_skytraq_send_buffer[1] = 0xA1;
+
+  // Fill in the message length.
+  gps_skytraq_send_buffer[2] = (uint8_t) ((count >> 8) & 0xFF);
+  gps_skytraq_send_buffer[3] = (uint8_t) (count & 0xFF);
+
+  // Fill in the buffer and compute the checksum.
+  for (i = 0; i < count; ++i)
+  {
+    // Put the data in the checksum.
+    chksum ^= buffer[i];
+
+    // Put in the buffer.
+    gps_skytraq_send_buffer[4 + i] = buffer[i];
+  }
+
+  // Fill in the payload checksum.
+  gps_skytraq_send_buffer[4 + count] = chksum;
+
+  // Fill in the last part of the binary message.
+  gps_skytraq_send_buffer[4 + count + 1] = 0x0D;
+  gps_skytraq_send_buffer[4 + count + 2] = 0x0A;
+
+  // Write the message to the GPS serial port.
+  gps_write_data(gps_skytraq_send_buffer, count + 7);
+}
+
+// Send a configuration message.
+static void gps_skytraq_config_send(uint32_t index)
+{
+  gps_skytraq_ack = 0;
+  gps_skytraq_send_message(gps_skytraq_config[index], gps_skytraq_config_size[index]);
+}
+
+// Was the configuration message acknowledged? The ACK holds its message ID.
+static bool gps_skytraq_config_acked(uint32_t index)
+{
+  return gps_skytraq_ack == gps_skytraq_config[index][0];
+}
+
+// SkyTraq Venus receiver.
+const gps_driver_t gps_skytraq_driver =
+{
+  .name = "SkyTraq",
+  .pulse_correction = false,
+  .parse = gps_skytraq_parse,
+  .config_count = sizeof(gps_skytraq_config) / sizeof(gps_skytraq_config[0]),
+  .config_send = gps_skytraq_config_send,
+  .config_acked = gps_skytraq_config_acked
+};
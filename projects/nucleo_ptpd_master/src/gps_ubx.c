@@ -0,0 +1,240 @@
+#include <stdbool.h>
+#include <string.h>
+#include "hal_system.h"
+#include "gps_driver.h"
+
+// u-blox GPS Receiver
+//
+// UBX binary messages are framed by 0xB5 0x62, the message class and ID, a
+// 16-bit little endian payload length, the payload and a two byte Fletcher
+// checksum over the class through the payload.
+//
+// The receiver is configured at its default 9600 baud to send only the ZDA
+// sentence for the time of day and the UBX-TIM-TP message. TIM-TP is sent
+// before each PPS edge and holds the quantization error (qErr) of the edge.
+// The receiver can only place its edge on a tick of its local clock, so each
+// edge is off from the second it marks by up to half that clock period in a
+// sawtooth pattern. Applying qErr to the edge removes the sawtooth, which is
+// tens of nanoseconds of jitter otherwise passed on to every PTP slave.
+
+#define PARSE_BUFFER_SIZE       64
+#define SEND_BUFFER_SIZE        32
+
+// UBX message classes and IDs.
+#define UBX_CLASS_ACK           0x05
+#define UBX_ID_ACK_NAK          0x00
+#define UBX_ID_ACK_ACK          0x01
+#define UBX_CLASS_CFG           0x06
+#define UBX_ID_CFG_MSG          0x01
+#define UBX_CLASS_TIM           0x0D
+#define UBX_ID_TIM_TP           0x01
+#define UBX_CLASS_NMEA          0xF0
+
+// UBX-TIM-TP payload length and flags.
+#define UBX_TIM_TP_LENGTH       16
+#define UBX_TIM_TP_QERR_INVALID 0x10
+
+// GPS binary message parsing buffer.
+static uint8_t gps_ubx_buffer[PARSE_BUFFER_SIZE];
+static uint16_t gps_ubx_count = 0;
+static uint32_t gps_ubx_state = 0;
+static uint8_t gps_ubx_class = 0;
+static uint8_t gps_ubx_id = 0;
+static uint16_t gps_ubx_length = 0;
+static uint8_t gps_ubx_ck_a = 0;
+static uint8_t gps_ubx_ck_b = 0;
+
+// GPS binary message send buffer.
+static uint8_t gps_ubx_send_buffer[SEND_BUFFER_SIZE];
+
+// Set when the last configuration message is acknowledged.
+static bool gps_ubx_acked = false;
+
+// Message rates set by CFG-MSG in the order sent. Standard NMEA sentences
+// other than ZDA are turned off so ZDA comes last each second.
+static const uint8_t gps_ubx_config[][3] =
+{
+  // Class          ID    Rate
+  { UBX_CLASS_NMEA, 0x00, 0x00 },         // GGA
+  { UBX_CLASS_NMEA, 0x01, 0x00 },         // GLL
+  { UBX_CLASS_NMEA, 0x02, 0x00 },         // GSA
+  { UBX_CLASS_NMEA, 0x03, 0x00 },         // GSV
+  { UBX_CLASS_NMEA, 0x04, 0x00 },         // RMC
+  { UBX_CLASS_NMEA, 0x05, 0x00 },         // VTG
+  { UBX_CLASS_NMEA, 0x08, 0x01 },         // ZDA
+  { UBX_CLASS_TIM, UBX_ID_TIM_TP, 0x01 }  // TIM-TP
+};
+
+// Load a little endian value from a payload.
+static uint32_t gps_ubx_load32(const uint8_t *buf)
+{
+  return ((uint32_t) buf[0]) | ((uint32_t) buf[1] << 8) | ((uint32_t) buf[2] << 16) | ((uint32_t) buf[3] << 24);
+}
+
+// Process the binary message.
+static void gps_ubx_process_message(uint8_t msg_class, uint8_t msg_id, uint8_t *buffer, uint16_t count)
+{
+  if ((msg_class == UBX_CLASS_ACK) && (msg_id == UBX_ID_ACK_ACK) && (count == 2))
+  {
+    // ACK message. The payload holds the class and ID acknowledged.
+    if ((buffer[0] == UBX_CLASS_CFG) && (buffer[1] == UBX_ID_CFG_MSG)) gps_ubx_acked = true;
+  }
+  else if ((msg_class == UBX_CLASS_TIM) && (msg_id == UBX_ID_TIM_TP) && (count == UBX_TIM_TP_LENGTH))
+  {
+    // Time pulse message for the next edge. The quantization error is in
+    // picoseconds at offset 8 and the flags are at offset 14.
+    if (!(buffer[14] & UBX_TIM_TP_QERR_INVALID))
+      gps_set_pulse_correction((int32_t) gps_ubx_load32(buffer + 8));
+    else
+      gps_set_pulse_correction(0);
+  }
+}
+
+// Parse the next character of a binary message. Returns true while the
+// character belongs to a binary message.
+static bool gps_ubx_parse(uint8_t c)
+{
+  // Each byte after the sync characters up to the checksum is summed.
+  if ((gps_ubx_state >= 2) && (gps_ubx_state <= 6))
+  {
+    gps_ubx_ck_a += c;
+    gps_ubx_ck_b += gps_ubx_ck_a;
+  }
+
+  // Handle the parsing state.
+  switch (gps_ubx_state)
+  {
+    case 0:
+      // Is this the start of a binary message?
+      if (c != 0xB5) return false;
+
+      // Reset the binary parsing information.
+      gps_ubx_count = 0;
+      gps_ubx_ck_a = 0;
+      gps_ubx_ck_b = 0;
+
+      // Move to the next state to parse the binary message.
+      gps_ubx_state = 1;
+      return true;
+
+    case 1:
+      // Is this the second sync character?
+      if (c != 0x62) break;
+      gps_ubx_state = 2;
+      return true;
+
+    case 2:
+      // Message class.
+      gps_ubx_class = c;
+      gps_ubx_state = 3;
+      return true;
+
+    case 3:
+      // Message ID.
+      gps_ubx_id = c;
+      gps_ubx_state = 4;
+      return true;
+
+    case 4:
+      // First byte of the payload length.
+      gps_ubx_length = c;
+      gps_ubx_state = 5;
+      return true;
+
+    case 5:
+      // Second byte of the payload length.
+      gps_ubx_length |= ((uint16_t) c) << 8;
+
+      // Can we parse a binary message of this length?
+      if (gps_ubx_length > PARSE_BUFFER_SIZE) break;
+      gps_ubx_state = (gps_ubx_length > 0) ? 6 : 7;
+      return true;
+
+    case 6:
+      // Add the character to the parse buffer.
+      gps_ubx_buffer[gps_ubx_count] = c;
+      gps_ubx_count += 1;
+
+      // Have we reached the end?
+      if (gps_ubx_count == gps_ubx_length) gps_ubx_state = 7;
+      return true;
+
+    case 7:
+      // Does the first checksum byte match?
+      if (c != gps_ubx_ck_a) break;
+      gps_ubx_state = 8;
+      return true;
+
+    case 8:
+      // Does the second checksum byte match?
+      if (c == gps_ubx_ck_b)
+      {
+        // Everything looks good, process the binary data.
+        gps_ubx_process_message(gps_ubx_class, gps_ubx_id, gps_ubx_buffer, gps_ubx_count);
+      }
+      break;
+  }
+
+  // Return to default state.
+  gps_ubx_state = 0;
+  return false;
+}
+
+// Send a properly formatted binary message to the GPS device.
+static void gps_ubx_send_message(uint8_t msg_class, uint8_t msg_id, const uint8_t *buffer, uint16_t count)
+{
+  uint16_t i;
+  uint8_t ck_a = 0;
+  uint8_t ck_b = 0;
+
+  // Make sure the message isn't too big.
+  if (count > (SEND_BUFFER_SIZE - 8)) return;
+
+  // Fill in the header of the binary message.
+  gps_ubx_send_buffer[0] = 0xB5;
+  gps_ubx_send_buffer[1] = 0x62;
+  gps_ubx_send_buffer[2] = msg_class;
+  gps_ubx_send_buffer[3] = msg_id;
+  gps_ubx_send_buffer[4] = (uint8_t) (count & 0xFF);
+  gps_ubx_send_buffer[5] = (uint8_t) ((count >> 8) & 0xFF);
+
+  // Fill in the payload.
+  memcpy(gps_ubx_send_buffer + 6, buffer, count);
+
+  // Compute the checksum over the class through the payload.
+  for (i = 2; i < (6 + count); ++i)
+  {
+    ck_a += gps_ubx_send_buffer[i];
+    ck_b += ck_a;
+  }
+  gps_ubx_send_buffer[6 + count] = ck_a;
+  gps_ubx_send_buffer[6 + count + 1] = ck_b;
+
+  // Write the message to the GPS serial port.
+  gps_write_data(gps_ubx_send_buffer, count + 8);
+}
+
+// Send a configuration message.
+static void gps_ubx_config_send(uint32_t index)
+{
+  gps_ubx_acked = false;
+  gps_ubx_send_message(UBX_CLASS_CFG, UBX_ID_CFG_MSG, gps_ubx_config[index], sizeof(gps_ubx_config[index]));
+}
+
+// Was the configuration message acknowledged?
+static bool gps_ubx_config_acked(uint32_t index)
+{
+  UNUSED(index);
+  return gps_ubx_acked;
+}
+
+// u-blox receiver.
+const gps_driver_t gps_ubx_driver =
+{
+  .name = "u-blox",
+  .pulse_correction = true,
+  .parse = gps_ubx_parse,
+  .config_count = sizeof(gps_ubx_config) / sizeof(gps_ubx_config[0]),
+  .config_send = gps_ubx_config_send,
+  .config_acked = gps_ubx_config_acked
+};
@@ -14,14 +14,18 @@
 #include "peek.h"
 #include "blink.h"
 #include "extint.h"
+#include "ptpprobe.h"
+#include "loadbench.h"
 #include "random.h"
 #include "console.h"
 #include "network.h"
 #include "shell.h"
 #include "telnet.h"
 #include "syslog.h"
+#include "dlog.h"
 #include "systime.h"
 #include "hardtime.h"
+#include "crosstime.h"
 #include "watchdog.h"
 #include "gps.h"
 
@@ -41,7 +45,11 @@ static const init_func_t init_functions[] =
   network_init,
   hardtime_init,
   systime_init,
+  crosstime_init,
+  ptpprobe_init,
+  loadbench_init,
   syslog_init,
+  dlog_init,
   telnet_init,
   peek_init,
   gps_init,
@@ -0,0 +1,264 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cmsis_compiler.h"
+#include "discipline.h"
+
+// CLOCK DISCIPLINE
+// Steers a local clock to a reference from samples of their offset. The GPS
+// master disciplines the system time to the PPS edges and the PTP slave to
+// the offset from its master, both through this module so a servo change
+// applies to both ends.
+//
+// Each sample is checked against the step threshold first. Offsets within it
+// go through the estimator, which may filter them, and then the controller,
+// which turns the estimate into a frequency adjustment clamped to the maximum
+// rate. Offsets beyond it are stepped away, or slewed at the maximum rate if
+// stepping is not allowed. The module never touches a clock itself, so it
+// also runs on a host against simulated samples.
+
+// Offset passed through unchanged.
+static void discipline_none_reset(discipline_t *disc)
+{
+  (void) disc;
+}
+
+static int64_t discipline_none_estimate(discipline_t *disc, int64_t offset_ns)
+{
+  (void) disc;
+  return offset_ns;
+}
+
+const discipline_estimator_t discipline_estimator_none =
+{
+  .name = "none",
+  .reset = discipline_none_reset,
+  .estimate = discipline_none_estimate
+};
+
+// Exponential smoothing with a weight of 1/2^n for the newest sample. The
+// weight starts at one and halves as samples come in until 2^n samples.
+static void discipline_exponential_reset(discipline_t *disc)
+{
+  disc->est_count = 0;
+  disc->est_offset = 0;
+}
+
+static int64_t discipline_exponential_estimate(discipline_t *disc, int64_t offset_ns)
+{
+  int32_t order = 0;
+
+  if (disc->est_count < (1u << disc->config.filter_log2)) disc->est_count += 1;
+  while ((order < disc->config.filter_log2) && ((1u << (order + 1)) <= disc->est_count)) order += 1;
+
+  if (disc->est_count == 1)
+    disc->est_offset = offset_ns;
+  else
+    disc->est_offset += (offset_ns - disc->est_offset) / (1 << order);
+
+  return disc->est_offset;
+}
+
+const discipline_estimator_t discipline_estimator_exponential =
+{
+  .name = "exponential",
+  .reset = discipline_exponential_reset,
+  .estimate = discipline_exponential_estimate
+};
+
+// Normalize the offset to a one second interval so the controller responds
+// the same for all sample intervals.
+static int32_t discipline_normalize(int32_t offset_ns, int8_t log_interval)
+{
+  if (log_interval > 0)
+    offset_ns >>= log_interval;
+  else if (log_interval < 0)
+    offset_ns <<= -log_interval;
+
+  return offset_ns;
+}
+
+// Integer PI controller. The gains are given as attenuations and the
+// accumulated offset (aka drift) is clamped to the maximum rate.
+static void discipline_pi_reset(discipline_t *disc)
+{
+  disc->drift = 0;
+}
+
+static int32_t discipline_pi_control(discipline_t *disc, int32_t offset_ns, int8_t log_interval)
+{
+  int32_t offset_norm = discipline_normalize(offset_ns, log_interval);
+
+  // Keep track of accumulated offset (aka drift).
+  disc->drift += offset_norm / disc->config.i_div;
+
+  // Clamp the accumulated offset to the maximum rate.
+  if (disc->drift > disc->config.max_ppb)
+    disc->drift = disc->config.max_ppb;
+  else if (disc->drift < -disc->config.max_ppb)
+    disc->drift = -disc->config.max_ppb;
+
+  // A clock ahead of the reference is slowed down.
+  return -((offset_norm / disc->config.p_div) + disc->drift);
+}
+
+static int32_t discipline_pi_drift(const discipline_t *disc)
+{
+  return disc->drift;
+}
+
+const discipline_controller_t discipline_controller_pi =
+{
+  .name = "pi",
+  .reset = discipline_pi_reset,
+  .control = discipline_pi_control,
+  .drift = discipline_pi_drift
+};
+
+// Floating point PID controller with the same gains as the PI controller and
+// no derivative term. The integrator holds the frequency correction.
+static void discipline_pid_reset(discipline_t *disc)
+{
+  pid_init_state(&disc->pid, 0.0f, 1.0f / disc->config.p_div, 0.0f, 1.0f / disc->config.i_div);
+  pid_set_limits(&disc->pid, (float) disc->config.step_ns, 0.0f, (float) disc->config.max_ppb, (float) disc->config.max_ppb);
+}
+
+static int32_t discipline_pid_control(discipline_t *disc, int32_t offset_ns, int8_t log_interval)
+{
+  // The PID drives the offset to zero.
+  return (int32_t) pid_calculate(&disc->pid, (float) discipline_normalize(offset_ns, log_interval), 0.0f);
+}
+
+static int32_t discipline_pid_drift(const discipline_t *disc)
+{
+  return -(int32_t) disc->pid.integrator;
+}
+
+const discipline_controller_t discipline_controller_pid =
+{
+  .name = "pid",
+  .reset = discipline_pid_reset,
+  .control = discipline_pid_control,
+  .drift = discipline_pid_drift
+};
+
+// Fill in the default configuration.
+void discipline_config_default(discipline_config_t *config)
+{
+  memset(config, 0, sizeof(discipline_config_t));
+  config->estimator = discipline_config_estimator();
+  config->controller = discipline_config_controller();
+  config->p_div = DISCIPLINE_P_DIV;
+  config->i_div = DISCIPLINE_I_DIV;
+  config->filter_log2 = DISCIPLINE_FILTER_LOG2;
+  config->max_ppb = DISCIPLINE_MAX_PPB;
+  config->step_ns = DISCIPLINE_STEP_NS;
+}
+
+// Configure the clock discipline and reset its state. The statistics are kept.
+void discipline_init(discipline_t *disc, const discipline_config_t *config)
+{
+  disc->config = *config;
+
+  // No negative or zero attenuation.
+  if (disc->config.p_div < 1) disc->config.p_div = 1;
+  if (disc->config.i_div < 1) disc->config.i_div = 1;
+  if (disc->config.filter_log2 < 0) disc->config.filter_log2 = 0;
+  if (disc->config.filter_log2 > 16) disc->config.filter_log2 = 16;
+  if (!disc->config.estimator) disc->config.estimator = &discipline_estimator_none;
+  if (!disc->config.controller) disc->config.controller = &discipline_controller_pi;
+
+  discipline_reset(disc);
+}
+
+// Reset the estimator and controller state, such as after the clock is set.
+void discipline_reset(discipline_t *disc)
+{
+  disc->config.estimator->reset(disc);
+  disc->config.controller->reset(disc);
+  disc->stats.drift_ppb = disc->config.controller->drift(disc);
+}
+
+// Reset the statistics.
+void discipline_reset_stats(discipline_t *disc)
+{
+  memset(&disc->stats, 0, sizeof(discipline_stats_t));
+  disc->stats.drift_ppb = disc->config.controller->drift(disc);
+}
+
+// Process an offset sample. Returns the action to take on the clock. A slew
+// applies the frequency adjustment and a step subtracts the offset from the
+// clock.
+discipline_action_t discipline_update(discipline_t *disc, const discipline_sample_t *sample, int32_t *adj_ppb)
+{
+  int64_t offset = sample->offset_ns;
+  int64_t abs_offset = (offset < 0) ? -offset : offset;
+  int64_t estimate;
+  int32_t adj;
+
+  // Account for the sample.
+  disc->stats.samples += 1;
+  disc->stats.last_offset_ns = offset;
+  if (abs_offset > disc->stats.max_offset_ns) disc->stats.max_offset_ns = abs_offset;
+
+  if (abs_offset > disc->config.step_ns)
+  {
+    if (!disc->config.no_step)
+    {
+      // Samples before the step no longer apply.
+      disc->config.estimator->reset(disc);
+      if (disc->config.no_adjust) return DISCIPLINE_NONE;
+      disc->stats.steps += 1;
+      return DISCIPLINE_STEP;
+    }
+
+    // Slew at the maximum rate.
+    adj = (offset > 0) ? -disc->config.max_ppb : disc->config.max_ppb;
+  }
+  else
+  {
+    // Determine the adjustment from the estimated offset.
+    estimate = disc->config.estimator->estimate(disc, offset);
+    adj = disc->config.controller->control(disc, (int32_t) estimate, sample->log_interval);
+
+    // Clamp the adjustment to the maximum rate.
+    if ((adj > disc->config.max_ppb) || (adj < -disc->config.max_ppb))
+    {
+      adj = (adj > 0) ? disc->config.max_ppb : -disc->config.max_ppb;
+      disc->stats.clamps += 1;
+    }
+  }
+
+  disc->stats.last_adj_ppb = adj;
+  disc->stats.drift_ppb = disc->config.controller->drift(disc);
+
+  // Without adjustment only the drift is tracked.
+  if (disc->config.no_adjust) return DISCIPLINE_NONE;
+
+  *adj_ppb = adj;
+
+  return DISCIPLINE_SLEW;
+}
+
+// Get the observed frequency of the local clock relative to the reference in ppb.
+int32_t discipline_get_drift(const discipline_t *disc)
+{
+  return disc->stats.drift_ppb;
+}
+
+// Get the statistics.
+void discipline_get_stats(const discipline_t *disc, discipline_stats_t *stats)
+{
+  *stats = disc->stats;
+}
+
+// System configurable offset estimator.
+__WEAK const discipline_estimator_t *discipline_config_estimator(void)
+{
+  return &discipline_estimator_none;
+}
+
+// System configurable controller.
+__WEAK const discipline_controller_t *discipline_config_controller(void)
+{
+  return &discipline_controller_pi;
+}
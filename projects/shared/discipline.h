@@ -0,0 +1,121 @@
+#ifndef __DISCIPLINE_H__
+#define __DISCIPLINE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "pid.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Default controller settings shared by the GPS and PTP servos.
+#define DISCIPLINE_P_DIV            2
+#define DISCIPLINE_I_DIV            16
+#define DISCIPLINE_FILTER_LOG2      2
+#define DISCIPLINE_MAX_PPB          5120000
+#define DISCIPLINE_STEP_NS          100000000
+
+// Action to take on the clock after a sample.
+typedef enum
+{
+  DISCIPLINE_NONE = 0,
+  DISCIPLINE_SLEW,
+  DISCIPLINE_STEP
+} discipline_action_t;
+
+// Offset sample. The offset is the local clock less the reference and the
+// interval is the log2 seconds between samples.
+typedef struct discipline_sample_s
+{
+  int64_t offset_ns;
+  int8_t log_interval;
+} discipline_sample_t;
+
+// Statistics since the last statistics reset. The drift is the observed
+// frequency of the local clock relative to the reference in ppb.
+typedef struct discipline_stats_s
+{
+  uint32_t samples;
+  uint32_t steps;
+  uint32_t clamps;
+  int64_t last_offset_ns;
+  int64_t max_offset_ns;
+  int32_t last_adj_ppb;
+  int32_t drift_ppb;
+} discipline_stats_t;
+
+typedef struct discipline_s discipline_t;
+
+// Estimator of the offset the controller acts on from the offset samples.
+typedef struct discipline_estimator_s
+{
+  const char *name;
+  void (*reset)(discipline_t *disc);
+  int64_t (*estimate)(discipline_t *disc, int64_t offset_ns);
+} discipline_estimator_t;
+
+// Controller of the frequency adjustment in ppb from the estimated offset.
+// A positive adjustment speeds up the local clock.
+typedef struct discipline_controller_s
+{
+  const char *name;
+  void (*reset)(discipline_t *disc);
+  int32_t (*control)(discipline_t *disc, int32_t offset_ns, int8_t log_interval);
+  int32_t (*drift)(const discipline_t *disc);
+} discipline_controller_t;
+
+// Clock discipline configuration. Offsets beyond the step threshold are
+// stepped, or slewed at the maximum rate when stepping is not allowed.
+// Without adjustment the controller only tracks the drift.
+typedef struct discipline_config_s
+{
+  const discipline_estimator_t *estimator;
+  const discipline_controller_t *controller;
+  int32_t p_div;
+  int32_t i_div;
+  int32_t filter_log2;
+  int32_t max_ppb;
+  int64_t step_ns;
+  bool no_step;
+  bool no_adjust;
+} discipline_config_t;
+
+// Clock discipline state.
+struct discipline_s
+{
+  discipline_config_t config;
+  discipline_stats_t stats;
+
+  // Estimator state.
+  uint32_t est_count;
+  int64_t est_offset;
+
+  // Controller state.
+  int32_t drift;
+  pid_state_t pid;
+};
+
+// Estimators and controllers.
+extern const discipline_estimator_t discipline_estimator_none;
+extern const discipline_estimator_t discipline_estimator_exponential;
+extern const discipline_controller_t discipline_controller_pi;
+extern const discipline_controller_t discipline_controller_pid;
+
+void discipline_config_default(discipline_config_t *config);
+void discipline_init(discipline_t *disc, const discipline_config_t *config);
+void discipline_reset(discipline_t *disc);
+void discipline_reset_stats(discipline_t *disc);
+discipline_action_t discipline_update(discipline_t *disc, const discipline_sample_t *sample, int32_t *adj_ppb);
+int32_t discipline_get_drift(const discipline_t *disc);
+void discipline_get_stats(const discipline_t *disc, discipline_stats_t *stats);
+
+// System configurable functions. Implemented as weak functions.
+const discipline_estimator_t *discipline_config_estimator(void);
+const discipline_controller_t *discipline_config_controller(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __DISCIPLINE_H__
@@ -28,15 +28,29 @@
 #define PTPD_ERR
 #endif
 
+/* #define PTPD_DLOG */
+
 #include "ptpd_constants.h"
 #include "ptpd_datatypes.h"
 
-// Debug messages.
+// Debug messages. With PTPD_DLOG the debug messages are recorded into the
+// deferred log and formatted later by its thread, so verbose debugging does
+// not disturb the timing of the protocol. Deferred messages take at most four
+// 32-bit arguments and only constant strings.
+#ifdef PTPD_DLOG
+#include "syslog.h"
+#include "dlog.h"
+#endif
+
 #ifdef PTPD_DBGVV
 #define PTPD_DBGV
 #define PTPD_DBG
 #define PTPD_ERR
+#ifdef PTPD_DLOG
+#define DBGVV(...) DLOG(SYSLOG_DEBUG, "(V) " __VA_ARGS__)
+#else
 #define DBGVV(...) __printf("(V) " __VA_ARGS__)
+#endif
 #else
 #define DBGVV(...)
 #endif
@@ -44,14 +58,22 @@
 #ifdef PTPD_DBGV
 #define PTPD_DBG
 #define PTPD_ERR
+#ifdef PTPD_DLOG
+#define DBGV(...)  DLOG(SYSLOG_DEBUG, "(d) " __VA_ARGS__)
+#else
 #define DBGV(...)  { TimeInternal tmpTime; ptpd_get_time(&tmpTime); __printf("(d %d.%09d) ", tmpTime.seconds, tmpTime.nanoseconds); __printf(__VA_ARGS__); }
+#endif
 #else
 #define DBGV(...)
 #endif
 
 #ifdef PTPD_DBG
 #define PTPD_ERR
+#ifdef PTPD_DLOG
+#define DBG(...)  DLOG(SYSLOG_DEBUG, "(D) " __VA_ARGS__)
+#else
 #define DBG(...)  { TimeInternal tmpTime; ptpd_get_time(&tmpTime); __printf("(D %d.%09d) ", tmpTime.seconds, tmpTime.nanoseconds); __printf(__VA_ARGS__); }
+#endif
 #else
 #define DBG(...)
 #endif
@@ -76,10 +98,23 @@
 extern "C" {
 #endif
 
+// PTP statistics.
+typedef struct ptpd_stats_s
+{
+  uint32_t state;
+  uint32_t servo_updates;
+  int32_t offset_sec;
+  int32_t offset_nsec;
+  uint32_t event_drops;
+  uint32_t general_drops;
+  uint32_t tx_timestamp_timeouts;
+} ptpd_stats_t;
+
 // Application management.
 void ptpd_alert(void);
 void ptpd_init(bool slave_only);
 uint32_t ptpd_get_state(void);
+void ptpd_get_stats(ptpd_stats_t *stats);
 
 // Protocol engine.
 void ptpd_protocol_do_state(PtpClock*);
@@ -92,7 +127,9 @@ void ptpd_p1(PtpClock*);
 void ptpd_s1(PtpClock*, const MsgHeader*, const MsgAnnounce*);
 void ptpd_clock_init(PtpClock*);
 bool ptpd_is_same_port_identity(const PortIdentity*, const PortIdentity*);
-void ptpd_add_foreign(PtpClock*, const MsgHeader*, const MsgAnnounce*);
+bool ptpd_add_foreign(PtpClock*, const MsgHeader*, const MsgAnnounce*);
+void ptpd_clear_foreign(PtpClock*);
+bool ptpd_foreign_aged(PtpClock*);
 
 // Message packing and unpacking functions.
 void ptpd_msg_unpack_header(const octet_t*, MsgHeader*);
@@ -104,26 +141,31 @@ void ptpd_msg_unpack_delay_resp(const octet_t*, MsgDelayResp*);
 void ptpd_msg_unpack_peer_delay_req(const octet_t*, MsgPDelayReq*);
 void ptpd_msg_unpack_peer_delay_resp(const octet_t*, MsgPDelayResp*);
 void ptpd_msg_unpack_peer_delay_resp_follow_up(const octet_t*, MsgPDelayRespFollowUp*);
-void ptpd_msg_pack_header(const PtpClock*, octet_t*);
+void ptpd_msg_unpack_signaling(const octet_t*, MsgSignaling*);
+void ptpd_msg_unpack_management(const octet_t*, MsgManagement*);
+ssize_t ptpd_msg_unpack_tlv(const octet_t*, ssize_t, TLV*);
+void ptpd_msg_pack_header(PtpClock*);
 void ptpd_msg_pack_announce(const PtpClock*, octet_t*);
 void ptpd_msg_pack_sync(const PtpClock*, octet_t*, const Timestamp*);
-void ptpd_msg_pack_follow_up(const PtpClock*, octet_t*, const Timestamp*);
+void ptpd_msg_pack_follow_up(const PtpClock*, octet_t*, int16_t, const Timestamp*);
 void ptpd_msg_pack_delay_req(const PtpClock*, octet_t*, const Timestamp*);
 void ptpd_msg_pack_delay_resp(const PtpClock*, octet_t*, const MsgHeader*, const Timestamp*);
 void ptpd_msg_pack_peer_delay_req(const PtpClock*, octet_t*, const Timestamp*);
-void ptpd_msg_pack_peer_delay_resp(octet_t*, const MsgHeader*, const Timestamp*);
-void ptpd_msg_pack_peer_delay_resp_follow_up(octet_t*, const MsgHeader*, const Timestamp*);
+void ptpd_msg_pack_peer_delay_resp(const PtpClock*, octet_t*, const MsgHeader*, const Timestamp*);
+void ptpd_msg_pack_peer_delay_resp_follow_up(const PtpClock*, octet_t*, const MsgHeader*, const Timestamp*);
 
 // Network functions.
 bool  ptpd_net_init(NetPath*, PtpClock*);
 bool  ptpd_net_shutdown(NetPath*);
 int32_t ptpd_net_select(NetPath*, const TimeInternal*);
-ssize_t ptpd_net_recv_event(NetPath*, octet_t*, TimeInternal*);
-ssize_t ptpd_net_recv_general(NetPath*, octet_t*, TimeInternal*);
-ssize_t ptpd_net_send_event(NetPath*, const octet_t*, int16_t, TimeInternal*);
+ssize_t ptpd_net_recv_event(NetPath*, MsgView*, TimeInternal*);
+ssize_t ptpd_net_recv_general(NetPath*, MsgView*, TimeInternal*);
+void ptpd_net_release(MsgView*);
+ssize_t ptpd_net_send_event(NetPath*, const octet_t*, int16_t);
 ssize_t ptpd_net_send_general(NetPath*, const octet_t*, int16_t);
 ssize_t ptpd_net_send_peer_general(NetPath*, const octet_t*, int16_t);
-ssize_t ptpd_net_send_peer_event(NetPath*, const octet_t*, int16_t, TimeInternal*);
+ssize_t ptpd_net_send_peer_event(NetPath*, const octet_t*, int16_t);
+bool ptpd_net_get_tx_timestamp(NetPath*, enum4bit_t*, int16_t*, TimeInternal*);
 void ptpd_net_empty_event_queue(NetPath *netPath);
 
 // Precions time adjustment functions.
@@ -1,4 +1,5 @@
 #include <string.h>
+#include "lwip/sys.h"
 #include "ptpd.h"
 
 #if LWIP_PTPD
@@ -72,9 +73,9 @@ void ptpd_clock_init(PtpClock *ptp_clock)
   ptp_clock->portDS.logMinPdelayReqInterval = DEFAULT_PDELAYREQ_INTERVAL;
   ptp_clock->portDS.versionNumber = VERSION_PTP;
 
-  // Initialize other stuff.
-  ptp_clock->foreignMasterDS.count = 0;
-  ptp_clock->foreignMasterDS.capacity = rtOpts->maxForeignRecords;
+  // Initialize other stuff. The hash table must stay at most half full.
+  ptp_clock->foreignMasterDS.capacity = min(rtOpts->maxForeignRecords, FOREIGN_MASTER_HASH_SIZE / 2);
+  ptpd_clear_foreign(ptp_clock);
 
   ptp_clock->inboundLatency = rtOpts->inboundLatency;
   ptp_clock->outboundLatency = rtOpts->outboundLatency;
@@ -97,55 +98,298 @@ bool ptpd_is_same_port_identity(const PortIdentity *a, const PortIdentity *b)
                 (a->portNumber == b->portNumber));
 }
 
-// Add foreign record defined by announce message.
-void ptpd_add_foreign(PtpClock *ptp_clock, const MsgHeader *header, const MsgAnnounce *announce)
+// Hash a port identity into the foreign master hash table (FNV-1a).
+static uint32_t ptpd_foreign_hash(const PortIdentity *port_identity)
 {
-  int i, j;
-  bool found = false;
+  int i;
+  uint32_t hash = 2166136261u;
+
+  for (i = 0; i < CLOCK_IDENTITY_LENGTH; i++)
+  {
+    hash ^= (uint8_t) port_identity->clockIdentity[i];
+    hash *= 16777619u;
+  }
+  hash ^= (uint16_t) port_identity->portNumber;
+  hash *= 16777619u;
 
-  j = ptp_clock->foreignMasterDS.best;
+  return (hash ^ (hash >> 16)) & FOREIGN_MASTER_HASH_MASK;
+}
+
+// Find the hash table slot holding the port identity or, if the port
+// identity is not known, the empty slot where it should be inserted.
+static uint32_t ptpd_foreign_slot(const ForeignMasterDS *foreign, const PortIdentity *port_identity)
+{
+  uint32_t slot = ptpd_foreign_hash(port_identity);
 
-  // Check if Foreign master is already known.
-  for (i = 0; i < ptp_clock->foreignMasterDS.count; i++)
+  // Linear probing. The table is at least twice the record capacity
+  // so an empty slot always terminates the probe.
+  while (foreign->table[slot] >= 0)
   {
-    if (ptpd_is_same_port_identity(&header->sourcePortIdentity, &ptp_clock->foreignMasterDS.records[j].foreignMasterPortIdentity))
+    if (ptpd_is_same_port_identity(port_identity, &foreign->records[foreign->table[slot]].foreignMasterPortIdentity))
     {
-      // Foreign Master is already in Foreignmaster data set.
-      found = true;
-      ptp_clock->foreignMasterDS.records[j].foreignMasterAnnounceMessages++;
-      DBGV("PTPD: ptpd_add_foreign: AnnounceMessage incremented\n");
-      ptp_clock->foreignMasterDS.records[j].header = *header;
-      ptp_clock->foreignMasterDS.records[j].announce = *announce;
       break;
     }
+    slot = (slot + 1) & FOREIGN_MASTER_HASH_MASK;
+  }
+
+  return slot;
+}
+
+// Rebuild the hash table from the dense array of records.
+static void ptpd_foreign_rehash(ForeignMasterDS *foreign)
+{
+  int16_t i;
 
-    j = (j + 1) % ptp_clock->foreignMasterDS.count;
+  memset(foreign->table, -1, sizeof(foreign->table));
+  for (i = 0; i < foreign->count; i++)
+  {
+    foreign->table[ptpd_foreign_slot(foreign, &foreign->records[i].foreignMasterPortIdentity)] = (int8_t) i;
+  }
+}
+
+// Remove the indexed record by moving the last record into its place.
+// The caller is responsible for rebuilding the hash table.
+static void ptpd_foreign_remove(ForeignMasterDS *foreign, int16_t index)
+{
+  // Losing a qualified record may change the best master.
+  if (foreign->records[index].qualified) foreign->changed = true;
+
+  foreign->count--;
+  if (index != foreign->count)
+  {
+    foreign->records[index] = foreign->records[foreign->count];
   }
 
+  // The best record is forgotten when removed and follows the last record
+  // when that is moved into its place.
+  if (foreign->best == index)
+  {
+    foreign->best = -1;
+    foreign->changed = true;
+  }
+  else if (foreign->best == foreign->count)
+  {
+    foreign->best = index;
+  }
+}
+
+// Return the foreign master time window in milliseconds (9.3.2.4.4).
+static uint32_t ptpd_foreign_window(const PtpClock *ptp_clock)
+{
+  return DEFAULT_FOREIGN_MASTER_TIME_WINDOW * pow2ms(ptp_clock->portDS.logAnnounceInterval);
+}
+
+// Return the receive time of the most recent announce message of the record.
+static uint32_t ptpd_foreign_last_announce(const ForeignMasterRecord *record)
+{
+  return record->announceTimes[(record->announceIndex + DEFAULT_FOREIGN_MASTER_THRESHOLD - 1) %
+                               DEFAULT_FOREIGN_MASTER_THRESHOLD];
+}
+
+// A foreign master is qualified when at least FOREIGN_MASTER_THRESHOLD announce
+// messages have been received within the FOREIGN_MASTER_TIME_WINDOW (9.3.2.5).
+static bool ptpd_foreign_is_qualified(const ForeignMasterRecord *record, uint32_t now, uint32_t window)
+{
+  if (record->foreignMasterAnnounceMessages < DEFAULT_FOREIGN_MASTER_THRESHOLD) return false;
+
+  // The oldest of the retained announce times is the next one to be overwritten.
+  return (now - record->announceTimes[record->announceIndex]) <= window;
+}
+
+// Update the qualification of the record and the time the foreign master
+// data set must next be aged. Returns true if the qualification changed.
+static bool ptpd_foreign_qualify(ForeignMasterDS *foreign, ForeignMasterRecord *record,
+                                 uint32_t now, uint32_t window)
+{
+  bool qualified = ptpd_foreign_is_qualified(record, now, window);
+  bool changed = (qualified != record->qualified);
+  uint32_t expires;
+
+  record->qualified = qualified;
+  if (qualified)
+  {
+    expires = record->announceTimes[record->announceIndex] + window + 1;
+    if ((int32_t) (expires - foreign->nextAging) < 0) foreign->nextAging = expires;
+  }
+  if (changed) foreign->changed = true;
+
+  return changed;
+}
+
+// Compare the fields of two announce messages used by the data set comparison.
+static bool ptpd_foreign_key_changed(const MsgAnnounce *a, const MsgAnnounce *b)
+{
+  return (a->grandmasterPriority1 != b->grandmasterPriority1) ||
+         (a->grandmasterClockQuality.clockClass != b->grandmasterClockQuality.clockClass) ||
+         (a->grandmasterClockQuality.clockAccuracy != b->grandmasterClockQuality.clockAccuracy) ||
+         (a->grandmasterClockQuality.offsetScaledLogVariance != b->grandmasterClockQuality.offsetScaledLogVariance) ||
+         (a->grandmasterPriority2 != b->grandmasterPriority2) ||
+         (a->stepsRemoved != b->stepsRemoved) ||
+         memcmp(a->grandmasterIdentity, b->grandmasterIdentity, CLOCK_IDENTITY_LENGTH);
+}
+
+// Compare the fields of the local default data set used by the state decision.
+static bool ptpd_default_ds_changed(const DefaultDS *a, const DefaultDS *b)
+{
+  return (a->priority1 != b->priority1) ||
+         (a->clockQuality.clockClass != b->clockQuality.clockClass) ||
+         (a->clockQuality.clockAccuracy != b->clockQuality.clockAccuracy) ||
+         (a->clockQuality.offsetScaledLogVariance != b->clockQuality.offsetScaledLogVariance) ||
+         (a->priority2 != b->priority2) ||
+         memcmp(a->clockIdentity, b->clockIdentity, CLOCK_IDENTITY_LENGTH);
+}
+
+// Remove foreign masters that have not announced within the time window.
+static void ptpd_foreign_purge(PtpClock *ptp_clock, uint32_t now)
+{
+  int16_t i;
+  bool removed = false;
+  uint32_t window = ptpd_foreign_window(ptp_clock);
+  ForeignMasterDS *foreign = &ptp_clock->foreignMasterDS;
+
+  for (i = foreign->count - 1; i >= 0; i--)
+  {
+    if ((now - ptpd_foreign_last_announce(&foreign->records[i])) > window)
+    {
+      DBGV("PTPD: ptpd_foreign_purge: foreign master %d aged out\n", i);
+      ptpd_foreign_remove(foreign, i);
+      removed = true;
+    }
+  }
+
+  if (removed) ptpd_foreign_rehash(foreign);
+}
+
+// Remove all foreign master records.
+void ptpd_clear_foreign(PtpClock *ptp_clock)
+{
+  ptp_clock->foreignMasterDS.count = 0;
+  ptp_clock->foreignMasterDS.best = -1;
+  ptp_clock->foreignMasterDS.changed = true;
+  ptp_clock->foreignMasterDS.nextAging = sys_now() + ptpd_foreign_window(ptp_clock);
+  memset(ptp_clock->foreignMasterDS.table, -1, sizeof(ptp_clock->foreignMasterDS.table));
+}
+
+// Re-qualify foreign masters once the earliest qualified record may have
+// expired. This is cheap to call often. Returns true if the best master
+// clock algorithm must be run again.
+bool ptpd_foreign_aged(PtpClock *ptp_clock)
+{
+  int16_t i;
+  bool changed = false;
+  uint32_t now = sys_now();
+  uint32_t window;
+  ForeignMasterDS *foreign = &ptp_clock->foreignMasterDS;
+
+  if ((int32_t) (now - foreign->nextAging) < 0) return false;
+
+  window = ptpd_foreign_window(ptp_clock);
+  foreign->nextAging = now + window;
+  for (i = 0; i < foreign->count; i++)
+  {
+    if (ptpd_foreign_qualify(foreign, &foreign->records[i], now, window)) changed = true;
+  }
+
+  if (changed)
+  {
+    DBGV("PTPD: ptpd_foreign_aged: qualification changed\n");
+  }
+
+  return changed;
+}
+
+// Add foreign record defined by announce message. Returns true if the
+// announce changed the input of the best master clock algorithm.
+bool ptpd_add_foreign(PtpClock *ptp_clock, const MsgHeader *header, const MsgAnnounce *announce)
+{
+  int16_t i;
+  int16_t j;
+  uint32_t slot;
+  uint32_t now = sys_now();
+  uint32_t window = ptpd_foreign_window(ptp_clock);
+  bool changed;
+  ForeignMasterDS *foreign = &ptp_clock->foreignMasterDS;
+  ForeignMasterRecord *record;
+
+  // Check if foreign master is already known.
+  slot = ptpd_foreign_slot(foreign, &header->sourcePortIdentity);
+  j = foreign->table[slot];
+
   // If not found, we have a new foreign master.
-  if (!found)
+  if (j < 0)
   {
-    if (ptp_clock->foreignMasterDS.count < ptp_clock->foreignMasterDS.capacity)
+    // Make room by discarding masters that stopped announcing.
+    if (foreign->count >= foreign->capacity)
     {
-      ptp_clock->foreignMasterDS.count++;
+      ptpd_foreign_purge(ptp_clock, now);
     }
 
-    j = ptp_clock->foreignMasterDS.i;
+    // Still full? Replace the least recently heard unqualified master other than
+    // the best so a storm of new candidates cannot displace qualified masters.
+    if (foreign->count >= foreign->capacity)
+    {
+      for (i = 0, j = -1; i < foreign->count; i++)
+      {
+        record = &foreign->records[i];
+        if ((i == foreign->best) || ptpd_foreign_is_qualified(record, now, window)) continue;
+        if ((j < 0) || ((int32_t) (ptpd_foreign_last_announce(record) -
+                                   ptpd_foreign_last_announce(&foreign->records[j])) < 0))
+        {
+          j = i;
+        }
+      }
+
+      if (j < 0)
+      {
+        DBGV("PTPD: ptpd_add_foreign: foreign master data set full\n");
+        return false;
+      }
+
+      ptpd_foreign_remove(foreign, j);
+      ptpd_foreign_rehash(foreign);
+    }
+
+    // Append the new record and index it.
+    j = foreign->count++;
+    foreign->table[ptpd_foreign_slot(foreign, &header->sourcePortIdentity)] = (int8_t) j;
 
     // Copy new foreign master data set from Announce message.
-    memcpy(ptp_clock->foreignMasterDS.records[j].foreignMasterPortIdentity.clockIdentity, 
+    record = &foreign->records[j];
+    memset(record, 0, sizeof(ForeignMasterRecord));
+    memcpy(record->foreignMasterPortIdentity.clockIdentity,
            header->sourcePortIdentity.clockIdentity, CLOCK_IDENTITY_LENGTH);
-    ptp_clock->foreignMasterDS.records[j].foreignMasterPortIdentity.portNumber = header->sourcePortIdentity.portNumber;
-    ptp_clock->foreignMasterDS.records[j].foreignMasterAnnounceMessages = 0;
-
-    // Header and announce field of each foreign master are useful to run Best Master Clock Algorithm.
-    ptp_clock->foreignMasterDS.records[j].header = *header;
-    ptp_clock->foreignMasterDS.records[j].announce = *announce;
+    record->foreignMasterPortIdentity.portNumber = header->sourcePortIdentity.portNumber;
 
     DBGV("PTPD: ptpd_add_foreign: New foreign master added\n");
+  }
+  else
+  {
+    record = &foreign->records[j];
+    DBGV("PTPD: ptpd_add_foreign: AnnounceMessage incremented\n");
+  }
 
-    ptp_clock->foreignMasterDS.i = (ptp_clock->foreignMasterDS.i + 1) % ptp_clock->foreignMasterDS.capacity;
+  // A change to the compared fields of a qualified master invalidates the decision.
+  if (record->qualified && ptpd_foreign_key_changed(&record->announce, announce))
+  {
+    DBGV("PTPD: ptpd_add_foreign: announce data set changed\n");
+    foreign->changed = true;
   }
+  changed = foreign->changed;
+
+  // Record the announce receive time.
+  if (record->foreignMasterAnnounceMessages < DEFAULT_FOREIGN_MASTER_THRESHOLD)
+  {
+    record->foreignMasterAnnounceMessages++;
+  }
+  record->announceTimes[record->announceIndex] = now;
+  record->announceIndex = (record->announceIndex + 1) % DEFAULT_FOREIGN_MASTER_THRESHOLD;
+  if (ptpd_foreign_qualify(foreign, record, now, window)) changed = true;
+
+  // Header and announce field of each foreign master are useful to run Best Master Clock Algorithm.
+  record->header = *header;
+  record->announce = *announce;
+
+  return changed;
 }
 
 // Local clock is becoming Master. Table 13 (9.3.5) of the spec.
@@ -455,25 +699,57 @@ uint8_t ptpd_bmc(PtpClock *ptp_clock)
 {
   int16_t i;
   int16_t best;
+  ForeignMasterDS *foreign = &ptp_clock->foreignMasterDS;
+
+  // Bring the qualification of foreign masters up to date.
+  ptpd_foreign_aged(ptp_clock);
+
+  // Reuse the previous decision if none of its inputs changed.
+  if (!foreign->changed &&
+      (foreign->cachedPortState == ptp_clock->portDS.portState) &&
+      !ptpd_default_ds_changed(&foreign->cachedDefaultDS, &ptp_clock->defaultDS))
+  {
+    DBGV("PTPD: ptpd_bmc: decision unchanged\n");
+    return foreign->cachedState;
+  }
 
-  // Starting from i = 1, not necessery to test record[i = 0] against record[best = 0] -> they are the same.
-  for (i = 1, best = 0; i < ptp_clock->foreignMasterDS.count; i++)
+  // Only qualified foreign masters take part in the comparison.
+  for (i = 0, best = -1; i < foreign->count; i++)
   {
-    if ((ptpd_data_set_comparison(&ptp_clock->foreignMasterDS.records[i].header,
-                                  &ptp_clock->foreignMasterDS.records[i].announce,
-                                  &ptp_clock->foreignMasterDS.records[best].header,
-                                  &ptp_clock->foreignMasterDS.records[best].announce, ptp_clock)) < 0)
+    if (!foreign->records[i].qualified) continue;
+
+    if ((best < 0) ||
+        (ptpd_data_set_comparison(&foreign->records[i].header,
+                                  &foreign->records[i].announce,
+                                  &foreign->records[best].header,
+                                  &foreign->records[best].announce, ptp_clock)) < 0)
     {
       best = i;
     }
   }
 
+  // Remember the inputs of this decision.
+  foreign->changed = false;
+  foreign->cachedPortState = ptp_clock->portDS.portState;
+  foreign->cachedDefaultDS = ptp_clock->defaultDS;
+
+  // Without a qualified foreign master there is nothing new to decide.
+  if (best < 0)
+  {
+    DBGV("PTPD: ptpd_bmc: no qualified foreign master\n");
+    foreign->best = -1;
+    foreign->cachedState = (ptp_clock->portDS.portState == PTP_LISTENING) ?
+                           PTP_LISTENING : ptp_clock->recommendedState;
+    return foreign->cachedState;
+  }
+
   DBGV("PTPD: ptpd_bmc: best record %d\n", best);
-  ptp_clock->foreignMasterDS.best = best;
+  foreign->best = best;
+  foreign->cachedState = ptpd_state_decision(&foreign->records[best].header,
+                                             &foreign->records[best].announce,
+                                             ptp_clock);
 
-  return ptpd_state_decision(&ptp_clock->foreignMasterDS.records[best].header,
-                             &ptp_clock->foreignMasterDS.records[best].announce,
-                             ptp_clock);
+  return foreign->cachedState;
 }
 
 #endif // LWIP_PTPD
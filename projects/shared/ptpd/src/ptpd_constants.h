@@ -40,7 +40,7 @@ extern "C" {
 #define DEFAULT_PRIORITY1               248
 #define DEFAULT_PRIORITY2               248
 #define DEFAULT_CLOCK_VARIANCE          5000    // To be determined in 802.1AS.
-#define DEFAULT_MAX_FOREIGN_RECORDS     5
+#define DEFAULT_MAX_FOREIGN_RECORDS     32
 #define DEFAULT_PARENTS_STATS           false
 #define DEFAULT_TWO_STEP_FLAG           true    // Transmitting only SYNC message or SYNC and FOLLOW UP.
 #define DEFAULT_TIME_SOURCE             GPS
@@ -62,6 +62,7 @@ extern "C" {
 // Minimal length values for each message.
 // If TLV used length could be higher.
 #define HEADER_LENGTH                   34
+#define TLV_HEADER_LENGTH               4
 #define ANNOUNCE_LENGTH                 64
 #define SYNC_LENGTH                     44
 #define FOLLOW_UP_LENGTH                44
@@ -249,6 +250,10 @@ enum
 // ptpdv1 value kept because of use of TLV...
 #define PACKET_SIZE                 300
 
+// Length of the prebuilt Ethernet (with padding), IPv4 and UDP headers
+// preceding the message in a transmit frame.
+#define PTP_TX_HEADER_LENGTH        (ETH_PAD_SIZE + 14 + 20 + 8)
+
 #define PTP_EVENT_PORT              319
 #define PTP_GENERAL_PORT            320
 
@@ -257,9 +262,41 @@ enum
 
 #define MM_STARTING_BOUNDARY_HOPS   0x7fff
 
-// Must be a power of 2.
-#define PBUF_QUEUE_SIZE             4
+// Foreign master hash table size. Must be a power of 2 and at
+// least twice the maximum number of foreign master records.
+#define FOREIGN_MASTER_HASH_SIZE    64
+#define FOREIGN_MASTER_HASH_MASK    (FOREIGN_MASTER_HASH_SIZE - 1)
+#if (FOREIGN_MASTER_HASH_SIZE & FOREIGN_MASTER_HASH_MASK)
+#error "FOREIGN_MASTER_HASH_SIZE must be a power of 2"
+#endif
+#if (FOREIGN_MASTER_HASH_SIZE < (2 * DEFAULT_MAX_FOREIGN_RECORDS))
+#error "FOREIGN_MASTER_HASH_SIZE must be at least twice DEFAULT_MAX_FOREIGN_RECORDS"
+#endif
+
+// Number of two-step sync messages that may await their follow-up
+// message. Must be a power of 2.
+#define PENDING_SYNC_SIZE           8
+#define PENDING_SYNC_MASK           (PENDING_SYNC_SIZE - 1)
+
+// Milliseconds a two-step sync message waits for its follow-up message.
+#define PENDING_SYNC_TIMEOUT        1000
+
+// Number of delay request messages that may await their delay response
+// message. Must be a power of 2.
+#define PENDING_DELAY_REQ_SIZE      8
+#define PENDING_DELAY_REQ_MASK      (PENDING_DELAY_REQ_SIZE - 1)
+
+// Milliseconds a delay request message waits for its delay response message.
+#define PENDING_DELAY_REQ_TIMEOUT   2000
+
+// Depth of each receive port queue. Must be a power of 2.
+#ifndef PBUF_QUEUE_SIZE
+#define PBUF_QUEUE_SIZE             8
+#endif
 #define PBUF_QUEUE_MASK             (PBUF_QUEUE_SIZE - 1)
+#if (PBUF_QUEUE_SIZE & PBUF_QUEUE_MASK)
+#error "PBUF_QUEUE_SIZE must be a power of 2"
+#endif
 
 #ifdef __cplusplus
 }
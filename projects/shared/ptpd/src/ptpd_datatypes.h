@@ -6,6 +6,7 @@
 #include "cmsis_os2.h"
 #include "lwip/api.h"
 #include "ptpd_constants.h"
+#include "discipline.h"
 
 #ifdef __cplusplus
 extern "C" {
@@ -55,15 +56,57 @@ typedef struct
   int32_t n;
 } Filter;
 
-// Network buffer queue.
+// Network buffer queue. This is a wait-free ring with a single producer and a
+// single consumer, the PTP thread. The head is only written by the producer
+// and the tail only by the consumer. Each buffer is queued with a stamp for
+// the latency probes.
 typedef struct
 {
   void *pbuf[PBUF_QUEUE_SIZE];
-  int16_t head;
-  int16_t tail;
-  sys_mutex_t mutex;
+  uint32_t stamp[PBUF_QUEUE_SIZE];
+  volatile uint32_t head;
+  volatile uint32_t tail;
+
+  // Statistics maintained by the producer.
+  uint32_t highWater;
+  uint32_t drops;
 } BufQueue;
 
+// View of a received message. The payload points directly into the received
+// pbuf, or into the bounded gather buffer when the pbuf is chained. The pbuf
+// is held until the message has been handled.
+typedef struct
+{
+  struct pbuf *pbuf;
+  const octet_t *payload;
+  ssize_t length;
+  octet_t gather[PACKET_SIZE];
+} MsgView;
+
+// Destinations of transmitted messages.
+enum
+{
+  PTP_TX_EVENT = 0,
+  PTP_TX_GENERAL,
+  PTP_TX_PEER_EVENT,
+  PTP_TX_PEER_GENERAL,
+  PTP_TX_DESTINATIONS
+};
+
+// Preallocated transmit frame. Outgoing messages are packed directly after
+// the headers and the frame is handed to the Ethernet driver through the
+// static pbuf, so sending neither allocates nor copies the message. The
+// headers are prebuilt for each destination and only the lengths,
+// identification and checksum are patched per send.
+typedef struct
+{
+  struct pbuf pbuf;
+  uint32_t ifaceAddr;
+  uint16_t ipId;
+  octet_t header[PTP_TX_DESTINATIONS][PTP_TX_HEADER_LENGTH];
+  uint32_t frame[(PTP_TX_HEADER_LENGTH + PACKET_SIZE + 3) / 4];
+} TxFrame;
+
 // Struct used to store network data.
 typedef struct
 {
@@ -74,8 +117,14 @@ typedef struct
   struct udp_pcb *eventPcb;
   struct udp_pcb *generalPcb;
 
+  // Queues filled by the Ethernet fast path and by the lwIP receive callbacks
+  // with the messages the fast path leaves to lwIP. Each has one producer.
   BufQueue eventQ;
   BufQueue generalQ;
+  BufQueue eventLwipQ;
+  BufQueue generalLwipQ;
+
+  TxFrame txFrame;
 } NetPath;
 
 // Define compiler specific symbols.
@@ -253,6 +302,12 @@ typedef struct
   PortIdentity foreignMasterPortIdentity;
   int16_t foreignMasterAnnounceMessages;
 
+  // Receive times in milliseconds of the most recent announce messages
+  // used to qualify the foreign master within the time window (9.3.2.5).
+  uint32_t announceTimes[DEFAULT_FOREIGN_MASTER_THRESHOLD];
+  uint8_t announceIndex;
+  bool qualified;
+
   // This one is not in the spec.
   MsgAnnounce announce;
   MsgHeader header;
@@ -322,6 +377,30 @@ typedef struct
   uint4bit_t  versionNumber;
 } PortDS;
 
+// Two-step sync message awaiting its follow-up message.
+typedef struct
+{
+  bool valid;
+  int16_t sequenceId;
+  uint32_t received;
+  TimeInternal timestamp;
+  TimeInternal correctionField;
+} PendingSync;
+
+// Delay request message awaiting its delay response message. The transmit
+// and receive timestamps may become available in either order.
+typedef struct
+{
+  bool valid;
+  bool hasSendTime;
+  bool hasRecvTime;
+  int16_t sequenceId;
+  uint32_t sent;
+  TimeInternal sendTime;
+  TimeInternal recvTime;
+  TimeInternal correctionField;
+} PendingDelayReq;
+
 // Foreign master data set.
 typedef struct
 {
@@ -330,8 +409,23 @@ typedef struct
   // Other things we need for the protocol.
   int16_t count;
   int16_t capacity;
-  int16_t i;
+
+  // Index of the best qualified record, or -1 if there is none.
   int16_t best;
+
+  // Hash table of record indices keyed by port identity. Empty slots are -1.
+  int8_t table[FOREIGN_MASTER_HASH_SIZE];
+
+  // Cached result of the best master clock algorithm. It is re-evaluated only
+  // when a qualified record changes, a record gains or loses qualification,
+  // the port state changes or the local default data set changes.
+  bool changed;
+  uint8_t cachedState;
+  uint8_t cachedPortState;
+  DefaultDS cachedDefaultDS;
+
+  // Earliest time in milliseconds a qualified record may lose qualification.
+  uint32_t nextAging;
 } ForeignMasterDS;
 
 // Clock servo filters and PI regulator values.
@@ -398,10 +492,12 @@ typedef struct
     MsgSignaling signaling;
   } msgTmp;
 
-  // Buffers for outgoing and incoming messages.
-  octet_t msgObuf[PACKET_SIZE];
-  octet_t msgIbuf[PACKET_SIZE];
-  ssize_t msgIbufLength;
+  // Outgoing message within the transmit frame and view of the incoming message.
+  octet_t *msgObuf;
+  MsgView msgIbuf;
+
+  // Prebuilt common headers of transmitted messages indexed by message type.
+  octet_t msgHeaderTemplate[16][HEADER_LENGTH];
 
   // Time Master -> Slave.
   TimeInternal Tms;
@@ -420,8 +516,7 @@ typedef struct
   TimeInternal timestamp_delayReqSend;
   TimeInternal timestamp_delayReqRecv;
 
-  // Correction field for sync/follow-up and peer delay response messages.
-  TimeInternal correctionField_sync;
+  // Correction field for peer delay response messages.
   TimeInternal correctionField_pDelayResp;
 
   int16_t sentPDelayReqSequenceId;
@@ -430,12 +525,22 @@ typedef struct
   int16_t sentAnnounceSequenceId;
 
   int16_t recvPDelayReqSequenceId;
-  int16_t recvSyncSequenceId;
 
-  // True if sync message was recieved and 2step flag is set.
-  bool   waitingForFollowUp;
+  // Two-step sync messages awaiting their follow-up message indexed by sequence id.
+  PendingSync pendingSync[PENDING_SYNC_SIZE];
+
+  // Delay request messages awaiting their delay response message indexed by sequence id.
+  PendingDelayReq pendingDelayReq[PENDING_DELAY_REQ_SIZE];
   // True if peer delay response message was recieved and 2step flag is set.
   bool   waitingForPDelayRespFollowUp;
+  // True if a peer delay response follow up is to be sent once the peer delay
+  // response transmit timestamp arrives. Holds the peer delay request header.
+  bool   waitingForPDelayRespTimestamp;
+  MsgHeader pdelayReqHeader;
+  // True while the last sent sync and peer delay request messages await their
+  // transmit timestamps.
+  bool   waitingForSyncTimestamp;
+  bool   waitingForPDelayReqTimestamp;
 
   // Filters for offset from master, one way delay and scaled log variance.
   Filter ofm_filt;
@@ -443,7 +548,9 @@ typedef struct
   Filter slv_filt;
 
   int16_t offsetHistory[2];
-  int32_t observedDrift;
+
+  // Clock discipline. Its drift is the observed drift from the master.
+  discipline_t discipline;
 
   bool  messageActivity;
 
@@ -459,6 +566,11 @@ typedef struct
   Servo servo;
   int32_t events;
   enum8bit_t stats;
+
+  // Number of servo updates and of event messages whose transmit timestamp
+  // never arrived.
+  uint32_t servoUpdates;
+  uint32_t txTimestampTimeouts;
 } PtpClock;
 
 #ifdef __cplusplus
@@ -3,6 +3,9 @@
 #include "ptpd.h"
 #include "syslog.h"
 #include "shell.h"
+#if defined(STM32F4) || defined(STM32F7)
+#include "ethernetif.h"
+#endif
 
 #if LWIP_PTPD
 
@@ -12,12 +15,103 @@ static PtpClock ptp_clock;
 static ForeignMasterRecord ptp_foreign_records[DEFAULT_MAX_FOREIGN_RECORDS];
 static sys_mbox_t ptp_alert_queue;
 
+#if defined(STM32F4) || defined(STM32F7)
+// Message codec benchmark data.
+static const Timestamp ptpd_bench_timestamp = { { 0x5e0be100, 0x0000 }, 123456789 };
+static MsgHeader ptpd_bench_header;
+static MsgSync ptpd_bench_sync;
+static MsgAnnounce ptpd_bench_announce;
+static MsgDelayResp ptpd_bench_delay_resp;
+
+static void ptpd_bench_pack_sync(octet_t *buf)
+{
+  ptpd_msg_pack_sync(&ptp_clock, buf, &ptpd_bench_timestamp);
+}
+
+static void ptpd_bench_unpack_sync(octet_t *buf)
+{
+  ptpd_msg_unpack_header(buf, &ptpd_bench_header);
+  ptpd_msg_unpack_sync(buf, &ptpd_bench_sync);
+}
+
+static void ptpd_bench_pack_announce(octet_t *buf)
+{
+  ptpd_msg_pack_announce(&ptp_clock, buf);
+}
+
+static void ptpd_bench_unpack_announce(octet_t *buf)
+{
+  ptpd_msg_unpack_header(buf, &ptpd_bench_header);
+  ptpd_msg_unpack_announce(buf, &ptpd_bench_announce);
+}
+
+static void ptpd_bench_pack_delay_resp(octet_t *buf)
+{
+  ptpd_msg_pack_delay_resp(&ptp_clock, buf, &ptpd_bench_header, &ptpd_bench_timestamp);
+}
+
+static void ptpd_bench_unpack_delay_resp(octet_t *buf)
+{
+  ptpd_msg_unpack_header(buf, &ptpd_bench_header);
+  ptpd_msg_unpack_delay_resp(buf, &ptpd_bench_delay_resp);
+}
+
+// Each unpack benchmark decodes the message packed by the one before it.
+static const struct
+{
+  const char *name;
+  void (*func)(octet_t *buf);
+} ptpd_benches[] =
+{
+  { "pack sync", ptpd_bench_pack_sync },
+  { "unpack sync", ptpd_bench_unpack_sync },
+  { "pack announce", ptpd_bench_pack_announce },
+  { "unpack announce", ptpd_bench_unpack_announce },
+  { "pack delay resp", ptpd_bench_pack_delay_resp },
+  { "unpack delay resp", ptpd_bench_unpack_delay_resp },
+};
+
+// Measure the throughput of the message codec using the cycle counter.
+static void ptpd_shell_bench(uint32_t iterations)
+{
+  uint32_t i, j;
+  uint32_t start;
+  uint32_t cycles;
+  octet_t buf[PACKET_SIZE];
+
+  memset(buf, 0, sizeof(buf));
+  if (iterations < 1) iterations = 1;
+
+  for (i = 0; i < (sizeof(ptpd_benches) / sizeof(ptpd_benches[0])); ++i)
+  {
+    start = DWT->CYCCNT;
+    for (j = 0; j < iterations; ++j) ptpd_benches[i].func(buf);
+    cycles = (DWT->CYCCNT - start) / iterations;
+    if (cycles < 1) cycles = 1;
+
+    shell_printf("%s: %u cycles, %u msgs/sec\n", ptpd_benches[i].name,
+                 (unsigned) cycles, (unsigned) (SystemCoreClock / cycles));
+  }
+}
+#endif
+
 // Shell command to show the PTPD status.
 static bool ptpd_shell_ptpd(int argc, char **argv)
 {
   char sign;
+  int32_t drift;
   const char *s;
   uint8_t *uuid;
+  discipline_stats_t stats;
+
+#if defined(STM32F4) || defined(STM32F7)
+  // Benchmark the message codec.
+  if ((argc > 1) && !strcasecmp(argv[1], "bench"))
+  {
+    ptpd_shell_bench((argc > 2) ? (uint32_t) atoi(argv[2]) : 10000);
+    return true;
+  }
+#endif
 
   // Master clock UUID.
   uuid = (uint8_t *) ptp_clock.parentDS.parentPortIdentity.clockIdentity;
@@ -93,13 +187,34 @@ static bool ptpd_shell_ptpd(int argc, char **argv)
     }
 
     // Observed drift from master.
+    drift = discipline_get_drift(&ptp_clock.discipline);
     sign = ' ';
-    if (ptp_clock.observedDrift > 0) sign = '+';
-    if (ptp_clock.observedDrift < 0) sign = '-';
+    if (drift > 0) sign = '+';
+    if (drift < 0) sign = '-';
+
+    shell_printf("drift: %c%d.%03d ppm\n", sign, abs(drift / 1000), abs(drift % 1000));
 
-    shell_printf("drift: %c%d.%03d ppm\n", sign, abs(ptp_clock.observedDrift / 1000), abs(ptp_clock.observedDrift % 1000));
+    // Servo statistics.
+    discipline_get_stats(&ptp_clock.discipline, &stats);
+    shell_printf("servo: %s/%s, %u samples, %u steps, %u clamped\n",
+                 ptp_clock.discipline.config.estimator->name, ptp_clock.discipline.config.controller->name,
+                 (unsigned) stats.samples, (unsigned) stats.steps, (unsigned) stats.clamps);
   }
 
+  // Receive queue statistics.
+  shell_printf("event queue: %u high water, %u dropped\n",
+               (unsigned) ptp_clock.netPath.eventQ.highWater, (unsigned) ptp_clock.netPath.eventQ.drops);
+  shell_printf("general queue: %u high water, %u dropped\n",
+               (unsigned) ptp_clock.netPath.generalQ.highWater, (unsigned) ptp_clock.netPath.generalQ.drops);
+  shell_printf("lwip event queue: %u high water, %u dropped\n",
+               (unsigned) ptp_clock.netPath.eventLwipQ.highWater, (unsigned) ptp_clock.netPath.eventLwipQ.drops);
+  shell_printf("lwip general queue: %u high water, %u dropped\n",
+               (unsigned) ptp_clock.netPath.generalLwipQ.highWater, (unsigned) ptp_clock.netPath.generalLwipQ.drops);
+#if defined(STM32F4) || defined(STM32F7)
+  shell_printf("tx timestamps: %u dropped\n", (unsigned) ethernetif_get_tx_completion_drops());
+#endif
+  shell_printf("tx timestamps: %u timed out\n", (unsigned) ptp_clock.txTimestampTimeouts);
+
   return true;
 }
 
@@ -231,4 +346,17 @@ uint32_t ptpd_get_state(void)
   return (uint32_t) ptp_clock.portDS.portState;
 }
 
+// Get the PTP statistics. The fields are read without locking so a field
+// may be a sample older than another.
+void ptpd_get_stats(ptpd_stats_t *stats)
+{
+  stats->state = (uint32_t) ptp_clock.portDS.portState;
+  stats->servo_updates = ptp_clock.servoUpdates;
+  stats->offset_sec = ptp_clock.currentDS.offsetFromMaster.seconds;
+  stats->offset_nsec = ptp_clock.currentDS.offsetFromMaster.nanoseconds;
+  stats->event_drops = ptp_clock.netPath.eventQ.drops + ptp_clock.netPath.eventLwipQ.drops;
+  stats->general_drops = ptp_clock.netPath.generalQ.drops + ptp_clock.netPath.generalLwipQ.drops;
+  stats->tx_timestamp_timeouts = ptp_clock.txTimestampTimeouts;
+}
+
 #endif // LWIP_PTPD
@@ -3,290 +3,374 @@
 
 #if LWIP_PTPD
 
-// Unpack header message.
-void ptpd_msg_unpack_header(const octet_t *buf, MsgHeader *header)
+// Messages are encoded and decoded through declarative field lists. Each
+// entry gives the octet offset of the field in the message, the wire type
+// of the field and the member of the message structure. The wire types map
+// to the alignment-safe big-endian load and store helpers below, so no
+// multi-byte field is ever accessed through a cast of the buffer.
+
+// Load an unsigned 16-bit big-endian value.
+static inline uint16_t ptpd_load16(const octet_t *buf)
 {
-  int32_t msb;
-  uint32_t lsb;
-
-  header->transportSpecific = (*(nibble_t*)(buf + 0)) >> 4;
-  header->messageType = (*(enum4bit_t*)(buf + 0)) & 0x0F;
-  header->versionPTP = (*(uint4bit_t*)(buf  + 1)) & 0x0F; // Force reserved bit to zero if not.
-  header->messageLength = flip16(*(int16_t*)(buf  + 2));
-  header->domainNumber = (*(uint8_t*)(buf + 4));
-  memcpy(header->flagField, (buf + 6), FLAG_FIELD_LENGTH);
-  memcpy(&msb, (buf + 8), 4);
-  memcpy(&lsb, (buf + 12), 4);
-  header->correctionfield = flip32(msb);
-  header->correctionfield <<= 32;
-  header->correctionfield += flip32(lsb);
-  memcpy(header->sourcePortIdentity.clockIdentity, (buf + 20), CLOCK_IDENTITY_LENGTH);
-  header->sourcePortIdentity.portNumber = flip16(*(int16_t*)(buf  + 28));
-  header->sequenceId = flip16(*(int16_t*)(buf + 30));
-  header->controlField = (*(uint8_t*)(buf + 32));
-  header->logMessageInterval = (*(int8_t*)(buf + 33));
+  const uint8_t *p = (const uint8_t *) buf;
+  return (uint16_t) (((uint16_t) p[0] << 8) | p[1]);
 }
 
-// Pack header message.
-void ptpd_msg_pack_header(const PtpClock *ptp_clock, octet_t *buf)
+// Load an unsigned 32-bit big-endian value.
+static inline uint32_t ptpd_load32(const octet_t *buf)
 {
-  nibble_t transport = 0x80; // (spec annex D)
-  *(uint8_t*)(buf + 0) = transport;
-  *(uint4bit_t*)(buf  + 1) = ptp_clock->portDS.versionNumber;
-  *(uint8_t*)(buf + 4) = ptp_clock->defaultDS.domainNumber;
-  if (ptp_clock->defaultDS.twoStepFlag)
-  {
-      *(uint8_t*)(buf + 6) = FLAG0_TWO_STEP;
-  }
-  memset((buf + 8), 0, 8);
-  memcpy((buf + 20), ptp_clock->portDS.portIdentity.clockIdentity, CLOCK_IDENTITY_LENGTH);
-  *(int16_t*)(buf + 28) = flip16(ptp_clock->portDS.portIdentity.portNumber);
-  *(uint8_t*)(buf + 33) = 0x7F; //Default value (spec Table 24)
+  const uint8_t *p = (const uint8_t *) buf;
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) | ((uint32_t) p[2] << 8) | p[3];
 }
 
-// Pack Announce message.
-void ptpd_msg_pack_announce(const PtpClock *ptp_clock, octet_t *buf)
+// Store an unsigned 16-bit big-endian value.
+static inline void ptpd_store16(octet_t *buf, uint16_t value)
 {
-  // Changes in header
-  *(char*)(buf + 0) = *(char*)(buf + 0) & 0xF0; // RAZ messageType
-  *(char*)(buf + 0) = *(char*)(buf + 0) | ANNOUNCE; //Table 19
-  *(int16_t*)(buf + 2)  = flip16(ANNOUNCE_LENGTH);
-  *(int16_t*)(buf + 30) = flip16(ptp_clock->sentAnnounceSequenceId);
-  *(uint8_t*)(buf + 32) = CTRL_OTHER; // Table 23 - controlField
-  *(int8_t*)(buf + 33) = ptp_clock->portDS.logAnnounceInterval;
-
-  // Announce message
-  memset((buf + 34), 0, 10); // origin_timestamp
-  *(int16_t*)(buf + 44) = flip16(ptp_clock->timePropertiesDS.currentUtcOffset);
-  *(uint8_t*)(buf + 47) = ptp_clock->parentDS.grandmasterPriority1;
-  *(uint8_t*)(buf + 48) = ptp_clock->defaultDS.clockQuality.clockClass;
-  *(enum8bit_t*)(buf + 49) = ptp_clock->defaultDS.clockQuality.clockAccuracy;
-  *(int16_t*)(buf + 50) = flip16(ptp_clock->defaultDS.clockQuality.offsetScaledLogVariance);
-  *(uint8_t*)(buf + 52) = ptp_clock->parentDS.grandmasterPriority2;
-  memcpy((buf + 53), ptp_clock->parentDS.grandmasterIdentity, CLOCK_IDENTITY_LENGTH);
-  *(int16_t*)(buf + 61) = flip16(ptp_clock->currentDS.stepsRemoved);
-  *(enum8bit_t*)(buf + 63) = ptp_clock->timePropertiesDS.timeSource;
+  uint8_t *p = (uint8_t *) buf;
+  p[0] = (uint8_t) (value >> 8);
+  p[1] = (uint8_t) value;
 }
 
-// Unpack Announce message.
-void ptpd_msg_unpack_announce(const octet_t *buf, MsgAnnounce *announce)
+// Store an unsigned 32-bit big-endian value.
+static inline void ptpd_store32(octet_t *buf, uint32_t value)
 {
-  announce->originTimestamp.secondsField.msb = flip16(*(int16_t*)(buf + 34));
-  announce->originTimestamp.secondsField.lsb = flip32(*(uint32_t*)(buf + 36));
-  announce->originTimestamp.nanosecondsField = flip32(*(uint32_t*)(buf + 40));
-  announce->currentUtcOffset = flip16(*(int16_t*)(buf + 44));
-  announce->grandmasterPriority1 = *(uint8_t*)(buf + 47);
-  announce->grandmasterClockQuality.clockClass = *(uint8_t*)(buf + 48);
-  announce->grandmasterClockQuality.clockAccuracy = *(enum8bit_t*)(buf + 49);
-  announce->grandmasterClockQuality.offsetScaledLogVariance = flip16(*(int16_t*)(buf  + 50));
-  announce->grandmasterPriority2 = *(uint8_t*)(buf + 52);
-  memcpy(announce->grandmasterIdentity, (buf + 53), CLOCK_IDENTITY_LENGTH);
-  announce->stepsRemoved = flip16(*(int16_t*)(buf + 61));
-  announce->timeSource = *(enum8bit_t*)(buf + 63);
+  uint8_t *p = (uint8_t *) buf;
+  p[0] = (uint8_t) (value >> 24);
+  p[1] = (uint8_t) (value >> 16);
+  p[2] = (uint8_t) (value >> 8);
+  p[3] = (uint8_t) value;
 }
 
-// Pack Sync message.
-void ptpd_msg_pack_sync(const PtpClock *ptp_clock, octet_t *buf, const Timestamp *origin_timestamp)
+// Field accessors for each wire type.
+static inline void ptpd_get_u8(const octet_t *buf, uint8_t *value) { *value = (uint8_t) buf[0]; }
+static inline void ptpd_put_u8(octet_t *buf, const uint8_t *value) { buf[0] = (octet_t) *value; }
+static inline void ptpd_get_i8(const octet_t *buf, int8_t *value) { *value = (int8_t) buf[0]; }
+static inline void ptpd_put_i8(octet_t *buf, const int8_t *value) { buf[0] = (octet_t) *value; }
+static inline void ptpd_get_i16(const octet_t *buf, int16_t *value) { *value = (int16_t) ptpd_load16(buf); }
+static inline void ptpd_put_i16(octet_t *buf, const int16_t *value) { ptpd_store16(buf, (uint16_t) *value); }
+static inline void ptpd_get_u16(const octet_t *buf, uint16_t *value) { *value = ptpd_load16(buf); }
+
+// High nibble of an octet, such as transportSpecific.
+static inline void ptpd_get_nibble_hi(const octet_t *buf, uint8_t *value) { *value = ((uint8_t) buf[0]) >> 4; }
+static inline void ptpd_put_nibble_hi(octet_t *buf, const uint8_t *value) { buf[0] = (octet_t) ((buf[0] & 0x0F) | (*value << 4)); }
+
+// Low nibble of an octet, such as messageType. Reserved high bits are ignored.
+static inline void ptpd_get_nibble_lo(const octet_t *buf, uint8_t *value) { *value = ((uint8_t) buf[0]) & 0x0F; }
+static inline void ptpd_put_nibble_lo(octet_t *buf, const uint8_t *value) { buf[0] = (octet_t) ((buf[0] & 0xF0) | (*value & 0x0F)); }
+
+// Two octet flag field.
+static inline void ptpd_get_flags(const octet_t *buf, octet_t (*flags)[FLAG_FIELD_LENGTH]) { memcpy(*flags, buf, FLAG_FIELD_LENGTH); }
+static inline void ptpd_put_flags(octet_t *buf, const octet_t (*flags)[FLAG_FIELD_LENGTH]) { memcpy(buf, *flags, FLAG_FIELD_LENGTH); }
+
+// 64-bit correction field.
+static inline void ptpd_get_i64(const octet_t *buf, int64_t *value)
 {
-  // Changes in header
-  *(char*)(buf + 0) = *(char*)(buf + 0) & 0xF0; // RAZ messageType
-  *(char*)(buf + 0) = *(char*)(buf + 0) | SYNC; // Table 19
-  *(int16_t*)(buf + 2)  = flip16(SYNC_LENGTH);
-  *(int16_t*)(buf + 30) = flip16(ptp_clock->sentSyncSequenceId);
-  *(uint8_t*)(buf + 32) = CTRL_SYNC; // Table 23
-  *(int8_t*)(buf + 33) = ptp_clock->portDS.logSyncInterval;
-  memset((buf + 8), 0, 8); // Correction field
-
-  // Sync message.
-  *(int16_t*)(buf + 34) = flip16(origin_timestamp->secondsField.msb);
-  *(uint32_t*)(buf + 36) = flip32(origin_timestamp->secondsField.lsb);
-  *(uint32_t*)(buf + 40) = flip32(origin_timestamp->nanosecondsField);
+  *value = (int64_t) (((uint64_t) ptpd_load32(buf) << 32) | ptpd_load32(buf + 4));
 }
 
-// Unpack Sync message.
-void ptpd_msg_unpack_sync(const octet_t *buf, MsgSync *sync)
+static inline void ptpd_put_i64(octet_t *buf, const int64_t *value)
 {
-  sync->originTimestamp.secondsField.msb = flip16(*(int16_t*)(buf + 34));
-  sync->originTimestamp.secondsField.lsb = flip32(*(uint32_t*)(buf + 36));
-  sync->originTimestamp.nanosecondsField = flip32(*(uint32_t*)(buf + 40));
+  ptpd_store32(buf, (uint32_t) ((uint64_t) *value >> 32));
+  ptpd_store32(buf + 4, (uint32_t) *value);
 }
 
-// Pack DelayReq message.
-void ptpd_msg_pack_delay_req(const PtpClock *ptp_clock, octet_t *buf, const Timestamp *origin_timestamp)
+// 5.3.4 ClockIdentity.
+static inline void ptpd_get_clock_id(const octet_t *buf, ClockIdentity *id) { memcpy(*id, buf, CLOCK_IDENTITY_LENGTH); }
+static inline void ptpd_put_clock_id(octet_t *buf, const ClockIdentity *id) { memcpy(buf, *id, CLOCK_IDENTITY_LENGTH); }
+
+// 5.3.5 PortIdentity.
+static inline void ptpd_get_port_id(const octet_t *buf, PortIdentity *id)
 {
-  // Changes in header.
-  *(char*)(buf + 0) = *(char*)(buf + 0) & 0xF0; // RAZ messageType
-  *(char*)(buf + 0) = *(char*)(buf + 0) | DELAY_REQ; // Table 19
-  *(int16_t*)(buf + 2)  = flip16(DELAY_REQ_LENGTH);
-  *(int16_t*)(buf + 30) = flip16(ptp_clock->sentDelayReqSequenceId);
-  *(uint8_t*)(buf + 32) = CTRL_DELAY_REQ; // Table 23
-  *(int8_t*)(buf + 33) = 0x7F; // Table 24
-  memset((buf + 8), 0, 8);
-
-  // Delay_req message.
-  *(int16_t*)(buf + 34) = flip16(origin_timestamp->secondsField.msb);
-  *(uint32_t*)(buf + 36) = flip32(origin_timestamp->secondsField.lsb);
-  *(uint32_t*)(buf + 40) = flip32(origin_timestamp->nanosecondsField);
+  memcpy(id->clockIdentity, buf, CLOCK_IDENTITY_LENGTH);
+  id->portNumber = (int16_t) ptpd_load16(buf + CLOCK_IDENTITY_LENGTH);
 }
 
-// Unpack DelayReq message.
-void ptpd_msg_unpack_delay_req(const octet_t *buf, MsgDelayReq *delay_req)
+static inline void ptpd_put_port_id(octet_t *buf, const PortIdentity *id)
 {
-  delay_req->originTimestamp.secondsField.msb = flip16(*(int16_t*)(buf + 34));
-  delay_req->originTimestamp.secondsField.lsb = flip32(*(uint32_t*)(buf + 36));
-  delay_req->originTimestamp.nanosecondsField = flip32(*(uint32_t*)(buf + 40));
+  memcpy(buf, id->clockIdentity, CLOCK_IDENTITY_LENGTH);
+  ptpd_store16(buf + CLOCK_IDENTITY_LENGTH, (uint16_t) id->portNumber);
 }
 
-// Pack FollowUp message.
-void ptpd_msg_pack_follow_up(const PtpClock *ptp_clock, octet_t*buf, const Timestamp *precise_origin_timestamp)
+// 5.3.3 Timestamp.
+static inline void ptpd_get_timestamp(const octet_t *buf, Timestamp *timestamp)
 {
-  // Changes in header.
-  *(char*)(buf + 0) = *(char*)(buf + 0) & 0xF0; // RAZ messageType
-  *(char*)(buf + 0) = *(char*)(buf + 0) | FOLLOW_UP; // Table 19
-  *(int16_t*)(buf + 2)  = flip16(FOLLOW_UP_LENGTH);
-  // sentSyncSequenceId has already been incremented in issueSync.
-  *(int16_t*)(buf + 30) = flip16(ptp_clock->sentSyncSequenceId - 1);
-  *(uint8_t*)(buf + 32) = CTRL_FOLLOW_UP; // Table 23
-  *(int8_t*)(buf + 33) = ptp_clock->portDS.logSyncInterval;
-
-  // Follow_up message.
-  *(int16_t*)(buf + 34) = flip16(precise_origin_timestamp->secondsField.msb);
-  *(uint32_t*)(buf + 36) = flip32(precise_origin_timestamp->secondsField.lsb);
-  *(uint32_t*)(buf + 40) = flip32(precise_origin_timestamp->nanosecondsField);
+  timestamp->secondsField.msb = ptpd_load16(buf);
+  timestamp->secondsField.lsb = ptpd_load32(buf + 2);
+  timestamp->nanosecondsField = ptpd_load32(buf + 6);
 }
 
-// Unpack FollowUp message.
-void ptpd_msg_unpack_follow_up(const octet_t *buf, MsgFollowUp *follow)
+static inline void ptpd_put_timestamp(octet_t *buf, const Timestamp *timestamp)
 {
-  follow->preciseOriginTimestamp.secondsField.msb = flip16(*(int16_t*)(buf  + 34));
-  follow->preciseOriginTimestamp.secondsField.lsb = flip32(*(uint32_t*)(buf + 36));
-  follow->preciseOriginTimestamp.nanosecondsField = flip32(*(uint32_t*)(buf + 40));
+  ptpd_store16(buf, timestamp->secondsField.msb);
+  ptpd_store32(buf + 2, timestamp->secondsField.lsb);
+  ptpd_store32(buf + 6, timestamp->nanosecondsField);
 }
 
-// Pack DelayResp message.
-void ptpd_msg_pack_delay_resp(const PtpClock *ptp_clock, octet_t *buf, const MsgHeader *header, const Timestamp *receive_timestamp)
+// Common header (Table 18).
+#define PTPD_MSG_HEADER_FIELDS(F) \
+  F(0, nibble_hi, transportSpecific) \
+  F(0, nibble_lo, messageType) \
+  F(1, nibble_lo, versionPTP) \
+  F(2, i16, messageLength) \
+  F(4, u8, domainNumber) \
+  F(6, flags, flagField) \
+  F(8, i64, correctionfield) \
+  F(20, port_id, sourcePortIdentity) \
+  F(30, i16, sequenceId) \
+  F(32, u8, controlField) \
+  F(33, i8, logMessageInterval)
+
+// Announce message (Table 25).
+#define PTPD_MSG_ANNOUNCE_FIELDS(F) \
+  F(34, timestamp, originTimestamp) \
+  F(44, i16, currentUtcOffset) \
+  F(47, u8, grandmasterPriority1) \
+  F(48, u8, grandmasterClockQuality.clockClass) \
+  F(49, u8, grandmasterClockQuality.clockAccuracy) \
+  F(50, i16, grandmasterClockQuality.offsetScaledLogVariance) \
+  F(52, u8, grandmasterPriority2) \
+  F(53, clock_id, grandmasterIdentity) \
+  F(61, i16, stepsRemoved) \
+  F(63, u8, timeSource)
+
+// Sync and Delay_Req messages (Table 26).
+#define PTPD_MSG_SYNC_FIELDS(F) \
+  F(34, timestamp, originTimestamp)
+
+// Follow_Up message (Table 27).
+#define PTPD_MSG_FOLLOW_UP_FIELDS(F) \
+  F(34, timestamp, preciseOriginTimestamp)
+
+// Delay_Resp message (Table 28).
+#define PTPD_MSG_DELAY_RESP_FIELDS(F) \
+  F(34, timestamp, receiveTimestamp) \
+  F(44, port_id, requestingPortIdentity)
+
+// Pdelay_Req message (Table 29).
+#define PTPD_MSG_PDELAY_REQ_FIELDS(F) \
+  F(34, timestamp, originTimestamp)
+
+// Pdelay_Resp message (Table 30).
+#define PTPD_MSG_PDELAY_RESP_FIELDS(F) \
+  F(34, timestamp, requestReceiptTimestamp) \
+  F(44, port_id, requestingPortIdentity)
+
+// Pdelay_Resp_Follow_Up message (Table 31).
+#define PTPD_MSG_PDELAY_RESP_FOLLOW_UP_FIELDS(F) \
+  F(34, timestamp, responseOriginTimestamp) \
+  F(44, port_id, requestingPortIdentity)
+
+// Signaling message (Table 33). TLVs follow at offset 44.
+#define PTPD_MSG_SIGNALING_FIELDS(F) \
+  F(34, port_id, targetPortIdentity)
+
+// Management message (Table 37). The TLV follows at offset 48.
+#define PTPD_MSG_MANAGEMENT_FIELDS(F) \
+  F(34, port_id, targetPortIdentity) \
+  F(44, u8, startingBoundaryHops) \
+  F(45, u8, boundaryHops) \
+  F(46, nibble_lo, actionField)
+
+// TLV header (5.3.8).
+#define PTPD_MSG_TLV_FIELDS(F) \
+  F(0, u16, tlvType) \
+  F(2, i16, lengthField)
+
+// Expand a field list into loads from or stores to the buffer.
+#define PTPD_MSG_GET(offset, type, member) ptpd_get_##type(buf + (offset), &msg->member);
+#define PTPD_MSG_PUT(offset, type, member) ptpd_put_##type(buf + (offset), &msg->member);
+
+// Generate the unpack function of a message.
+#define PTPD_MSG_UNPACKER(name, type, FIELDS) \
+  void ptpd_msg_unpack_##name(const octet_t *buf, type *msg) \
+  { \
+    FIELDS(PTPD_MSG_GET) \
+  }
+
+// Generate the pack function of the fields of a message.
+#define PTPD_MSG_PACKER(name, type, FIELDS) \
+  static void ptpd_msg_pack_##name##_fields(octet_t *buf, const type *msg) \
+  { \
+    FIELDS(PTPD_MSG_PUT) \
+  }
+
+PTPD_MSG_UNPACKER(header, MsgHeader, PTPD_MSG_HEADER_FIELDS)
+PTPD_MSG_UNPACKER(announce, MsgAnnounce, PTPD_MSG_ANNOUNCE_FIELDS)
+PTPD_MSG_UNPACKER(sync, MsgSync, PTPD_MSG_SYNC_FIELDS)
+PTPD_MSG_UNPACKER(delay_req, MsgDelayReq, PTPD_MSG_SYNC_FIELDS)
+PTPD_MSG_UNPACKER(follow_up, MsgFollowUp, PTPD_MSG_FOLLOW_UP_FIELDS)
+PTPD_MSG_UNPACKER(delay_resp, MsgDelayResp, PTPD_MSG_DELAY_RESP_FIELDS)
+PTPD_MSG_UNPACKER(peer_delay_req, MsgPDelayReq, PTPD_MSG_PDELAY_REQ_FIELDS)
+PTPD_MSG_UNPACKER(peer_delay_resp, MsgPDelayResp, PTPD_MSG_PDELAY_RESP_FIELDS)
+PTPD_MSG_UNPACKER(peer_delay_resp_follow_up, MsgPDelayRespFollowUp, PTPD_MSG_PDELAY_RESP_FOLLOW_UP_FIELDS)
+PTPD_MSG_UNPACKER(signaling, MsgSignaling, PTPD_MSG_SIGNALING_FIELDS)
+PTPD_MSG_UNPACKER(management, MsgManagement, PTPD_MSG_MANAGEMENT_FIELDS)
+
+PTPD_MSG_PACKER(header, MsgHeader, PTPD_MSG_HEADER_FIELDS)
+PTPD_MSG_PACKER(announce, MsgAnnounce, PTPD_MSG_ANNOUNCE_FIELDS)
+PTPD_MSG_PACKER(sync, MsgSync, PTPD_MSG_SYNC_FIELDS)
+PTPD_MSG_PACKER(delay_req, MsgDelayReq, PTPD_MSG_SYNC_FIELDS)
+PTPD_MSG_PACKER(follow_up, MsgFollowUp, PTPD_MSG_FOLLOW_UP_FIELDS)
+PTPD_MSG_PACKER(delay_resp, MsgDelayResp, PTPD_MSG_DELAY_RESP_FIELDS)
+PTPD_MSG_PACKER(peer_delay_req, MsgPDelayReq, PTPD_MSG_PDELAY_REQ_FIELDS)
+PTPD_MSG_PACKER(peer_delay_resp, MsgPDelayResp, PTPD_MSG_PDELAY_RESP_FIELDS)
+PTPD_MSG_PACKER(peer_delay_resp_follow_up, MsgPDelayRespFollowUp, PTPD_MSG_PDELAY_RESP_FOLLOW_UP_FIELDS)
+
+// Unpack the TLV at the buffer. The value field points into the buffer.
+// Returns the total length of the TLV or zero if it does not fit.
+ssize_t ptpd_msg_unpack_tlv(const octet_t *buf, ssize_t length, TLV *msg)
 {
-  // Changes in header.
-  *(char*)(buf + 0) = *(char*)(buf + 0) & 0xF0; // RAZ messageType
-  *(char*)(buf + 0) = *(char*)(buf + 0) | DELAY_RESP; // Table 19
-  *(int16_t*)(buf + 2)  = flip16(DELAY_RESP_LENGTH);
-  // *(uint8_t*)(buf+4) = header->domainNumber; // TODO: Why?
-  memset((buf + 8), 0, 8);
+  if (length < TLV_HEADER_LENGTH) return 0;
+  PTPD_MSG_TLV_FIELDS(PTPD_MSG_GET)
+  if ((msg->lengthField < 0) || ((TLV_HEADER_LENGTH + msg->lengthField) > length)) return 0;
+  msg->valueField = (octet_t *) buf + TLV_HEADER_LENGTH;
+  return TLV_HEADER_LENGTH + msg->lengthField;
+}
 
-  // Copy correctionField of delayReqMessage.
-  *(int32_t*)(buf + 8) = flip32(header->correctionfield >> 32);
-  *(int32_t*)(buf + 12) = flip32((int32_t)header->correctionfield);
-  *(int16_t*)(buf + 30) = flip16(header->sequenceId);
-  *(uint8_t*)(buf + 32) = CTRL_DELAY_RESP; // Table 23
-  *(int8_t*)(buf + 33) = ptp_clock->portDS.logMinDelayReqInterval; //Table 24
-
-  // delay_resp message.
-  *(int16_t*)(buf + 34) = flip16(receive_timestamp->secondsField.msb);
-  *(uint32_t*)(buf + 36) = flip32(receive_timestamp->secondsField.lsb);
-  *(uint32_t*)(buf + 40) = flip32(receive_timestamp->nanosecondsField);
-  memcpy((buf + 44), header->sourcePortIdentity.clockIdentity, CLOCK_IDENTITY_LENGTH);
-  *(int16_t*)(buf + 52) = flip16(header->sourcePortIdentity.portNumber);
+// Build the header template of a message type.
+static void ptpd_msg_build_template(PtpClock *ptp_clock, enum4bit_t message_type,
+                                    int16_t message_length, uint8_t control_field)
+{
+  MsgHeader header;
+
+  memset(&header, 0, sizeof(header));
+  header.transportSpecific = 0x08; // (spec annex D)
+  header.messageType = message_type; // Table 19
+  header.versionPTP = ptp_clock->portDS.versionNumber;
+  header.messageLength = message_length;
+  header.domainNumber = ptp_clock->defaultDS.domainNumber;
+  if (ptp_clock->defaultDS.twoStepFlag) header.flagField[0] = FLAG0_TWO_STEP;
+  header.sourcePortIdentity = ptp_clock->portDS.portIdentity;
+  header.controlField = control_field; // Table 23
+  header.logMessageInterval = 0x7F; // Default value (spec Table 24)
+
+  memset(ptp_clock->msgHeaderTemplate[message_type], 0, HEADER_LENGTH);
+  ptpd_msg_pack_header_fields(ptp_clock->msgHeaderTemplate[message_type], &header);
 }
 
-// Unpack DelayResp message.
-void ptpd_msg_unpack_delay_resp(const octet_t *buf, MsgDelayResp *resp)
+// Copy the header template of a message type into the buffer and set the
+// fields that change with every message.
+static void ptpd_msg_pack_template(const PtpClock *ptp_clock, octet_t *buf, enum4bit_t message_type,
+                                   int16_t sequence_id, int8_t log_message_interval)
 {
-  resp->receiveTimestamp.secondsField.msb = flip16(*(int16_t*)(buf  + 34));
-  resp->receiveTimestamp.secondsField.lsb = flip32(*(uint32_t*)(buf + 36));
-  resp->receiveTimestamp.nanosecondsField = flip32(*(uint32_t*)(buf + 40));
-  memcpy(resp->requestingPortIdentity.clockIdentity, (buf + 44), CLOCK_IDENTITY_LENGTH);
-  resp->requestingPortIdentity.portNumber = flip16(*(int16_t*)(buf  + 52));
+  memcpy(buf, ptp_clock->msgHeaderTemplate[message_type], HEADER_LENGTH);
+  ptpd_put_i16(buf + 30, &sequence_id);
+  ptpd_put_i8(buf + 33, &log_message_interval);
 }
 
-// Pack PeerDelayReq message.
-void ptpd_msg_pack_peer_delay_req(const PtpClock *ptp_clock, octet_t *buf, const Timestamp *origin_timestamp)
+// Build the header templates of all transmitted messages.
+void ptpd_msg_pack_header(PtpClock *ptp_clock)
 {
-  // Changes in header.
-  *(char*)(buf + 0) = *(char*)(buf + 0) & 0xF0; // RAZ messageType
-  *(char*)(buf + 0) = *(char*)(buf + 0) | PDELAY_REQ; // Table 19
-  *(int16_t*)(buf + 2)  = flip16(PDELAY_REQ_LENGTH);
-  *(int16_t*)(buf + 30) = flip16(ptp_clock->sentPDelayReqSequenceId);
-  *(uint8_t*)(buf + 32) = CTRL_OTHER; // Table 23
-  *(int8_t*)(buf + 33) = 0x7F; // Table 24
-  memset((buf + 8), 0, 8);
-
-  // Pdelay_req message
-  *(int16_t*)(buf + 34) = flip16(origin_timestamp->secondsField.msb);
-  *(uint32_t*)(buf + 36) = flip32(origin_timestamp->secondsField.lsb);
-  *(uint32_t*)(buf + 40) = flip32(origin_timestamp->nanosecondsField);
-  memset((buf + 44), 0, 10); // RAZ reserved octets.
+  ptpd_msg_build_template(ptp_clock, ANNOUNCE, ANNOUNCE_LENGTH, CTRL_OTHER);
+  ptpd_msg_build_template(ptp_clock, SYNC, SYNC_LENGTH, CTRL_SYNC);
+  ptpd_msg_build_template(ptp_clock, FOLLOW_UP, FOLLOW_UP_LENGTH, CTRL_FOLLOW_UP);
+  ptpd_msg_build_template(ptp_clock, DELAY_REQ, DELAY_REQ_LENGTH, CTRL_DELAY_REQ);
+  ptpd_msg_build_template(ptp_clock, DELAY_RESP, DELAY_RESP_LENGTH, CTRL_DELAY_RESP);
+  ptpd_msg_build_template(ptp_clock, PDELAY_REQ, PDELAY_REQ_LENGTH, CTRL_OTHER);
+  ptpd_msg_build_template(ptp_clock, PDELAY_RESP, PDELAY_RESP_LENGTH, CTRL_OTHER);
+  ptpd_msg_build_template(ptp_clock, PDELAY_RESP_FOLLOW_UP, PDELAY_RESP_FOLLOW_UP_LENGTH, CTRL_OTHER);
 }
 
-// Unpack PeerDelayReq message.
-void ptpd_msg_unpack_peer_delay_req(const octet_t *buf, MsgPDelayReq *pdelayreq)
+// Pack Announce message.
+void ptpd_msg_pack_announce(const PtpClock *ptp_clock, octet_t *buf)
 {
-  pdelayreq->originTimestamp.secondsField.msb = flip16(*(int16_t*)(buf  + 34));
-  pdelayreq->originTimestamp.secondsField.lsb = flip32(*(uint32_t*)(buf + 36));
-  pdelayreq->originTimestamp.nanosecondsField = flip32(*(uint32_t*)(buf + 40));
+  MsgAnnounce announce;
+
+  ptpd_msg_pack_template(ptp_clock, buf, ANNOUNCE, ptp_clock->sentAnnounceSequenceId, ptp_clock->portDS.logAnnounceInterval);
+
+  // Announce message with a zero origin timestamp and reserved octets.
+  memset(&announce, 0, sizeof(announce));
+  announce.currentUtcOffset = ptp_clock->timePropertiesDS.currentUtcOffset;
+  announce.grandmasterPriority1 = ptp_clock->parentDS.grandmasterPriority1;
+  announce.grandmasterClockQuality.clockClass = ptp_clock->defaultDS.clockQuality.clockClass;
+  announce.grandmasterClockQuality.clockAccuracy = ptp_clock->defaultDS.clockQuality.clockAccuracy;
+  announce.grandmasterClockQuality.offsetScaledLogVariance = ptp_clock->defaultDS.clockQuality.offsetScaledLogVariance;
+  announce.grandmasterPriority2 = ptp_clock->parentDS.grandmasterPriority2;
+  memcpy(announce.grandmasterIdentity, ptp_clock->parentDS.grandmasterIdentity, CLOCK_IDENTITY_LENGTH);
+  announce.stepsRemoved = ptp_clock->currentDS.stepsRemoved;
+  announce.timeSource = ptp_clock->timePropertiesDS.timeSource;
+  memset(buf + HEADER_LENGTH, 0, ANNOUNCE_LENGTH - HEADER_LENGTH);
+  ptpd_msg_pack_announce_fields(buf, &announce);
 }
 
-// Pack PeerDelayResp message.
-void ptpd_msg_pack_peer_delay_resp(octet_t *buf, const MsgHeader *header, const Timestamp *request_receipt_timestamp)
+// Pack Sync message.
+void ptpd_msg_pack_sync(const PtpClock *ptp_clock, octet_t *buf, const Timestamp *origin_timestamp)
 {
-  // Changes in header.
-  *(char*)(buf + 0) = *(char*)(buf + 0) & 0xF0; // RAZ messageType
-  *(char*)(buf + 0) = *(char*)(buf + 0) | PDELAY_RESP; // Table 19
-  *(int16_t*)(buf + 2)  = flip16(PDELAY_RESP_LENGTH);
-  // *(uint8_t*)(buf+4) = header->domainNumber; // TODO: Why?
-  memset((buf + 8), 0, 8);
-  *(int16_t*)(buf + 30) = flip16(header->sequenceId);
-  *(uint8_t*)(buf + 32) = CTRL_OTHER; // Table 23
-  *(int8_t*)(buf + 33) = 0x7F; // Table 24
-
-  // Pdelay_resp message.
-  *(int16_t*)(buf + 34) = flip16(request_receipt_timestamp->secondsField.msb);
-  *(uint32_t*)(buf + 36) = flip32(request_receipt_timestamp->secondsField.lsb);
-  *(uint32_t*)(buf + 40) = flip32(request_receipt_timestamp->nanosecondsField);
-  memcpy((buf + 44), header->sourcePortIdentity.clockIdentity, CLOCK_IDENTITY_LENGTH);
-  *(int16_t*)(buf + 52) = flip16(header->sourcePortIdentity.portNumber);
+  MsgSync sync = { *origin_timestamp };
+
+  ptpd_msg_pack_template(ptp_clock, buf, SYNC, ptp_clock->sentSyncSequenceId, ptp_clock->portDS.logSyncInterval);
+  ptpd_msg_pack_sync_fields(buf, &sync);
 }
 
-// Unpack PeerDelayResp message.
-void ptpd_msg_unpack_peer_delay_resp(const octet_t *buf, MsgPDelayResp *presp)
+// Pack DelayReq message.
+void ptpd_msg_pack_delay_req(const PtpClock *ptp_clock, octet_t *buf, const Timestamp *origin_timestamp)
 {
-  presp->requestReceiptTimestamp.secondsField.msb = flip16(*(int16_t*)(buf  + 34));
-  presp->requestReceiptTimestamp.secondsField.lsb = flip32(*(uint32_t*)(buf + 36));
-  presp->requestReceiptTimestamp.nanosecondsField = flip32(*(uint32_t*)(buf + 40));
-  memcpy(presp->requestingPortIdentity.clockIdentity, (buf + 44), CLOCK_IDENTITY_LENGTH);
-  presp->requestingPortIdentity.portNumber = flip16(*(int16_t*)(buf + 52));
+  MsgDelayReq req = { *origin_timestamp };
+
+  ptpd_msg_pack_template(ptp_clock, buf, DELAY_REQ, ptp_clock->sentDelayReqSequenceId, 0x7F);
+  ptpd_msg_pack_delay_req_fields(buf, &req);
 }
 
-// Pack PeerDelayRespFollowUp message.
-void ptpd_msg_pack_peer_delay_resp_follow_up(octet_t *buf, const MsgHeader *header, const Timestamp *response_origin_timestamp)
+// Pack FollowUp message.
+void ptpd_msg_pack_follow_up(const PtpClock *ptp_clock, octet_t *buf, int16_t sequence_id, const Timestamp *precise_origin_timestamp)
 {
-  // Changes in header.
-  *(char*)(buf + 0) = *(char*)(buf + 0) & 0xF0; // RAZ messageType
-  *(char*)(buf + 0) = *(char*)(buf + 0) | PDELAY_RESP_FOLLOW_UP; // Table 19
-  *(int16_t*)(buf + 2)  = flip16(PDELAY_RESP_FOLLOW_UP_LENGTH);
-  *(int16_t*)(buf + 30) = flip16(header->sequenceId);
-  *(uint8_t*)(buf + 32) = CTRL_OTHER; // Table 23
-  *(int8_t*)(buf + 33) = 0x7F; // Table 24
+  MsgFollowUp follow = { *precise_origin_timestamp };
 
-  // Copy correctionField of PdelayReqMessage.
-  *(int32_t*)(buf + 8) = flip32(header->correctionfield >> 32);
-  *(int32_t*)(buf + 12) = flip32((int32_t)header->correctionfield);
-
-  // Pdelay_resp_follow_up message.
-  *(int16_t*)(buf + 34) = flip16(response_origin_timestamp->secondsField.msb);
-  *(uint32_t*)(buf + 36) = flip32(response_origin_timestamp->secondsField.lsb);
-  *(uint32_t*)(buf + 40) = flip32(response_origin_timestamp->nanosecondsField);
-  memcpy((buf + 44), header->sourcePortIdentity.clockIdentity, CLOCK_IDENTITY_LENGTH);
-  *(int16_t*)(buf + 52) = flip16(header->sourcePortIdentity.portNumber);
+  // Sequence id of the Sync message this follows.
+  ptpd_msg_pack_template(ptp_clock, buf, FOLLOW_UP, sequence_id, ptp_clock->portDS.logSyncInterval);
+  ptpd_msg_pack_follow_up_fields(buf, &follow);
 }
 
-// Unpack PeerDelayRespFollowUp message.
-void ptpd_msg_unpack_peer_delay_resp_follow_up(const octet_t *buf, MsgPDelayRespFollowUp *resp_follow_up)
+// Pack DelayResp message.
+void ptpd_msg_pack_delay_resp(const PtpClock *ptp_clock, octet_t *buf, const MsgHeader *header, const Timestamp *receive_timestamp)
 {
-  resp_follow_up->responseOriginTimestamp.secondsField.msb = flip16(*(int16_t*)(buf  + 34));
-  resp_follow_up->responseOriginTimestamp.secondsField.lsb = flip32(*(uint32_t*)(buf + 36));
-  resp_follow_up->responseOriginTimestamp.nanosecondsField = flip32(*(uint32_t*)(buf + 40));
-  memcpy(resp_follow_up->requestingPortIdentity.clockIdentity, (buf + 44), CLOCK_IDENTITY_LENGTH);
-  resp_follow_up->requestingPortIdentity.portNumber = flip16(*(int16_t*)(buf + 52));
+  MsgDelayResp resp;
+
+  ptpd_msg_pack_template(ptp_clock, buf, DELAY_RESP, header->sequenceId, ptp_clock->portDS.logMinDelayReqInterval);
+
+  // Copy correctionField of delayReqMessage.
+  ptpd_put_i64(buf + 8, &header->correctionfield);
+
+  resp.receiveTimestamp = *receive_timestamp;
+  resp.requestingPortIdentity = header->sourcePortIdentity;
+  ptpd_msg_pack_delay_resp_fields(buf, &resp);
+}
+
+// Pack PeerDelayReq message.
+void ptpd_msg_pack_peer_delay_req(const PtpClock *ptp_clock, octet_t *buf, const Timestamp *origin_timestamp)
+{
+  MsgPDelayReq req = { *origin_timestamp };
+
+  ptpd_msg_pack_template(ptp_clock, buf, PDELAY_REQ, ptp_clock->sentPDelayReqSequenceId, 0x7F);
+  ptpd_msg_pack_peer_delay_req_fields(buf, &req);
+  memset((buf + 44), 0, 10); // RAZ reserved octets.
+}
+
+// Pack PeerDelayResp message.
+void ptpd_msg_pack_peer_delay_resp(const PtpClock *ptp_clock, octet_t *buf, const MsgHeader *header, const Timestamp *request_receipt_timestamp)
+{
+  MsgPDelayResp resp;
+
+  ptpd_msg_pack_template(ptp_clock, buf, PDELAY_RESP, header->sequenceId, 0x7F);
+
+  resp.requestReceiptTimestamp = *request_receipt_timestamp;
+  resp.requestingPortIdentity = header->sourcePortIdentity;
+  ptpd_msg_pack_peer_delay_resp_fields(buf, &resp);
+}
+
+// Pack PeerDelayRespFollowUp message.
+void ptpd_msg_pack_peer_delay_resp_follow_up(const PtpClock *ptp_clock, octet_t *buf, const MsgHeader *header, const Timestamp *response_origin_timestamp)
+{
+  MsgPDelayRespFollowUp follow;
+
+  ptpd_msg_pack_template(ptp_clock, buf, PDELAY_RESP_FOLLOW_UP, header->sequenceId, 0x7F);
+
+  // Copy correctionField of PdelayReqMessage.
+  ptpd_put_i64(buf + 8, &header->correctionfield);
+
+  follow.responseOriginTimestamp = *response_origin_timestamp;
+  follow.requestingPortIdentity = header->sourcePortIdentity;
+  ptpd_msg_pack_peer_delay_resp_follow_up_fields(buf, &follow);
 }
 
 #endif // LWIP_PTPD
@@ -2,9 +2,16 @@
 #include "lwip/inet.h"
 #include "lwip/udp.h"
 #include "lwip/igmp.h"
+#include "lwip/inet_chksum.h"
+#include "lwip/prot/ethernet.h"
+#include "lwip/prot/ip4.h"
+#include "lwip/prot/udp.h"
 #include "syslog.h"
 #include "ptpd.h"
 #include "ethernetif.h"
+#if defined(STM32F4) || defined(STM32F7)
+#include "ptpprobe.h"
+#endif
 
 #if LWIP_PTPD
 
@@ -13,78 +20,71 @@ static void ptpd_net_queue_init(BufQueue *queue)
 {
   queue->head = 0;
   queue->tail = 0;
-  sys_mutex_new(&queue->mutex);
+  queue->highWater = 0;
+  queue->drops = 0;
 }
 
-// Put data to the network queue.
-static bool ptpd_net_queue_put(BufQueue *queue, void *pbuf)
+// Put data to the network queue. Called only by the producer.
+static bool ptpd_net_queue_put(BufQueue *queue, void *pbuf, uint32_t stamp)
 {
-  bool retval = false;
-
-  sys_mutex_lock(&queue->mutex);
+  uint32_t head = queue->head;
+  uint32_t count = head - queue->tail;
 
   // Is there room on the queue for the buffer?
-  if (((queue->head + 1) & PBUF_QUEUE_MASK) != queue->tail)
+  if (count >= PBUF_QUEUE_SIZE)
   {
-    // Place the buffer in the queue.
-    queue->head = (queue->head + 1) & PBUF_QUEUE_MASK;
-    queue->pbuf[queue->head] = pbuf;
-    retval = true;
+    queue->drops++;
+    return false;
   }
 
-  sys_mutex_unlock(&queue->mutex);
+  // Place the buffer in the queue before publishing the new head.
+  queue->pbuf[head & PBUF_QUEUE_MASK] = pbuf;
+  queue->stamp[head & PBUF_QUEUE_MASK] = stamp;
+  __DMB();
+  queue->head = head + 1;
 
-  return retval;
+  // Track the deepest the queue has been.
+  if (count + 1 > queue->highWater) queue->highWater = count + 1;
+
+  return true;
 }
 
-// Get data from the network queue.
-static void *ptpd_net_queue_get(BufQueue *queue)
+// Get data from the network queue with its stamp, which may be NULL. Called
+// only by the consumer.
+static void *ptpd_net_queue_get(BufQueue *queue, uint32_t *stamp)
 {
-  void *pbuf = NULL;
-
-  sys_mutex_lock(&queue->mutex);
+  void *pbuf;
+  uint32_t tail = queue->tail;
 
   // Is there a buffer on the queue?
-  if (queue->tail != queue->head)
-  {
-    // Get the buffer from the queue.
-    queue->tail = (queue->tail + 1) & PBUF_QUEUE_MASK;
-    pbuf = queue->pbuf[queue->tail];
-  }
+  if (tail == queue->head) return NULL;
 
-  sys_mutex_unlock(&queue->mutex);
+  // Get the buffer from the queue before releasing the slot.
+  __DMB();
+  pbuf = queue->pbuf[tail & PBUF_QUEUE_MASK];
+  if (stamp != NULL) *stamp = queue->stamp[tail & PBUF_QUEUE_MASK];
+  __DMB();
+  queue->tail = tail + 1;
 
   return pbuf;
 }
 
-// Free any remaining pbufs in the queue.
+// Free any remaining pbufs in the queue. Called only by the consumer.
 static void ptpd_net_queue_empty(BufQueue *queue)
 {
-  sys_mutex_lock(&queue->mutex);
+  void *pbuf;
 
   // Free each remaining buffer in the queue.
-  while (queue->tail != queue->head)
+  while ((pbuf = ptpd_net_queue_get(queue, NULL)) != NULL)
   {
-    // Get the buffer from the queue.
-    queue->tail = (queue->tail + 1) & PBUF_QUEUE_MASK;
-    pbuf_free(queue->pbuf[queue->tail]);
+    pbuf_free((struct pbuf *) pbuf);
   }
-  
-  sys_mutex_unlock(&queue->mutex);
 }
 
 // Return true if something is in the queue.
 static bool ptpd_net_queue_check(BufQueue  *queue)
 {
-  bool  retval = false;
-
-  sys_mutex_lock(&queue->mutex);
-
-  if (queue->tail != queue->head) retval = true;
-
-  sys_mutex_unlock(&queue->mutex);
-
-  return retval;
+  return queue->tail != queue->head;
 }
 
 // Find interface to be used. uuid will be filled with MAC address of the interface.
@@ -103,23 +103,93 @@ static int32_t ptpd_find_iface(const octet_t *ifaceName, octet_t *uuid, NetPath
   return iface->ip_addr.addr;
 }
 
+// Build the Ethernet, IPv4 and UDP headers of a transmit destination.
+static void ptpd_net_build_header(octet_t *header, const struct netif *netif, uint32_t addr, uint16_t port)
+{
+  struct eth_hdr *ethhdr = (struct eth_hdr *) header;
+  struct ip_hdr *iphdr = (struct ip_hdr *) (header + SIZEOF_ETH_HDR);
+  struct udp_hdr *udphdr = (struct udp_hdr *) (header + SIZEOF_ETH_HDR + IP_HLEN);
+  const uint8_t *group = (const uint8_t *) &addr;
+
+  memset(header, 0, PTP_TX_HEADER_LENGTH);
+
+  // Ethernet header with the multicast MAC address mapped from the group.
+  ethhdr->dest.addr[0] = LL_IP4_MULTICAST_ADDR_0;
+  ethhdr->dest.addr[1] = LL_IP4_MULTICAST_ADDR_1;
+  ethhdr->dest.addr[2] = LL_IP4_MULTICAST_ADDR_2;
+  ethhdr->dest.addr[3] = group[1] & 0x7f;
+  ethhdr->dest.addr[4] = group[2];
+  ethhdr->dest.addr[5] = group[3];
+  memcpy(ethhdr->src.addr, netif->hwaddr, ETH_HWADDR_LEN);
+  ethhdr->type = lwip_htons(ETHTYPE_IP);
+
+  // IPv4 header. The length, identification and checksum are set per send.
+  IPH_VHL_SET(iphdr, 4, IP_HLEN / 4);
+  IPH_TTL_SET(iphdr, UDP_TTL);
+  IPH_PROTO_SET(iphdr, IP_PROTO_UDP);
+  iphdr->src.addr = ip4_addr_get_u32(netif_ip4_addr(netif));
+  iphdr->dest.addr = addr;
+
+  // UDP header. The length is set per send and the checksum is left zero
+  // for the hardware to insert.
+  udphdr->src = lwip_htons(port);
+  udphdr->dest = lwip_htons(port);
+}
+
+// Build the headers of all transmit destinations for the interface.
+static void ptpd_net_build_headers(NetPath *net_path, const struct netif *netif)
+{
+  TxFrame *tx = &net_path->txFrame;
+
+  ptpd_net_build_header(tx->header[PTP_TX_EVENT], netif, net_path->multicastAddr, PTP_EVENT_PORT);
+  ptpd_net_build_header(tx->header[PTP_TX_GENERAL], netif, net_path->multicastAddr, PTP_GENERAL_PORT);
+  ptpd_net_build_header(tx->header[PTP_TX_PEER_EVENT], netif, net_path->peerMulticastAddr, PTP_EVENT_PORT);
+  ptpd_net_build_header(tx->header[PTP_TX_PEER_GENERAL], netif, net_path->peerMulticastAddr, PTP_GENERAL_PORT);
+  tx->ifaceAddr = ip4_addr_get_u32(netif_ip4_addr(netif));
+}
+
+#if defined(STM32F4) || defined(STM32F7)
+// Process an incoming message from the Ethernet fast path. This runs in the
+// context of the Ethernet thread, which is the only producer of these queues.
+static void ptpd_net_fast_callback(void *arg, struct pbuf *p, uint16_t port)
+{
+  NetPath *net_path = (NetPath *) arg;
+  BufQueue *queue = (port == PTP_EVENT_PORT) ? &net_path->eventQ : &net_path->generalQ;
+
+  // Place the incoming message on the port queue.
+  if (ptpd_net_queue_put(queue, p, ptpprobe_enqueue()))
+  {
+    // Alert the PTP thread there is now something to do.
+    ptpd_alert();
+  }
+  else
+  {
+    // Overflow is accounted by the queue.
+    pbuf_free(p);
+  }
+}
+#endif
+
 // Process an incoming message on the event port.
 static void ptpd_net_event_callback(void *arg, struct udp_pcb *pcb, struct pbuf *p,
                                     const ip_addr_t *addr, u16_t port)
 {
   NetPath *net_path = (NetPath *) arg;
 
-  // Place the incoming message on the event port queue.
-  if (ptpd_net_queue_put(&net_path->eventQ, p))
+  // Most messages arrive through the Ethernet fast path. Those it leaves to
+  // lwIP, such as VLAN tagged frames and reassembled fragments, arrive here.
+  // They are queued without a latency probe stamp on a queue of their own,
+  // as the tcpip thread is its only producer.
+  if (ptpd_net_queue_put(&net_path->eventLwipQ, p, 0))
   {
     // Alert the PTP thread there is now something to do.
     ptpd_alert();
   }
   else
   {
+    // Overflow is accounted by the queue. Avoid logging here as
+    // this runs in the context of the TCP/IP thread.
     pbuf_free(p);
-    syslog_printf(SYSLOG_ERROR, "PTPD: event port queue full");
-    ERROR("PTPD: event port queue full\n");
   }
 }
 
@@ -129,17 +199,18 @@ static void ptpd_net_general_callback(void *arg, struct udp_pcb *pcb, struct pbu
 {
   NetPath *net_path = (NetPath *) arg;
 
-  // Place the incoming message on the event port queue.
-  if (ptpd_net_queue_put(&net_path->generalQ, p))
+  // Place the incoming message on the lwIP general port queue. Messages the
+  // Ethernet fast path leaves to lwIP arrive here without a stamp.
+  if (ptpd_net_queue_put(&net_path->generalLwipQ, p, 0))
   {
     // Alert the PTP thread there is now something to do.
     ptpd_alert();
   }
   else
   {
+    // Overflow is accounted by the queue. Avoid logging here as
+    // this runs in the context of the TCP/IP thread.
     pbuf_free(p);
-    syslog_printf(SYSLOG_ERROR, "PTPD: general port queue full");
-    ERROR("PTPD: general port queue full\n");
   }
 }
 
@@ -153,6 +224,8 @@ bool ptpd_net_init(NetPath *net_path, PtpClock *ptp_clock)
   // Initialize the buffer queues.
   ptpd_net_queue_init(&net_path->eventQ);
   ptpd_net_queue_init(&net_path->generalQ);
+  ptpd_net_queue_init(&net_path->eventLwipQ);
+  ptpd_net_queue_init(&net_path->generalLwipQ);
 
   // Find a network interface.
   interface_addr.addr = ptpd_find_iface(ptp_clock->rtOpts.ifaceName, ptp_clock->portUuidField, net_path);
@@ -214,6 +287,21 @@ bool ptpd_net_init(NetPath *net_path, PtpClock *ptp_clock)
   net_path->eventPcb->mcast_ip4.addr = net_path->multicastAddr;
   net_path->generalPcb->mcast_ip4.addr = net_path->multicastAddr;
 
+  // Prebuild the transmit headers and pack outgoing messages in place.
+  ptpd_net_build_headers(net_path, netif_default);
+  net_path->txFrame.ipId = 0;
+  ptp_clock->msgObuf = (octet_t *) net_path->txFrame.frame + PTP_TX_HEADER_LENGTH;
+
+#if defined(STM32F4) || defined(STM32F7)
+  // Transmit timestamps of event messages complete asynchronously. The Ethernet
+  // interface alerts the PTP thread from interrupt context as they arrive.
+  ethernetif_set_tx_completion_callback(ptpd_alert);
+
+  // Receive messages directly from the Ethernet thread rather than through
+  // the tcpip thread so their latency is independent of other traffic.
+  ethernetif_set_ptp_input(ptpd_net_fast_callback, net_path);
+#endif
+
   // Establish the appropriate UDP bindings/connections for event port.
   udp_recv(net_path->eventPcb, ptpd_net_event_callback, net_path);
   udp_bind(net_path->eventPcb, IP_ADDR_ANY, PTP_EVENT_PORT);
@@ -263,6 +351,18 @@ bool ptpd_net_shutdown(NetPath *net_path)
     net_path->generalPcb = NULL;
   }
 
+#if defined(STM32F4) || defined(STM32F7)
+  // Stop transmit timestamp alerts and the receive fast path.
+  ethernetif_set_tx_completion_callback(NULL);
+  ethernetif_set_ptp_input(NULL, NULL);
+#endif
+
+  // Free any messages still waiting on the queues.
+  ptpd_net_queue_empty(&net_path->eventQ);
+  ptpd_net_queue_empty(&net_path->generalQ);
+  ptpd_net_queue_empty(&net_path->eventLwipQ);
+  ptpd_net_queue_empty(&net_path->generalLwipQ);
+
   // Clear the network addresses.
   net_path->multicastAddr = 0;
   net_path->unicastAddr = 0;
@@ -278,6 +378,7 @@ int32_t ptpd_net_select(NetPath *net_path, const TimeInternal *timeout)
 {
   // Check the packet queues.  If there is data, return true.
   if (ptpd_net_queue_check(&net_path->eventQ) || ptpd_net_queue_check(&net_path->generalQ)) return 1;
+  if (ptpd_net_queue_check(&net_path->eventLwipQ) || ptpd_net_queue_check(&net_path->generalLwipQ)) return 1;
 
   return 0;
 }
@@ -286,24 +387,27 @@ int32_t ptpd_net_select(NetPath *net_path, const TimeInternal *timeout)
 void ptpd_net_empty_event_queue(NetPath *net_path)
 {
   ptpd_net_queue_empty(&net_path->eventQ);
+  ptpd_net_queue_empty(&net_path->eventLwipQ);
 }
 
-// Receive the next buffer from the given queue.
-static ssize_t ptpd_net_recv(octet_t *buf, TimeInternal *time, BufQueue *queue)
+// Receive the next buffer from the given queue as a view of the pbuf payload.
+static ssize_t ptpd_net_recv(MsgView *view, TimeInternal *time, BufQueue *queue)
 {
-  int i;
-  int j;
-  u16_t length;
   struct pbuf *p;
-  struct pbuf *pcopy;
+  uint32_t stamp;
 
   // Get the next buffer from the queue.
-  if ((p = (struct pbuf*) ptpd_net_queue_get(queue)) == NULL)
+  if ((p = (struct pbuf*) ptpd_net_queue_get(queue, &stamp)) == NULL)
   {
     return 0;
   }
 
-  // Verify that we have enough space to store the contents.
+#if defined(STM32F4) || defined(STM32F7)
+  // Measure the latency from the queue of messages from the fast path.
+  if (stamp != 0) ptpprobe_dequeue(stamp);
+#endif
+
+  // Verify that the message fits the gather buffer.
   if (p->tot_len > PACKET_SIZE)
   {
     syslog_printf(SYSLOG_ERROR, "PTPD: received truncated packet");
@@ -312,7 +416,7 @@ static ssize_t ptpd_net_recv(octet_t *buf, TimeInternal *time, BufQueue *queue)
     return 0;
   }
 
-  // Verify there is contents to copy.
+  // Verify there is contents to parse.
   if (p->tot_len == 0)
   {
     syslog_printf(SYSLOG_ERROR, "PTPD: received empty packet");
@@ -321,128 +425,160 @@ static ssize_t ptpd_net_recv(octet_t *buf, TimeInternal *time, BufQueue *queue)
     return 0;
   }
 
-  // Get the timestamp of the packet.
+  // Get the timestamp of the packet. It is carried in the hardware format
+  // and only converted here for the messages that use it.
   if (time != NULL)
   {
     time->seconds = p->time_sec;
-    time->nanoseconds = p->time_nsec;
+    time->nanoseconds = ethptp_subsec_to_nsec(p->time_subsec);
   }
 
-  // Get the length of the buffer to copy.
-  length = p->tot_len;
-
-  // Copy the pbuf payload into the buffer.
-  pcopy = p;
-  j = 0;
-  for (i = 0; i < length; i++)
+  // Parse directly from the payload in the common single pbuf case and
+  // gather the chain into the bounded buffer otherwise.
+  if (p->len == p->tot_len)
+  {
+    view->payload = (const octet_t *) p->payload;
+  }
+  else
   {
-    // Copy the next byte in the payload.
-    buf[i] = ((u8_t *)pcopy->payload)[j++];
-
-    // Skip to the next buffer in the payload?
-    if (j == pcopy->len)
-    {
-      // Move to the next buffer.
-      pcopy = pcopy->next;
-      j = 0;
-    }
+    pbuf_copy_partial(p, view->gather, p->tot_len, 0);
+    view->payload = view->gather;
   }
 
-  // Free up the pbuf (chain).
-  pbuf_free(p);
+  // Hold the pbuf (chain) until the message is released.
+  view->pbuf = p;
 
-  return length;
+  return p->tot_len;
 }
 
-ssize_t ptpd_net_recv_event(NetPath *net_path, octet_t *buf, TimeInternal *time)
+// The fast path queue is polled before the lwIP queue of the same port.
+ssize_t ptpd_net_recv_event(NetPath *net_path, MsgView *view, TimeInternal *time)
 {
-  return ptpd_net_recv(buf, time, &net_path->eventQ);
+  if (ptpd_net_queue_check(&net_path->eventQ)) return ptpd_net_recv(view, time, &net_path->eventQ);
+  return ptpd_net_recv(view, time, &net_path->eventLwipQ);
 }
 
-ssize_t ptpd_net_recv_general(NetPath *net_path, octet_t *buf, TimeInternal *time)
+ssize_t ptpd_net_recv_general(NetPath *net_path, MsgView *view, TimeInternal *time)
 {
-  return ptpd_net_recv(buf, time, &net_path->generalQ);
+  if (ptpd_net_queue_check(&net_path->generalQ)) return ptpd_net_recv(view, time, &net_path->generalQ);
+  return ptpd_net_recv(view, time, &net_path->generalLwipQ);
 }
 
-static ssize_t ptpd_net_send(const octet_t *buf, int16_t  length, TimeInternal *time, const int32_t * addr, struct udp_pcb * pcb)
+// Release the pbuf (chain) held by the view of a handled message.
+void ptpd_net_release(MsgView *view)
 {
-  err_t result;
-  struct pbuf *p;
-
-  // Allocate the tx pbuf based on the current size.
-  p = pbuf_alloc(PBUF_TRANSPORT, length, PBUF_RAM);
-  if (NULL == p)
+  if (view->pbuf != NULL)
   {
-    syslog_printf(SYSLOG_ERROR, "PTPD: failed to allocate transmit protocol buffer");
-    ERROR("PTPD: Failed to allocate transmit protocol buffer\n");
-    goto fail01;
+    pbuf_free(view->pbuf);
+    view->pbuf = NULL;
   }
+  view->payload = NULL;
+  view->length = 0;
+}
 
-  // Copy the incoming data into the pbuf payload.
-  result = pbuf_take(p, buf, length);
-  if (ERR_OK != result)
+// Send a message to the destination using the preallocated transmit frame.
+static ssize_t ptpd_net_send(NetPath *net_path, const octet_t *buf, int16_t length, int destination)
+{
+  err_t result;
+  struct netif *netif = netif_default;
+  TxFrame *tx = &net_path->txFrame;
+  octet_t *frame = (octet_t *) tx->frame;
+  struct ip_hdr *iphdr = (struct ip_hdr *) (frame + SIZEOF_ETH_HDR);
+  struct udp_hdr *udphdr = (struct udp_hdr *) (frame + SIZEOF_ETH_HDR + IP_HLEN);
+
+  // Verify the message fits the frame.
+  if ((length <= 0) || (length > PACKET_SIZE))
   {
-    syslog_printf(SYSLOG_ERROR, "PTPD: failed to copy data into protocol buffer (%d)", result);
-    ERROR("PTPD: Failed to copy data into protocol buffer (%d)\n", result);
-    length = 0;
-    goto fail02;
+    syslog_printf(SYSLOG_ERROR, "PTPD: invalid transmit length (%d)", length);
+    ERROR("PTPD: Invalid transmit length (%d)\n", length);
+    return 0;
   }
 
-  // Send the buffer.
-  result = udp_sendto(pcb, p, (void *)addr, pcb->local_port);
-  if (ERR_OK != result)
+  // Verify the interface is able to send.
+  if (!netif_is_up(netif) || !netif_is_link_up(netif))
   {
-    syslog_printf(SYSLOG_ERROR, "PTPD: failed to send data (%d)", result);
-    ERROR("PTPD: Failed to send data (%d)\n", result);
-    length = 0;
-    goto fail02;
+    syslog_printf(SYSLOG_ERROR, "PTPD: failed to send data (%d)", ERR_RTE);
+    ERROR("PTPD: Failed to send data (%d)\n", ERR_RTE);
+    return 0;
   }
 
-#if defined(STM32F4) || defined(STM32F7)
-  // Fill in the timestamp of the buffer just sent.
-  if (time != NULL)
-  {
-    // We have special call back into the Ethernet interface to fill the timestamp
-    // of the buffer just transmitted. This call will block for up to a certain amount
-    // of time before it may fail if a timestamp was not obtained.
-    ethernetif_get_tx_timestamp(p);
-  }
-#endif
+  // Rebuild the headers if the interface address changed.
+  if (tx->ifaceAddr != ip4_addr_get_u32(netif_ip4_addr(netif))) ptpd_net_build_headers(net_path, netif);
 
-  // Get the timestamp of the sent buffer.  We avoid overwriting 
-  // the time if it looks to be an invalid zero value.
-  if ((time != NULL) && (p->time_sec != 0))
+  // Messages are normally packed in place, otherwise copy into the frame.
+  if (buf != frame + PTP_TX_HEADER_LENGTH) memcpy(frame + PTP_TX_HEADER_LENGTH, buf, length);
+
+  // Lay down the prebuilt headers and patch the per message fields.
+  memcpy(frame, tx->header[destination], PTP_TX_HEADER_LENGTH);
+  IPH_LEN_SET(iphdr, lwip_htons(IP_HLEN + UDP_HLEN + length));
+  IPH_ID_SET(iphdr, lwip_htons(tx->ipId));
+  tx->ipId++;
+#if CHECKSUM_GEN_IP
+  IPH_CHKSUM_SET(iphdr, inet_chksum(iphdr, IP_HLEN));
+#endif
+  udphdr->len = lwip_htons(UDP_HLEN + length);
+
+  // Describe the frame with the static pbuf. The driver does not keep a
+  // reference to the pbuf beyond the call.
+  tx->pbuf.next = NULL;
+  tx->pbuf.payload = frame;
+  tx->pbuf.tot_len = tx->pbuf.len = (u16_t) (PTP_TX_HEADER_LENGTH + length);
+  tx->pbuf.type_internal = (u8_t) PBUF_REF;
+  tx->pbuf.flags = 0;
+  tx->pbuf.ref = 1;
+  tx->pbuf.if_idx = NETIF_NO_INDEX;
+
+  // Hand the frame directly to the driver.
+  result = netif->linkoutput(netif, &tx->pbuf);
+  if (ERR_OK != result)
   {
-    time->seconds = p->time_sec;
-    time->nanoseconds = p->time_nsec;
-    DBGV("PTPD: %d sec %d nsec\n", time->seconds, time->nanoseconds);
+    syslog_printf(SYSLOG_ERROR, "PTPD: failed to send data (%d)", result);
+    ERROR("PTPD: Failed to send data (%d)\n", result);
+    return 0;
   }
 
-fail02:
-  pbuf_free(p);
-
-fail01:
   return length;
 }
 
-ssize_t ptpd_net_send_event(NetPath *net_path, const octet_t *buf, int16_t  length, TimeInternal *time)
+ssize_t ptpd_net_send_event(NetPath *net_path, const octet_t *buf, int16_t  length)
 {
-  return ptpd_net_send(buf, length, time, &net_path->multicastAddr, net_path->eventPcb);
+  return ptpd_net_send(net_path, buf, length, PTP_TX_EVENT);
 }
 
-ssize_t ptpd_net_send_peer_event(NetPath *net_path, const octet_t *buf, int16_t  length, TimeInternal* time)
+ssize_t ptpd_net_send_peer_event(NetPath *net_path, const octet_t *buf, int16_t  length)
 {
-  return ptpd_net_send(buf, length, time, &net_path->peerMulticastAddr, net_path->eventPcb);
+  return ptpd_net_send(net_path, buf, length, PTP_TX_PEER_EVENT);
 }
 
 ssize_t ptpd_net_send_general(NetPath *net_path, const octet_t *buf, int16_t  length)
 {
-  return ptpd_net_send(buf, length, NULL, &net_path->multicastAddr, net_path->generalPcb);
+  return ptpd_net_send(net_path, buf, length, PTP_TX_GENERAL);
 }
 
 ssize_t ptpd_net_send_peer_general(NetPath *net_path, const octet_t *buf, int16_t  length)
 {
-  return ptpd_net_send(buf, length, NULL, &net_path->peerMulticastAddr, net_path->generalPcb);
+  return ptpd_net_send(net_path, buf, length, PTP_TX_PEER_GENERAL);
+}
+
+// Get the next transmit timestamp of an event message. The message is identified
+// by its type and sequence id. Returns false if no timestamp is available.
+bool ptpd_net_get_tx_timestamp(NetPath *net_path, enum4bit_t *message_type, int16_t *sequence_id, TimeInternal *time)
+{
+#if defined(STM32F4) || defined(STM32F7)
+  ethernetif_tx_completion_t completion;
+
+  if (!ethernetif_get_tx_completion(&completion)) return false;
+
+  *message_type = ETHERNETIF_TX_TOKEN_MESSAGE_TYPE(completion.token);
+  *sequence_id = (int16_t) ETHERNETIF_TX_TOKEN_SEQUENCE_ID(completion.token);
+  time->seconds = completion.time_sec;
+  time->nanoseconds = ethptp_subsec_to_nsec(completion.time_subsec);
+  DBGV("PTPD: tx timestamp type %d seq %d: %d sec %d nsec\n", *message_type, *sequence_id, time->seconds, time->nanoseconds);
+
+  return true;
+#else
+  return false;
+#endif
 }
 
 #endif
@@ -1,9 +1,11 @@
+#include "lwip/sys.h"
 #include "ptpd.h"
 #include "syslog.h"
 
 #if LWIP_PTPD
 
 static void handle(PtpClock*);
+static void handle_message(PtpClock*, TimeInternal*);
 static void handle_announce(PtpClock*, bool);
 static void handle_sync(PtpClock*, TimeInternal*, bool);
 static void handle_follow_up(PtpClock*, bool);
@@ -14,17 +16,21 @@ static void handle_delay_resp(PtpClock*, bool);
 static void handle_peer_delay_resp_follow_up(PtpClock*, bool);
 static void handle_management(PtpClock*, bool);
 static void handle_signaling(PtpClock*, bool);
+static void handle_tx_timestamps(PtpClock*);
 
 static void issue_delay_req_timer_expired(PtpClock*);
 static void issue_announce(PtpClock*);
 static void issue_sync(PtpClock*);
-static void issue_follow_up(PtpClock*, const TimeInternal*);
+static void issue_follow_up(PtpClock*, int16_t, const TimeInternal*);
 static void issue_delay_req(PtpClock*);
 static void issue_delay_resp(PtpClock*, const TimeInternal*, const MsgHeader*);
 static void issue_peer_delay_req(PtpClock*);
-static void issue_peer_delay_resp(PtpClock*, TimeInternal*, const MsgHeader*);
+static void issue_peer_delay_resp(PtpClock*, const TimeInternal*, const MsgHeader*);
 static void issue_peer_delay_resp_follow_up(PtpClock*, const TimeInternal*, const MsgHeader*);
 
+static PendingDelayReq *pending_delay_req(PtpClock*, int16_t);
+static void pending_delay_req_complete(PtpClock*, PendingDelayReq*);
+
 static bool ptpd_protocol_do_init(PtpClock*);
 
 #ifdef PTPD_DBG
@@ -221,7 +227,7 @@ static bool ptpd_protocol_do_init(PtpClock *ptp_clock)
     ptpd_timer_init();
     ptpd_servo_init_clock(ptp_clock);
     ptpd_m1(ptp_clock);
-    ptpd_msg_pack_header(ptp_clock, ptp_clock->msgObuf);
+    ptpd_msg_pack_header(ptp_clock);
     return true;
   }
 }
@@ -240,6 +246,12 @@ void ptpd_protocol_do_state(PtpClock *ptp_clock)
     case PTP_PRE_MASTER:
     case PTP_MASTER:
     case PTP_PASSIVE:
+      // Foreign masters losing qualification also require a new decision.
+      if (ptpd_foreign_aged(ptp_clock))
+      {
+        set_flag(ptp_clock->events, STATE_DECISION_EVENT);
+      }
+
       // State decision event.
       if (get_flag(ptp_clock->events, STATE_DECISION_EVENT))
       {
@@ -375,8 +387,7 @@ void ptpd_protocol_do_state(PtpClock *ptp_clock)
       {
         DBGV("event ANNOUNCE_RECEIPT_TIMEOUT_EXPIRES for state %s\n",
              state_string(ptp_clock->portDS.portState));
-        ptp_clock->foreignMasterDS.count = 0;
-        ptp_clock->foreignMasterDS.i = 0;
+        ptpd_clear_foreign(ptp_clock);
         if (!(ptp_clock->defaultDS.slaveOnly || (ptp_clock->defaultDS.clockQuality.clockClass == 255)))
         {
           ptpd_m1(ptp_clock);
@@ -418,9 +429,11 @@ void ptpd_protocol_do_state(PtpClock *ptp_clock)
 static void handle(PtpClock *ptp_clock)
 {
   int ret;
-  bool is_from_self;
   TimeInternal time = { 0, 0 };
 
+  // Transmit timestamps complete asynchronously.
+  handle_tx_timestamps(ptp_clock);
+
   if (!ptp_clock->messageActivity)
   {
     ret = ptpd_net_select(&ptp_clock->netPath, 0);
@@ -440,43 +453,53 @@ static void handle(PtpClock *ptp_clock)
   DBGVV("handle: something\n");
 
   // Receive an event.
-  ptp_clock->msgIbufLength = ptpd_net_recv_event(&ptp_clock->netPath, ptp_clock->msgIbuf, &time);
+  ptp_clock->msgIbuf.length = ptpd_net_recv_event(&ptp_clock->netPath, &ptp_clock->msgIbuf, &time);
 
   // Local time is not UTC, we can calculate UTC on demand, otherwise UTC time is not used
   // time.seconds += ptp_clock->timePropertiesDS.currentUtcOffset;
-  DBGV("handle: ptpd_net_recv_event returned %d\n", ptp_clock->msgIbufLength);
+  DBGV("handle: ptpd_net_recv_event returned %d\n", ptp_clock->msgIbuf.length);
 
-  if (ptp_clock->msgIbufLength < 0)
+  if (ptp_clock->msgIbuf.length < 0)
   {
     ERROR("handle: failed to receive on the event socket\n");
     ptpd_protocol_to_state(ptp_clock, PTP_FAULTY);
     return;
   }
-  else if (!ptp_clock->msgIbufLength)
+  else if (!ptp_clock->msgIbuf.length)
   {
     // Receive a general packet.
-    ptp_clock->msgIbufLength = ptpd_net_recv_general(&ptp_clock->netPath, ptp_clock->msgIbuf, &time);
-    DBGV("handle: ptpd_net_recv_general returned %d\n", ptp_clock->msgIbufLength);
-    if (ptp_clock->msgIbufLength < 0)
+    ptp_clock->msgIbuf.length = ptpd_net_recv_general(&ptp_clock->netPath, &ptp_clock->msgIbuf, &time);
+    DBGV("handle: ptpd_net_recv_general returned %d\n", ptp_clock->msgIbuf.length);
+    if (ptp_clock->msgIbuf.length < 0)
     {
       ERROR("handle: failed to receive on the general socket\n");
       ptpd_protocol_to_state(ptp_clock, PTP_FAULTY);
       return;
     }
-    else if (!ptp_clock->msgIbufLength)
+    else if (!ptp_clock->msgIbuf.length)
       return;
   }
 
+  // Handle the message and release the view of the received pbuf.
+  handle_message(ptp_clock, &time);
+  ptpd_net_release(&ptp_clock->msgIbuf);
+}
+
+// Handle the received message.
+static void handle_message(PtpClock *ptp_clock, TimeInternal *time)
+{
+  bool is_from_self;
+
   ptp_clock->messageActivity = true;
 
-  if (ptp_clock->msgIbufLength < HEADER_LENGTH)
+  if (ptp_clock->msgIbuf.length < HEADER_LENGTH)
   {
     ERROR("handle: message shorter than header length\n");
     ptpd_protocol_to_state(ptp_clock, PTP_FAULTY);
     return;
   }
 
-  ptpd_msg_unpack_header(ptp_clock->msgIbuf, &ptp_clock->msgTmpHeader);
+  ptpd_msg_unpack_header(ptp_clock->msgIbuf.payload, &ptp_clock->msgTmpHeader);
   DBGV("handle: unpacked message type %d\n", ptp_clock->msgTmpHeader.messageType);
 
   if (ptp_clock->msgTmpHeader.versionPTP != ptp_clock->portDS.versionNumber)
@@ -497,8 +520,8 @@ static void handle(PtpClock *ptp_clock)
 
   // Subtract the inbound latency adjustment if it is not a loop back and the
   // time stamp seems reasonable.
-  if (!is_from_self && time.seconds > 0)
-      ptpd_sub_time(&time, &time, &ptp_clock->inboundLatency);
+  if (!is_from_self && time->seconds > 0)
+      ptpd_sub_time(time, time, &ptp_clock->inboundLatency);
 
   switch (ptp_clock->msgTmpHeader.messageType)
   {
@@ -507,7 +530,7 @@ static void handle(PtpClock *ptp_clock)
       break;
 
     case SYNC:
-      handle_sync(ptp_clock, &time, is_from_self);
+      handle_sync(ptp_clock, time, is_from_self);
       break;
 
     case FOLLOW_UP:
@@ -515,11 +538,11 @@ static void handle(PtpClock *ptp_clock)
       break;
 
     case DELAY_REQ:
-      handle_delay_req(ptp_clock, &time, is_from_self);
+      handle_delay_req(ptp_clock, time, is_from_self);
       break;
 
     case PDELAY_REQ:
-      handle_peer_delay_req(ptp_clock, &time, is_from_self);
+      handle_peer_delay_req(ptp_clock, time, is_from_self);
       break;
 
     case DELAY_RESP:
@@ -527,7 +550,7 @@ static void handle(PtpClock *ptp_clock)
       break;
 
     case PDELAY_RESP:
-      handle_peer_delay_resp(ptp_clock, &time, is_from_self);
+      handle_peer_delay_resp(ptp_clock, time, is_from_self);
       break;
 
     case PDELAY_RESP_FOLLOW_UP:
@@ -555,7 +578,7 @@ static void handle_announce(PtpClock *ptp_clock, bool is_from_self)
 
   DBGV("handle_announce: received in state %s\n", state_string(ptp_clock->portDS.portState));
 
-  if (ptp_clock->msgIbufLength < ANNOUNCE_LENGTH)
+  if (ptp_clock->msgIbuf.length < ANNOUNCE_LENGTH)
   {
     ERROR("handle_announce: short message\n");
     ptpd_protocol_to_state(ptp_clock, PTP_FAULTY);
@@ -578,15 +601,19 @@ static void handle_announce(PtpClock *ptp_clock, bool is_from_self)
 
     case PTP_UNCALIBRATED:
     case PTP_SLAVE:
-      // Valid announce message is received : BMC algorithm will be executed.
-      set_flag(ptp_clock->events, STATE_DECISION_EVENT);
       is_from_current_parent = ptpd_is_same_port_identity(
                                   &ptp_clock->parentDS.parentPortIdentity,
                                   &ptp_clock->msgTmpHeader.sourcePortIdentity);
-      ptpd_msg_unpack_announce(ptp_clock->msgIbuf, &ptp_clock->msgTmp.announce);
+      ptpd_msg_unpack_announce(ptp_clock->msgIbuf.payload, &ptp_clock->msgTmp.announce);
       if (is_from_current_parent)
       {
         ptpd_s1(ptp_clock, &ptp_clock->msgTmpHeader, &ptp_clock->msgTmp.announce);
+        // Keep the parent record fresh so it remains qualified.
+        if (ptpd_add_foreign(ptp_clock, &ptp_clock->msgTmpHeader, &ptp_clock->msgTmp.announce))
+        {
+          // BMC algorithm will be executed only if the announce changed its input.
+          set_flag(ptp_clock->events, STATE_DECISION_EVENT);
+        }
         // Reset Timer handling Announce receipt timeout.
         ptpd_timer_start(ANNOUNCE_RECEIPT_TIMER, ptp_clock->portDS.announceReceiptTimeout *
                                                  pow2ms(ptp_clock->portDS.logAnnounceInterval));
@@ -595,7 +622,10 @@ static void handle_announce(PtpClock *ptp_clock, bool is_from_self)
       {
         DBGV("handle_announce: from another foreign master\n");
         // ptpd_add_foreign takes care  of AnnounceUnpacking.
-        ptpd_add_foreign(ptp_clock, &ptp_clock->msgTmpHeader, &ptp_clock->msgTmp.announce);
+        if (ptpd_add_foreign(ptp_clock, &ptp_clock->msgTmpHeader, &ptp_clock->msgTmp.announce))
+        {
+          set_flag(ptp_clock->events, STATE_DECISION_EVENT);
+        }
       }
       break;
 
@@ -609,11 +639,14 @@ static void handle_announce(PtpClock *ptp_clock, bool is_from_self)
     default :
 
       DBGV("handle_announce: from another foreign master\n");
-      ptpd_msg_unpack_announce(ptp_clock->msgIbuf, &ptp_clock->msgTmp.announce);
+      ptpd_msg_unpack_announce(ptp_clock->msgIbuf.payload, &ptp_clock->msgTmp.announce);
 
-      // Valid announce message is received : BMC algorithm will be executed.
-      set_flag(ptp_clock->events, STATE_DECISION_EVENT);
-      ptpd_add_foreign(ptp_clock, &ptp_clock->msgTmpHeader, &ptp_clock->msgTmp.announce);
+      // Valid announce message is received : BMC algorithm will be executed
+      // only if the announce changed its input.
+      if (ptpd_add_foreign(ptp_clock, &ptp_clock->msgTmpHeader, &ptp_clock->msgTmp.announce))
+      {
+        set_flag(ptp_clock->events, STATE_DECISION_EVENT);
+      }
 
       break;
   }
@@ -623,11 +656,12 @@ static void handle_sync(PtpClock *ptp_clock, TimeInternal *time, bool is_from_se
 {
   TimeInternal correction_field;
   TimeInternal origin_timestamp;
+  PendingSync *pending_sync;
   bool is_from_current_parent = false;
 
   DBGV("handle_sync: received in state %s\n", state_string(ptp_clock->portDS.portState));
 
-  if (ptp_clock->msgIbufLength < SYNC_LENGTH)
+  if (ptp_clock->msgIbuf.length < SYNC_LENGTH)
   {
     ERROR("handle_sync: short message\n");
     ptpd_protocol_to_state(ptp_clock, PTP_FAULTY);
@@ -657,20 +691,23 @@ static void handle_sync(PtpClock *ptp_clock, TimeInternal *time, bool is_from_se
         DBGV("handle_sync: ignore from another master\n");
         break;
       }
-      ptp_clock->timestamp_syncRecv = *time;
       ptpd_scaled_nanoseconds_to_internal_time(&correction_field, &ptp_clock->msgTmpHeader.correctionfield);
 
       if (get_flag(ptp_clock->msgTmpHeader.flagField[0], FLAG0_TWO_STEP))
       {
-        ptp_clock->waitingForFollowUp = true;
-        ptp_clock->recvSyncSequenceId = ptp_clock->msgTmpHeader.sequenceId;
-        // Save correction_field of Sync message for future use.
-        ptp_clock->correctionField_sync = correction_field;
+        // Save the ingress time and correction_field of the Sync message until its
+        // Follow_Up arrives. Several Sync messages may be pending at the same time.
+        pending_sync = &ptp_clock->pendingSync[ptp_clock->msgTmpHeader.sequenceId & PENDING_SYNC_MASK];
+        pending_sync->valid = true;
+        pending_sync->sequenceId = ptp_clock->msgTmpHeader.sequenceId;
+        pending_sync->received = sys_now();
+        pending_sync->timestamp = *time;
+        pending_sync->correctionField = correction_field;
       }
       else
       {
-        ptpd_msg_unpack_sync(ptp_clock->msgIbuf, &ptp_clock->msgTmp.sync);
-        ptp_clock->waitingForFollowUp = false;
+        ptp_clock->timestamp_syncRecv = *time;
+        ptpd_msg_unpack_sync(ptp_clock->msgIbuf.payload, &ptp_clock->msgTmp.sync);
         // Synchronize  local clock.
         ptpd_to_internal_time(&origin_timestamp, &ptp_clock->msgTmp.sync.originTimestamp);
         // Use correction_field of Sync message for future use.
@@ -707,11 +744,12 @@ static void handle_follow_up(PtpClock *ptp_clock, bool is_from_self)
 {
   TimeInternal correction_field;
   TimeInternal precise_origin_timestamp;
+  PendingSync *pending_sync;
   bool is_from_current_parent = false;
 
   DBGV("handle_followup: received in state %s\n", state_string(ptp_clock->portDS.portState));
 
-  if (ptp_clock->msgIbufLength < FOLLOW_UP_LENGTH)
+  if (ptp_clock->msgIbuf.length < FOLLOW_UP_LENGTH)
   {
     ERROR("handle_followup: short message\n");
     ptpd_protocol_to_state(ptp_clock, PTP_FAULTY);
@@ -738,23 +776,27 @@ static void handle_follow_up(PtpClock *ptp_clock, bool is_from_self)
       is_from_current_parent = ptpd_is_same_port_identity(
                                   &ptp_clock->parentDS.parentPortIdentity,
                                   &ptp_clock->msgTmpHeader.sourcePortIdentity);
-      if (!ptp_clock->waitingForFollowUp)
+      if (!is_from_current_parent)
       {
-        DBGV("handle_followup: not waiting a message\n");
+        DBGV("handle_followup: not from current parent\n");
         break;
       }
-      if (!is_from_current_parent)
+
+      // Match the Follow_Up to a pending Sync message regardless of arrival order.
+      pending_sync = &ptp_clock->pendingSync[ptp_clock->msgTmpHeader.sequenceId & PENDING_SYNC_MASK];
+      if (!pending_sync->valid || (pending_sync->sequenceId != ptp_clock->msgTmpHeader.sequenceId))
       {
-        DBGV("handle_followup: not from current parent\n");
+        DBGV("handle_followup: SequenceID doesn't match a pending Sync message\n");
         break;
       }
-      if (ptp_clock->recvSyncSequenceId !=  ptp_clock->msgTmpHeader.sequenceId)
+      pending_sync->valid = false;
+      if ((sys_now() - pending_sync->received) > PENDING_SYNC_TIMEOUT)
       {
-        DBGV("handle_followup: SequenceID doesn't match with last Sync message\n");
+        DBGV("handle_followup: pending Sync message expired\n");
         break;
       }
-      ptpd_msg_unpack_follow_up(ptp_clock->msgIbuf, &ptp_clock->msgTmp.follow);
-      ptp_clock->waitingForFollowUp = false;
+      ptp_clock->timestamp_syncRecv = pending_sync->timestamp;
+      ptpd_msg_unpack_follow_up(ptp_clock->msgIbuf.payload, &ptp_clock->msgTmp.follow);
 
       // Synchronize local clock.
 
@@ -766,7 +808,7 @@ static void handle_follow_up(PtpClock *ptp_clock, bool is_from_self)
 
       // Add to the correction field the correction field of the sync message.  These two correction
       // fields are combined in a single value that is passed to determine the offset from the master.
-      ptpd_add_time(&correction_field, &correction_field, &ptp_clock->correctionField_sync);
+      ptpd_add_time(&correction_field, &correction_field, &pending_sync->correctionField);
 
       // Calculate the offset from the master as follows:
       //  <offsetFromMaster> = <sync_event_ingress_timestamp> - <precise_origin_timestamp>
@@ -807,7 +849,7 @@ static void handle_delay_req(PtpClock *ptp_clock, TimeInternal *time, bool is_fr
   {
     case E2E:
       DBGV("handle_delay_req: received in mode E2E in state %s\n", state_string(ptp_clock->portDS.portState));
-      if (ptp_clock->msgIbufLength < DELAY_REQ_LENGTH)
+      if (ptp_clock->msgIbuf.length < DELAY_REQ_LENGTH)
       {
         ERROR("handle_delay_req: short message\n");
         ptpd_protocol_to_state(ptp_clock, PTP_FAULTY);
@@ -848,9 +890,41 @@ static void handle_delay_req(PtpClock *ptp_clock, TimeInternal *time, bool is_fr
   }
 }
 
+// Find the outstanding delay request with the sequence id.
+static PendingDelayReq *pending_delay_req(PtpClock *ptp_clock, int16_t sequence_id)
+{
+  PendingDelayReq *pending = &ptp_clock->pendingDelayReq[sequence_id & PENDING_DELAY_REQ_MASK];
+
+  if (!pending->valid || (pending->sequenceId != sequence_id)) return NULL;
+
+  // Discard requests whose response never arrived.
+  if ((sys_now() - pending->sent) > PENDING_DELAY_REQ_TIMEOUT)
+  {
+    DBGV("pending_delay_req: delay request %d expired\n", sequence_id);
+    if (!pending->hasSendTime) ptp_clock->txTimestampTimeouts++;
+    pending->valid = false;
+    return NULL;
+  }
+
+  return pending;
+}
+
+// Update the path delay once both the transmit timestamp and the delay
+// response of an outstanding delay request are known.
+static void pending_delay_req_complete(PtpClock *ptp_clock, PendingDelayReq *pending)
+{
+  if (!pending->hasSendTime || !pending->hasRecvTime) return;
+
+  pending->valid = false;
+  ptp_clock->timestamp_delayReqSend = pending->sendTime;
+  ptp_clock->timestamp_delayReqRecv = pending->recvTime;
+  ptpd_servo_update_delay(ptp_clock, &ptp_clock->timestamp_delayReqSend,
+                          &ptp_clock->timestamp_delayReqRecv, &pending->correctionField);
+}
+
 static void handle_delay_resp(PtpClock *ptp_clock, bool is_from_self)
 {
-  TimeInternal correction_field;
+  PendingDelayReq *pending;
   bool is_current_request = false;
   bool is_from_current_parent = false;
 
@@ -858,7 +932,7 @@ static void handle_delay_resp(PtpClock *ptp_clock, bool is_from_self)
   {
     case E2E:
       DBGV("handle_delay_resp: received in mode E2E in state %s\n", state_string(ptp_clock->portDS.portState));
-      if (ptp_clock->msgIbufLength < DELAY_RESP_LENGTH)
+      if (ptp_clock->msgIbuf.length < DELAY_RESP_LENGTH)
       {
         ERROR("handle_delay_resp: short message\n");
         ptpd_protocol_to_state(ptp_clock, PTP_FAULTY);
@@ -875,7 +949,7 @@ static void handle_delay_resp(PtpClock *ptp_clock, bool is_from_self)
 
         case PTP_UNCALIBRATED:
         case PTP_SLAVE:
-          ptpd_msg_unpack_delay_resp(ptp_clock->msgIbuf, &ptp_clock->msgTmp.resp);
+          ptpd_msg_unpack_delay_resp(ptp_clock->msgIbuf.payload, &ptp_clock->msgTmp.resp);
 
           is_from_current_parent = ptpd_is_same_port_identity(
                                       &ptp_clock->parentDS.parentPortIdentity,
@@ -885,13 +959,16 @@ static void handle_delay_resp(PtpClock *ptp_clock, bool is_from_self)
                                     &ptp_clock->portDS.portIdentity,
                                     &ptp_clock->msgTmp.resp.requestingPortIdentity);
 
-          if (((ptp_clock->sentDelayReqSequenceId - 1) == ptp_clock->msgTmpHeader.sequenceId) && is_current_request && is_from_current_parent)
+          // Match the response to its own outstanding request.
+          pending = pending_delay_req(ptp_clock, ptp_clock->msgTmpHeader.sequenceId);
+
+          if (pending && !pending->hasRecvTime && is_current_request && is_from_current_parent)
           {
             // TODO: revisit 11.3.
-            ptpd_to_internal_time(&ptp_clock->timestamp_delayReqRecv, &ptp_clock->msgTmp.resp.receiveTimestamp);
-
-            ptpd_scaled_nanoseconds_to_internal_time(&correction_field, &ptp_clock->msgTmpHeader.correctionfield);
-            ptpd_servo_update_delay(ptp_clock, &ptp_clock->timestamp_delayReqSend, &ptp_clock->timestamp_delayReqRecv, &correction_field);
+            ptpd_to_internal_time(&pending->recvTime, &ptp_clock->msgTmp.resp.receiveTimestamp);
+            ptpd_scaled_nanoseconds_to_internal_time(&pending->correctionField, &ptp_clock->msgTmpHeader.correctionfield);
+            pending->hasRecvTime = true;
+            pending_delay_req_complete(ptp_clock, pending);
 
             // The value of the portDS.logMinDelayReqInterval member of the data set in a multicast 
             // message, and 0x7F in a unicast message.  We assume the value is not being set if it
@@ -928,7 +1005,7 @@ static void handle_peer_delay_req(PtpClock *ptp_clock, TimeInternal *time, bool
 
     case P2P:
       DBGV("handle_peer_delay_req: received in mode P2P in state %s\n", state_string(ptp_clock->portDS.portState));
-      if (ptp_clock->msgIbufLength < PDELAY_REQ_LENGTH)
+      if (ptp_clock->msgIbuf.length < PDELAY_REQ_LENGTH)
       {
         ERROR("handle_peer_delay_req: short message\n");
         ptpd_protocol_to_state(ptp_clock, PTP_FAULTY);
@@ -953,10 +1030,11 @@ static void handle_peer_delay_req(PtpClock *ptp_clock, TimeInternal *time, bool
             break;
           }
           issue_peer_delay_resp(ptp_clock, time, &ptp_clock->msgTmpHeader);
-          if ((time->seconds != 0) && get_flag(ptp_clock->msgTmpHeader.flagField[0], FLAG0_TWO_STEP))
+          if (get_flag(ptp_clock->msgTmpHeader.flagField[0], FLAG0_TWO_STEP))
           {
-            // Not loopback mode.
-            issue_peer_delay_resp_follow_up(ptp_clock, time, &ptp_clock->msgTmpHeader);
+            // The follow up is sent once the response transmit timestamp arrives.
+            ptp_clock->pdelayReqHeader = ptp_clock->msgTmpHeader;
+            ptp_clock->waitingForPDelayRespTimestamp = true;
           }
           break;
 
@@ -986,7 +1064,7 @@ static void handle_peer_delay_resp(PtpClock *ptp_clock, TimeInternal *time, bool
     case P2P:
       DBGV("handle_peer_delay_resp: received in mode P2P in state %s\n",
            state_string(ptp_clock->portDS.portState));
-      if (ptp_clock->msgIbufLength < PDELAY_RESP_LENGTH)
+      if (ptp_clock->msgIbuf.length < PDELAY_RESP_LENGTH)
       {
         ERROR("handle_peer_delay_resp: short message\n");
         ptpd_protocol_to_state(ptp_clock, PTP_FAULTY);
@@ -1009,7 +1087,7 @@ static void handle_peer_delay_resp(PtpClock *ptp_clock, TimeInternal *time, bool
             DBGV("handle_peer_delay_resp: ignore from self\n");
             break;
           }
-          ptpd_msg_unpack_peer_delay_resp(ptp_clock->msgIbuf, &ptp_clock->msgTmp.presp);
+          ptpd_msg_unpack_peer_delay_resp(ptp_clock->msgIbuf.payload, &ptp_clock->msgTmp.presp);
           is_current_request = ptpd_is_same_port_identity(
                                   &ptp_clock->portDS.portIdentity,
                                   &ptp_clock->msgTmp.presp.requestingPortIdentity);
@@ -1067,7 +1145,7 @@ static void handle_peer_delay_resp_follow_up(PtpClock *ptp_clock, bool is_from_s
 
     case P2P:
       DBGV("handle_peer_delay_resp_follow_up: received in mode P2P in state %s\n", state_string(ptp_clock->portDS.portState));
-      if (ptp_clock->msgIbufLength < PDELAY_RESP_FOLLOW_UP_LENGTH)
+      if (ptp_clock->msgIbuf.length < PDELAY_RESP_FOLLOW_UP_LENGTH)
       {
         ERROR("handle_peer_delay_resp_follow_up: short message\n");
         ptpd_protocol_to_state(ptp_clock, PTP_FAULTY);
@@ -1091,7 +1169,7 @@ static void handle_peer_delay_resp_follow_up(PtpClock *ptp_clock, bool is_from_s
           }
           if (ptp_clock->msgTmpHeader.sequenceId == ptp_clock->sentPDelayReqSequenceId - 1)
           {
-            ptpd_msg_unpack_peer_delay_resp_follow_up(ptp_clock->msgIbuf, &ptp_clock->msgTmp.prespfollow);
+            ptpd_msg_unpack_peer_delay_resp_follow_up(ptp_clock->msgIbuf.payload, &ptp_clock->msgTmp.prespfollow);
             ptpd_to_internal_time(&response_origin_timestamp, &ptp_clock->msgTmp.prespfollow.responseOriginTimestamp);
             ptp_clock->pdelay_t3 = response_origin_timestamp;
             ptpd_scaled_nanoseconds_to_internal_time(&correction_field, &ptp_clock->msgTmpHeader.correctionfield);
@@ -1121,6 +1199,73 @@ static void handle_signaling(PtpClock *ptp_clock, bool is_from_self)
   // Do nothing.
 }
 
+// Consume the transmit timestamps of sent event messages. These complete
+// asynchronously from the transmit complete interrupt so the messages
+// that depend on them never wait on the DMA.
+static void handle_tx_timestamps(PtpClock *ptp_clock)
+{
+  enum4bit_t message_type;
+  int16_t sequence_id;
+  TimeInternal time;
+  PendingDelayReq *pending;
+
+  while (ptpd_net_get_tx_timestamp(&ptp_clock->netPath, &message_type, &sequence_id, &time))
+  {
+    // Ignore timestamps that look invalid.
+    if (time.seconds == 0) continue;
+
+    ptpd_add_time(&time, &time, &ptp_clock->outboundLatency);
+
+    switch (message_type)
+    {
+      case SYNC:
+        if (sequence_id == (int16_t) (ptp_clock->sentSyncSequenceId - 1))
+        {
+          ptp_clock->waitingForSyncTimestamp = false;
+        }
+
+        // Two step clock sends the precise origin timestamp in the follow up.
+        if ((ptp_clock->portDS.portState == PTP_MASTER) && ptp_clock->defaultDS.twoStepFlag)
+        {
+          issue_follow_up(ptp_clock, sequence_id, &time);
+        }
+        break;
+
+      case DELAY_REQ:
+        pending = pending_delay_req(ptp_clock, sequence_id);
+        if (pending && !pending->hasSendTime)
+        {
+          pending->sendTime = time;
+          pending->hasSendTime = true;
+          pending_delay_req_complete(ptp_clock, pending);
+        }
+        break;
+
+      case PDELAY_REQ:
+        // Store t1 (Fig 35).
+        if (sequence_id == (int16_t) (ptp_clock->sentPDelayReqSequenceId - 1))
+        {
+          ptp_clock->waitingForPDelayReqTimestamp = false;
+          ptp_clock->pdelay_t1 = time;
+        }
+        break;
+
+      case PDELAY_RESP:
+        if (ptp_clock->waitingForPDelayRespTimestamp &&
+            (sequence_id == ptp_clock->pdelayReqHeader.sequenceId))
+        {
+          ptp_clock->waitingForPDelayRespTimestamp = false;
+          issue_peer_delay_resp_follow_up(ptp_clock, &time, &ptp_clock->pdelayReqHeader);
+        }
+        break;
+
+      default:
+        DBGV("handle_tx_timestamps: unexpected message type %d\n", message_type);
+        break;
+    }
+  }
+}
+
 static void issue_delay_req_timer_expired(PtpClock *ptp_clock)
 {
   switch (ptp_clock->portDS.delayMechanism)
@@ -1181,32 +1326,31 @@ static void issue_sync(PtpClock *ptp_clock)
   ptpd_from_internal_time(&internal_time, &origin_timestamp);
   ptpd_msg_pack_sync(ptp_clock, ptp_clock->msgObuf, &origin_timestamp);
 
-  if (!ptpd_net_send_event(&ptp_clock->netPath, ptp_clock->msgObuf, SYNC_LENGTH, &internal_time))
+  // The timestamp of the previous sync has certainly been lost by now.
+  if (ptp_clock->waitingForSyncTimestamp) ptp_clock->txTimestampTimeouts++;
+  ptp_clock->waitingForSyncTimestamp = false;
+
+  if (!ptpd_net_send_event(&ptp_clock->netPath, ptp_clock->msgObuf, SYNC_LENGTH))
   {
     ERROR("issue_sync: can't sent\n");
     ptpd_protocol_to_state(ptp_clock, PTP_FAULTY);
   }
   else
   {
+    // The follow up is issued when the transmit timestamp arrives.
     DBGV("issue_sync\n");
     ptp_clock->sentSyncSequenceId++;
-
-    // Sync TX timestamp is valid.
-    if ((internal_time.seconds != 0) && (ptp_clock->defaultDS.twoStepFlag))
-    {
-      ptpd_add_time(&internal_time, &internal_time, &ptp_clock->outboundLatency);
-      issue_follow_up(ptp_clock, &internal_time);
-    }
+    ptp_clock->waitingForSyncTimestamp = true;
   }
 }
 
 // Pack and send on general multicast ip adress a FollowUp message.
-static void issue_follow_up(PtpClock *ptp_clock, const TimeInternal *time)
+static void issue_follow_up(PtpClock *ptp_clock, int16_t sequence_id, const TimeInternal *time)
 {
   Timestamp precise_origin_timestamp;
 
   ptpd_from_internal_time(time, &precise_origin_timestamp);
-  ptpd_msg_pack_follow_up(ptp_clock, ptp_clock->msgObuf, &precise_origin_timestamp);
+  ptpd_msg_pack_follow_up(ptp_clock, ptp_clock->msgObuf, sequence_id, &precise_origin_timestamp);
 
   if (!ptpd_net_send_general(&ptp_clock->netPath, ptp_clock->msgObuf, FOLLOW_UP_LENGTH))
   {
@@ -1225,32 +1369,34 @@ static void issue_delay_req(PtpClock *ptp_clock)
 {
   Timestamp origin_timestamp;
   TimeInternal internal_time;
+  PendingDelayReq *pending;
 
   ptpd_get_time(&internal_time);
   ptpd_from_internal_time(&internal_time, &origin_timestamp);
 
   ptpd_msg_pack_delay_req(ptp_clock, ptp_clock->msgObuf, &origin_timestamp);
 
-  if (!ptpd_net_send_event(&ptp_clock->netPath, ptp_clock->msgObuf, DELAY_REQ_LENGTH, &internal_time))
+  // Track the request until its response arrives. An older request in the
+  // same slot has certainly been answered or lost by now.
+  pending = &ptp_clock->pendingDelayReq[ptp_clock->sentDelayReqSequenceId & PENDING_DELAY_REQ_MASK];
+  if (pending->valid && !pending->hasSendTime) ptp_clock->txTimestampTimeouts++;
+  pending->valid = false;
+  pending->hasSendTime = false;
+  pending->hasRecvTime = false;
+  pending->sequenceId = ptp_clock->sentDelayReqSequenceId;
+  pending->sent = sys_now();
+
+  if (!ptpd_net_send_event(&ptp_clock->netPath, ptp_clock->msgObuf, DELAY_REQ_LENGTH))
   {
     ERROR("issue_delay_req: can't sent\n");
     ptpd_protocol_to_state(ptp_clock, PTP_FAULTY);
   }
   else
   {
+    // The transmit timestamp is filled in when it arrives.
     DBGV("issue_delay_req:\n");
     ptp_clock->sentDelayReqSequenceId++;
-
-    // Delay req TX timestamp is valid.
-    if (internal_time.seconds != 0)
-    {
-      ptpd_add_time(&internal_time, &internal_time, &ptp_clock->outboundLatency);
-      ptp_clock->timestamp_delayReqSend = internal_time;
-    }
-    else
-    {
-      DBGV("issue_delay_req: internal time invalid\n");
-    }
+    pending->valid = true;
   }
 }
 
@@ -1265,46 +1411,43 @@ static void issue_peer_delay_req(PtpClock *ptp_clock)
 
   ptpd_msg_pack_peer_delay_req(ptp_clock, ptp_clock->msgObuf, &origin_timestamp);
 
-  if (!ptpd_net_send_peer_event(&ptp_clock->netPath, ptp_clock->msgObuf, PDELAY_REQ_LENGTH, &internal_time))
+  // The timestamp of the previous request has certainly been lost by now.
+  if (ptp_clock->waitingForPDelayReqTimestamp) ptp_clock->txTimestampTimeouts++;
+  ptp_clock->waitingForPDelayReqTimestamp = false;
+
+  if (!ptpd_net_send_peer_event(&ptp_clock->netPath, ptp_clock->msgObuf, PDELAY_REQ_LENGTH))
   {
     ERROR("issue_peer_delay_req: can't sent\n");
     ptpd_protocol_to_state(ptp_clock, PTP_FAULTY);
   }
   else
   {
+    // The transmit timestamp (t1) is filled in when it arrives.
     DBGV("issue_peer_delay_req\n");
     ptp_clock->sentPDelayReqSequenceId++;
-
-    // Delay req TX timestamp is valid.
-    if (internal_time.seconds != 0)
-    {
-      ptpd_add_time(&internal_time, &internal_time, &ptp_clock->outboundLatency);
-      ptp_clock->pdelay_t1 = internal_time;
-    }
+    ptp_clock->waitingForPDelayReqTimestamp = true;
   }
 }
 
 // Pack and send on event multicast ip adress a PDelayResp message.
-static void issue_peer_delay_resp(PtpClock *ptp_clock, TimeInternal *time, const MsgHeader *delay_req_header)
+static void issue_peer_delay_resp(PtpClock *ptp_clock, const TimeInternal *time, const MsgHeader *delay_req_header)
 {
   Timestamp request_receipt_timestamp;
 
   ptpd_from_internal_time(time, &request_receipt_timestamp);
-  ptpd_msg_pack_peer_delay_resp(ptp_clock->msgObuf, delay_req_header, &request_receipt_timestamp);
+  ptpd_msg_pack_peer_delay_resp(ptp_clock, ptp_clock->msgObuf, delay_req_header, &request_receipt_timestamp);
+
+  // A new response replaces one whose follow up still awaits its timestamp.
+  if (ptp_clock->waitingForPDelayRespTimestamp) ptp_clock->txTimestampTimeouts++;
+  ptp_clock->waitingForPDelayRespTimestamp = false;
 
-  if (!ptpd_net_send_peer_event(&ptp_clock->netPath, ptp_clock->msgObuf, PDELAY_RESP_LENGTH, time))
+  if (!ptpd_net_send_peer_event(&ptp_clock->netPath, ptp_clock->msgObuf, PDELAY_RESP_LENGTH))
   {
     ERROR("issue_peer_delay_resp: can't sent\n");
     ptpd_protocol_to_state(ptp_clock, PTP_FAULTY);
   }
   else
   {
-    if (time->seconds != 0)
-    {
-      // Add  latency.
-      ptpd_add_time(time, time, &ptp_clock->outboundLatency);
-    }
-
     DBGV("issue_peer_delay_resp\n");
   }
 }
@@ -1334,7 +1477,7 @@ static void issue_peer_delay_resp_follow_up(PtpClock *ptp_clock, const TimeInter
   Timestamp response_origin_timestamp;
 
   ptpd_from_internal_time(time, &response_origin_timestamp);
-  ptpd_msg_pack_peer_delay_resp_follow_up(ptp_clock->msgObuf, delay_req_header, &response_origin_timestamp);
+  ptpd_msg_pack_peer_delay_resp_follow_up(ptp_clock, ptp_clock->msgObuf, delay_req_header, &response_origin_timestamp);
 
   if (!ptpd_net_send_peer_general(&ptp_clock->netPath, ptp_clock->msgObuf, PDELAY_RESP_FOLLOW_UP_LENGTH))
   {
@@ -1,20 +1,34 @@
 #include <stdlib.h>
+#include <string.h>
 #include "ptpd.h"
 #include "systime.h"
+#if defined(STM32F4) || defined(STM32F7)
+#include "ptpprobe.h"
+#endif
 #include "syslog.h"
 
 #if LWIP_PTPD
 
 void ptpd_servo_init_clock(PtpClock *ptp_clock)
 {
+  discipline_config_t config;
+
   DBG("ptpd_servo_init_clock\n");
 
   // Clear the time.
   ptp_clock->Tms.seconds = 0;
   ptp_clock->Tms.nanoseconds = 0;
 
-  // Clears clock servo accumulator (the I term).
-  ptp_clock->observedDrift = 0;
+  // Configure the clock discipline from the servo options. This also clears
+  // the clock servo accumulator (the I term).
+  discipline_config_default(&config);
+  config.p_div = ptp_clock->servo.ap;
+  config.i_div = ptp_clock->servo.ai;
+  config.max_ppb = ADJ_FREQ_MAX;
+  config.step_ns = MAX_ADJ_OFFSET_NS;
+  config.no_step = ptp_clock->servo.noResetClock;
+  config.no_adjust = ptp_clock->servo.noAdjust;
+  discipline_init(&ptp_clock->discipline, &config);
 
   // One way delay.
   ptp_clock->owd_filt.n = 0;
@@ -34,8 +48,12 @@ void ptpd_servo_init_clock(PtpClock *ptp_clock)
   }
 
   // Clear the wait flags.
-  ptp_clock->waitingForFollowUp = false;
+  memset(ptp_clock->pendingSync, 0, sizeof(ptp_clock->pendingSync));
+  memset(ptp_clock->pendingDelayReq, 0, sizeof(ptp_clock->pendingDelayReq));
   ptp_clock->waitingForPDelayRespFollowUp = false;
+  ptp_clock->waitingForPDelayRespTimestamp = false;
+  ptp_clock->waitingForSyncTimestamp = false;
+  ptp_clock->waitingForPDelayReqTimestamp = false;
 
   // Clear the peer delays.
   ptp_clock->pdelay_t1.seconds = ptp_clock->pdelay_t1.nanoseconds = 0;
@@ -305,90 +323,79 @@ void ptpd_servo_update_peer_delay(PtpClock *ptp_clock, const TimeInternal *corre
 void ptpd_servo_update_clock(PtpClock *ptp_clock)
 {
   int32_t adj;
+  bool in_range;
   TimeInternal timeTmp;
-  int32_t offsetNorm;
   char buffer[32];
-  
+  discipline_sample_t sample;
+
+#if defined(STM32F4) || defined(STM32F7)
+  // Measure the latency from the message that updated the servo.
+  ptpprobe_servo();
+#endif
+
+  // Count the update for the statistics.
+  ptp_clock->servoUpdates++;
+
   DBGV("PTPD: ptpd_servo_update_clock offset %d sec %d nsec\n",
        ptp_clock->currentDS.offsetFromMaster.seconds,
        abs(ptp_clock->currentDS.offsetFromMaster.nanoseconds));
 
-  if (ptp_clock->currentDS.offsetFromMaster.seconds != 0 || abs(ptp_clock->currentDS.offsetFromMaster.nanoseconds) > MAX_ADJ_OFFSET_NS)
+  // Is the offset within the range the servo adjusts?
+  in_range = (ptp_clock->currentDS.offsetFromMaster.seconds == 0) &&
+             (abs(ptp_clock->currentDS.offsetFromMaster.nanoseconds) <= MAX_ADJ_OFFSET_NS);
+
+  // The discipline normalizes the offset to a 1s sync interval so the response
+  // of the servo is the same for all sync interval values.
+  sample.offset_ns = ((int64_t) ptp_clock->currentDS.offsetFromMaster.seconds * 1000000000) +
+                     ptp_clock->currentDS.offsetFromMaster.nanoseconds;
+  sample.log_interval = ptp_clock->portDS.logSyncInterval;
+
+  // Step or slew the clock.
+  switch (discipline_update(&ptp_clock->discipline, &sample, &adj))
   {
-    // If secs, reset clock or set freq adjustment to max.
-    if (!ptp_clock->servo.noAdjust)
-    {
-      if (!ptp_clock->servo.noResetClock)
-      {
-        // Get the current time.
-        ptpd_get_time(&timeTmp);
-
-        // Subtract the offset from the master.
-        ptpd_sub_time(&timeTmp, &timeTmp, &ptp_clock->currentDS.offsetFromMaster);
-
-        // Set the time with the offset.
-        ptpd_set_time(&timeTmp);
-
-        // Get the date from system time.
-        systime_str(buffer, sizeof(buffer));
-
-        // Log the time being set.
-        syslog_printf(SYSLOG_NOTICE, "PTPD: setting %s", buffer);
-
-        // Reinitialize clock.
-        ptpd_servo_init_clock(ptp_clock);
-      }
-      else
-      {
-        adj = ptp_clock->currentDS.offsetFromMaster.nanoseconds > 0 ? ADJ_FREQ_MAX : -ADJ_FREQ_MAX;
-        ptpd_adj_freq(-adj);
-      }
-    }
+    case DISCIPLINE_STEP:
+      // Get the current time.
+      ptpd_get_time(&timeTmp);
+
+      // Subtract the offset from the master.
+      ptpd_sub_time(&timeTmp, &timeTmp, &ptp_clock->currentDS.offsetFromMaster);
+
+      // Set the time with the offset.
+      ptpd_set_time(&timeTmp);
+
+      // Get the date from system time.
+      systime_str(buffer, sizeof(buffer));
+
+      // Log the time being set.
+      syslog_printf(SYSLOG_NOTICE, "PTPD: setting %s", buffer);
+
+      // Reinitialize clock.
+      ptpd_servo_init_clock(ptp_clock);
+      break;
+
+    case DISCIPLINE_SLEW:
+      // Apply controller output as a clock tick rate adjustment.
+      ptpd_adj_freq(adj);
+      break;
+
+    default:
+      break;
   }
-  else
-  {
-    // The PI controller.
-
-    // Normalize offset to 1s sync interval -> response of the servo
-    // will be same for all sync interval values, but faster/slower
-    // (possible lost of precision/overflow but much more stable).
-    offsetNorm = ptp_clock->currentDS.offsetFromMaster.nanoseconds;
-    if (ptp_clock->portDS.logSyncInterval > 0)
-      offsetNorm >>= ptp_clock->portDS.logSyncInterval;
-    else if (ptp_clock->portDS.logSyncInterval < 0)
-      offsetNorm <<= -ptp_clock->portDS.logSyncInterval;
-
-    // The accumulator for the I component.
-    ptp_clock->observedDrift += offsetNorm / ptp_clock->servo.ai;
-
-    // Clamp the accumulator to ADJ_FREQ_MAX for sanity.
-    if (ptp_clock->observedDrift > ADJ_FREQ_MAX)
-      ptp_clock->observedDrift = ADJ_FREQ_MAX;
-    else if (ptp_clock->observedDrift < -ADJ_FREQ_MAX)
-      ptp_clock->observedDrift = -ADJ_FREQ_MAX;
-
-    // Apply controller output as a clock tick rate adjustment.
-    if (!ptp_clock->servo.noAdjust)
-    {
-      adj = offsetNorm / ptp_clock->servo.ap + ptp_clock->observedDrift;
-      ptpd_adj_freq(-adj);
-    }
 
-    if (DEFAULT_PARENTS_STATS)
-    {
-      int32_t a, scaledLogVariance;
-      ptp_clock->parentDS.parentStats = true;
-      ptp_clock->parentDS.observedParentClockPhaseChangeRate = 1100 * ptp_clock->observedDrift;
-
-      a = (ptp_clock->offsetHistory[1] - 2 * ptp_clock->offsetHistory[0] + ptp_clock->currentDS.offsetFromMaster.nanoseconds);
-      ptp_clock->offsetHistory[1] = ptp_clock->offsetHistory[0];
-      ptp_clock->offsetHistory[0] = ptp_clock->currentDS.offsetFromMaster.nanoseconds;
-
-      scaledLogVariance = ptpd_servo_order(a * a) << 8;
-      ptpd_servo_filter(&scaledLogVariance, &ptp_clock->slv_filt);
-      ptp_clock->parentDS.observedParentOffsetScaledLogVariance = 17000 + scaledLogVariance;
-      DBGV("PTPD: ptpd_servo_update_clock: observed scalled log variance: 0x%x\n", ptp_clock->parentDS.observedParentOffsetScaledLogVariance);
-    }
+  if (in_range && DEFAULT_PARENTS_STATS)
+  {
+    int32_t a, scaledLogVariance;
+    ptp_clock->parentDS.parentStats = true;
+    ptp_clock->parentDS.observedParentClockPhaseChangeRate = 1100 * discipline_get_drift(&ptp_clock->discipline);
+
+    a = (ptp_clock->offsetHistory[1] - 2 * ptp_clock->offsetHistory[0] + ptp_clock->currentDS.offsetFromMaster.nanoseconds);
+    ptp_clock->offsetHistory[1] = ptp_clock->offsetHistory[0];
+    ptp_clock->offsetHistory[0] = ptp_clock->currentDS.offsetFromMaster.nanoseconds;
+
+    scaledLogVariance = ptpd_servo_order(a * a) << 8;
+    ptpd_servo_filter(&scaledLogVariance, &ptp_clock->slv_filt);
+    ptp_clock->parentDS.observedParentOffsetScaledLogVariance = 17000 + scaledLogVariance;
+    DBGV("PTPD: ptpd_servo_update_clock: observed scalled log variance: 0x%x\n", ptp_clock->parentDS.observedParentOffsetScaledLogVariance);
   }
 
   switch (ptp_clock->portDS.delayMechanism)
@@ -410,7 +417,7 @@ void ptpd_servo_update_clock(PtpClock *ptp_clock)
   DBG("PTPD: ptpd_servo_update_clock: offset from master: %d sec %d nsec\n",
       ptp_clock->currentDS.offsetFromMaster.seconds,
       ptp_clock->currentDS.offsetFromMaster.nanoseconds);
-  DBG("PTPD: ptpd_servo_update_clock: observed drift: %d\n", ptp_clock->observedDrift);
+  DBG("PTPD: ptpd_servo_update_clock: observed drift: %d\n", discipline_get_drift(&ptp_clock->discipline));
 }
 
 #endif // LWIP_PTPD
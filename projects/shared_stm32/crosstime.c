@@ -0,0 +1,380 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "cmsis_os2.h"
+#include "rtx_os.h"
+#include "hal_system.h"
+#include "tick.h"
+#include "shell.h"
+#include "syslog.h"
+#include "systime.h"
+#include "hardtime.h"
+#include "crosstime.h"
+
+// CROSS TIMESTAMPING
+// Maps the free running hardware timer to the disciplined system time. Once a
+// second a pair of simultaneous readings is captured by reading the system
+// time on both sides of the hardware timer. A line is fit by least squares
+// through the pairs of a sliding window, giving the offset and the rate of
+// the system time relative to the hardware timer.
+//
+// Interrupt handlers can take cheap hardware timestamps and have them
+// converted to system time later from thread context. The error bound of a
+// conversion adds the resolution of the hardware timer, the largest residual
+// of the fit and three standard errors of the rate over the distance from the
+// reference point of the fit.
+//
+// A pair far from the line restarts the window, as happens when the system
+// time is stepped.
+
+// Number of pairs in the fit window.
+#if !defined CROSSTIME_WINDOW_SIZE
+#define CROSSTIME_WINDOW_SIZE     16
+#endif
+
+// Pairs needed for a valid mapping.
+#define CROSSTIME_MIN_PAIRS       4
+
+// Capture period in milliseconds.
+#define CROSSTIME_PERIOD_MS       1000
+
+// Longest system time read around the hardware timer read in nanoseconds and
+// the attempts made to capture a pair within it.
+#define CROSSTIME_MAX_READ_NS     5000
+#define CROSSTIME_CAPTURE_TRIES   4
+
+// Distance from the line in nanoseconds at which a pair restarts the window.
+#define CROSSTIME_RESTART_NS      1000000
+
+// Resolution of the hardware timer in nanoseconds.
+#define CROSSTIME_RESOLUTION_NS   10000
+
+// Mapping from hardware time to system time through a reference point.
+typedef struct crosstime_map_s
+{
+  bool valid;
+  uint32_t pairs;
+  int64_t hardtime;
+  int64_t systime;
+  double rate;
+  double rate_error;
+  uint32_t residual_ns;
+} crosstime_map_t;
+
+// Capture timer id.
+static osTimerId_t crosstime_timer_id = NULL;
+
+// Window of captured pairs. Only accessed from the timer thread.
+static int64_t crosstime_hard[CROSSTIME_WINDOW_SIZE];
+static int64_t crosstime_sys[CROSSTIME_WINDOW_SIZE];
+static uint32_t crosstime_count = 0;
+static uint32_t crosstime_next = 0;
+
+// Restarts of the window and a pending restart request.
+static volatile uint32_t crosstime_restarts = 0;
+static volatile bool crosstime_restart_request = false;
+
+// Published mapping. Two copies are kept and the sequence selects the latest,
+// so a reader never waits on the timer thread updating the mapping.
+static volatile uint32_t crosstime_map_seq = 0;
+static crosstime_map_t crosstime_maps[2];
+
+// Get the latest mapping.
+static void crosstime_get_map(crosstime_map_t *map)
+{
+  uint32_t seq;
+
+  // Retry if the copy was rewritten while being read.
+  do
+  {
+    seq = crosstime_map_seq;
+    __DMB();
+    memcpy(map, &crosstime_maps[seq & 1], sizeof(crosstime_map_t));
+    __DMB();
+  } while (seq != crosstime_map_seq);
+}
+
+// Publish a new mapping. Only called from the timer thread.
+static void crosstime_publish(const crosstime_map_t *map)
+{
+  uint32_t seq = crosstime_map_seq + 1;
+
+  // Write the copy not being read and then publish it.
+  memcpy(&crosstime_maps[seq & 1], map, sizeof(crosstime_map_t));
+  __DMB();
+  crosstime_map_seq = seq;
+}
+
+// Error bound in nanoseconds of a conversion the given distance in
+// nanoseconds from the reference point.
+static uint32_t crosstime_error(const crosstime_map_t *map, double distance)
+{
+  double error = CROSSTIME_RESOLUTION_NS + map->residual_ns + (3.0 * map->rate_error * fabs(distance));
+
+  return (error < (double) UINT32_MAX) ? (uint32_t) error : UINT32_MAX;
+}
+
+// Capture a pair of simultaneous hardware and system times. The system time
+// is read on both sides of the hardware timer and the midpoint taken.
+static bool crosstime_capture(int64_t *hardtime, int64_t *systime)
+{
+  int64_t before;
+  int64_t hard;
+  int64_t after;
+
+  for (uint32_t i = 0; i < CROSSTIME_CAPTURE_TRIES; ++i)
+  {
+    before = systime_get();
+    hard = hardtime_get();
+    after = systime_get();
+
+    // An interrupt between the reads widens the pair. Try again.
+    if ((after >= before) && ((after - before) <= CROSSTIME_MAX_READ_NS))
+    {
+      *hardtime = hard;
+      *systime = before + ((after - before) / 2);
+      return true;
+    }
+  }
+
+  return false;
+}
+
+// Fit a line through the pairs of the window.
+static void crosstime_fit(crosstime_map_t *map)
+{
+  uint32_t last = (crosstime_next + CROSSTIME_WINDOW_SIZE - 1) % CROSSTIME_WINDOW_SIZE;
+  int64_t hard_base = crosstime_hard[last];
+  int64_t diff_base = crosstime_sys[last] - hard_base;
+  double mean_x = 0.0;
+  double mean_y = 0.0;
+  double sxx = 0.0;
+  double sxy = 0.0;
+  double ssr = 0.0;
+  double residual_max = 0.0;
+  double slope;
+  double x;
+  double y;
+  double r;
+
+  // The fit is of the difference between the times against the hardware
+  // time, both relative to the latest pair, which keeps the values small
+  // enough for doubles to hold exactly.
+  for (uint32_t i = 0; i < crosstime_count; ++i)
+  {
+    mean_x += (double) (crosstime_hard[i] - hard_base);
+    mean_y += (double) ((crosstime_sys[i] - crosstime_hard[i]) - diff_base);
+  }
+  mean_x /= crosstime_count;
+  mean_y /= crosstime_count;
+
+  for (uint32_t i = 0; i < crosstime_count; ++i)
+  {
+    x = (double) (crosstime_hard[i] - hard_base) - mean_x;
+    y = (double) ((crosstime_sys[i] - crosstime_hard[i]) - diff_base) - mean_y;
+    sxx += x * x;
+    sxy += x * y;
+  }
+  slope = (sxx > 0.0) ? (sxy / sxx) : 0.0;
+
+  for (uint32_t i = 0; i < crosstime_count; ++i)
+  {
+    x = (double) (crosstime_hard[i] - hard_base) - mean_x;
+    y = (double) ((crosstime_sys[i] - crosstime_hard[i]) - diff_base) - mean_y;
+    r = y - (slope * x);
+    ssr += r * r;
+    if (fabs(r) > residual_max) residual_max = fabs(r);
+  }
+
+  // The reference point is the mean of the pairs, where the offset is known
+  // best.
+  map->valid = true;
+  map->pairs = crosstime_count;
+  map->hardtime = hard_base + (int64_t) mean_x;
+  map->systime = map->hardtime + diff_base + (int64_t) (mean_y + (slope * ((double) (int64_t) mean_x - mean_x)));
+  map->rate = slope;
+  map->rate_error = (sxx > 0.0) ? sqrt((ssr / (crosstime_count - 2)) / sxx) : 0.0;
+  map->residual_ns = (uint32_t) ceil(residual_max);
+}
+
+// Capture timer callback. This is called from the context of the timer thread.
+static void crosstime_timer_callback(void *arg)
+{
+  crosstime_map_t map;
+  int64_t hardtime;
+  int64_t systime;
+  int64_t predicted;
+  int64_t distance;
+
+  UNUSED(arg);
+
+  // Nothing to map until the system time is running.
+  if (!systime_is_valid()) return;
+
+  // Capture the next pair.
+  if (!crosstime_capture(&hardtime, &systime)) return;
+
+  // Restart the window if requested or if the pair is far from the line.
+  crosstime_get_map(&map);
+  if (map.valid && !crosstime_restart_request)
+  {
+    distance = hardtime - map.hardtime;
+    predicted = map.systime + distance + (int64_t) ((double) distance * map.rate);
+    if (llabs(systime - predicted) > CROSSTIME_RESTART_NS) crosstime_restart_request = true;
+  }
+  if (crosstime_restart_request)
+  {
+    crosstime_restart_request = false;
+    crosstime_count = 0;
+    crosstime_next = 0;
+    crosstime_restarts += 1;
+  }
+
+  // Add the pair to the window.
+  crosstime_hard[crosstime_next] = hardtime;
+  crosstime_sys[crosstime_next] = systime;
+  crosstime_next = (crosstime_next + 1) % CROSSTIME_WINDOW_SIZE;
+  if (crosstime_count < CROSSTIME_WINDOW_SIZE) crosstime_count += 1;
+
+  // Fit and publish the new mapping.
+  memset(&map, 0, sizeof(map));
+  if (crosstime_count >= CROSSTIME_MIN_PAIRS) crosstime_fit(&map);
+  map.pairs = crosstime_count;
+  crosstime_publish(&map);
+}
+
+// Convert a hardware time to system time. The error bound in nanoseconds is
+// optional. Returns false if there is no valid mapping.
+bool crosstime_hard_to_sys(int64_t hardtime, int64_t *systime, uint32_t *error_ns)
+{
+  crosstime_map_t map;
+  int64_t distance;
+
+  crosstime_get_map(&map);
+  if (!map.valid) return false;
+
+  distance = hardtime - map.hardtime;
+  *systime = map.systime + distance + (int64_t) ((double) distance * map.rate);
+  if (error_ns) *error_ns = crosstime_error(&map, (double) distance);
+
+  return true;
+}
+
+// Convert a system time to hardware time. The error bound in nanoseconds is
+// optional. Returns false if there is no valid mapping.
+bool crosstime_sys_to_hard(int64_t systime, int64_t *hardtime, uint32_t *error_ns)
+{
+  crosstime_map_t map;
+  double distance;
+
+  crosstime_get_map(&map);
+  if (!map.valid) return false;
+
+  distance = (double) (systime - map.systime) / (1.0 + map.rate);
+  *hardtime = map.hardtime + (int64_t) distance;
+  if (error_ns) *error_ns = crosstime_error(&map, distance);
+
+  return true;
+}
+
+// Get the state of the mapping.
+void crosstime_get_state(crosstime_state_t *state)
+{
+  crosstime_map_t map;
+  double rate_ppb;
+
+  crosstime_get_map(&map);
+
+  rate_ppb = map.rate * 1000000000.0;
+  state->valid = map.valid;
+  state->pairs = map.pairs;
+  state->restarts = crosstime_restarts;
+  state->hardtime = map.hardtime;
+  state->systime = map.systime;
+  state->rate_ppb = (fabs(rate_ppb) < (double) INT32_MAX) ? (int32_t) rate_ppb : ((rate_ppb > 0.0) ? INT32_MAX : -INT32_MAX);
+  state->rate_error_ppb = (map.rate_error * 1000000000.0 < (double) UINT32_MAX) ? (uint32_t) (map.rate_error * 1000000000.0) : UINT32_MAX;
+  state->residual_ns = map.residual_ns;
+}
+
+// Discard the captured pairs and start a new mapping.
+void crosstime_restart(void)
+{
+  crosstime_restart_request = true;
+}
+
+// Cross timestamping shell utility.
+static bool crosstime_shell_command(int argc, char **argv)
+{
+  bool needs_help = false;
+  crosstime_state_t state;
+  int64_t systime;
+  int64_t converted;
+  uint32_t error_ns;
+
+  // Parse the command.
+  if (argc > 1)
+  {
+    if (!strcasecmp(argv[1], "restart"))
+    {
+      crosstime_restart();
+      return true;
+    }
+    needs_help = true;
+  }
+
+  // Print help.
+  if (needs_help)
+  {
+    shell_puts("Usage:\n");
+    shell_printf("    %s [restart]\n", argv[0]);
+    return true;
+  }
+
+  // Print the state of the mapping.
+  crosstime_get_state(&state);
+  shell_printf("mapping: %s\n", state.valid ? "valid" : "not valid");
+  shell_printf("pairs: %u\n", (unsigned) state.pairs);
+  shell_printf("restarts: %u\n", (unsigned) state.restarts);
+  if (!state.valid) return true;
+  shell_printf("rate: %d ppb +/- %u ppb\n", (int) state.rate_ppb, (unsigned) state.rate_error_ppb);
+  shell_printf("residual: %u nsec\n", (unsigned) state.residual_ns);
+
+  // Check the conversion of the current hardware time against the system time.
+  if (crosstime_hard_to_sys(hardtime_get(), &converted, &error_ns))
+  {
+    systime = systime_get();
+    shell_printf("now: %d nsec +/- %u nsec\n", (int) (converted - systime), (unsigned) error_ns);
+  }
+
+  return true;
+}
+
+// Initialize cross timestamping. This must be called after the system time
+// and the hardware time are initialized.
+void crosstime_init(void)
+{
+  // Static timer control blocks.
+  static uint32_t crosstime_timer_cb[osRtxTimerCbSize/4U] __attribute__((section(".bss.os.timer.cb")));
+
+  // Capture timer attributes.
+  osTimerAttr_t crosstime_timer_attrs =
+  {
+    .name = "crosstime",
+    .attr_bits = 0U,
+    .cb_mem = crosstime_timer_cb,
+    .cb_size = sizeof(crosstime_timer_cb)
+  };
+
+  // Start without a mapping.
+  memset(crosstime_maps, 0, sizeof(crosstime_maps));
+
+  // Create and start the capture timer.
+  crosstime_timer_id = osTimerNew(crosstime_timer_callback, osTimerPeriodic, NULL, &crosstime_timer_attrs);
+  if (crosstime_timer_id)
+    osTimerStart(crosstime_timer_id, tick_from_milliseconds(CROSSTIME_PERIOD_MS));
+  else
+    syslog_printf(SYSLOG_ERROR, "CROSSTIME: error creating capture timer");
+
+  // Initialize the shell command.
+  shell_add_command("xtime", crosstime_shell_command);
+}
@@ -0,0 +1,36 @@
+#ifndef __CROSSTIME_H__
+#define __CROSSTIME_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// State of the mapping from hardware time to system time. The rate is that of
+// the system clock relative to the hardware timer, so it measures the
+// disciplined clock against the local oscillator.
+typedef struct crosstime_state_s
+{
+  bool valid;
+  uint32_t pairs;
+  uint32_t restarts;
+  int64_t hardtime;
+  int64_t systime;
+  int32_t rate_ppb;
+  uint32_t rate_error_ppb;
+  uint32_t residual_ns;
+} crosstime_state_t;
+
+void crosstime_init(void);
+bool crosstime_hard_to_sys(int64_t hardtime, int64_t *systime, uint32_t *error_ns);
+bool crosstime_sys_to_hard(int64_t systime, int64_t *hardtime, uint32_t *error_ns);
+void crosstime_get_state(crosstime_state_t *state);
+void crosstime_restart(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // __CROSSTIME_H__
@@ -0,0 +1,326 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cmsis_os2.h"
+#include "rtx_os.h"
+#include "hal_system.h"
+#include "outputf.h"
+#include "shell.h"
+#include "syslog.h"
+#include "systime.h"
+#include "dlog.h"
+
+// DEFERRED LOGGING
+// Formatting a log message takes thousands of cycles, the syslog mutex and
+// the time of day, which is too much to leave in a hot path such as the PTP
+// message handlers or an interrupt. A deferred log message instead records
+// the DWT cycle counter, a pointer to the format string and the raw arguments
+// into a ring of fixed size records. Writing a record is a few dozen cycles
+// with interrupts masked, so any thread or interrupt may write one.
+//
+// A low priority thread drains the ring, converts the cycles to system time
+// and formats each record into syslog. The cycle counter wraps every 2^32
+// cycles, so records are expected to be drained within that many cycles of
+// being written. While the ring is held the thread leaves the records for
+// the shell to dump raw. The format pointers and any string arguments in a
+// dump resolve against the firmware image, so records can also be formatted
+// on a host.
+//
+// When the ring is full new records are dropped and counted rather than
+// overwriting records that may be in the middle of being read.
+
+// Period of draining the ring in milliseconds.
+#define DLOG_DRAIN_MS             50
+
+// Size of a formatted message.
+#define DLOG_MESSAGE_SIZE         128
+
+// Ring of records. The head and tail count records written and read and
+// are masked to index the ring.
+static dlog_record_t dlog_ring[DLOG_RECORD_COUNT];
+static volatile uint32_t dlog_head = 0;
+static volatile uint32_t dlog_tail = 0;
+
+// Record counters.
+static volatile uint32_t dlog_dropped = 0;
+static volatile uint32_t dlog_max_pending = 0;
+
+// Drops already reported by the drain thread.
+static uint32_t dlog_dropped_reported = 0;
+
+// Set while records are left in the ring for the shell.
+static bool dlog_hold = false;
+
+// Mutex between the readers of the ring.
+static osMutexId_t dlog_mutex_id = NULL;
+
+// Formatted message buffer. Only used with the mutex held.
+static char dlog_message[DLOG_MESSAGE_SIZE];
+
+// Record a message to be formatted later.
+void dlog_write(uint32_t severity, const char *fmt, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3)
+{
+  dlog_record_t *record;
+  uint32_t cycles;
+  uint32_t pending;
+  uint32_t primask;
+
+  // Stamp before masking interrupts so the time is of the call.
+  cycles = DWT->CYCCNT;
+
+  // Writers may interrupt each other, so the record is reserved and filled
+  // with interrupts masked.
+  primask = __get_PRIMASK();
+  __disable_irq();
+
+  pending = dlog_head - dlog_tail;
+  if (pending < DLOG_RECORD_COUNT)
+  {
+    record = &dlog_ring[dlog_head & (DLOG_RECORD_COUNT - 1)];
+    record->cycles = cycles;
+    record->severity = severity;
+    record->fmt = fmt;
+    record->args[0] = a0;
+    record->args[1] = a1;
+    record->args[2] = a2;
+    record->args[3] = a3;
+
+    // Publish the record.
+    __DMB();
+    dlog_head += 1;
+
+    if (pending >= dlog_max_pending) dlog_max_pending = pending + 1;
+  }
+  else
+  {
+    dlog_dropped += 1;
+  }
+
+  __set_PRIMASK(primask);
+}
+
+// Take the oldest record from the ring. Called with the mutex held.
+static bool dlog_read(dlog_record_t *record)
+{
+  uint32_t tail = dlog_tail;
+
+  if (tail == dlog_head) return false;
+
+  // Copy the record before releasing its slot.
+  __DMB();
+  *record = dlog_ring[tail & (DLOG_RECORD_COUNT - 1)];
+  __DMB();
+  dlog_tail = tail + 1;
+
+  return true;
+}
+
+// Convert the cycles of a record to system time given the cycles and system
+// time of now.
+static int64_t dlog_systime(uint32_t cycles, uint32_t now_cycles, int64_t now_systime)
+{
+  uint64_t age = ((uint64_t) (now_cycles - cycles) * 1000u) / (SystemCoreClock / 1000000u);
+
+  return now_systime - (int64_t) age;
+}
+
+// Format the records in the ring into syslog.
+static void dlog_drain(void)
+{
+  dlog_record_t record;
+  uint32_t now_cycles;
+  int64_t now_systime;
+  int64_t systime;
+  uint32_t dropped;
+  uint32_t count;
+  int len;
+
+  // Lock the reader mutex.
+  if (!dlog_mutex_id || (osMutexAcquire(dlog_mutex_id, osWaitForever) != osOK)) return;
+
+  // Count the records before taking the time they are converted from, so
+  // only records written before then are formatted this time around.
+  count = dlog_head - dlog_tail;
+  __DMB();
+  now_systime = systime_get();
+  now_cycles = DWT->CYCCNT;
+
+  for (; count && !dlog_hold && dlog_read(&record); --count)
+  {
+    // Arguments beyond those the format uses are ignored.
+    len = snoutputf(dlog_message, sizeof(dlog_message), record.fmt, record.args[0],
+                    record.args[1], record.args[2], record.args[3]);
+
+    // Syslog ends each message itself.
+    if ((len > 0) && (len < (int) sizeof(dlog_message)) && (dlog_message[len - 1] == '\n'))
+      dlog_message[len - 1] = 0;
+
+    systime = dlog_systime(record.cycles, now_cycles, now_systime);
+    syslog_printf((int) record.severity, "(%u.%09u) %s", (unsigned) (systime / 1000000000),
+                  (unsigned) (systime % 1000000000), dlog_message);
+  }
+
+  // Report newly dropped records.
+  dropped = dlog_dropped;
+  if (dropped != dlog_dropped_reported)
+  {
+    syslog_printf(SYSLOG_WARNING, "DLOG: %u records dropped", (unsigned) (dropped - dlog_dropped_reported));
+    dlog_dropped_reported = dropped;
+  }
+
+  // Release the mutex.
+  osMutexRelease(dlog_mutex_id);
+}
+
+// Deferred logging thread.
+static void dlog_thread(void *arg)
+{
+  UNUSED(arg);
+
+  for (;;)
+  {
+    osDelay(DLOG_DRAIN_MS);
+    dlog_drain();
+  }
+}
+
+// Dump the records in the ring raw for formatting on a host.
+static void dlog_dump(void)
+{
+  dlog_record_t record;
+  uint32_t now_cycles;
+  int64_t now_systime;
+
+  // Lock the reader mutex.
+  if (!dlog_mutex_id || (osMutexAcquire(dlog_mutex_id, osWaitForever) != osOK)) return;
+
+  // The first line relates the cycle counter to system time.
+  now_systime = systime_get();
+  now_cycles = DWT->CYCCNT;
+  shell_printf("anchor %08x %u.%09u %u\n", (unsigned) now_cycles, (unsigned) (now_systime / 1000000000),
+               (unsigned) (now_systime % 1000000000), (unsigned) SystemCoreClock);
+
+  // Each following line is the cycles, severity, format address and arguments.
+  while (dlog_read(&record))
+  {
+    shell_printf("%08x %u %08x %08x %08x %08x %08x\n", (unsigned) record.cycles, (unsigned) record.severity,
+                 (unsigned) (uintptr_t) record.fmt, (unsigned) record.args[0], (unsigned) record.args[1],
+                 (unsigned) record.args[2], (unsigned) record.args[3]);
+  }
+
+  // Release the mutex.
+  osMutexRelease(dlog_mutex_id);
+}
+
+// Deferred logging shell command.
+static bool dlog_shell_dlog(int argc, char **argv)
+{
+  bool needs_help = false;
+  dlog_stats_t stats;
+
+  // Parse the command.
+  if (argc > 1)
+  {
+    if (!strcasecmp(argv[1], "hold"))
+    {
+      // Are we setting or just getting?
+      if (argc > 2) dlog_set_hold(!strcasecmp(argv[2], "on"));
+      shell_printf("hold: %s\n", dlog_get_hold() ? "on" : "off");
+      return true;
+    }
+    else if (!strcasecmp(argv[1], "dump"))
+    {
+      dlog_dump();
+      return true;
+    }
+    needs_help = true;
+  }
+
+  // Print help.
+  if (needs_help)
+  {
+    shell_puts("Usage:\n");
+    shell_printf("    %s\n", argv[0]);
+    shell_printf("    %s hold [on|off]\n", argv[0]);
+    shell_printf("    %s dump\n", argv[0]);
+    return true;
+  }
+
+  // Print the statistics.
+  dlog_get_stats(&stats);
+  shell_printf("records: %u of %u\n", (unsigned) stats.pending, (unsigned) DLOG_RECORD_COUNT);
+  shell_printf("written: %u\n", (unsigned) stats.written);
+  shell_printf("dropped: %u\n", (unsigned) stats.dropped);
+  shell_printf("max: %u\n", (unsigned) stats.max_pending);
+  shell_printf("hold: %s\n", dlog_get_hold() ? "on" : "off");
+
+  return true;
+}
+
+// Initialize deferred logging.
+void dlog_init(void)
+{
+  // Static mutex and thread control blocks.
+  static uint32_t dlog_mutex_cb[osRtxMutexCbSize/4U] __attribute__((section(".bss.os.mutex.cb")));
+  static uint32_t dlog_thread_cb[osRtxThreadCbSize/4U] __attribute__((section(".bss.os.thread.cb")));
+
+  // Deferred logging mutex attributes. Note the mutex is not recursive.
+  osMutexAttr_t dlog_mutex_attrs =
+  {
+    .name = "dlog",
+    .attr_bits = osMutexPrioInherit,
+    .cb_mem = dlog_mutex_cb,
+    .cb_size = sizeof(dlog_mutex_cb)
+  };
+
+  // Deferred logging thread attributes. Formatting should never get in the
+  // way of anything else.
+  osThreadAttr_t dlog_thread_attrs =
+  {
+    .name = "dlog",
+    .attr_bits = 0U,
+    .cb_mem = dlog_thread_cb,
+    .cb_size = sizeof(dlog_thread_cb),
+    .priority = osPriorityLow
+  };
+
+  // Create the deferred logging mutex.
+  dlog_mutex_id = osMutexNew(&dlog_mutex_attrs);
+  if (!dlog_mutex_id)
+  {
+    syslog_printf(SYSLOG_ERROR, "DLOG: cannot create mutex");
+    return;
+  }
+
+  // Create the deferred logging thread.
+  if (!osThreadNew(dlog_thread, NULL, &dlog_thread_attrs))
+  {
+    syslog_printf(SYSLOG_ERROR, "DLOG: cannot create thread");
+    return;
+  }
+
+  // Add the shell command.
+  shell_add_command("dlog", dlog_shell_dlog);
+}
+
+// Leave records in the ring rather than formatting them.
+void dlog_set_hold(bool hold)
+{
+  dlog_hold = hold;
+}
+
+// Get whether records are left in the ring.
+bool dlog_get_hold(void)
+{
+  return dlog_hold;
+}
+
+// Get the deferred logging statistics.
+void dlog_get_stats(dlog_stats_t *stats)
+{
+  uint32_t head = dlog_head;
+
+  stats->written = head;
+  stats->dropped = dlog_dropped;
+  stats->pending = head - dlog_tail;
+  stats->max_pending = dlog_max_pending;
+}
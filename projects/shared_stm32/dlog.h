@@ -0,0 +1,58 @@
+#ifndef __DLOG_H__
+#define __DLOG_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Number of records held in the ring. Must be a power of two.
+#if !defined(DLOG_RECORD_COUNT)
+#define DLOG_RECORD_COUNT         128
+#endif
+
+// Largest number of arguments to a deferred log message.
+#define DLOG_MAX_ARGS             4
+
+// Deferred log record. The cycles are the DWT cycle counter when the record
+// was written and the format is a pointer to the format string, which must
+// still be valid when the record is formatted.
+typedef struct dlog_record_s
+{
+  uint32_t cycles;
+  uint32_t severity;
+  const char *fmt;
+  uint32_t args[DLOG_MAX_ARGS];
+} dlog_record_t;
+
+// Deferred log statistics.
+typedef struct dlog_stats_s
+{
+  uint32_t written;
+  uint32_t dropped;
+  uint32_t pending;
+  uint32_t max_pending;
+} dlog_stats_t;
+
+// Record a message with up to four 32-bit integer or pointer arguments to be
+// formatted later. String arguments must point to constant strings. Further
+// arguments are ignored and 64-bit or floating point arguments are not
+// supported. Safe to call from interrupts.
+#define DLOG(severity, ...)       DLOG_WRITE_(severity, __VA_ARGS__, 0, 0, 0, 0, 0)
+#define DLOG_ARG_(x)              ((uint32_t) (uintptr_t) (x))
+#define DLOG_WRITE_(severity, fmt, a0, a1, a2, a3, ...) \
+  dlog_write(severity, fmt, DLOG_ARG_(a0), DLOG_ARG_(a1), DLOG_ARG_(a2), DLOG_ARG_(a3))
+
+void dlog_init(void);
+void dlog_write(uint32_t severity, const char *fmt, uint32_t a0, uint32_t a1, uint32_t a2, uint32_t a3);
+void dlog_set_hold(bool hold);
+bool dlog_get_hold(void);
+void dlog_get_stats(dlog_stats_t *stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // __DLOG_H__
@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cmsis_os2.h"
+#include "hal_system.h"
+#include "ethptp.h"
+#include "trigout.h"
+#include "syslog.h"
+#include "shell.h"
+#include "ethpps.h"
+
+// PPS OUTPUT
+// PPS      PG8   ETH_PPS_OUT driven by the MAC at 2^n Hz.
+// TRIG     PD11  Driven from the target time interrupt at a programmable period.
+
+// The hardware PPS output is exact but limited to powers of two. The trigger
+// output follows any period but is driven by software from the target time
+// interrupt, so the interrupt latency of each rising edge is measured against
+// the PTP clock and reported.
+
+// Minimum time in the future an edge is armed.
+#define ETHPPS_MARGIN_NS      100000
+
+// Default period and pulse width.
+#define ETHPPS_PERIOD_MS      1000
+#define ETHPPS_WIDTH_MS       100
+
+// Output period and pulse width in nanoseconds. A zero period disables the output.
+static int64_t ethpps_period_ns = 0;
+static int64_t ethpps_width_ns = 0;
+
+// The armed edge and the level it drives.
+static int64_t ethpps_target_ns = 0;
+static bool ethpps_target_level = false;
+
+// Measured latency of the rising edges.
+static ethpps_latency_t ethpps_latency;
+
+// Current PTP time in nanoseconds.
+static int64_t ethpps_now(void)
+{
+  ptptime_t now;
+
+  ethptp_get_time(&now);
+  return ((int64_t) now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+// Arm the next edge following the current time.
+static void ethpps_arm(int64_t now_ns);
+
+// Target time reached or PTP time stepped.
+static void ethpps_target_callback(bool time_stepped)
+{
+  int64_t now_ns;
+  int32_t latency;
+
+  if (time_stepped)
+  {
+    // Restart the edge sequence from the new time.
+    trigout_set_output(false);
+    ethpps_arm(ethpps_now());
+    return;
+  }
+
+  // Drive the edge first to keep the latency low.
+  trigout_set_output(ethpps_target_level);
+  now_ns = ethpps_now();
+
+  // Account for the latency of rising edges.
+  if (ethpps_target_level)
+  {
+    latency = (int32_t) (now_ns - ethpps_target_ns);
+    if ((ethpps_latency.count == 0) || (latency < ethpps_latency.min)) ethpps_latency.min = latency;
+    if ((ethpps_latency.count == 0) || (latency > ethpps_latency.max)) ethpps_latency.max = latency;
+    ethpps_latency.last = latency;
+    ethpps_latency.sum += latency;
+    ethpps_latency.count += 1;
+  }
+
+  ethpps_arm(now_ns);
+}
+
+static void ethpps_arm(int64_t now_ns)
+{
+  int64_t boundary;
+  ptptime_t target;
+
+  if (ethpps_period_ns <= 0) return;
+
+  // Rising edges are at multiples of the period and falling edges follow
+  // after the pulse width. Pick the first edge far enough in the future.
+  boundary = (now_ns / ethpps_period_ns) * ethpps_period_ns;
+  if ((boundary + ethpps_width_ns) >= (now_ns + ETHPPS_MARGIN_NS))
+  {
+    ethpps_target_ns = boundary + ethpps_width_ns;
+    ethpps_target_level = false;
+  }
+  else if ((boundary + ethpps_period_ns) >= (now_ns + ETHPPS_MARGIN_NS))
+  {
+    ethpps_target_ns = boundary + ethpps_period_ns;
+    ethpps_target_level = true;
+  }
+  else
+  {
+    ethpps_target_ns = boundary + ethpps_period_ns + ethpps_width_ns;
+    ethpps_target_level = false;
+  }
+
+  target.tv_sec = (int32_t) (ethpps_target_ns / 1000000000);
+  target.tv_nsec = (int32_t) (ethpps_target_ns % 1000000000);
+  ethptp_set_target_time(&target, ethpps_target_callback);
+}
+
+// Set the period and pulse width of the trigger output. A zero period disables it.
+void ethpps_set_period(uint32_t period_ms, uint32_t width_ms)
+{
+  // Keep the pulse within the period.
+  if (width_ms >= period_ms) width_ms = period_ms / 2;
+
+  // Stop the current sequence.
+  NVIC_DisableIRQ(ETH_IRQn);
+  ethptp_cancel_target_time();
+  trigout_set_output(false);
+
+  ethpps_period_ns = (int64_t) period_ms * 1000000;
+  ethpps_width_ns = (int64_t) width_ms * 1000000;
+  memset(&ethpps_latency, 0, sizeof(ethpps_latency));
+
+  // Start the new sequence.
+  ethpps_arm(ethpps_now());
+  NVIC_EnableIRQ(ETH_IRQn);
+}
+
+// Get the measured latency of the trigger output.
+void ethpps_get_latency(ethpps_latency_t *latency)
+{
+  NVIC_DisableIRQ(ETH_IRQn);
+  *latency = ethpps_latency;
+  NVIC_EnableIRQ(ETH_IRQn);
+}
+
+// Reset the measured latency of the trigger output.
+void ethpps_reset_latency(void)
+{
+  NVIC_DisableIRQ(ETH_IRQn);
+  memset(&ethpps_latency, 0, sizeof(ethpps_latency));
+  NVIC_EnableIRQ(ETH_IRQn);
+}
+
+// PPS output shell functionality.
+static bool ethpps_shell_command(int argc, char **argv)
+{
+  bool needs_help = false;
+  ethpps_latency_t latency;
+
+  // Parse the command.
+  if (argc > 1)
+  {
+    if (!strcasecmp(argv[1], "period"))
+    {
+      uint32_t period = ETHPPS_PERIOD_MS;
+      uint32_t width = ETHPPS_WIDTH_MS;
+
+      // Get the period and width in milliseconds.
+      if (argc > 2) period = (uint32_t) strtol(argv[2], NULL, 0);
+      if (argc > 3) width = (uint32_t) strtol(argv[3], NULL, 0);
+
+      ethpps_set_period(period, width);
+    }
+    else if (!strcasecmp(argv[1], "hw"))
+    {
+      // Set the hardware output to 2^n Hz.
+      if (argc > 2) ethptp_set_pps_frequency((uint32_t) strtol(argv[2], NULL, 0));
+      else needs_help = true;
+    }
+    else if (!strcasecmp(argv[1], "reset"))
+    {
+      ethpps_reset_latency();
+    }
+    else
+    {
+      needs_help = true;
+    }
+  }
+
+  // Print help.
+  if (needs_help)
+  {
+    shell_puts("Usage:\n");
+    shell_printf("    %s [period <ms> [width_ms]|hw <log2_hz>|reset]\n", argv[0]);
+    return true;
+  }
+
+  // Show the output and the measured latency.
+  shell_printf("period: %u ms, width: %u ms\n",
+               (unsigned) (ethpps_period_ns / 1000000), (unsigned) (ethpps_width_ns / 1000000));
+  ethpps_get_latency(&latency);
+  if (latency.count)
+  {
+    shell_printf("latency: %d nsec last, %d nsec min, %d nsec max, %d nsec avg, %u edges\n",
+                 (int) latency.last, (int) latency.min, (int) latency.max,
+                 (int) (latency.sum / latency.count), (unsigned) latency.count);
+  }
+  else
+  {
+    shell_puts("latency: no edges\n");
+  }
+
+  return true;
+}
+
+// Initialize the PPS outputs. Requires the Ethernet PTP clock to be running.
+void ethpps_init(void)
+{
+  // Enable GPIO peripheral clock.
+  LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_GPIOG);
+
+  // Configure the hardware PPS output pin.
+  LL_GPIO_InitTypeDef gpio_init;
+  LL_GPIO_StructInit(&gpio_init);
+  gpio_init.Pin = LL_GPIO_PIN_8;
+  gpio_init.Mode = LL_GPIO_MODE_ALTERNATE;
+  gpio_init.OutputType = LL_GPIO_OUTPUT_PUSHPULL;
+  gpio_init.Speed = LL_GPIO_SPEED_FREQ_VERY_HIGH;
+  gpio_init.Pull = LL_GPIO_PULL_NO;
+  gpio_init.Alternate = LL_GPIO_AF_11;
+  LL_GPIO_Init(GPIOG, &gpio_init);
+
+  // One pulse per second from the hardware.
+  ethptp_set_pps_frequency(0);
+
+  // Start the trigger output at the default period.
+  ethpps_set_period(ETHPPS_PERIOD_MS, ETHPPS_WIDTH_MS);
+
+  // Initialize the shell command.
+  shell_add_command("pps", ethpps_shell_command);
+}
@@ -0,0 +1,30 @@
+#ifndef __ETHPPS_H__
+#define __ETHPPS_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Interrupt latency of the target time output edges in nanoseconds.
+typedef struct ethpps_latency_s
+{
+  uint32_t count;
+  int32_t last;
+  int32_t min;
+  int32_t max;
+  int64_t sum;
+} ethpps_latency_t;
+
+void ethpps_init(void);
+void ethpps_set_period(uint32_t period_ms, uint32_t width_ms);
+void ethpps_get_latency(ethpps_latency_t *latency);
+void ethpps_reset_latency(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // __ETHPPS_H__
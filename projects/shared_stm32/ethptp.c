@@ -1,4 +1,3 @@
-#include <limits.h>
 #include "hal_system.h"
 #include "ethptp.h"
 
@@ -6,21 +5,8 @@
 // from within another module to function. Normally this is done by the module
 // that initialize the STM32 Ethernet perhipheral for network communcation.
 
-// Conversion from hardware to PTP format.
-static uint32_t subsecond_to_nanosecond(uint32_t subsecond_value)
-{
-  uint64_t val = subsecond_value * 1000000000ll;
-  val >>= 31;
-  return val;
-}
-
-// Conversion from PTP to hardware format.
-static uint32_t nanosecond_to_subsecond(uint32_t subsecond_value)
-{
-  uint64_t val = subsecond_value * 0x80000000ll;
-  val /= 1000000000;
-  return val;
-}
+// Owner of the target time interrupt.
+static ethptp_target_callback_t ethptp_target_callback = NULL;
 
 /***
   **
@@ -450,36 +436,39 @@ void ethptp_start(uint32_t update_method)
   // with the value written in the Time stamp update register.
 }
 
-// Get the PTP time.
-void ethptp_get_time(ptptime_t *timestamp)
+// Get the PTP time in the hardware format. Safe to call from any interrupt
+// or thread as interrupts are never masked.
+void ethptp_get_time_raw(ptptime_raw_t *timestamp)
 {
   int32_t hi_reg;
   int32_t lo_reg;
-  int32_t hi_reg_after;
 
   // The problem is we are reading two 32-bit registers that form
   // a 64-bit value, but it's possible the high 32-bits of the value
-  // rolls over before we read the low 32-bits of the value.  To avoid
-  // this situation we read the high 32-bits twice and determine which
-  // high 32-bits the low 32-bit are associated with.
-  __disable_irq();
-  hi_reg = ETH_GetPTPRegister(ETH_PTPTSHR);
-  lo_reg = ETH_GetPTPRegister(ETH_PTPTSLR);
-  hi_reg_after = ETH_GetPTPRegister(ETH_PTPTSHR);
-  __enable_irq();
-
-  // Did a roll over occur while reading?
-  if (hi_reg != hi_reg_after)
+  // rolls over before we read the low 32-bits of the value.  The
+  // seconds act as a sequence count: the read is retried until they
+  // are the same on both sides of the subseconds. This also covers
+  // being interrupted between the reads for any length of time.
+  do
   {
-    // We now know a roll over occurred. If the rollover occured before
-    // the reading of the low 32-bits we move the substitute the second
-    // 32-bit high value for the first 32-bit high value.
-    if (lo_reg < (INT_MAX / 2)) hi_reg = hi_reg_after;
-  }
+    hi_reg = ETH_GetPTPRegister(ETH_PTPTSHR);
+    lo_reg = ETH_GetPTPRegister(ETH_PTPTSLR);
+  } while (hi_reg != (int32_t) ETH_GetPTPRegister(ETH_PTPTSHR));
 
-  // Now convert the raw registers values into timestamp values.
-  timestamp->tv_nsec = subsecond_to_nanosecond(lo_reg);
   timestamp->tv_sec = hi_reg;
+  timestamp->tv_subsec = (uint32_t) lo_reg;
+}
+
+// Get the PTP time. Safe to call from any interrupt or thread.
+void ethptp_get_time(ptptime_t *timestamp)
+{
+  ptptime_raw_t raw;
+
+  ethptp_get_time_raw(&raw);
+
+  // Now convert the raw registers values into timestamp values.
+  timestamp->tv_nsec = ethptp_subsec_to_nsec(raw.tv_subsec);
+  timestamp->tv_sec = raw.tv_sec;
 }
 
 // Set the PTP time.
@@ -505,7 +494,7 @@ void ethptp_set_time(ptptime_t *timestamp)
   }
 
   // Convert nanosecond to subseconds.
-  subsecond_value = nanosecond_to_subsecond(nanosecond_value);
+  subsecond_value = ethptp_nsec_to_subsec(nanosecond_value);
 
   // Write the offset (positive or negative) in the Time stamp update
   // high and low registers.
@@ -517,6 +506,16 @@ void ethptp_set_time(ptptime_t *timestamp)
   // The Time stamp counter starts operation as soon as it is initialized
   // with the value written in the Time stamp update register.
   while (ETH_GetPTPFlagStatus(ETH_PTP_FLAG_TSSTI) == SET);
+
+  // An armed target time is meaningless after a step. Let the owner
+  // re-arm from the new time with the Ethernet interrupt masked.
+  if (ethptp_target_callback)
+  {
+    NVIC_DisableIRQ(ETH_IRQn);
+    ETH->PTPTSCR &= ~ETH_PTPTSCR_TSITE;
+    ethptp_target_callback(true);
+    NVIC_EnableIRQ(ETH_IRQn);
+  }
 }
 
 // Adjust the PTP system clock rate by the specified value in parts-per-billion.
@@ -531,3 +530,46 @@ void ethptp_adj_freq(int32_t adj_ppb)
   ETH_EnablePTPTimeStampAddend();
 }
 
+// Arm the target time interrupt. The callback is called from the Ethernet
+// interrupt once the PTP time reaches the target. The target must be in
+// the future and the interrupt is one shot, so the callback re-arms.
+void ethptp_set_target_time(const ptptime_t *target, ethptp_target_callback_t callback)
+{
+  // The target time registers must not be written while the trigger is enabled.
+  ETH->PTPTSCR &= ~ETH_PTPTSCR_TSITE;
+
+  // Set the callback and the target in the hardware format.
+  ethptp_target_callback = callback;
+  ETH_SetPTPTargetTime((uint32_t) target->tv_sec, ethptp_nsec_to_subsec((uint32_t) target->tv_nsec));
+
+  // Unmask the time stamp trigger interrupt and enable the trigger.
+  ETH->MACIMR &= ~(ETH_MAC_IT_TST);
+  ETH_EnablePTPTimeStampInterruptTrigger();
+}
+
+// Cancel the target time interrupt.
+void ethptp_cancel_target_time(void)
+{
+  ETH->PTPTSCR &= ~ETH_PTPTSCR_TSITE;
+  ethptp_target_callback = NULL;
+}
+
+// Handle the time stamp trigger from the Ethernet interrupt handler.
+void ethptp_target_time_irq(void)
+{
+  // Reading the status register clears the target time reached flag (bit 1).
+  uint32_t status = ETH->PTPTSSR;
+
+  // Notify the owner of the target time.
+  if ((status & 0x00000002u) && ethptp_target_callback) ethptp_target_callback(false);
+}
+
+// Set the frequency of the hardware PPS output to 2^log2_hz Hz. Zero
+// gives the one pulse per second output aligned to the seconds rollover.
+void ethptp_set_pps_frequency(uint32_t log2_hz)
+{
+  __IO uint32_t *ppscr = (__IO uint32_t *) (ETH_MAC_BASE + ETH_PTPPPSCR);
+
+  if (log2_hz > 15) log2_hz = 15;
+  *ppscr = (*ppscr & ~0x0fu) | log2_hz;
+}
@@ -2,6 +2,7 @@
 #define __ETHPTP_H__
 
 #include <stdint.h>
+#include <stdbool.h>
 #include "hal_system.h"
 
 #ifdef __cplusplus
@@ -85,12 +86,14 @@ extern "C" {
 #define ETH_PTPTTLR     ((uint32_t)0x00000720)  /* PTP TTLR register */
 
 #define ETH_PTPTSSR     ((uint32_t)0x00000728)  /* PTP TSSR register */
+#define ETH_PTPPPSCR    ((uint32_t)0x0000072C)  /* PTP PPSCR register */
 
 #define IS_ETH_PTP_REGISTER(REG) (((REG) == ETH_PTPTSCR) || ((REG) == ETH_PTPSSIR) || \
                                    ((REG) == ETH_PTPTSHR) || ((REG) == ETH_PTPTSLR) || \
                                    ((REG) == ETH_PTPTSHUR) || ((REG) == ETH_PTPTSLUR) || \
                                    ((REG) == ETH_PTPTSAR) || ((REG) == ETH_PTPTTHR) || \
-                                   ((REG) == ETH_PTPTTLR) || ((REG) == ETH_PTPTSSR)) 
+                                   ((REG) == ETH_PTPTTLR) || ((REG) == ETH_PTPTSSR) || \
+                                   ((REG) == ETH_PTPPPSCR)) 
 
 /** 
   * @brief  ETHERNET PTP clock  
@@ -143,11 +146,46 @@ typedef struct ptptime_s
   int32_t tv_nsec;
 } ptptime_t;
 
+// PTP time in the hardware format. The digital rollover is not enabled, so
+// the subseconds count in units of 2^-31 seconds.
+typedef struct ptptime_raw_s
+{
+  int32_t tv_sec;
+  uint32_t tv_subsec;
+} ptptime_raw_t;
+
+// Subseconds in one second of the hardware format.
+#define ETHPTP_SUBSEC_PER_SEC     0x80000000u
+
+// Conversion from hardware to nanosecond format.
+static inline int32_t ethptp_subsec_to_nsec(uint32_t subsec)
+{
+  return (int32_t) (((uint64_t) subsec * 1000000000u) >> 31);
+}
+
+// Conversion from nanosecond to hardware format. The division by 10^9 is
+// done as a multiply by 2^61 / 10^9 rounded up and the result is rounded up,
+// so converting back to nanoseconds gives the original value.
+static inline uint32_t ethptp_nsec_to_subsec(uint32_t nsec)
+{
+  return (uint32_t) ((((uint64_t) nsec * 2305843010u) + 0x3fffffffu) >> 30);
+}
+
 void ethptp_start(uint32_t update_method);
+void ethptp_get_time_raw(ptptime_raw_t *timestamp);
 void ethptp_get_time(ptptime_t *timestamp);
 void ethptp_set_time(ptptime_t *timestamp);
 void ethptp_adj_freq(int32_t adj_ppb);
 
+// Called from the Ethernet interrupt when the target time is reached or,
+// with time_stepped set, from thread context after the time is stepped.
+typedef void (*ethptp_target_callback_t)(bool time_stepped);
+
+void ethptp_set_target_time(const ptptime_t *target, ethptp_target_callback_t callback);
+void ethptp_cancel_target_time(void);
+void ethptp_target_time_irq(void);
+void ethptp_set_pps_frequency(uint32_t log2_hz);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,521 @@
+#include <stdlib.h>
+#include <string.h>
+#include "cmsis_os2.h"
+#include "hal_system.h"
+#include "lwip/udp.h"
+#include "lwip/tcpip.h"
+#include "lwip/timeouts.h"
+#include "ethptp.h"
+#include "extint.h"
+#include "syslog.h"
+#include "shell.h"
+#include "evcapture.h"
+
+// EVENT CAPTURE
+// Any GPIO pin can be captured through its EXTI line. The interrupt reads the
+// PTP clock on entry and queues a record with the time of the edge. The fixed
+// delay between the edge and the clock read is removed from each record. It is
+// calibrated by looping the PG8 hardware PPS output into a captured pin, since
+// those edges fall exactly on the PTP second.
+//
+// Records are consumed either by the application with evcapture_get() or by the
+// network export, which sends them as UDP datagrams of 16 byte big-endian records:
+//   uint32_t seq, uint8_t port, uint8_t pin, uint16_t flags, int32_t sec, int32_t nsec
+
+// Capture queue size. Must be a power of two.
+#define EVCAPTURE_QUEUE_SIZE        64
+#define EVCAPTURE_QUEUE_MASK        (EVCAPTURE_QUEUE_SIZE - 1)
+
+// Export polling period and the records sent per datagram.
+#define EVCAPTURE_EXPORT_MS         10
+#define EVCAPTURE_EXPORT_RECORDS    32
+#define EVCAPTURE_RECORD_LENGTH     16
+
+// Default number of edges averaged by calibration.
+#define EVCAPTURE_CALIBRATE_COUNT   16
+
+// Marks a pin that is not captured.
+#define EVCAPTURE_NONE              0xff
+
+// GPIO ports selectable as EXTI sources.
+static GPIO_TypeDef * const evcapture_gpios[] =
+{
+  GPIOA, GPIOB, GPIOC, GPIOD, GPIOE, GPIOF, GPIOG, GPIOH, GPIOI, GPIOJ, GPIOK
+};
+
+#define EVCAPTURE_PORT_COUNT        (sizeof(evcapture_gpios) / sizeof(evcapture_gpios[0]))
+
+// EXTI source selection for each pin.
+static const uint32_t evcapture_syscfg_lines[EXTINT_COUNT] =
+{
+  LL_SYSCFG_EXTI_LINE0,
+  LL_SYSCFG_EXTI_LINE1,
+  LL_SYSCFG_EXTI_LINE2,
+  LL_SYSCFG_EXTI_LINE3,
+  LL_SYSCFG_EXTI_LINE4,
+  LL_SYSCFG_EXTI_LINE5,
+  LL_SYSCFG_EXTI_LINE6,
+  LL_SYSCFG_EXTI_LINE7,
+  LL_SYSCFG_EXTI_LINE8,
+  LL_SYSCFG_EXTI_LINE9,
+  LL_SYSCFG_EXTI_LINE10,
+  LL_SYSCFG_EXTI_LINE11,
+  LL_SYSCFG_EXTI_LINE12,
+  LL_SYSCFG_EXTI_LINE13,
+  LL_SYSCFG_EXTI_LINE14,
+  LL_SYSCFG_EXTI_LINE15
+};
+
+// Port captured on each pin and the edges captured.
+static uint8_t evcapture_ports[EXTINT_COUNT];
+static uint8_t evcapture_edges[EXTINT_COUNT];
+
+// Capture queue. The head is only written by the EXTI interrupts, which share
+// a single priority, and the tail only by the consumer.
+static evcapture_record_t evcapture_queue[EVCAPTURE_QUEUE_SIZE];
+static volatile uint32_t evcapture_head = 0;
+static volatile uint32_t evcapture_tail = 0;
+static uint32_t evcapture_seq = 0;
+
+// Capture statistics.
+static evcapture_stats_t evcapture_stats;
+
+// Interrupt entry latency removed from each record.
+static volatile int32_t evcapture_latency_ns = 0;
+
+// Calibration state.
+static volatile uint8_t evcapture_cal_pin = EVCAPTURE_NONE;
+static uint32_t evcapture_cal_target = 0;
+static uint32_t evcapture_cal_count = 0;
+static int64_t evcapture_cal_sum = 0;
+
+// Network export state. Only accessed in the tcpip thread apart from the
+// requested destination which is handed over from the caller.
+static struct udp_pcb *evcapture_pcb = NULL;
+static ip4_addr_t evcapture_export_addr;
+static uint16_t evcapture_export_port = 0;
+static bool evcapture_export_active = false;
+static ip4_addr_t evcapture_request_addr;
+static uint16_t evcapture_request_port = 0;
+
+// EXTI interrupt for a captured pin.
+static void evcapture_extint_handler(uint32_t extint_line, void *arg)
+{
+  ptptime_t now;
+  uint32_t pin = (uint32_t) arg;
+  uint32_t head;
+  uint32_t used;
+  evcapture_record_t *record;
+
+  UNUSED(extint_line);
+
+  // Read the clock first so the latency stays short and constant.
+  ethptp_get_time(&now);
+
+  // Calibration edges are at the PTP second, so the raw offset from the nearest
+  // second is the latency.
+  if (pin == evcapture_cal_pin)
+  {
+    evcapture_cal_sum += (now.tv_nsec < 500000000) ? now.tv_nsec : now.tv_nsec - 1000000000;
+    evcapture_cal_count += 1;
+    if (evcapture_cal_count >= evcapture_cal_target)
+    {
+      evcapture_latency_ns = (int32_t) (evcapture_cal_sum / evcapture_cal_count);
+      evcapture_cal_pin = EVCAPTURE_NONE;
+    }
+  }
+
+  // Remove the latency.
+  now.tv_nsec -= evcapture_latency_ns;
+  if (now.tv_nsec < 0)
+  {
+    now.tv_nsec += 1000000000;
+    now.tv_sec -= 1;
+  }
+  else if (now.tv_nsec >= 1000000000)
+  {
+    now.tv_nsec -= 1000000000;
+    now.tv_sec += 1;
+  }
+
+  evcapture_stats.captured += 1;
+
+  // Drop the record if the queue is full.
+  head = evcapture_head;
+  used = head - evcapture_tail;
+  if (used >= EVCAPTURE_QUEUE_SIZE)
+  {
+    evcapture_stats.dropped += 1;
+    return;
+  }
+
+  record = &evcapture_queue[head & EVCAPTURE_QUEUE_MASK];
+  record->seq = evcapture_seq++;
+  record->port = evcapture_ports[pin];
+  record->pin = (uint8_t) pin;
+  record->flags = LL_GPIO_IsInputPinSet(evcapture_gpios[record->port], 1UL << pin) ? EVCAPTURE_FLAG_LEVEL : 0;
+  record->tv_sec = now.tv_sec;
+  record->tv_nsec = now.tv_nsec;
+
+  // Publish the record after it is written.
+  __DMB();
+  evcapture_head = head + 1;
+
+  if ((used + 1) > evcapture_stats.high_water) evcapture_stats.high_water = used + 1;
+}
+
+// Capture the edges of a GPIO pin. The port index is 0 for GPIOA. Only one
+// port can be captured on each pin number as they share the EXTI line.
+bool evcapture_enable(uint8_t port, uint8_t pin, uint8_t edges)
+{
+  LL_GPIO_InitTypeDef gpio_init;
+  LL_EXTI_InitTypeDef exti_init;
+
+  // Sanity check the arguments.
+  if ((port >= EVCAPTURE_PORT_COUNT) || (pin >= EXTINT_COUNT) || !(edges & EVCAPTURE_EDGE_BOTH)) return false;
+
+  // Release the line from any previous capture.
+  evcapture_disable(pin);
+
+  // Enable GPIO peripheral clock. The AHB1 enable bits follow the port order.
+  LL_AHB1_GRP1_EnableClock(LL_AHB1_GRP1_PERIPH_GPIOA << port);
+
+  // Configure the pin as an input.
+  LL_GPIO_StructInit(&gpio_init);
+  gpio_init.Pin = 1UL << pin;
+  gpio_init.Mode = LL_GPIO_MODE_INPUT;
+  gpio_init.Pull = LL_GPIO_PULL_NO;
+  LL_GPIO_Init(evcapture_gpios[port], &gpio_init);
+
+  // Set the callback before the line is enabled.
+  evcapture_ports[pin] = port;
+  evcapture_edges[pin] = edges;
+  extint_set_callback_with_arg(1UL << pin, evcapture_extint_handler, (void *) (uint32_t) pin);
+
+  // Route the port to the EXTI line.
+  LL_SYSCFG_SetEXTISource((uint32_t) port, evcapture_syscfg_lines[pin]);
+
+  // Enable the EXTI line for the requested edges.
+  LL_EXTI_StructInit(&exti_init);
+  exti_init.Line_0_31 = 1UL << pin;
+  exti_init.Mode = LL_EXTI_MODE_IT;
+  exti_init.Trigger = (edges == EVCAPTURE_EDGE_BOTH) ? LL_EXTI_TRIGGER_RISING_FALLING :
+                      (edges == EVCAPTURE_EDGE_RISING) ? LL_EXTI_TRIGGER_RISING : LL_EXTI_TRIGGER_FALLING;
+  exti_init.LineCommand = ENABLE;
+  LL_EXTI_Init(&exti_init);
+
+  return true;
+}
+
+// Stop capturing a pin.
+void evcapture_disable(uint8_t pin)
+{
+  if (pin >= EXTINT_COUNT) return;
+
+  // Disable the EXTI line and clear any pending edge.
+  LL_EXTI_DisableIT_0_31(1UL << pin);
+  LL_EXTI_DisableRisingTrig_0_31(1UL << pin);
+  LL_EXTI_DisableFallingTrig_0_31(1UL << pin);
+  LL_EXTI_ClearFlag_0_31(1UL << pin);
+  extint_set_callback_with_arg(1UL << pin, NULL, NULL);
+
+  if (evcapture_cal_pin == pin) evcapture_cal_pin = EVCAPTURE_NONE;
+  evcapture_ports[pin] = EVCAPTURE_NONE;
+  evcapture_edges[pin] = 0;
+}
+
+// Get the next captured event. Returns false if there are none. Must not be
+// called while the records are exported.
+bool evcapture_get(evcapture_record_t *record)
+{
+  uint32_t tail = evcapture_tail;
+
+  if (tail == evcapture_head) return false;
+
+  // Read the record after the head that published it.
+  __DMB();
+  *record = evcapture_queue[tail & EVCAPTURE_QUEUE_MASK];
+  __DMB();
+  evcapture_tail = tail + 1;
+
+  return true;
+}
+
+// Set the interrupt entry latency removed from each record.
+void evcapture_set_latency(int32_t latency_ns)
+{
+  evcapture_latency_ns = latency_ns;
+}
+
+// Get the interrupt entry latency removed from each record.
+int32_t evcapture_get_latency(void)
+{
+  return evcapture_latency_ns;
+}
+
+// Calibrate the latency from the edges of a PTP second aligned pulse on a
+// captured pin. The latency is updated once the edges have been averaged.
+void evcapture_calibrate(uint8_t pin, uint32_t count)
+{
+  // Stop any calibration in progress.
+  evcapture_cal_pin = EVCAPTURE_NONE;
+  __DMB();
+
+  evcapture_cal_target = count ? count : EVCAPTURE_CALIBRATE_COUNT;
+  evcapture_cal_count = 0;
+  evcapture_cal_sum = 0;
+  __DMB();
+
+  if (pin < EXTINT_COUNT) evcapture_cal_pin = pin;
+}
+
+// Get the capture statistics.
+void evcapture_get_stats(evcapture_stats_t *stats)
+{
+  *stats = evcapture_stats;
+}
+
+// Store a big-endian 32 bit value.
+static uint8_t *evcapture_store32(uint8_t *buf, uint32_t value)
+{
+  buf[0] = (uint8_t) (value >> 24);
+  buf[1] = (uint8_t) (value >> 16);
+  buf[2] = (uint8_t) (value >> 8);
+  buf[3] = (uint8_t) value;
+  return buf + 4;
+}
+
+// Send the queued records. Called periodically in the tcpip thread.
+static void evcapture_export_timeout(void *arg)
+{
+  struct pbuf *p;
+  uint8_t *buf;
+  uint32_t count;
+  evcapture_record_t record;
+
+  UNUSED(arg);
+
+  // Stop polling if export was turned off.
+  if (!evcapture_export_port)
+  {
+    evcapture_export_active = false;
+    return;
+  }
+
+  while (evcapture_head != evcapture_tail)
+  {
+    // Size the datagram to the records waiting.
+    count = evcapture_head - evcapture_tail;
+    if (count > EVCAPTURE_EXPORT_RECORDS) count = EVCAPTURE_EXPORT_RECORDS;
+
+    // Leave the records queued until a buffer is available.
+    p = pbuf_alloc(PBUF_TRANSPORT, (u16_t) (count * EVCAPTURE_RECORD_LENGTH), PBUF_RAM);
+    if (p == NULL) break;
+
+    buf = (uint8_t *) p->payload;
+    while (count && evcapture_get(&record))
+    {
+      buf = evcapture_store32(buf, record.seq);
+      *buf++ = record.port;
+      *buf++ = record.pin;
+      *buf++ = (uint8_t) (record.flags >> 8);
+      *buf++ = (uint8_t) record.flags;
+      buf = evcapture_store32(buf, (uint32_t) record.tv_sec);
+      buf = evcapture_store32(buf, (uint32_t) record.tv_nsec);
+      evcapture_stats.exported += 1;
+      count -= 1;
+    }
+
+    udp_sendto(evcapture_pcb, p, &evcapture_export_addr, evcapture_export_port);
+    pbuf_free(p);
+  }
+
+  sys_timeout(EVCAPTURE_EXPORT_MS, evcapture_export_timeout, NULL);
+}
+
+// Apply the requested export destination within the tcpip thread.
+static void evcapture_export_callback(void *arg)
+{
+  UNUSED(arg);
+
+  // Create the pcb on first use.
+  if ((evcapture_pcb == NULL) && ((evcapture_pcb = udp_new()) == NULL))
+  {
+    syslog_printf(SYSLOG_ERROR, "EVCAPTURE: cannot create export pcb");
+    return;
+  }
+
+  evcapture_export_addr = evcapture_request_addr;
+  evcapture_export_port = evcapture_request_port;
+
+  // Start polling the queue. A stopped export ends at the next poll.
+  if (evcapture_export_port && !evcapture_export_active)
+  {
+    evcapture_export_active = true;
+    sys_timeout(EVCAPTURE_EXPORT_MS, evcapture_export_timeout, NULL);
+  }
+}
+
+// Export the records to a UDP address and port. A null address or a zero port
+// stops the export and leaves the records to evcapture_get().
+bool evcapture_export(const char *address, uint16_t port)
+{
+  ip4_addr_t addr;
+
+  ip4_addr_set_zero(&addr);
+  if (address && port && !ip4addr_aton(address, &addr)) return false;
+
+  evcapture_request_addr = addr;
+  evcapture_request_port = address ? port : 0;
+
+  return tcpip_callback(evcapture_export_callback, NULL) == ERR_OK;
+}
+
+// Parse a pin name such as "PD12" into its port index and pin number.
+static bool evcapture_parse_pin(const char *name, uint8_t *port, uint8_t *pin)
+{
+  char *end;
+  long number;
+
+  if ((*name == 'P') || (*name == 'p')) ++name;
+  if ((*name >= 'a') && (*name <= 'z')) *port = (uint8_t) (*name - 'a');
+  else *port = (uint8_t) (*name - 'A');
+  if (*port >= EVCAPTURE_PORT_COUNT) return false;
+
+  number = strtol(name + 1, &end, 10);
+  if ((end == name + 1) || *end || (number < 0) || (number >= EXTINT_COUNT)) return false;
+  *pin = (uint8_t) number;
+
+  return true;
+}
+
+// Event capture shell functionality.
+static bool evcapture_shell_command(int argc, char **argv)
+{
+  bool needs_help = false;
+  uint8_t port;
+  uint8_t pin;
+  uint32_t index;
+  evcapture_stats_t stats;
+  evcapture_record_t record;
+
+  // Parse the command.
+  if (argc > 1)
+  {
+    if (!strcasecmp(argv[1], "enable") && (argc > 2) && evcapture_parse_pin(argv[2], &port, &pin))
+    {
+      uint8_t edges = EVCAPTURE_EDGE_RISING;
+
+      // Get the edges to capture.
+      if (argc > 3)
+      {
+        if (!strcasecmp(argv[3], "falling")) edges = EVCAPTURE_EDGE_FALLING;
+        else if (!strcasecmp(argv[3], "both")) edges = EVCAPTURE_EDGE_BOTH;
+        else if (strcasecmp(argv[3], "rising")) needs_help = true;
+      }
+
+      if (!needs_help) evcapture_enable(port, pin, edges);
+    }
+    else if (!strcasecmp(argv[1], "disable") && (argc > 2) && evcapture_parse_pin(argv[2], &port, &pin))
+    {
+      evcapture_disable(pin);
+    }
+    else if (!strcasecmp(argv[1], "latency") && (argc > 2))
+    {
+      evcapture_set_latency((int32_t) strtol(argv[2], NULL, 0));
+    }
+    else if (!strcasecmp(argv[1], "calibrate") && (argc > 2) && evcapture_parse_pin(argv[2], &port, &pin))
+    {
+      evcapture_calibrate(pin, (argc > 3) ? (uint32_t) strtol(argv[3], NULL, 0) : 0);
+      shell_puts("calibrating from PTP second edges\n");
+    }
+    else if (!strcasecmp(argv[1], "export") && (argc > 2))
+    {
+      if (!strcasecmp(argv[2], "off"))
+      {
+        evcapture_export(NULL, 0);
+      }
+      else
+      {
+        uint16_t udp_port = (argc > 3) ? (uint16_t) strtol(argv[3], NULL, 0) : 0;
+        if (!udp_port || !evcapture_export(argv[2], udp_port)) needs_help = true;
+      }
+    }
+    else if (!strcasecmp(argv[1], "read"))
+    {
+      // The export consumes the records while it is running.
+      if (evcapture_request_port)
+      {
+        shell_puts("records are being exported\n");
+        return true;
+      }
+
+      // Print the queued records.
+      while (evcapture_get(&record))
+      {
+        shell_printf("%u: P%c%u %s %d.%09d\n", (unsigned) record.seq,
+                     'A' + record.port, (unsigned) record.pin,
+                     (record.flags & EVCAPTURE_FLAG_LEVEL) ? "high" : "low",
+                     (int) record.tv_sec, (int) record.tv_nsec);
+      }
+      return true;
+    }
+    else
+    {
+      needs_help = true;
+    }
+  }
+
+  // Print help.
+  if (needs_help)
+  {
+    shell_puts("Usage:\n");
+    shell_printf("    %s [enable <pin> [rising|falling|both]|disable <pin>]\n", argv[0]);
+    shell_printf("    %s [latency <ns>|calibrate <pin> [edges]]\n", argv[0]);
+    shell_printf("    %s [export <address> <port>|export off|read]\n", argv[0]);
+    return true;
+  }
+
+  // Show the captured pins.
+  for (index = 0; index < EXTINT_COUNT; ++index)
+  {
+    if (evcapture_ports[index] == EVCAPTURE_NONE) continue;
+    shell_printf("P%c%u: %s\n", 'A' + evcapture_ports[index], (unsigned) index,
+                 (evcapture_edges[index] == EVCAPTURE_EDGE_BOTH) ? "both" :
+                 (evcapture_edges[index] == EVCAPTURE_EDGE_RISING) ? "rising" : "falling");
+  }
+
+  // Show the latency and statistics.
+  evcapture_get_stats(&stats);
+  shell_printf("latency: %d nsec%s\n", (int) evcapture_get_latency(),
+               (evcapture_cal_pin != EVCAPTURE_NONE) ? " (calibrating)" : "");
+  shell_printf("events: %u captured, %u dropped, %u exported, %u queued, %u high water\n",
+               (unsigned) stats.captured, (unsigned) stats.dropped, (unsigned) stats.exported,
+               (unsigned) (evcapture_head - evcapture_tail), (unsigned) stats.high_water);
+  if (evcapture_request_port)
+  {
+    shell_printf("export: %s:%u\n", ip4addr_ntoa(&evcapture_request_addr), (unsigned) evcapture_request_port);
+  }
+
+  return true;
+}
+
+// Initialize event capture. Pins are captured once enabled.
+void evcapture_init(void)
+{
+  // No pins are captured yet.
+  memset(evcapture_ports, EVCAPTURE_NONE, sizeof(evcapture_ports));
+  memset(&evcapture_stats, 0, sizeof(evcapture_stats));
+
+  // Use the configured latency until calibrated.
+  evcapture_latency_ns = evcapture_config_latency();
+
+  // Initialize the shell command.
+  shell_add_command("evcap", evcapture_shell_command);
+}
+
+// System configurable interrupt entry latency in nanoseconds.
+__WEAK int32_t evcapture_config_latency(void)
+{
+  return 0;
+}
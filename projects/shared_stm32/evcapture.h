@@ -0,0 +1,59 @@
+#ifndef __EVCAPTURE_H__
+#define __EVCAPTURE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Edges captured on an input.
+#define EVCAPTURE_EDGE_RISING     0x01
+#define EVCAPTURE_EDGE_FALLING    0x02
+#define EVCAPTURE_EDGE_BOTH       (EVCAPTURE_EDGE_RISING | EVCAPTURE_EDGE_FALLING)
+
+// Record flags.
+#define EVCAPTURE_FLAG_LEVEL      0x01
+
+// A captured event. The time is the PTP time of the edge with the interrupt
+// entry latency removed. The level flag holds the input level read in the
+// interrupt, so it tells rising from falling edges unless the pulse is shorter
+// than the interrupt latency.
+typedef struct evcapture_record_s
+{
+  uint32_t seq;
+  uint8_t port;
+  uint8_t pin;
+  uint16_t flags;
+  int32_t tv_sec;
+  int32_t tv_nsec;
+} evcapture_record_t;
+
+// Capture statistics.
+typedef struct evcapture_stats_s
+{
+  uint32_t captured;
+  uint32_t dropped;
+  uint32_t exported;
+  uint32_t high_water;
+} evcapture_stats_t;
+
+void evcapture_init(void);
+bool evcapture_enable(uint8_t port, uint8_t pin, uint8_t edges);
+void evcapture_disable(uint8_t pin);
+bool evcapture_get(evcapture_record_t *record);
+void evcapture_set_latency(int32_t latency_ns);
+int32_t evcapture_get_latency(void);
+void evcapture_calibrate(uint8_t pin, uint32_t count);
+bool evcapture_export(const char *address, uint16_t port);
+void evcapture_get_stats(evcapture_stats_t *stats);
+
+// System configurable functions. Implemented as weak functions.
+int32_t evcapture_config_latency(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // __EVCAPTURE_H__
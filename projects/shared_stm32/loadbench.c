@@ -0,0 +1,512 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "cmsis_os2.h"
+#include "hal_system.h"
+#include "lwip/udp.h"
+#include "lwip/tcpip.h"
+#include "lwip/timeouts.h"
+#include "lwip/apps/lwiperf.h"
+#include "ptpd.h"
+#include "ethernetif.h"
+#include "tick.h"
+#include "syslog.h"
+#include "shell.h"
+#include "loadbench.h"
+
+// LOAD BENCHMARK
+// Measures how well the PTP clock holds while the node carries background
+// traffic. A run steps through load levels: idle, UDP at each configured rate
+// and TCP at the full rate of the lwiperf client. For each level the offset
+// from master, PTP receive queue drops, transmit timestamps lost and CPU idle
+// time are recorded.
+//
+// The peer is a stock iperf2 on a host, "iperf -s -u" for the UDP levels and
+// "iperf -s" for the TCP level. The UDP datagrams carry the iperf2 header so
+// the peer reports the rate and loss it saw. Receive load is generated from
+// the host with "iperf -c" against the lwiperf TCP server.
+//
+// All traffic is generated from timeouts in the tcpip thread.
+
+// UDP datagram length and the iperf2 header at its start.
+#define LOADBENCH_UDP_PORT          5001
+#define LOADBENCH_DATAGRAM_LENGTH   1470
+#define LOADBENCH_HEADER_LENGTH     12
+
+// UDP pacing period and the most datagrams sent in one period.
+#define LOADBENCH_TICK_MS           1
+#define LOADBENCH_BURST             8
+
+// Sampling period of the PTP statistics.
+#define LOADBENCH_SAMPLE_MS         1000
+
+// Offsets are clipped to a second.
+#define LOADBENCH_OFFSET_LIMIT      1000000000
+
+#if !defined LOADBENCH_LEVEL_SECONDS
+// Default duration of each load level.
+#define LOADBENCH_LEVEL_SECONDS     60
+#endif
+
+// Default UDP load levels.
+static const uint32_t loadbench_default_rates[] = { 1000, 5000, 10000, 25000, 50000 };
+
+// Payload following the iperf2 header. Referenced by every datagram.
+static const uint8_t loadbench_payload[LOADBENCH_DATAGRAM_LENGTH - LOADBENCH_HEADER_LENGTH];
+
+// Levels of the run and their results.
+static loadbench_result_t loadbench_results[LOADBENCH_LEVEL_COUNT];
+static volatile uint32_t loadbench_level_count = 0;
+static volatile uint32_t loadbench_level = 0;
+static volatile bool loadbench_running = false;
+
+// Run requested from the shell.
+static ip4_addr_t loadbench_request_addr;
+static uint32_t loadbench_request_seconds;
+
+// Run state. Only accessed in the tcpip thread.
+static ip_addr_t loadbench_addr;
+static uint32_t loadbench_seconds;
+static uint32_t loadbench_elapsed;
+static struct udp_pcb *loadbench_pcb = NULL;
+static void *loadbench_tcp_session = NULL;
+static void *loadbench_server_session = NULL;
+static int32_t loadbench_udp_id;
+static uint32_t loadbench_udp_credit;
+static uint32_t loadbench_udp_last;
+static uint64_t loadbench_sent_bytes;
+static uint32_t loadbench_sent_ms;
+
+// Samples of the level.
+static ptpd_stats_t loadbench_start_stats;
+static uint32_t loadbench_start_tx_drops;
+static uint32_t loadbench_start_rx_drops;
+static uint32_t loadbench_servo_updates;
+static int64_t loadbench_offset_sum;
+static double loadbench_offset_sumsq;
+static uint32_t loadbench_idle_sum;
+
+static void loadbench_tcp_report(void *arg, enum lwiperf_report_type report_type,
+                                 const ip_addr_t *local_addr, u16_t local_port,
+                                 const ip_addr_t *remote_addr, u16_t remote_port,
+                                 u32_t bytes_transferred, u32_t ms_duration, u32_t bandwidth_kbitpsec);
+
+// Store a big-endian 32 bit value.
+static uint8_t *loadbench_store32(uint8_t *buf, uint32_t value)
+{
+  buf[0] = (uint8_t) (value >> 24);
+  buf[1] = (uint8_t) (value >> 16);
+  buf[2] = (uint8_t) (value >> 8);
+  buf[3] = (uint8_t) value;
+  return buf + 4;
+}
+
+// Total of the receive drops counted by the Ethernet interface.
+static uint32_t loadbench_rx_drops(void)
+{
+  uint32_t no_buffer, missed, overflow;
+
+  ethernetif_drops(&no_buffer, &missed, &overflow);
+
+  return no_buffer + missed + overflow;
+}
+
+// Send a UDP datagram with the iperf2 header. A negative id ends the stream.
+static err_t loadbench_udp_send(int32_t id)
+{
+  err_t err;
+  uint8_t *buf;
+  struct pbuf *p;
+  struct pbuf *q;
+  uint32_t now = sys_now();
+
+  // Only the header is allocated. The payload references the constant buffer.
+  p = pbuf_alloc(PBUF_TRANSPORT, LOADBENCH_HEADER_LENGTH, PBUF_RAM);
+  if (p == NULL) return ERR_MEM;
+  q = pbuf_alloc(PBUF_RAW, sizeof(loadbench_payload), PBUF_REF);
+  if (q == NULL)
+  {
+    pbuf_free(p);
+    return ERR_MEM;
+  }
+  q->payload = (void *) loadbench_payload;
+  pbuf_cat(p, q);
+
+  buf = (uint8_t *) p->payload;
+  buf = loadbench_store32(buf, (uint32_t) id);
+  buf = loadbench_store32(buf, now / 1000u);
+  loadbench_store32(buf, (now % 1000u) * 1000u);
+
+  err = udp_sendto(loadbench_pcb, p, &loadbench_addr, LOADBENCH_UDP_PORT);
+  pbuf_free(p);
+
+  return err;
+}
+
+// Send the datagrams due at the rate of the level. Called periodically in
+// the tcpip thread.
+static void loadbench_udp_timeout(void *arg)
+{
+  uint32_t now = sys_now();
+  uint32_t rate_kbps = loadbench_results[loadbench_level].rate_kbps;
+
+  UNUSED(arg);
+
+  // A rate in kbit/s is an eighth of the rate in bytes per millisecond.
+  loadbench_udp_credit += ((now - loadbench_udp_last) * rate_kbps) / 8u;
+  loadbench_udp_last = now;
+  if (loadbench_udp_credit > (LOADBENCH_BURST * LOADBENCH_DATAGRAM_LENGTH))
+    loadbench_udp_credit = LOADBENCH_BURST * LOADBENCH_DATAGRAM_LENGTH;
+
+  while (loadbench_udp_credit >= LOADBENCH_DATAGRAM_LENGTH)
+  {
+    // Give up the credit when the interface cannot keep up.
+    if (loadbench_udp_send(loadbench_udp_id) != ERR_OK)
+    {
+      loadbench_udp_credit = 0;
+      break;
+    }
+    loadbench_udp_id += 1;
+    loadbench_udp_credit -= LOADBENCH_DATAGRAM_LENGTH;
+    loadbench_sent_bytes += LOADBENCH_DATAGRAM_LENGTH;
+  }
+
+  sys_timeout(LOADBENCH_TICK_MS, loadbench_udp_timeout, NULL);
+}
+
+// Start a TCP client session to the peer.
+static void loadbench_tcp_start(void *arg)
+{
+  UNUSED(arg);
+
+  loadbench_tcp_session = lwiperf_start_tcp_client_default(&loadbench_addr, loadbench_tcp_report, NULL);
+  if (loadbench_tcp_session == NULL) syslog_printf(SYSLOG_ERROR, "LOADBENCH: cannot start TCP client");
+}
+
+// Called by lwiperf as a session ends. Client sessions run for ten seconds
+// and are restarted until the level is over.
+static void loadbench_tcp_report(void *arg, enum lwiperf_report_type report_type,
+                                 const ip_addr_t *local_addr, u16_t local_port,
+                                 const ip_addr_t *remote_addr, u16_t remote_port,
+                                 u32_t bytes_transferred, u32_t ms_duration, u32_t bandwidth_kbitpsec)
+{
+  UNUSED(arg);
+
+  loadbench_tcp_session = NULL;
+  loadbench_sent_bytes += bytes_transferred;
+  loadbench_sent_ms += ms_duration;
+
+  // Restart outside of the lwiperf callback.
+  if (loadbench_running && (loadbench_elapsed < loadbench_seconds))
+    sys_timeout(10, loadbench_tcp_start, NULL);
+}
+
+// Begin the current level.
+static void loadbench_level_start(void)
+{
+  loadbench_result_t *result = &loadbench_results[loadbench_level];
+
+  // Counts at the start of the level.
+  ptpd_get_stats(&loadbench_start_stats);
+  loadbench_start_tx_drops = ethernetif_get_tx_completion_drops();
+  loadbench_start_rx_drops = loadbench_rx_drops();
+  loadbench_servo_updates = loadbench_start_stats.servo_updates;
+
+  loadbench_elapsed = 0;
+  loadbench_offset_sum = 0;
+  loadbench_offset_sumsq = 0.0;
+  loadbench_idle_sum = 0;
+  loadbench_sent_bytes = 0;
+  loadbench_sent_ms = 0;
+
+  if (result->load == LOADBENCH_LOAD_UDP)
+  {
+    loadbench_udp_id = 0;
+    loadbench_udp_credit = 0;
+    loadbench_udp_last = sys_now();
+    sys_timeout(LOADBENCH_TICK_MS, loadbench_udp_timeout, NULL);
+  }
+  else if (result->load == LOADBENCH_LOAD_TCP)
+  {
+    loadbench_tcp_start(NULL);
+  }
+}
+
+// End the current level and record its result.
+static void loadbench_level_end(void)
+{
+  ptpd_stats_t stats;
+  loadbench_result_t *result = &loadbench_results[loadbench_level];
+
+  // No TCP session is restarted after the level.
+  sys_untimeout(loadbench_tcp_start, NULL);
+
+  if (result->load == LOADBENCH_LOAD_UDP)
+  {
+    // Stop sending and tell the peer the stream is over.
+    sys_untimeout(loadbench_udp_timeout, NULL);
+    loadbench_udp_send(-loadbench_udp_id);
+    loadbench_sent_ms = loadbench_elapsed * 1000u;
+  }
+
+  ptpd_get_stats(&stats);
+  result->sent_kbps = loadbench_sent_ms ? (uint32_t) ((loadbench_sent_bytes * 8u) / loadbench_sent_ms) : 0;
+  if (result->samples)
+  {
+    result->offset_mean = (int32_t) (loadbench_offset_sum / result->samples);
+    result->offset_rms = (uint32_t) sqrt(loadbench_offset_sumsq / result->samples);
+  }
+  result->queue_drops = (stats.event_drops + stats.general_drops) -
+                        (loadbench_start_stats.event_drops + loadbench_start_stats.general_drops);
+  result->tx_timestamp_timeouts = stats.tx_timestamp_timeouts - loadbench_start_stats.tx_timestamp_timeouts;
+  result->tx_timestamp_drops = ethernetif_get_tx_completion_drops() - loadbench_start_tx_drops;
+  result->rx_drops = loadbench_rx_drops() - loadbench_start_rx_drops;
+  result->idle_percent = loadbench_elapsed ? loadbench_idle_sum / loadbench_elapsed : 0;
+}
+
+// Sample the PTP statistics. Called periodically in the tcpip thread.
+static void loadbench_sample_timeout(void *arg)
+{
+  int32_t offset;
+  ptpd_stats_t stats;
+  loadbench_result_t *result = &loadbench_results[loadbench_level];
+
+  UNUSED(arg);
+
+  // Take a sample of the offset if the servo has been updated.
+  ptpd_get_stats(&stats);
+  if (stats.servo_updates != loadbench_servo_updates)
+  {
+    loadbench_servo_updates = stats.servo_updates;
+    if (stats.offset_sec > 0) offset = LOADBENCH_OFFSET_LIMIT;
+    else if (stats.offset_sec < 0) offset = -LOADBENCH_OFFSET_LIMIT;
+    else offset = stats.offset_nsec;
+
+    if ((result->samples == 0) || (offset < result->offset_min)) result->offset_min = offset;
+    if ((result->samples == 0) || (offset > result->offset_max)) result->offset_max = offset;
+    loadbench_offset_sum += offset;
+    loadbench_offset_sumsq += (double) offset * (double) offset;
+    result->samples += 1;
+  }
+
+  loadbench_idle_sum += tick_get_percent_idle();
+  loadbench_elapsed += 1;
+
+  // The level ends once its time is up and any TCP session has finished.
+  if ((loadbench_elapsed >= loadbench_seconds) && (loadbench_tcp_session == NULL))
+  {
+    loadbench_level_end();
+    loadbench_level += 1;
+
+    if (loadbench_level >= loadbench_level_count)
+    {
+      loadbench_running = false;
+      syslog_printf(SYSLOG_INFO, "LOADBENCH: run complete");
+      return;
+    }
+
+    loadbench_level_start();
+  }
+
+  sys_timeout(LOADBENCH_SAMPLE_MS, loadbench_sample_timeout, NULL);
+}
+
+// Start the requested run within the tcpip thread.
+static void loadbench_run_callback(void *arg)
+{
+  UNUSED(arg);
+
+  // Create the pcb on first use.
+  if ((loadbench_pcb == NULL) && ((loadbench_pcb = udp_new()) == NULL))
+  {
+    syslog_printf(SYSLOG_ERROR, "LOADBENCH: cannot create pcb");
+    loadbench_running = false;
+    return;
+  }
+
+  ip_addr_copy_from_ip4(loadbench_addr, loadbench_request_addr);
+  loadbench_seconds = loadbench_request_seconds;
+  loadbench_level = 0;
+
+  loadbench_level_start();
+  sys_timeout(LOADBENCH_SAMPLE_MS, loadbench_sample_timeout, NULL);
+}
+
+// Stop the run within the tcpip thread. The level in progress is discarded.
+static void loadbench_stop_callback(void *arg)
+{
+  UNUSED(arg);
+
+  if (!loadbench_running) return;
+
+  sys_untimeout(loadbench_sample_timeout, NULL);
+  sys_untimeout(loadbench_udp_timeout, NULL);
+  sys_untimeout(loadbench_tcp_start, NULL);
+  loadbench_level_count = loadbench_level;
+  loadbench_running = false;
+
+  // A TCP session in progress finishes on its own.
+}
+
+// Called by lwiperf as a server session ends. The peer reports the receive load.
+static void loadbench_server_report(void *arg, enum lwiperf_report_type report_type,
+                                    const ip_addr_t *local_addr, u16_t local_port,
+                                    const ip_addr_t *remote_addr, u16_t remote_port,
+                                    u32_t bytes_transferred, u32_t ms_duration, u32_t bandwidth_kbitpsec)
+{
+  UNUSED(arg);
+}
+
+// Start the lwiperf TCP server within the tcpip thread.
+static void loadbench_server_callback(void *arg)
+{
+  UNUSED(arg);
+
+  if (loadbench_server_session != NULL) return;
+
+  loadbench_server_session = lwiperf_start_tcp_server_default(loadbench_server_report, NULL);
+  if (loadbench_server_session == NULL) syslog_printf(SYSLOG_ERROR, "LOADBENCH: cannot start TCP server");
+}
+
+// Run the benchmark against an iperf2 peer. Each level lasts the given seconds
+// and the UDP levels run at the given rates in kbit/s, or the default rates if
+// none are given.
+bool loadbench_run(const char *address, uint32_t seconds, const uint32_t *rates_kbps, uint32_t rate_count)
+{
+  uint32_t count = 0;
+
+  if (loadbench_running) return false;
+  if (!ip4addr_aton(address, &loadbench_request_addr)) return false;
+
+  if (rate_count == 0)
+  {
+    rates_kbps = loadbench_default_rates;
+    rate_count = sizeof(loadbench_default_rates) / sizeof(loadbench_default_rates[0]);
+  }
+  if (rate_count > (LOADBENCH_LEVEL_COUNT - 2)) rate_count = LOADBENCH_LEVEL_COUNT - 2;
+
+  // Idle, then each UDP rate, then TCP.
+  memset(loadbench_results, 0, sizeof(loadbench_results));
+  loadbench_results[count++].load = LOADBENCH_LOAD_IDLE;
+  for (uint32_t i = 0; i < rate_count; ++i)
+  {
+    loadbench_results[count].load = LOADBENCH_LOAD_UDP;
+    loadbench_results[count++].rate_kbps = rates_kbps[i];
+  }
+  loadbench_results[count++].load = LOADBENCH_LOAD_TCP;
+
+  loadbench_request_seconds = seconds ? seconds : LOADBENCH_LEVEL_SECONDS;
+  loadbench_level_count = count;
+  loadbench_level = 0;
+  loadbench_running = true;
+
+  if (tcpip_callback(loadbench_run_callback, NULL) != ERR_OK)
+  {
+    loadbench_running = false;
+    return false;
+  }
+
+  return true;
+}
+
+// Stop the benchmark. Completed levels keep their results.
+void loadbench_stop(void)
+{
+  tcpip_callback(loadbench_stop_callback, NULL);
+}
+
+// Start the lwiperf TCP server for receive load from the peer. The lwiperf
+// of this lwIP cannot close a server cleanly, so it runs until reset.
+bool loadbench_server(void)
+{
+  return tcpip_callback(loadbench_server_callback, NULL) == ERR_OK;
+}
+
+// Returns true while a run is in progress.
+bool loadbench_is_running(void)
+{
+  return loadbench_running;
+}
+
+// Get the results of the levels completed. Returns the number of levels.
+uint32_t loadbench_get_results(loadbench_result_t *results, uint32_t count)
+{
+  uint32_t completed = loadbench_running ? loadbench_level : loadbench_level_count;
+
+  if (count > completed) count = completed;
+  memcpy(results, loadbench_results, count * sizeof(loadbench_result_t));
+
+  return count;
+}
+
+// Load benchmark shell functionality.
+static bool loadbench_shell_command(int argc, char **argv)
+{
+  bool needs_help = false;
+  uint32_t rates[LOADBENCH_LEVEL_COUNT - 2];
+  uint32_t rate_count = 0;
+  loadbench_result_t results[LOADBENCH_LEVEL_COUNT];
+  uint32_t count;
+
+  // Parse the command.
+  if (argc > 1)
+  {
+    if (!strcasecmp(argv[1], "run") && (argc > 2))
+    {
+      for (int i = 4; (i < argc) && (rate_count < (LOADBENCH_LEVEL_COUNT - 2)); ++i)
+      {
+        rates[rate_count++] = (uint32_t) strtoul(argv[i], NULL, 0);
+      }
+      if (!loadbench_run(argv[2], (argc > 3) ? (uint32_t) strtoul(argv[3], NULL, 0) : 0, rates, rate_count))
+      {
+        shell_puts("cannot start benchmark\n");
+      }
+      return true;
+    }
+    else if (!strcasecmp(argv[1], "stop"))
+    {
+      loadbench_stop();
+      return true;
+    }
+    else if (!strcasecmp(argv[1], "server"))
+    {
+      if (!loadbench_server()) shell_puts("cannot start server\n");
+      return true;
+    }
+    needs_help = true;
+  }
+
+  // Print help.
+  if (needs_help)
+  {
+    shell_puts("Usage:\n");
+    shell_printf("    %s [run <host> [seconds [kbps ...]]|stop|server]\n", argv[0]);
+    return true;
+  }
+
+  // Print the results of the levels completed.
+  count = loadbench_get_results(results, LOADBENCH_LEVEL_COUNT);
+  shell_printf("benchmark: %s\n", loadbench_is_running() ? "running" : "stopped");
+  shell_puts("load   rate kbps  sent kbps  samples  mean ns   rms ns   min ns   max ns  qdrop  txto  txdrop  rxdrop  idle\n");
+  for (uint32_t i = 0; i < count; ++i)
+  {
+    const char *load = (results[i].load == LOADBENCH_LOAD_UDP) ? "udp" :
+                       (results[i].load == LOADBENCH_LOAD_TCP) ? "tcp" : "idle";
+    shell_printf("%-5s %10u %10u %8u %8d %8u %8d %8d %6u %5u %7u %7u %4u%%\n", load,
+                 (unsigned) results[i].rate_kbps, (unsigned) results[i].sent_kbps,
+                 (unsigned) results[i].samples, (int) results[i].offset_mean,
+                 (unsigned) results[i].offset_rms, (int) results[i].offset_min,
+                 (int) results[i].offset_max, (unsigned) results[i].queue_drops,
+                 (unsigned) results[i].tx_timestamp_timeouts, (unsigned) results[i].tx_timestamp_drops,
+                 (unsigned) results[i].rx_drops, (unsigned) results[i].idle_percent);
+  }
+
+  return true;
+}
+
+// Initialize the load benchmark.
+void loadbench_init(void)
+{
+  // Initialize the shell command.
+  shell_add_command("loadbench", loadbench_shell_command);
+}
@@ -0,0 +1,53 @@
+#ifndef __LOADBENCH_H__
+#define __LOADBENCH_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Maximum number of load levels in a run.
+#define LOADBENCH_LEVEL_COUNT     8
+
+// Traffic of a load level.
+typedef enum
+{
+  LOADBENCH_LOAD_IDLE = 0,
+  LOADBENCH_LOAD_UDP,
+  LOADBENCH_LOAD_TCP
+} loadbench_load_t;
+
+// Result of a load level. Offsets are in nanoseconds and sampled once a
+// second when the servo has been updated since the last sample. Counts are
+// the increase over the level.
+typedef struct loadbench_result_s
+{
+  uint8_t load;
+  uint32_t rate_kbps;
+  uint32_t sent_kbps;
+  uint32_t samples;
+  int32_t offset_mean;
+  uint32_t offset_rms;
+  int32_t offset_min;
+  int32_t offset_max;
+  uint32_t queue_drops;
+  uint32_t tx_timestamp_timeouts;
+  uint32_t tx_timestamp_drops;
+  uint32_t rx_drops;
+  uint32_t idle_percent;
+} loadbench_result_t;
+
+void loadbench_init(void);
+bool loadbench_run(const char *address, uint32_t seconds, const uint32_t *rates_kbps, uint32_t rate_count);
+void loadbench_stop(void);
+bool loadbench_server(void);
+bool loadbench_is_running(void);
+uint32_t loadbench_get_results(loadbench_result_t *results, uint32_t count);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // __LOADBENCH_H__
@@ -6,6 +6,7 @@
 #include "lwip/tcpip.h"
 #include "lwip/ethip6.h"
 #include "lwip/timeouts.h"
+#include "lwip/memp.h"
 #include "netif/ethernet.h"
 #include "netif/etharp.h"
 #include "delay.h"
@@ -15,6 +16,7 @@
 #include "hardtime.h"
 #include "network.h"
 #include "ethptp.h"
+#include "ptpprobe.h"
 #include "ethernetif.h"
 
 // Ethernet event flag values.
@@ -42,6 +44,51 @@
 #define ENET_ETHERNETL2 0x88F7U
 #define ENET_8021QVLAN 0x8100U
 #define ENET_FRAME_VLAN_TAGLEN 4U
+#define ENET_PTP1588_ETHL2_HEADER_OFFSET 0x0EU
+#define ENET_PTP1588_IPV6_HEADER_OFFSET 0x3EU
+#define ENET_PTP1588_SEQUENCEID_OFFSET 0x1EU
+#define ENET_IPV4_HEADER_LENGTH 20U
+#define ENET_UDP_HEADER_LENGTH 8U
+#define ENET_PTP1588_IPV4_FRAGMENT_OFFSET 0x14U
+#define ENET_PTP1588_IPV4_DESTINATION_OFFSET 0x1EU
+
+// Transmit timestamp tracking. Must be powers of 2.
+#define ETHERNETIF_TX_PENDING_SIZE 8U
+#define ETHERNETIF_TX_PENDING_MASK (ETHERNETIF_TX_PENDING_SIZE - 1U)
+#define ETHERNETIF_TX_COMPLETION_SIZE 8U
+#define ETHERNETIF_TX_COMPLETION_MASK (ETHERNETIF_TX_COMPLETION_SIZE - 1U)
+#endif
+
+// Receive frames directly into pbuf owned buffers rather than copying them
+// out of fixed DMA buffers.
+#if !defined ETHERNETIF_RX_ZERO_COPY
+#define ETHERNETIF_RX_ZERO_COPY 1
+#endif
+
+// Send pbufs that own their payload in place rather than copying them into
+// fixed DMA buffers.
+#if !defined ETHERNETIF_TX_ZERO_COPY
+#define ETHERNETIF_TX_ZERO_COPY 1
+#endif
+
+// Number of zero copy receive buffers. Buffers beyond those armed in the DMA
+// descriptors are held by the stack while received frames are processed.
+#if !defined ETHERNETIF_RX_BUFFERS
+#define ETHERNETIF_RX_BUFFERS (2 * ETH_RXBUFNB)
+#endif
+
+// Number of multicast MAC addresses tracked for the MAC filters. The first
+// three use the perfect address filters and the rest the hash table.
+#if !defined ETHERNETIF_MCAST_FILTER_SIZE
+#define ETHERNETIF_MCAST_FILTER_SIZE 16
+#endif
+
+// Receive interrupt coalescing. When non-zero the DMA does not interrupt on
+// each received frame but once this many microseconds after the first frame
+// of a batch, up to 255 * 256 HCLK cycles. Received frames carry hardware
+// timestamps so coalescing delays their processing but not their accuracy.
+#if !defined ETHERNETIF_RX_WATCHDOG_US
+#define ETHERNETIF_RX_WATCHDOG_US 0
 #endif
 
 // Macro to define section. On STM32F7 architectures we must be certain
@@ -66,12 +113,36 @@ __ALIGN_BEGIN ETH_DMADescTypeDef dma_rx_descriptor_table[ETH_RXBUFNB] __SECTION_
 // Ethernet transmit DMA descriptors.
 __ALIGN_BEGIN ETH_DMADescTypeDef dma_tx_descriptor_table[ETH_TXBUFNB] __SECTION_NAME("dtcm") __ALIGN_END;
 
+#if ETHERNETIF_RX_ZERO_COPY
+// Receive buffer owned either by a DMA descriptor or by a received pbuf. The DMA
+// writes the frame after the padding word so the buffer is a PBUF_RAW payload.
+typedef struct ethernetif_rx_buffer_s
+{
+  struct pbuf_custom pbuf;
+  uint8_t data[ETH_PAD_SIZE + ETH_RX_BUF_SIZE];
+} ethernetif_rx_buffer_t;
+
+// Ethernet receive buffers.
+LWIP_MEMPOOL_DECLARE(ETHERNETIF_RX_POOL, ETHERNETIF_RX_BUFFERS, sizeof(ethernetif_rx_buffer_t), "ethernetif rx");
+
+// Receive buffer armed in each receive DMA descriptor.
+static ethernetif_rx_buffer_t *ethernetif_rx_armed[ETH_RXBUFNB];
+#else
 // Ethernet receive buffers.
 __ALIGN_BEGIN uint8_t dma_rx_buffer[ETH_RXBUFNB][ETH_RX_BUF_SIZE] __SECTION_NAME("dtcm") __ALIGN_END;
+#endif
 
 // Ethernet transmit buffers.
 __ALIGN_BEGIN uint8_t dma_tx_buffer[ETH_TXBUFNB][ETH_TX_BUF_SIZE] __SECTION_NAME("dtcm") __ALIGN_END;
 
+// Transmit descriptors handed to the DMA and not yet reclaimed.
+static uint32_t ethernetif_tx_used = 0;
+
+#if ETHERNETIF_TX_ZERO_COPY
+// Frame referenced by the last descriptor of each frame sent in place.
+static struct pbuf *ethernetif_tx_pbufs[ETH_TXBUFNB];
+#endif
+
 // Ethernet mutex identifier.
 static osMutexId_t ethernetif_mutex_id = NULL;
 
@@ -93,28 +164,103 @@ static uint32_t ethernetif_recv_bytes = 0u;
 static uint32_t ethernetif_send_count = 0u;
 static uint32_t ethernetif_send_bytes = 0u;
 
+// Ethernet receive drop counts.
+static uint32_t ethernetif_drop_no_buffer = 0u;
+static uint32_t ethernetif_drop_missed = 0u;
+static uint32_t ethernetif_drop_overflow = 0u;
+
+#if LWIP_IGMP || (LWIP_IPV6 && LWIP_IPV6_MLD)
+// Multicast MAC address joined by the stack.
+typedef struct ethernetif_mcast_filter_s
+{
+  uint8_t hwaddr[ETH_HWADDR_LEN];
+  uint16_t users;
+} ethernetif_mcast_filter_t;
+
+// Multicast MAC addresses programmed into the MAC filters. Pass all multicast
+// is set when more addresses are joined than can be tracked.
+static ethernetif_mcast_filter_t ethernetif_mcast_filters[ETHERNETIF_MCAST_FILTER_SIZE];
+static uint32_t ethernetif_mcast_overflow = 0u;
+#endif
+
 // Ethernet interface handle.
 static ETH_HandleTypeDef ethernetif_handle;
 
 #if LWIP_PTPD
-// Ethernet TX entry for tracking timestamps.
-typedef struct ethernet_tx_entry_s
+// PTP event frame handed to the DMA and awaiting its transmit timestamp. Entries
+// are added by the transmit path and removed by the transmit complete interrupt.
+typedef struct ethernetif_tx_pending_s
 {
-  int32_t id;
+  uint32_t token;
   __IO ETH_DMADescTypeDef *tx_desc;
-} ethernet_tx_entry_t;
-static uint32_t ethernet_tx_head = 0;
-static uint32_t ethernet_tx_tail = 0;
-static ethernet_tx_entry_t ethernet_tx_entries[ETH_TXBUFNB];
+} ethernetif_tx_pending_t;
+static ethernetif_tx_pending_t ethernetif_tx_pending[ETHERNETIF_TX_PENDING_SIZE];
+static volatile uint32_t ethernetif_tx_pending_head = 0;
+static volatile uint32_t ethernetif_tx_pending_tail = 0;
+
+// Transmit timestamps harvested by the transmit complete interrupt and
+// consumed by the PTP thread.
+static ethernetif_tx_completion_t ethernetif_tx_completions[ETHERNETIF_TX_COMPLETION_SIZE];
+static volatile uint32_t ethernetif_tx_completion_head = 0;
+static volatile uint32_t ethernetif_tx_completion_tail = 0;
+static uint32_t ethernetif_tx_completion_drops = 0;
+
+// Called from interrupt context when transmit timestamps complete.
+static void (*ethernetif_tx_completion_callback)(void) = NULL;
+
+// Receives PTP messages from the fast path in the Ethernet thread.
+static ethernetif_ptp_input_t ethernetif_ptp_input_callback = NULL;
+static void *ethernetif_ptp_input_arg = NULL;
 #endif
 
 #if LWIP_PTPD
-// Conversion from hardware to PTP format.
-static uint32_t subsecond_to_nanosecond(uint32_t subsecond_value)
+// Move the timestamps of transmitted PTP event frames from the DMA descriptors
+// to the completion ring. Must not be preempted by itself, it is called from
+// the transmit complete interrupt or with the Ethernet interrupt disabled.
+static void ethernetif_tx_harvest(void)
 {
-  uint64_t val = subsecond_value * 1000000000ll;
-  val >>= 31;
-  return val;
+  bool completed = false;
+  uint32_t status;
+  uint32_t tail = ethernetif_tx_pending_tail;
+  uint32_t head;
+  ethernetif_tx_pending_t *pending;
+  ethernetif_tx_completion_t *completion;
+
+  while (tail != ethernetif_tx_pending_head)
+  {
+    pending = &ethernetif_tx_pending[tail & ETHERNETIF_TX_PENDING_MASK];
+
+    // Frames are sent in order so stop at the first one still owned by the DMA.
+    status = pending->tx_desc->Status;
+    if (status & ETH_DMATXDESC_OWN) break;
+
+    // Was the frame timestamped?
+    if (status & ETH_DMATXDESC_TTSS)
+    {
+      head = ethernetif_tx_completion_head;
+      if ((head - ethernetif_tx_completion_tail) < ETHERNETIF_TX_COMPLETION_SIZE)
+      {
+        completion = &ethernetif_tx_completions[head & ETHERNETIF_TX_COMPLETION_MASK];
+        completion->token = pending->token;
+        completion->time_sec = pending->tx_desc->TimeStampHigh;
+        completion->time_subsec = pending->tx_desc->TimeStampLow;
+        __DMB();
+        ethernetif_tx_completion_head = head + 1;
+        completed = true;
+      }
+      else
+      {
+        ethernetif_tx_completion_drops++;
+      }
+    }
+
+    tail += 1;
+  }
+
+  ethernetif_tx_pending_tail = tail;
+
+  // Notify the consumer of the new completions.
+  if (completed && ethernetif_tx_completion_callback) ethernetif_tx_completion_callback();
 }
 #endif
 
@@ -125,6 +271,14 @@ static uint32_t subsecond_to_nanosecond(uint32_t subsecond_value)
 // This function handles Ethernet global interrupt.
 void ETH_IRQHandler(void)
 {
+#if LWIP_PTPD
+  // Stamp the interrupt for the latency of received frames.
+  if (ETH->DMASR & ETH_DMASR_RS) ptpprobe_irq();
+#endif
+
+  // Handle the time stamp target time trigger.
+  if (ETH->MACSR & ETH_MACSR_TSTS) ethptp_target_time_irq();
+
   // Call the HAL Ethernet interrupt handler.
   HAL_ETH_IRQHandler(&ethernetif_handle);
 }
@@ -134,6 +288,10 @@ void HAL_ETH_RxCpltCallback(ETH_HandleTypeDef *eth_handle)
 {
   UNUSED(eth_handle);
 
+  // Mask further receive interrupts until the Ethernet thread has drained
+  // the ring, so a burst of frames raises a single interrupt.
+  ETH->DMAIER &= ~ETH_DMAIER_RIE;
+
   // Notify the Ethernet thread of the incoming packets.
   osEventFlagsSet(ethernetif_event_id, ETHERNETIF_EVENT_RECEIVE);
 }
@@ -143,6 +301,11 @@ void HAL_ETH_TxCpltCallback(ETH_HandleTypeDef *eth_handle)
 {
   UNUSED(eth_handle);
 
+#if LWIP_PTPD
+  // Collect the transmit timestamps of completed PTP event frames.
+  ethernetif_tx_harvest();
+#endif
+
   // Notify the Ethernet thread of the outgoing packet complete.
   osEventFlagsSet(ethernetif_event_id, ETHERNETIF_EVENT_TRANSMIT);
 }
@@ -152,85 +315,278 @@ void HAL_ETH_TxCpltCallback(ETH_HandleTypeDef *eth_handle)
 //
 
 #if LWIP_PTPD
-// Returns true if the packet is a PTP frame.  This is to avoid waiting for
-// the timestamp to become available when transmitting non-PTP packets.
-static bool is_ptp1588_frame(uint8_t *data)
+// Returns the offset of the PTP header if the frame is a PTP message carried
+// over Ethernet or UDP and zero otherwise. The UDP destination port is
+// returned in port, or zero for Ethernet layer 2 messages.
+static uint32_t ethernetif_ptp1588_offset(const uint8_t *buffer, uint32_t length, uint16_t *port)
 {
-  uint8_t *buffer = data;
   uint16_t ptp_type;
-  bool is_ptp_frame = false;
+  uint32_t ptp_offset;
+  uint32_t udp_offset;
+  uint32_t vlan_offset = 0;
+
+  if (length < ENET_PTP1588_ETHL2_HEADER_OFFSET) return 0;
 
   // Check for VLAN frame.
-  if (*(uint16_t *)(buffer + ENET_PTP1588_ETHL2_PACKETTYPE_OFFSET) == lwip_htons(ENET_8021QVLAN))
+  if (((buffer[ENET_PTP1588_ETHL2_PACKETTYPE_OFFSET] << 8) | buffer[ENET_PTP1588_ETHL2_PACKETTYPE_OFFSET + 1]) == ENET_8021QVLAN)
   {
+    if (length < ENET_PTP1588_ETHL2_HEADER_OFFSET + ENET_FRAME_VLAN_TAGLEN) return 0;
+    vlan_offset = ENET_FRAME_VLAN_TAGLEN;
     buffer += ENET_FRAME_VLAN_TAGLEN;
+    length -= ENET_FRAME_VLAN_TAGLEN;
   }
 
-  ptp_type = *((uint16_t *)(buffer + ENET_PTP1588_ETHL2_PACKETTYPE_OFFSET));
-  switch (lwip_htons(ptp_type))
+  ptp_type = (buffer[ENET_PTP1588_ETHL2_PACKETTYPE_OFFSET] << 8) | buffer[ENET_PTP1588_ETHL2_PACKETTYPE_OFFSET + 1];
+  switch (ptp_type)
   {
     // Ethernet layer 2.
     case ENET_ETHERNETL2:
-      if (*(uint8_t *)(buffer + ENET_PTP1588_ETHL2_MSGTYPE_OFFSET) <= ENET_PTP1588_ETHL2_MSGTYPE)
-      {
-        // This is a PTP frame.
-        is_ptp_frame = true;
-      }
+      ptp_offset = ENET_PTP1588_ETHL2_HEADER_OFFSET;
+      *port = 0;
       break;
     // IPV4.
     case ENET_IPV4:
-      if ((*(uint8_t *)(buffer + ENET_PTP1588_IPVERSION_OFFSET) >> 4) == ENET_IPV4VERSION)
-      {
-        if (((*(uint16_t *)(buffer + ENET_PTP1588_IPV4_UDP_PORT_OFFSET)) == lwip_htons(ENET_PTP1588_EVENT_PORT)) &&
-            (*(uint8_t *)(buffer + ENET_PTP1588_IPV4_UDP_PROTOCOL_OFFSET) == ENET_UDPVERSION))
-        {
-          // This is a PTP frame.
-          is_ptp_frame = true;
-        }
-      }
+      if (length < ENET_PTP1588_IPV4_UDP_PORT_OFFSET + 2) return 0;
+      if ((buffer[ENET_PTP1588_IPVERSION_OFFSET] >> 4) != ENET_IPV4VERSION) return 0;
+      if (buffer[ENET_PTP1588_IPV4_UDP_PROTOCOL_OFFSET] != ENET_UDPVERSION) return 0;
+      // The UDP header follows any IPv4 options.
+      udp_offset = (buffer[ENET_PTP1588_IPVERSION_OFFSET] & 0x0fU) * 4U;
+      if (udp_offset < ENET_IPV4_HEADER_LENGTH) return 0;
+      udp_offset += ENET_PTP1588_IPVERSION_OFFSET;
+      if (length < udp_offset + ENET_UDP_HEADER_LENGTH) return 0;
+      *port = (buffer[udp_offset + 2] << 8) | buffer[udp_offset + 3];
+      ptp_offset = udp_offset + ENET_UDP_HEADER_LENGTH;
       break;
     // IPV6.
     case ENET_IPV6:
-      if ((*(uint8_t *)(buffer + ENET_PTP1588_IPVERSION_OFFSET) >> 4) == ENET_IPV6VERSION)
-      {
-        if (((*(uint16_t *)(buffer + ENET_PTP1588_IPV6_UDP_PORT_OFFSET)) == lwip_htons(ENET_PTP1588_EVENT_PORT)) &&
-            (*(uint8_t *)(buffer + ENET_PTP1588_IPV6_UDP_PROTOCOL_OFFSET) == ENET_UDPVERSION))
-        {
-          // This is a PTP frame.
-          is_ptp_frame = true;
-        }
-      }
+      if (length < ENET_PTP1588_IPV6_UDP_PORT_OFFSET + 2) return 0;
+      if ((buffer[ENET_PTP1588_IPVERSION_OFFSET] >> 4) != ENET_IPV6VERSION) return 0;
+      if (buffer[ENET_PTP1588_IPV6_UDP_PROTOCOL_OFFSET] != ENET_UDPVERSION) return 0;
+      *port = (buffer[ENET_PTP1588_IPV6_UDP_PORT_OFFSET] << 8) | buffer[ENET_PTP1588_IPV6_UDP_PORT_OFFSET + 1];
+      ptp_offset = ENET_PTP1588_IPV6_HEADER_OFFSET;
       break;
     default:
-      break;
+      return 0;
+  }
+
+  if ((*port != 0) && (*port != ENET_PTP1588_EVENT_PORT) && (*port != ENET_PTP1588_GENERAL_PORT)) return 0;
+
+  // Make sure the PTP header is present.
+  if (length < ptp_offset + ENET_PTP1588_SEQUENCEID_OFFSET + 2) return 0;
+
+  return vlan_offset + ptp_offset;
+}
+
+// Returns true if the frame is a PTP event message and fills in the token that
+// identifies its transmit timestamp. Only PTP event messages are timestamped.
+static bool ethernetif_ptp1588_token(const uint8_t *buffer, uint32_t length, uint32_t *token)
+{
+  uint16_t port;
+  uint32_t ptp_offset;
+  uint8_t message_type;
+  uint16_t sequence_id;
+
+  ptp_offset = ethernetif_ptp1588_offset(buffer, length, &port);
+  if ((ptp_offset == 0) || (port == ENET_PTP1588_GENERAL_PORT)) return false;
+
+  // Only event messages carry a transmit timestamp.
+  message_type = buffer[ptp_offset] & 0x0fU;
+  if (message_type > ENET_PTP1588_ETHL2_MSGTYPE) return false;
+
+  sequence_id = (buffer[ptp_offset + ENET_PTP1588_SEQUENCEID_OFFSET] << 8) | buffer[ptp_offset + ENET_PTP1588_SEQUENCEID_OFFSET + 1];
+  *token = ETHERNETIF_TX_TOKEN(message_type, sequence_id);
+
+  return true;
+}
+
+// Hand a received PTP message over UDP/IPv4 straight to the PTP receive
+// queues, bypassing the tcpip thread. Returns true if the frame was consumed.
+// Fragments, VLAN tagged frames and frames not addressed to us are left to
+// lwIP so the fast path accepts exactly what lwIP would deliver.
+static bool ethernetif_ptp_input(struct netif *netif, struct pbuf *p)
+{
+  uint16_t port;
+  uint32_t ptp_offset;
+  uint32_t ip_header_length;
+  uint32_t udp_length;
+  uint32_t length;
+  const uint8_t *buffer;
+  ethernetif_ptp_input_t callback = ethernetif_ptp_input_callback;
+
+  if (callback == NULL) return false;
+
+  // The headers are expected in the first pbuf.
+  if (p->len <= ETH_PAD_SIZE) return false;
+  buffer = (const uint8_t *) p->payload + ETH_PAD_SIZE;
+  length = p->len - ETH_PAD_SIZE;
+
+  ptp_offset = ethernetif_ptp1588_offset(buffer, length, &port);
+  if ((ptp_offset == 0) || (port == 0)) return false;
+  if (((buffer[ENET_PTP1588_ETHL2_PACKETTYPE_OFFSET] << 8) | buffer[ENET_PTP1588_ETHL2_PACKETTYPE_OFFSET + 1]) != ENET_IPV4) return false;
+
+  // Leave fragments to lwIP reassembly.
+  if (((buffer[ENET_PTP1588_IPV4_FRAGMENT_OFFSET] & 0x3fU) | buffer[ENET_PTP1588_IPV4_FRAGMENT_OFFSET + 1]) != 0) return false;
+
+  // Only multicast or our own unicast address.
+  if (((buffer[ENET_PTP1588_IPV4_DESTINATION_OFFSET] & 0xf0U) != 0xe0U) &&
+      (memcmp(&buffer[ENET_PTP1588_IPV4_DESTINATION_OFFSET], netif_ip4_addr(netif), 4) != 0)) return false;
+
+  // The UDP payload must be within the frame. Ethernet padding follows it.
+  ip_header_length = (buffer[ENET_PTP1588_IPVERSION_OFFSET] & 0x0fU) * 4U;
+  udp_length = (buffer[ENET_PTP1588_IPVERSION_OFFSET + ip_header_length + 4] << 8) |
+               buffer[ENET_PTP1588_IPVERSION_OFFSET + ip_header_length + 5];
+  if ((udp_length < ENET_UDP_HEADER_LENGTH) ||
+      ((ENET_PTP1588_IPVERSION_OFFSET + ip_header_length + udp_length) > (p->tot_len - ETH_PAD_SIZE))) return false;
+
+  // Measure the latency from the hardware timestamp.
+  ptpprobe_input(p->time_sec, p->time_subsec);
+
+  // Point the pbuf at the PTP message and pass it on with its timestamp.
+  pbuf_remove_header(p, ETH_PAD_SIZE + ptp_offset);
+  pbuf_realloc(p, (u16_t) (udp_length - ENET_UDP_HEADER_LENGTH));
+  callback(ethernetif_ptp_input_arg, p, port);
+
+  return true;
+}
+#endif
+
+// Index of a transmit DMA descriptor.
+static uint32_t ethernetif_tx_index(__IO ETH_DMADescTypeDef *dma_tx_desc)
+{
+  return (uint32_t) (dma_tx_desc - dma_tx_descriptor_table);
+}
+
+// Release the transmit descriptors of frames the DMA has finished with. Must
+// be called with the Ethernet mutex held.
+static void ethernetif_tx_reclaim(void)
+{
+  uint32_t index;
+#if LWIP_PTPD
+  uint32_t unharvested = ETH_TXBUFNB;
+
+  // Collect the timestamps of sent PTP event frames first. The DMA may finish
+  // further frames at any time, so descriptors are only released up to the
+  // first PTP event frame still awaiting its timestamp. Otherwise it could be
+  // reused before the transmit complete interrupt reads its timestamp.
+  NVIC_DisableIRQ(ETH_IRQn);
+  ethernetif_tx_harvest();
+  if (ethernetif_tx_pending_tail != ethernetif_tx_pending_head)
+    unharvested = ethernetif_tx_index(ethernetif_tx_pending[ethernetif_tx_pending_tail & ETHERNETIF_TX_PENDING_MASK].tx_desc);
+  NVIC_EnableIRQ(ETH_IRQn);
+#endif
+
+  while (ethernetif_tx_used > 0)
+  {
+    // Descriptors are released in the order they were handed to the DMA.
+    index = (ethernetif_tx_index(ethernetif_handle.TxDesc) + ETH_TXBUFNB - ethernetif_tx_used) % ETH_TXBUFNB;
+    if (dma_tx_descriptor_table[index].Status & ETH_DMATXDESC_OWN) break;
+#if LWIP_PTPD
+    if (index == unharvested) break;
+#endif
+
+#if ETHERNETIF_TX_ZERO_COPY
+    // Drop the reference held on a frame sent in place.
+    if (ethernetif_tx_pbufs[index] != NULL)
+    {
+      pbuf_free(ethernetif_tx_pbufs[index]);
+      ethernetif_tx_pbufs[index] = NULL;
+    }
+#endif
+
+    ethernetif_tx_used -= 1;
+  }
+}
+
+#if ETHERNETIF_TX_ZERO_COPY
+// Returns the number of descriptors needed to send the chain in place or zero
+// if it must be copied. Only pbufs that own their payload (PBUF_RAM and
+// PBUF_POOL) are sent in place. The payload of a PBUF_REF pbuf may change once
+// linkoutput returns and a PBUF_ROM payload may not be reachable by the DMA.
+static uint32_t ethernetif_tx_segments(struct pbuf *p)
+{
+  uint32_t segcount = 0;
+  struct pbuf *q;
+
+  for (q = p; q != NULL; q = q->next)
+  {
+    if (!(q->type_internal & PBUF_TYPE_FLAG_STRUCT_DATA_CONTIGUOUS)) return 0;
+    if (q->len > 0) segcount += 1;
   }
 
-  return is_ptp_frame;
+  return segcount;
 }
 #endif
 
+// Hand the prepared descriptors of a frame to the DMA. Returns the last
+// descriptor of the frame which receives its transmit timestamp.
+static __IO ETH_DMADescTypeDef *ethernetif_tx_start(uint32_t index, uint32_t segcount)
+{
+  uint32_t i;
+  __IO ETH_DMADescTypeDef *dma_tx_desc = NULL;
+
+  for (i = 0; i < segcount; ++i)
+  {
+    dma_tx_desc = &dma_tx_descriptor_table[(index + i) % ETH_TXBUFNB];
+
+    // Mark the first and last segments. The frame is timestamped from the
+    // first and interrupts on completion of the last.
+    dma_tx_desc->Status &= ~(ETH_DMATXDESC_FS | ETH_DMATXDESC_LS | ETH_DMATXDESC_IC | ETH_DMATXDESC_TTSE | ETH_DMATXDESC_TTSS);
+    if (i == 0) dma_tx_desc->Status |= ETH_DMATXDESC_FS | ETH_DMATXDESC_TTSE;
+    if (i == (segcount - 1)) dma_tx_desc->Status |= ETH_DMATXDESC_LS | ETH_DMATXDESC_IC;
+
+    // The first descriptor is given to the DMA last so it never sees a partial frame.
+    if (i > 0) dma_tx_desc->Status |= ETH_DMATXDESC_OWN;
+  }
+
+  __DMB();
+  dma_tx_descriptor_table[index].Status |= ETH_DMATXDESC_OWN;
+
+  // Advance to the descriptor following the frame.
+  ethernetif_handle.TxDesc = (ETH_DMADescTypeDef *) &dma_tx_descriptor_table[(index + segcount) % ETH_TXBUFNB];
+  ethernetif_tx_used += segcount;
+
+  // When Tx Buffer unavailable flag is set: clear it and resume transmission.
+  if ((ethernetif_handle.Instance->DMASR & ETH_DMASR_TBUS) != (uint32_t) RESET)
+  {
+    // Clear TBUS ETHERNET DMA flag.
+    ethernetif_handle.Instance->DMASR = ETH_DMASR_TBUS;
+
+    // Resume DMA transmission.
+    ethernetif_handle.Instance->DMATPDR = 0;
+  }
+
+  return dma_tx_desc;
+}
+
 // This function should does the actual transmission of the packet. The packet
 // (IP packet including MAC addresses and type) is contained in the pbuf that is
 // passed to the function. This pbuf might be chained. Returns ERR_OK if the
 // packet could be sent or an err_t value if the packet couldn't be sent.
 //
+// Chains of pbufs owning their payload are sent in place with a descriptor per
+// pbuf and referenced until the DMA is done with them. Other frames are copied
+// into the transmit buffers of the descriptors.
+//
 // Returning ERR_MEM here if a DMA queue of your MAC is full can lead to
 // strange results. You might consider waiting for space in the DMA queue to
 // become availale since the stack doesn't retry to send a packet dropped
 // because of memory failure (except for the TCP timers).
 static err_t ethernetif_linkoutput(struct netif *netif, struct pbuf *p)
 {
-  err_t errval;
-  struct pbuf *q;
-  uint8_t *buffer;
+  err_t errval = ERR_OK;
+  uint32_t index;
+  uint32_t segcount = 0;
+  uint32_t seglength;
+  uint32_t framelength;
+  uint32_t i;
   __IO ETH_DMADescTypeDef *dma_tx_desc;
-  uint32_t framelength = 0;
-  uint32_t bufferoffset = 0;
-  uint32_t byteslefttocopy = 0;
-  uint32_t payloadoffset = 0;
-  HAL_StatusTypeDef hal_status;
+#if ETHERNETIF_TX_ZERO_COPY
+  struct pbuf *q;
+#endif
 #if LWIP_PTPD
   bool is_ptp;
+  uint32_t token = 0;
+  uint32_t head;
 #endif
 
 #if ETH_PAD_SIZE
@@ -239,174 +595,281 @@ static err_t ethernetif_linkoutput(struct netif *netif, struct pbuf *p)
   pbuf_header(p, -ETH_PAD_SIZE);
 #endif
 
-  // Point to the first transmit DMA descriptor.
-  dma_tx_desc = ethernetif_handle.TxDesc;
-
-  // Point to the transmit buffer associated with the transmit descriptor.
-  buffer = (uint8_t *) (dma_tx_desc->Buffer1Addr);
+  framelength = p->tot_len;
 
 #if LWIP_PTPD
-  // Clear the timestamp information.
-  p->time_sec = 0;
-  p->time_nsec = 0;
-
-  // Does this look like a PTP IEEE 1588 frame?
-  is_ptp = is_ptp1588_frame(buffer);
+  // Does this look like a PTP IEEE 1588 event frame? The headers are
+  // expected in the first pbuf of the chain.
+  is_ptp = ethernetif_ptp1588_token((const uint8_t *) p->payload, p->len, &token);
 #endif
 
-  // Copy frame from pbufs to driver buffers.
-  for (q = p; q != NULL; q = q->next)
+  // Clear the transmit event flag before sending the frame.
+  osEventFlagsClear(ethernetif_event_id, ETHERNETIF_EVENT_TRANSMIT);
+
+  // Lock the Ethernet mutex to prevent reentrant calls into HAL Ethernet code.
+  osMutexAcquire(ethernetif_mutex_id, osWaitForever);
+
+  // Release the descriptors of frames already sent.
+  ethernetif_tx_reclaim();
+
+  // Point to the next transmit DMA descriptor.
+  index = ethernetif_tx_index(ethernetif_handle.TxDesc);
+
+#if ETHERNETIF_TX_ZERO_COPY
+  // Can the frame be sent in place?
+  segcount = ethernetif_tx_segments(p);
+  if ((segcount > 0) && (segcount <= (ETH_TXBUFNB - ethernetif_tx_used)))
+  {
+    // Point a descriptor at each pbuf payload.
+    i = 0;
+    for (q = p; q != NULL; q = q->next)
+    {
+      if (q->len == 0) continue;
+      dma_tx_desc = &dma_tx_descriptor_table[(index + i) % ETH_TXBUFNB];
+      dma_tx_desc->Buffer1Addr = (uint32_t) q->payload;
+      dma_tx_desc->ControlBufferSize = q->len & ETH_DMATXDESC_TBS1;
+      i += 1;
+    }
+
+    // Hold the frame until its last descriptor is released.
+    pbuf_ref(p);
+    ethernetif_tx_pbufs[(index + segcount - 1) % ETH_TXBUFNB] = p;
+  }
+  else
+#endif
   {
-    // Is this buffer available? If not, goto error.
-    if ((dma_tx_desc->Status & ETH_DMATXDESC_OWN) != (uint32_t) RESET)
+    // Copy the frame into the transmit buffers of as many descriptors as needed.
+    segcount = (framelength + ETH_TX_BUF_SIZE - 1) / ETH_TX_BUF_SIZE;
+    if ((segcount == 0) || (segcount > (ETH_TXBUFNB - ethernetif_tx_used)))
     {
       errval = ERR_USE;
       goto error;
     }
 
-    // Get bytes in current lwIP buffer.
-    byteslefttocopy = q->len;
-    payloadoffset = 0;
-
-    // Check if the length of data to copy is bigger than transmit buffer size.
-    while ((byteslefttocopy + bufferoffset) > ETH_TX_BUF_SIZE)
+    for (i = 0; i < segcount; ++i)
     {
-      // Copy data to the transmit buffer.
-      memcpy((uint8_t*) ((uint8_t*) buffer + bufferoffset), (uint8_t*) ((uint8_t*) q->payload + payloadoffset), (ETH_TX_BUF_SIZE - bufferoffset));
-
-      // Point to next descriptor.
-      dma_tx_desc = (ETH_DMADescTypeDef *)(dma_tx_desc->Buffer2NextDescAddr);
+      seglength = framelength - (i * ETH_TX_BUF_SIZE);
+      if (seglength > ETH_TX_BUF_SIZE) seglength = ETH_TX_BUF_SIZE;
+      dma_tx_desc = &dma_tx_descriptor_table[(index + i) % ETH_TXBUFNB];
+      dma_tx_desc->Buffer1Addr = (uint32_t) &dma_tx_buffer[(index + i) % ETH_TXBUFNB][0];
+      dma_tx_desc->ControlBufferSize = seglength & ETH_DMATXDESC_TBS1;
+      pbuf_copy_partial(p, &dma_tx_buffer[(index + i) % ETH_TXBUFNB][0], (u16_t) seglength, (u16_t) (i * ETH_TX_BUF_SIZE));
+    }
+  }
 
-      // Point to the transmit buffer associated with the transmit descriptor.
-      buffer = (uint8_t *) (dma_tx_desc->Buffer1Addr);
+  // Transmit the frame.
+  dma_tx_desc = ethernetif_tx_start(index, segcount);
 
-      // Verify the buffer is available.
-      if ((dma_tx_desc->Status & ETH_DMATXDESC_OWN) != (uint32_t)RESET)
-      {
-        errval = ERR_USE;
-        goto error;
-      }
+  // Increment the interface send count and bytes.
+  ethernetif_send_count += 1;
+  ethernetif_send_bytes += framelength;
 
-      byteslefttocopy = byteslefttocopy - (ETH_TX_BUF_SIZE - bufferoffset);
-      payloadoffset = payloadoffset + (ETH_TX_BUF_SIZE - bufferoffset);
-      framelength = framelength + (ETH_TX_BUF_SIZE - bufferoffset);
-      bufferoffset = 0;
+#if LWIP_PTPD
+  // Keep track of the DMA TX descriptors used for PTP event frames.
+  if (is_ptp)
+  {
+    head = ethernetif_tx_pending_head;
+    if ((head - ethernetif_tx_pending_tail) < ETHERNETIF_TX_PENDING_SIZE)
+    {
+      // Publish the entry to the transmit complete interrupt.
+      ethernetif_tx_pending[head & ETHERNETIF_TX_PENDING_MASK].token = token;
+      ethernetif_tx_pending[head & ETHERNETIF_TX_PENDING_MASK].tx_desc = dma_tx_desc;
+      __DMB();
+      ethernetif_tx_pending_head = head + 1;
+
+      // The frame may already be sent so harvest now with the interrupt masked.
+      NVIC_DisableIRQ(ETH_IRQn);
+      ethernetif_tx_harvest();
+      NVIC_EnableIRQ(ETH_IRQn);
+    }
+    else
+    {
+      ethernetif_tx_completion_drops++;
     }
-
-    // Copy the remaining bytes to the transmit buffer.
-    memcpy((uint8_t*) ((uint8_t*) buffer + bufferoffset), (uint8_t*) ((uint8_t*) q->payload + payloadoffset), byteslefttocopy);
-    bufferoffset = bufferoffset + byteslefttocopy;
-    framelength = framelength + byteslefttocopy;
   }
+#endif
 
-#if 0
-  {
-    // Get the timestamp.
-    int64_t timestamp = hardtime_get();
+error:
 
-    // Break into two pieces -- seconds and nanoseconds.
-    int32_t top = timestamp / 1000000000;
-    int32_t bot = abs(((int32_t) (timestamp % 1000000000)) / 1000);
+  // Release the Ethernet mutex.
+  osMutexRelease(ethernetif_mutex_id);
 
-    // Print the received buffer.
-    outputf("Transmitted %d.%06d:\n", top, bot);
-    for (uint32_t i = 0; i < framelength; ++i)
-    {
-      outputf("%02x ", (uint32_t) buffer[i]);
-      if ((i & 0x07) == 0x07) outputf(" ");
-      if ((i & 0x0f) == 0x0f) outputf("\n");
-    }
-    outputf("\n\n");
+  // When Transmit Underflow flag is set, clear it and issue a Transmit Poll Demand to resume transmission.
+  if ((ethernetif_handle.Instance->DMASR & ETH_DMASR_TUS) != (uint32_t) RESET)
+  {
+    // Clear TUS ETHERNET DMA flag.
+    ethernetif_handle.Instance->DMASR = ETH_DMASR_TUS;
+
+    // Resume DMA transmission.
+    ethernetif_handle.Instance->DMATPDR = 0;
   }
+
+#if ETH_PAD_SIZE
+  // Reclaim the padding word.
+  pbuf_header(p, ETH_PAD_SIZE);
 #endif
 
-  // Clear the transmit event flag before sending the frame.
-  osEventFlagsClear(ethernetif_event_id, ETHERNETIF_EVENT_TRANSMIT);
+  return errval;
+}
+
+#if ETHERNETIF_RX_ZERO_COPY
+// Return a receive buffer to the pool once the stack frees its pbuf.
+static void ethernetif_rx_buffer_free(struct pbuf *p)
+{
+  LWIP_MEMPOOL_FREE(ETHERNETIF_RX_POOL, p);
+}
+
+// Arm a receive descriptor with a buffer and give it back to the DMA.
+static void ethernetif_rx_arm(__IO ETH_DMADescTypeDef *dma_rx_desc, ethernetif_rx_buffer_t *rx_buffer)
+{
+  ethernetif_rx_armed[dma_rx_desc - dma_rx_descriptor_table] = rx_buffer;
+  dma_rx_desc->Buffer1Addr = (uint32_t) &rx_buffer->data[ETH_PAD_SIZE];
+
+  // The buffer address must be in place before the DMA owns the descriptor.
+  __DMB();
+  dma_rx_desc->Status |= ETH_DMARXDESC_OWN;
+}
+
+// Handles the receiving of the incoming packets by wrapping the receive
+// buffers of the frame in custom pbufs and arming the descriptors with fresh
+// buffers. The buffers return to the pool when the stack frees the pbufs.
+// Returns false if no frame was ready, otherwise returns true with the frame
+// set to a pbuf with the received packet (including MAC header) or NULL if
+// the frame was dropped.
+static bool ethernetif_linkinput(struct netif *netif, struct pbuf **frame)
+{
+  struct pbuf *p = NULL;
+  struct pbuf *q = NULL;
+  __IO ETH_DMADescTypeDef *dma_rx_desc;
+  __IO ETH_DMADescTypeDef *dma_rx_next;
+  ethernetif_rx_buffer_t *rx_buffer;
+  ethernetif_rx_buffer_t *rx_fresh[ETH_RXBUFNB];
+  uint32_t segcount;
+  uint32_t seglength;
+  uint32_t length;
+  uint32_t fresh;
+  uint32_t i;
+#if LWIP_PTPD
+  int32_t time_sec;
+  uint32_t time_subsec;
+#endif
+  HAL_StatusTypeDef hal_status;
 
   // Lock the Ethernet mutex to prevent reentrant calls into HAL Ethernet code.
   osMutexAcquire(ethernetif_mutex_id, osWaitForever);
 
-  // Transmit the frame.
-  hal_status = HAL_ETH_TransmitFrame_IT(&ethernetif_handle, framelength);
+  // Get received frame.
+  hal_status = HAL_ETH_GetReceivedFrame_IT(&ethernetif_handle);
 
-  // Increment the interface send count and bytes.
+  // Increment the interface receive count and bytes.
   if (hal_status == HAL_OK)
   {
-    ethernetif_send_count += 1;
-    ethernetif_send_bytes += framelength;
+    ethernetif_recv_count += 1;
+    ethernetif_recv_bytes += ethernetif_handle.RxFrameInfos.length;
   }
 
-#if LWIP_PTPD
-  // Keep track of the DMA TX descriptors used for PTP frames.
-  if ((hal_status == HAL_OK) && is_ptp)
-  {
-    // Unique id for each packet sent. Range 1 to 10000.
-    static int32_t unique_id = 1;
-
-    // Save a unique id in the nanosecond field. This is a convienent place
-    // to save the unique id in the packet buffer we can later use to retrieve
-    // the timestamp information after the is sent.
-    p->time_sec = 0;
-    p->time_nsec = unique_id;
+  // Release the Ethernet mutex.
+  osMutexRelease(ethernetif_mutex_id);
 
-    // Update the unique id keeping it non-zero.
-    unique_id = (unique_id + 1) > 10000 ? 1 : unique_id + 1;
+  *frame = NULL;
+  if (hal_status != HAL_OK) return false;
 
-    // Fill in the next entry to use.
-    ethernet_tx_entries[ethernet_tx_head].id = p->time_nsec;
-    ethernet_tx_entries[ethernet_tx_head].tx_desc = dma_tx_desc;
+#if LWIP_PTPD
+  // Stamp the frame for the latency probes.
+  ptpprobe_linkinput();
+#endif
 
-    // Increment the head.
-    ethernet_tx_head = (ethernet_tx_head + 1) == ETH_TXBUFNB ? 0 : ethernet_tx_head + 1;
+  length = ethernetif_handle.RxFrameInfos.length;
+  segcount = ethernetif_handle.RxFrameInfos.SegCount;
+  dma_rx_desc = ethernetif_handle.RxFrameInfos.FSRxDesc;
 
-    // Increment the tail if we have wrapped.
-    if (ethernet_tx_head == ethernet_tx_tail)
-      ethernet_tx_tail = (ethernet_tx_tail + 1) == ETH_TXBUFNB ? 0 : ethernet_tx_tail + 1;
-  }
+#if LWIP_PTPD
+  // Get the frame timestamp before the descriptor is given back.
+  time_sec = dma_rx_desc->TimeStampHigh;
+  time_subsec = dma_rx_desc->TimeStampLow;
 #endif
 
-  // Release the Ethernet mutex.
-  osMutexRelease(ethernetif_mutex_id);
-
-  // Prepare transmit descriptors to give to DMA.
-  if (hal_status != HAL_OK)
+  // Get a fresh buffer for each descriptor of the frame. If the pool is empty
+  // the frame is dropped and the descriptors keep their current buffers.
+  for (fresh = 0; (length > 0) && (fresh < segcount); ++fresh)
+  {
+    rx_fresh[fresh] = (ethernetif_rx_buffer_t *) LWIP_MEMPOOL_ALLOC(ETHERNETIF_RX_POOL);
+    if (rx_fresh[fresh] == NULL) break;
+  }
+  if (fresh < segcount)
   {
-    // Report an error.
-    syslog_printf(SYSLOG_ERROR, "ETHERNETIF: error sending packet");
+    if (length > 0) ethernetif_drop_no_buffer += 1;
+    while (fresh > 0) LWIP_MEMPOOL_FREE(ETHERNETIF_RX_POOL, rx_fresh[--fresh]);
   }
 
-#if ETH_PAD_SIZE
-  // Reclaim the padding word.
-  pbuf_header(p, ETH_PAD_SIZE);
-#endif
+  for (i = 0; i < segcount; ++i)
+  {
+    dma_rx_next = (ETH_DMADescTypeDef *) (dma_rx_desc->Buffer2NextDescAddr);
 
-  errval = ERR_OK;
+    if (fresh)
+    {
+      // Wrap the buffer in a pbuf. The padding word is only kept in the first.
+      rx_buffer = ethernetif_rx_armed[dma_rx_desc - dma_rx_descriptor_table];
+      seglength = (length > ETH_RX_BUF_SIZE) ? ETH_RX_BUF_SIZE : length;
+      length -= seglength;
+      rx_buffer->pbuf.custom_free_function = ethernetif_rx_buffer_free;
+      q = pbuf_alloced_custom(PBUF_RAW, (u16_t) (seglength + ETH_PAD_SIZE), PBUF_REF,
+                              &rx_buffer->pbuf, rx_buffer->data, sizeof(rx_buffer->data));
+      if (p == NULL)
+      {
+        p = q;
+      }
+      else
+      {
+        pbuf_remove_header(q, ETH_PAD_SIZE);
+        pbuf_cat(p, q);
+      }
 
-error:
+      // Arm the descriptor with a fresh buffer.
+      ethernetif_rx_arm(dma_rx_desc, rx_fresh[i]);
+    }
+    else
+    {
+      // Give the descriptor back with its current buffer.
+      __DMB();
+      dma_rx_desc->Status |= ETH_DMARXDESC_OWN;
+    }
 
-  // When Transmit Underflow flag is set, clear it and issue a Transmit Poll Demand to resume transmission.
-  if ((ethernetif_handle.Instance->DMASR & ETH_DMASR_TUS) != (uint32_t) RESET)
+    dma_rx_desc = dma_rx_next;
+  }
+
+  // Clear the segment count.
+  ethernetif_handle.RxFrameInfos.SegCount = 0;
+
+  // When Rx Buffer unavailable flag is set: clear it and resume reception.
+  if ((ethernetif_handle.Instance->DMASR & ETH_DMASR_RBUS) != (uint32_t) RESET)
   {
-    // Clear TUS ETHERNET DMA flag.
-    ethernetif_handle.Instance->DMASR = ETH_DMASR_TUS;
+    // Clear RBUS ETHERNET DMA flag.
+    ethernetif_handle.Instance->DMASR = ETH_DMASR_RBUS;
 
-    // Resume DMA transmission.
-    ethernetif_handle.Instance->DMATPDR = 0;
+    // Resume DMA reception.
+    ethernetif_handle.Instance->DMARPDR = 0;
   }
 
-#if ETH_PAD_SIZE
-  // Reclaim the padding word.
-  pbuf_header(p, ETH_PAD_SIZE);
+#if LWIP_PTPD
+  // Copy the frame timestamp.
+  if (p != NULL)
+  {
+    p->time_sec = time_sec;
+    p->time_subsec = time_subsec;
+  }
 #endif
 
-  return errval;
+  *frame = p;
+  return true;
 }
-
+#else
 // Handles the receiving of the incoming packets by allocating a pbuf
 // and transfering the bytes of the incoming packet from the interface
-// into the pbuf.  Returns a pbuf filled with the received packet
-// (including MAC header) NULL on memory error.
-static struct pbuf *ethernetif_linkinput(struct netif *netif)
+// into the pbuf.  Returns false if no frame was ready, otherwise returns
+// true with the frame set to a pbuf filled with the received packet
+// (including MAC header) or NULL on memory error.
+static bool ethernetif_linkinput(struct netif *netif, struct pbuf **frame)
 {
   struct pbuf *p = NULL;
   struct pbuf *q = NULL;
@@ -438,6 +901,11 @@ static struct pbuf *ethernetif_linkinput(struct netif *netif)
   // Get received frame.
   if (hal_status == HAL_OK)
   {
+#if LWIP_PTPD
+    // Stamp the frame for the latency probes.
+    ptpprobe_linkinput();
+#endif
+
     // Obtain the size of the packet and put it into the "len" variable.
     len = ethernetif_handle.RxFrameInfos.length;
     buffer = (uint8_t *) ethernetif_handle.RxFrameInfos.buffer;
@@ -451,6 +919,7 @@ static struct pbuf *ethernetif_linkinput(struct netif *netif)
 
       // We allocate a pbuf chain of pbufs from the Lwip buffer pool.
       p = pbuf_alloc(PBUF_RAW, len, PBUF_POOL);
+      if (p == NULL) ethernetif_drop_no_buffer += 1;
     }
 
     if (p != NULL)
@@ -511,7 +980,7 @@ static struct pbuf *ethernetif_linkinput(struct netif *netif)
 #if LWIP_PTPD
       // Copy the frame timestamp.
       p->time_sec = ethernetif_handle.RxFrameInfos.FSRxDesc->TimeStampHigh;
-      p->time_nsec = subsecond_to_nanosecond(ethernetif_handle.RxFrameInfos.FSRxDesc->TimeStampLow);
+      p->time_subsec = ethernetif_handle.RxFrameInfos.FSRxDesc->TimeStampLow;
 #endif
 
 #if ETH_PAD_SIZE
@@ -545,9 +1014,216 @@ static struct pbuf *ethernetif_linkinput(struct netif *netif)
     }
   }
 
-  return p;
+  *frame = p;
+  return hal_status == HAL_OK;
+}
+#endif
+
+// Accumulate the DMA missed frame and FIFO overflow counts. The register
+// clears on read, so it must be read with the Ethernet mutex locked.
+static void ethernetif_drop_update(void)
+{
+  uint32_t mfbocr;
+
+  // Ignore the register until the MAC is initialized.
+  if (ethernetif_handle.Instance == NULL) return;
+
+  // Frames missed for lack of receive descriptors.
+  mfbocr = ethernetif_handle.Instance->DMAMFBOCR;
+  ethernetif_drop_missed += (mfbocr & ETH_DMAMFBOCR_OMFC) ? 0xffffu : (mfbocr & ETH_DMAMFBOCR_MFC);
+
+  // Frames missed because the receive FIFO overflowed.
+  ethernetif_drop_overflow += (mfbocr & ETH_DMAMFBOCR_OFOC) ? 0x7ffu : ((mfbocr & ETH_DMAMFBOCR_MFA) >> 17);
+}
+
+#if LWIP_IGMP || (LWIP_IPV6 && LWIP_IPV6_MLD)
+// Index of a multicast MAC address in the 64 bit hash table. This is the upper
+// six bits of the bit reversed Ethernet CRC of the address.
+static uint32_t ethernetif_mcast_hash(const uint8_t *hwaddr)
+{
+  uint32_t crc = 0xffffffffu;
+
+  for (uint32_t i = 0; i < ETH_HWADDR_LEN; ++i)
+  {
+    crc ^= hwaddr[i];
+    for (uint32_t j = 0; j < 8; ++j) crc = (crc >> 1) ^ (0xedb88320u & (0u - (crc & 1u)));
+  }
+
+  return __RBIT(~crc) >> 26;
+}
+
+// Program the MAC filters from the joined multicast addresses. Must be
+// called with the Ethernet mutex locked.
+static void ethernetif_mcast_apply(void)
+{
+  __IO uint32_t *perfect[3][2];
+  uint32_t hash_high = 0u;
+  uint32_t hash_low = 0u;
+  uint32_t count = 0u;
+  uint32_t macffr;
+
+  // Ignore the registers until the MAC is initialized.
+  if (ethernetif_handle.Instance == NULL) return;
+
+  // Perfect filter address registers 1 to 3. Address 0 is our own address.
+  perfect[0][0] = &ethernetif_handle.Instance->MACA1HR;
+  perfect[0][1] = &ethernetif_handle.Instance->MACA1LR;
+  perfect[1][0] = &ethernetif_handle.Instance->MACA2HR;
+  perfect[1][1] = &ethernetif_handle.Instance->MACA2LR;
+  perfect[2][0] = &ethernetif_handle.Instance->MACA3HR;
+  perfect[2][1] = &ethernetif_handle.Instance->MACA3LR;
+
+  for (uint32_t i = 0; i < ETHERNETIF_MCAST_FILTER_SIZE; ++i)
+  {
+    const uint8_t *hwaddr = ethernetif_mcast_filters[i].hwaddr;
+
+    if (ethernetif_mcast_filters[i].users == 0) continue;
+
+    if (count < 3)
+    {
+      // Compare the destination address against a perfect filter.
+      *perfect[count][0] = ETH_MACA1HR_AE | ((uint32_t) hwaddr[5] << 8) | hwaddr[4];
+      *perfect[count][1] = ((uint32_t) hwaddr[3] << 24) | ((uint32_t) hwaddr[2] << 16) |
+                           ((uint32_t) hwaddr[1] << 8) | hwaddr[0];
+    }
+    else
+    {
+      // Set the address bit in the hash table.
+      uint32_t hash = ethernetif_mcast_hash(hwaddr);
+      if (hash & 0x20u)
+        hash_high |= 1u << (hash & 0x1fu);
+      else
+        hash_low |= 1u << (hash & 0x1fu);
+    }
+    count += 1;
+  }
+
+  // Disable the perfect filters not in use.
+  for (uint32_t i = count; i < 3; ++i) *perfect[i][0] = 0u;
+
+  ethernetif_handle.Instance->MACHTHR = hash_high;
+  ethernetif_handle.Instance->MACHTLR = hash_low;
+
+  // Filter multicast frames on the perfect filters and the hash table unless
+  // the table has overflowed, in which case pass all multicast frames.
+  macffr = ethernetif_handle.Instance->MACFFR & ~(ETH_MACFFR_PAM | ETH_MACFFR_HPF | ETH_MACFFR_HM);
+  if (ethernetif_mcast_overflow)
+    macffr |= ETH_MACFFR_PAM;
+  else
+    macffr |= ETH_MULTICASTFRAMESFILTER_PERFECTHASHTABLE;
+
+  // Write the frame filter twice as the HAL does for the register to cross
+  // into the MAC clock domain.
+  ethernetif_handle.Instance->MACFFR = macffr;
+  macffr = ethernetif_handle.Instance->MACFFR;
+  delay_dwt_us(10);
+  ethernetif_handle.Instance->MACFFR = macffr;
 }
 
+// Add or remove a user of a multicast MAC address and reprogram the MAC filters.
+static err_t ethernetif_mcast_filter(const uint8_t *hwaddr, enum netif_mac_filter_action action)
+{
+  ethernetif_mcast_filter_t *filter = NULL;
+  ethernetif_mcast_filter_t *unused = NULL;
+  err_t err = ERR_OK;
+
+  // Lock the Ethernet mutex while the table and registers change.
+  osMutexAcquire(ethernetif_mutex_id, osWaitForever);
+
+  // Find the address or an unused entry.
+  for (uint32_t i = 0; i < ETHERNETIF_MCAST_FILTER_SIZE; ++i)
+  {
+    if (ethernetif_mcast_filters[i].users == 0)
+    {
+      if (unused == NULL) unused = &ethernetif_mcast_filters[i];
+    }
+    else if (!memcmp(ethernetif_mcast_filters[i].hwaddr, hwaddr, ETH_HWADDR_LEN))
+    {
+      filter = &ethernetif_mcast_filters[i];
+      break;
+    }
+  }
+
+  if (action == NETIF_ADD_MAC_FILTER)
+  {
+    if (filter != NULL)
+    {
+      // Several groups can share a MAC address.
+      filter->users += 1;
+    }
+    else if (unused != NULL)
+    {
+      memcpy(unused->hwaddr, hwaddr, ETH_HWADDR_LEN);
+      unused->users = 1;
+    }
+    else
+    {
+      // Too many addresses so fall back to passing all multicast frames.
+      if (ethernetif_mcast_overflow == 0)
+        syslog_printf(SYSLOG_WARNING, "ETHERNETIF: multicast filter full, passing all multicast");
+      ethernetif_mcast_overflow += 1;
+    }
+  }
+  else
+  {
+    if (filter != NULL)
+      filter->users -= 1;
+    else if (ethernetif_mcast_overflow > 0)
+      ethernetif_mcast_overflow -= 1;
+    else
+      err = ERR_VAL;
+  }
+
+  // Reprogram the MAC filters.
+  ethernetif_mcast_apply();
+
+  // Release the Ethernet mutex.
+  osMutexRelease(ethernetif_mutex_id);
+
+  return err;
+}
+#endif
+
+#if LWIP_IGMP
+// Called by IGMP to filter on an IPv4 multicast group.
+static err_t ethernetif_igmp_mac_filter(struct netif *netif, const ip4_addr_t *group,
+                                        enum netif_mac_filter_action action)
+{
+  uint8_t hwaddr[ETH_HWADDR_LEN];
+  uint32_t addr = lwip_ntohl(ip4_addr_get_u32(group));
+
+  // The group maps to 01:00:5e followed by its lower 23 bits.
+  hwaddr[0] = LL_IP4_MULTICAST_ADDR_0;
+  hwaddr[1] = LL_IP4_MULTICAST_ADDR_1;
+  hwaddr[2] = LL_IP4_MULTICAST_ADDR_2;
+  hwaddr[3] = (uint8_t) ((addr >> 16) & 0x7f);
+  hwaddr[4] = (uint8_t) (addr >> 8);
+  hwaddr[5] = (uint8_t) addr;
+
+  return ethernetif_mcast_filter(hwaddr, action);
+}
+#endif
+
+#if LWIP_IPV6 && LWIP_IPV6_MLD
+// Called by MLD to filter on an IPv6 multicast group.
+static err_t ethernetif_mld_mac_filter(struct netif *netif, const ip6_addr_t *group,
+                                       enum netif_mac_filter_action action)
+{
+  uint8_t hwaddr[ETH_HWADDR_LEN];
+  uint32_t addr = lwip_ntohl(group->addr[3]);
+
+  // The group maps to 33:33 followed by its lower 32 bits.
+  hwaddr[0] = LL_IP6_MULTICAST_ADDR_0;
+  hwaddr[1] = LL_IP6_MULTICAST_ADDR_1;
+  hwaddr[2] = (uint8_t) (addr >> 24);
+  hwaddr[3] = (uint8_t) (addr >> 16);
+  hwaddr[4] = (uint8_t) (addr >> 8);
+  hwaddr[5] = (uint8_t) addr;
+
+  return ethernetif_mcast_filter(hwaddr, action);
+}
+#endif
+
 // Configure the Ethernet MAC and DMA.
 static void ethernetif_link_config(struct netif *netif)
 {
@@ -568,10 +1244,26 @@ static void ethernetif_link_config(struct netif *netif)
 
   // Initialize Tx and Rx Descriptors list: Chain Mode.
   HAL_ETH_DMATxDescListInit(&ethernetif_handle, dma_tx_descriptor_table, &dma_tx_buffer[0][0], ETH_TXBUFNB);
+#if ETHERNETIF_RX_ZERO_COPY
+  // The receive descriptors are armed with pool buffers below.
+  HAL_ETH_DMARxDescListInit(&ethernetif_handle, dma_rx_descriptor_table, NULL, ETH_RXBUFNB);
+  LWIP_MEMPOOL_INIT(ETHERNETIF_RX_POOL);
+  for (uint32_t i = 0; i < ETH_RXBUFNB; ++i)
+  {
+    ethernetif_rx_buffer_t *rx_buffer = (ethernetif_rx_buffer_t *) LWIP_MEMPOOL_ALLOC(ETHERNETIF_RX_POOL);
+    if (rx_buffer == NULL)
+    {
+      syslog_printf(SYSLOG_ERROR, "ETHERNETIF: cannot allocate receive buffer");
+      break;
+    }
+    ethernetif_rx_arm(&dma_rx_descriptor_table[i], rx_buffer);
+  }
+#else
   HAL_ETH_DMARxDescListInit(&ethernetif_handle, dma_rx_descriptor_table, &dma_rx_buffer[0][0], ETH_RXBUFNB);
+#endif
 
-  // Initialize custom MAC parameters.
-  // NOTE: the MulticastFramesFilter is set to none for support of MDNS packets.
+  // Initialize custom MAC parameters. Multicast frames are filtered on the
+  // groups joined through IGMP, which includes the MDNS and PTP groups.
   ETH_MACInitTypeDef mac_init;
   memset(&mac_init, 0, sizeof(mac_init));
   mac_init.Watchdog = ETH_WATCHDOG_ENABLE;
@@ -591,7 +1283,11 @@ static void ethernetif_link_config(struct netif *netif)
   mac_init.BroadcastFramesReception = ETH_BROADCASTFRAMESRECEPTION_ENABLE;
   mac_init.DestinationAddrFilter = ETH_DESTINATIONADDRFILTER_NORMAL;
   mac_init.PromiscuousMode = ETH_PROMISCUOUS_MODE_DISABLE;
+#if LWIP_IGMP || (LWIP_IPV6 && LWIP_IPV6_MLD)
+  mac_init.MulticastFramesFilter = ETH_MULTICASTFRAMESFILTER_PERFECTHASHTABLE;
+#else
   mac_init.MulticastFramesFilter = ETH_MULTICASTFRAMESFILTER_NONE;
+#endif
   mac_init.UnicastFramesFilter = ETH_UNICASTFRAMESFILTER_PERFECT;
   mac_init.HashTableHigh = 0x0U;
   mac_init.HashTableLow = 0x0U;
@@ -605,6 +1301,11 @@ static void ethernetif_link_config(struct netif *netif)
   mac_init.VLANTagIdentifier = 0x0U;
   HAL_ETH_ConfigMAC(&ethernetif_handle, &mac_init);
 
+#if LWIP_IGMP || (LWIP_IPV6 && LWIP_IPV6_MLD)
+  // Program the multicast groups joined before the MAC was initialized.
+  ethernetif_mcast_apply();
+#endif
+
   // Initialize custom DMA parameters.
   ETH_DMAInitTypeDef dma_init;
   memset(&dma_init, 0, sizeof(dma_init));
@@ -626,6 +1327,18 @@ static void ethernetif_link_config(struct netif *netif)
   dma_init.DMAArbitration = ETH_DMAARBITRATION_ROUNDROBIN_RXTX_1_1;
   HAL_ETH_ConfigDMA(&ethernetif_handle, &dma_init);
 
+#if ETHERNETIF_RX_WATCHDOG_US
+  {
+    // Convert the coalescing delay to units of 256 HCLK cycles.
+    uint32_t watchdog = (ETHERNETIF_RX_WATCHDOG_US * (SystemCoreClock / 1000000U) + 255U) / 256U;
+    if (watchdog > 255U) watchdog = 255U;
+
+    // Interrupt from the receive watchdog rather than on completion of each frame.
+    for (uint32_t i = 0; i < ETH_RXBUFNB; ++i) dma_rx_descriptor_table[i].ControlBufferSize |= ETH_DMARXDESC_DIC;
+    __HAL_ETH_SET_RECEIVE_WATCHDOG_TIMER(&ethernetif_handle, watchdog);
+  }
+#endif
+
   // Enable interrupt on change of link status.
   uint32_t regvalue = 0;
   HAL_ETH_ReadPHYRegister(&ethernetif_handle, PHY_ISFR, &regvalue);
@@ -735,38 +1448,60 @@ static void ethernetif_thread(void *argument )
   // Loop forever.
   for(;;)
   {
-    // Get the next low level input.
-    struct pbuf *p = ethernetif_linkinput(netif);
+    // Set flags to wait for a receive, transmit or timer event.
+    uint32_t flags = ETHERNETIF_EVENT_RECEIVE | ETHERNETIF_EVENT_TRANSMIT | ETHERNETIF_EVENT_TIMER;
+
+    // Wait for an Ethernet receiver, transmit or timer event.
+    flags = osEventFlagsWait(ethernetif_event_id, flags, osFlagsWaitAny, osWaitForever);
 
-    // Should we wait for an event?
-    while (p == NULL)
+    // Do the flags indicate a transmit event?
+    if ((flags & ETHERNETIF_EVENT_TRANSMIT) == ETHERNETIF_EVENT_TRANSMIT)
     {
-      // Set flags to wait for a receive or timer event.
-      uint32_t flags = ETHERNETIF_EVENT_RECEIVE | ETHERNETIF_EVENT_TIMER;
+      // Release the frames the DMA has sent.
+      osMutexAcquire(ethernetif_mutex_id, osWaitForever);
+      ethernetif_tx_reclaim();
+      osMutexRelease(ethernetif_mutex_id);
+    }
 
-      // Wait for an Ethernet receiver or timer event.
-      flags = osEventFlagsWait(ethernetif_event_id, flags, osFlagsWaitAny, osWaitForever);
+    // Do the flags indicate a receive event?
+    if ((flags & ETHERNETIF_EVENT_RECEIVE) == ETHERNETIF_EVENT_RECEIVE)
+    {
+      struct pbuf *p;
 
-      // Do the flags indicate a receive event?
-      if ((flags & ETHERNETIF_EVENT_RECEIVE) == ETHERNETIF_EVENT_RECEIVE)
+      // Drain every frame the DMA has completed.
+      while (ethernetif_linkinput(netif, &p))
       {
-        // Get the next low level input.
-        p = ethernetif_linkinput(netif);
-      }
+        // Dropped frames have no pbuf.
+        if (p == NULL) continue;
 
-      // Do the flags indicate a timer event?
-      if ((flags & ETHERNETIF_EVENT_TIMER) == ETHERNETIF_EVENT_TIMER)
-      {
-        // Test if the ethernet interface went up or down.
-        ethernetif_link_check(netif);
+#if LWIP_PTPD
+        // PTP messages go straight to the PTP receive queues.
+        if (ethernetif_ptp_input(netif, p)) continue;
+#endif
+
+        // Call into the interface input handler.
+        if (netif->input(p, netif) != ERR_OK)
+        {
+          // Free the buffer here if there was an error.
+          pbuf_free(p);
+        }
       }
+
+      // Unmask receive interrupts. A frame completed since the ring was
+      // found empty interrupts as soon as they are unmasked.
+      ETH->DMAIER |= ETH_DMAIER_RIE;
     }
 
-    // Call into the interface input handler.
-    if (netif->input(p, netif) != ERR_OK)
+    // Do the flags indicate a timer event?
+    if ((flags & ETHERNETIF_EVENT_TIMER) == ETHERNETIF_EVENT_TIMER)
     {
-      // Free the buffer here if there was an error.
-      pbuf_free(p);
+      // Test if the ethernet interface went up or down.
+      ethernetif_link_check(netif);
+
+      // Accumulate the DMA drop counts before the hardware counters saturate.
+      osMutexAcquire(ethernetif_mutex_id, osWaitForever);
+      ethernetif_drop_update();
+      osMutexRelease(ethernetif_mutex_id);
     }
   }
 }
@@ -837,6 +1572,14 @@ err_t ethernetif_init(struct netif *netif)
   netif->flags |= NETIF_FLAG_IGMP;
 #endif
 
+  // Set callbacks for filtering multicast groups.
+#if LWIP_IGMP
+  netif_set_igmp_mac_filter(netif, ethernetif_igmp_mac_filter);
+#endif
+#if LWIP_IPV6 && LWIP_IPV6_MLD
+  netif_set_mld_mac_filter(netif, ethernetif_mld_mac_filter);
+#endif
+
   // Set callbacks for sending packets.
 #if LWIP_IPV4
   netif->output = ethernetif_etharp_output;
@@ -948,70 +1691,61 @@ void ethernetif_counts(uint32_t *recv_count, uint32_t *recv_bytes, uint32_t *sen
   osMutexRelease(ethernetif_mutex_id);
 }
 
-#if LWIP_PTPD
-// Get the TX time associated with the packet buffer.
-void ethernetif_get_tx_timestamp(struct pbuf *p)
+void ethernetif_drops(uint32_t *no_buffer, uint32_t *missed, uint32_t *overflow)
 {
-  // Lock the Ethernet mutex.
+  // Lock the Ethernet mutex to get the counts.
   osMutexAcquire(ethernetif_mutex_id, osWaitForever);
 
-  // Start without a DMA TX descriptor.
-  __IO ETH_DMADescTypeDef *dma_tx_desc = NULL;
+  // Accumulate the latest DMA drop counts.
+  ethernetif_drop_update();
 
-  // Find the DMA TX descriptor assocated with this packet buffer.
-  // This is a onetime function to prevent issues with accidently
-  // pointing to a recycled DMA TX descriptor.
-  uint32_t index = ethernet_tx_tail;
-  while (index != ethernet_tx_head)
-  {
-    // Is this the DMA TX descriptor we are interested in?
-    if (p->time_nsec == ethernet_tx_entries[index].id)
-    {
-      // Get the DMA TX descriptor for use below.
-      dma_tx_desc = ethernet_tx_entries[index].tx_desc;
+  // Return the drop information.
+  if (no_buffer) *no_buffer = ethernetif_drop_no_buffer;
+  if (missed) *missed = ethernetif_drop_missed;
+  if (overflow) *overflow = ethernetif_drop_overflow;
 
-      // This is a one time operation so clear the entry.
-      ethernet_tx_entries[index].id = 0;
-      ethernet_tx_entries[index].tx_desc = NULL;
+  // Release the Ethernet mutex.
+  osMutexRelease(ethernetif_mutex_id);
+}
 
-      // We found the DMA TX descriptor.
-      break;
-    }
+#if LWIP_PTPD
+// Register the function called from interrupt context when transmit timestamps complete.
+void ethernetif_set_tx_completion_callback(void (*callback)(void))
+{
+  ethernetif_tx_completion_callback = callback;
+}
 
-    // Increment to the next TX buffer.
-    index = (index + 1) == ETH_TXBUFNB ? 0 : index + 1;
-  }
+// Get the next transmit timestamp completion. Must only be called from a
+// single thread. Returns false if there are no completions.
+bool ethernetif_get_tx_completion(ethernetif_tx_completion_t *completion)
+{
+  uint32_t tail = ethernetif_tx_completion_tail;
 
-  // Release the Ethernet mutex.
-  osMutexRelease(ethernetif_mutex_id);
+  if (tail == ethernetif_tx_completion_head) return false;
 
-  // Fill in the default values.
-  p->time_sec = 0;
-  p->time_nsec = 0;
+  __DMB();
+  *completion = ethernetif_tx_completions[tail & ETHERNETIF_TX_COMPLETION_MASK];
+  __DMB();
+  ethernetif_tx_completion_tail = tail + 1;
 
-  // Did we find the dma tx descriptor?
-  if (dma_tx_desc)
-  {
-    // Wait up to 20 millisecond for the DMA transfer to complete.
-    for (uint32_t retry_count = 10; (retry_count > 0) && ((dma_tx_desc->Status & ETH_DMATXDESC_TTSS) != ETH_DMATXDESC_TTSS); --retry_count)
-    {
-      // Wait up to two milliseconds for a transfer to complete.
-      osEventFlagsWait(ethernetif_event_id, ETHERNETIF_EVENT_TRANSMIT, osFlagsWaitAny, 2);
-    }
+  return true;
+}
 
-    // Make sure after waiting we have the timestamp information.
-    if (dma_tx_desc->Status & ETH_DMATXDESC_TTSS)
-    {
-      // Fill in the timestamp information.
-      p->time_sec = dma_tx_desc->TimeStampHigh;
-      p->time_nsec = subsecond_to_nanosecond(dma_tx_desc->TimeStampLow);
-    }
-    else
-    {
-      // Report timeount.
-      outputf("ETHERNETIF: tx timestamp timeout\n");
-    }
-  }
+// Register the function receiving PTP messages from the Ethernet thread. A
+// null callback sends PTP messages through lwIP.
+void ethernetif_set_ptp_input(ethernetif_ptp_input_t callback, void *arg)
+{
+  ethernetif_ptp_input_callback = NULL;
+  __DMB();
+  ethernetif_ptp_input_arg = arg;
+  __DMB();
+  ethernetif_ptp_input_callback = callback;
+}
+
+// Number of transmit timestamps lost because the tracking rings were full.
+uint32_t ethernetif_get_tx_completion_drops(void)
+{
+  return ethernetif_tx_completion_drops;
 }
 #endif
 
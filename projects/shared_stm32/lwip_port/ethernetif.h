@@ -12,9 +12,32 @@ err_t ethernetif_deinit(struct netif *netif);
 
 // Ethernet interface count functions.
 void ethernetif_counts(uint32_t *recv_count, uint32_t *recv_bytes, uint32_t *send_count, uint32_t *send_bytes);
+void ethernetif_drops(uint32_t *no_buffer, uint32_t *missed, uint32_t *overflow);
 
 #if LWIP_PTPD
-void ethernetif_get_tx_timestamp(struct pbuf *p);
+// Token identifying the transmit timestamp of a PTP event message.
+#define ETHERNETIF_TX_TOKEN(message_type, sequence_id) \
+  ((((uint32_t) (message_type)) << 16) | ((uint16_t) (sequence_id)))
+#define ETHERNETIF_TX_TOKEN_MESSAGE_TYPE(token) ((uint8_t) ((token) >> 16))
+#define ETHERNETIF_TX_TOKEN_SEQUENCE_ID(token) ((uint16_t) (token))
+
+// Transmit timestamp of a PTP event message in the hardware format.
+typedef struct ethernetif_tx_completion_s
+{
+  uint32_t token;
+  int32_t time_sec;
+  uint32_t time_subsec;
+} ethernetif_tx_completion_t;
+
+// Receives a PTP message from the Ethernet thread. The pbuf payload is the PTP
+// message, the port is its UDP destination port and the callback takes
+// ownership of the pbuf.
+typedef void (*ethernetif_ptp_input_t)(void *arg, struct pbuf *p, uint16_t port);
+
+void ethernetif_set_tx_completion_callback(void (*callback)(void));
+void ethernetif_set_ptp_input(ethernetif_ptp_input_t callback, void *arg);
+bool ethernetif_get_tx_completion(ethernetif_tx_completion_t *completion);
+uint32_t ethernetif_get_tx_completion_drops(void);
 #endif
 
 void ethernetif_ptp_start(uint32_t update_method);
@@ -688,6 +688,11 @@ static bool network_shell_network(int argc, char **argv)
     ethernetif_counts(&recv_count, &recv_bytes, &send_count, &send_bytes);
     shell_printf("recv: %u (%u bytes)\n", recv_count, recv_bytes);
     shell_printf("send: %u (%u bytes)\n", send_count, send_bytes);
+
+    // Print the network interface receive drop counts.
+    uint32_t no_buffer, missed, overflow;
+    ethernetif_drops(&no_buffer, &missed, &overflow);
+    shell_printf("drop: %u no buffer, %u missed, %u overflow\n", no_buffer, missed, overflow);
   }
 
   return true;
@@ -78,26 +78,30 @@ void ntime_resume(void)
   LL_TIM_EnableCounter(TIM12);
 }
 
-// Get the current nanosecond timer timestamp.
+// Get the current nanosecond timer timestamp. Safe to call from any
+// interrupt or thread as interrupts are never masked.
 int64_t ntime_get_nsecs(void)
 {
-  // Get the counter which forms the high portion of the timestamp.
-  uint32_t timestamp_hi = ntime_counter;
-
-  // Get the hardware timer which forms the low portion of the timestamp.
-  uint32_t timestamp_lo = LL_TIM_GetCounter(TIM12);
-
-  // Get again the counter which forms the high portion of the timestamp.
-  uint32_t timestamp_hi_after = ntime_counter;
-
-  // Has the high portion of the timestamp changed?
-  if (timestamp_hi != timestamp_hi_after)
+  uint32_t timestamp_hi;
+  uint32_t timestamp_lo;
+  uint32_t pending;
+
+  // The counter forms the high portion of the timestamp and the hardware
+  // timer the low portion. The timer may have rolled over without the
+  // counter being incremented when called from an interrupt of higher
+  // priority than the timer. The pending update then belongs to a low
+  // portion read after the rollover. Retry until the counter is the same
+  // on both sides of the timer and update flag reads, so the flag is never
+  // seen cleared by an update the counter does not include.
+  do
   {
-    // If they are not equal, we pulled the time just when a rollover occurred.
-    // We need to determine if the low portion of the timestamp goes with the
-    // older high portion of the timestamp or the newer high portion.
-    if (timestamp_lo < 5000) timestamp_hi = timestamp_hi_after;
-  }
+    timestamp_hi = ntime_counter;
+    timestamp_lo = LL_TIM_GetCounter(TIM12);
+    pending = LL_TIM_IsActiveFlag_UPDATE(TIM12);
+  } while (timestamp_hi != ntime_counter);
+
+  // Account for a pending update.
+  if (pending && (timestamp_lo < 5000)) timestamp_hi += 1;
 
   // Create the 64-bit timestamp high and low hardware timer components.
   int64_t timestamp = (((int64_t) timestamp_hi) * 100000000) + ((int64_t) timestamp_lo * 10000);
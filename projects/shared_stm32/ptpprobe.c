@@ -0,0 +1,217 @@
+#include <string.h>
+#include "cmsis_os2.h"
+#include "hal_system.h"
+#include "ethptp.h"
+#include "shell.h"
+#include "ptpprobe.h"
+
+// PTP LATENCY PROBES
+// Each received PTP message is stamped as it moves from the Ethernet DMA to
+// the servo. The Ethernet interrupt reads the PTP clock in the hardware
+// format so the delay from the hardware receive timestamp can be measured
+// without conversions in the interrupt. Later stages are stamped with
+// the DWT cycle counter, which is cheap to read and unaffected by steps or
+// adjustments of the PTP clock.
+//
+// The interrupt, link input and enqueue stages run in the Ethernet thread and
+// the dequeue and servo stages in the PTP thread. Each histogram is written
+// by a single context, so a reset is only requested here and carried out by
+// the writer of the stage. Reads from the shell may be torn across a sample.
+
+// Stamps of the last receive interrupt and of the frame in the link input.
+static volatile int32_t ptpprobe_irq_sec = 0;
+static volatile uint32_t ptpprobe_irq_subsec = 0;
+static volatile uint32_t ptpprobe_irq_cycles = 0;
+static uint32_t ptpprobe_input_cycles = 0;
+
+// Stamp of the message being handled by the PTP thread.
+static uint32_t ptpprobe_dequeue_cycles = 0;
+static bool ptpprobe_dequeue_valid = false;
+
+// Stage histograms and their reset requests.
+static ptpprobe_hist_t ptpprobe_hists[PTPPROBE_STAGE_COUNT];
+static volatile bool ptpprobe_reset_request[PTPPROBE_STAGE_COUNT];
+
+// Stage names for the shell.
+static const char * const ptpprobe_names[PTPPROBE_STAGE_COUNT] =
+{
+  "irq",
+  "input",
+  "enqueue",
+  "dequeue",
+  "servo"
+};
+
+// Convert a cycle count to nanoseconds.
+static uint32_t ptpprobe_cycles_to_ns(uint32_t cycles)
+{
+  uint64_t ns = ((uint64_t) cycles * 1000u) / (SystemCoreClock / 1000000u);
+  return (ns > UINT32_MAX) ? UINT32_MAX : (uint32_t) ns;
+}
+
+// Add a latency in nanoseconds to the histogram of a stage.
+static void ptpprobe_record(ptpprobe_stage_t stage, uint32_t ns)
+{
+  ptpprobe_hist_t *hist = &ptpprobe_hists[stage];
+  uint32_t bucket = 0;
+
+  // Carry out a pending reset of the histogram.
+  if (ptpprobe_reset_request[stage])
+  {
+    memset(hist, 0, sizeof(ptpprobe_hist_t));
+    ptpprobe_reset_request[stage] = false;
+  }
+
+  // Find the bucket from the number of whole microseconds.
+  for (uint32_t us = ns / 1000u; (us > 0) && (bucket < (PTPPROBE_BUCKET_COUNT - 1)); us >>= 1) bucket += 1;
+
+  if ((hist->count == 0) || (ns < hist->min)) hist->min = ns;
+  if (ns > hist->max) hist->max = ns;
+  hist->sum += ns;
+  hist->buckets[bucket] += 1;
+  hist->count += 1;
+}
+
+// Called from the Ethernet interrupt when a frame has been received.
+void ptpprobe_irq(void)
+{
+  ptptime_raw_t now;
+
+  ptpprobe_irq_cycles = DWT->CYCCNT;
+  ethptp_get_time_raw(&now);
+  ptpprobe_irq_sec = now.tv_sec;
+  ptpprobe_irq_subsec = now.tv_subsec;
+}
+
+// Called from the Ethernet thread as each frame is taken from the DMA.
+void ptpprobe_linkinput(void)
+{
+  ptpprobe_input_cycles = DWT->CYCCNT;
+}
+
+// Called from the Ethernet thread when the frame taken from the DMA is a PTP
+// message with the given hardware receive timestamp in the hardware format.
+void ptpprobe_input(int32_t time_sec, uint32_t time_subsec)
+{
+  int64_t delta;
+
+  // Frames received while the ring is drained have timestamps later than
+  // the interrupt, as do all frames after a step of the clock. Skip them.
+  // A second is the most that is recorded, so the subseconds of the delta
+  // convert directly.
+  delta = ((int64_t) (ptpprobe_irq_sec - time_sec) * ETHPTP_SUBSEC_PER_SEC) +
+          ((int64_t) ptpprobe_irq_subsec - (int64_t) time_subsec);
+  if ((delta >= 0) && (delta < ETHPTP_SUBSEC_PER_SEC))
+  {
+    ptpprobe_record(PTPPROBE_STAGE_IRQ, (uint32_t) ethptp_subsec_to_nsec((uint32_t) delta));
+    ptpprobe_record(PTPPROBE_STAGE_INPUT, ptpprobe_cycles_to_ns(ptpprobe_input_cycles - ptpprobe_irq_cycles));
+  }
+}
+
+// Called from the Ethernet thread as the PTP message is queued. Returns the
+// stamp to be queued with the message.
+uint32_t ptpprobe_enqueue(void)
+{
+  uint32_t cycles = DWT->CYCCNT;
+
+  ptpprobe_record(PTPPROBE_STAGE_ENQUEUE, ptpprobe_cycles_to_ns(cycles - ptpprobe_input_cycles));
+
+  return cycles;
+}
+
+// Called from the PTP thread as the PTP message is taken from the queue with
+// the stamp queued with it.
+void ptpprobe_dequeue(uint32_t stamp)
+{
+  ptpprobe_dequeue_cycles = DWT->CYCCNT;
+  ptpprobe_dequeue_valid = true;
+
+  ptpprobe_record(PTPPROBE_STAGE_DEQUEUE, ptpprobe_cycles_to_ns(ptpprobe_dequeue_cycles - stamp));
+}
+
+// Called from the PTP thread as the servo is updated from the last message.
+void ptpprobe_servo(void)
+{
+  if (!ptpprobe_dequeue_valid) return;
+  ptpprobe_dequeue_valid = false;
+
+  ptpprobe_record(PTPPROBE_STAGE_SERVO, ptpprobe_cycles_to_ns(DWT->CYCCNT - ptpprobe_dequeue_cycles));
+}
+
+// Get the histogram of a stage.
+void ptpprobe_get(ptpprobe_stage_t stage, ptpprobe_hist_t *hist)
+{
+  if (stage >= PTPPROBE_STAGE_COUNT) return;
+
+  // An unserved reset reads as an empty histogram.
+  if (ptpprobe_reset_request[stage])
+    memset(hist, 0, sizeof(ptpprobe_hist_t));
+  else
+    memcpy(hist, &ptpprobe_hists[stage], sizeof(ptpprobe_hist_t));
+}
+
+// Reset the histograms of all stages.
+void ptpprobe_reset(void)
+{
+  for (uint32_t i = 0; i < PTPPROBE_STAGE_COUNT; ++i) ptpprobe_reset_request[i] = true;
+}
+
+// Show the latency histograms.
+static bool ptpprobe_shell_command(int argc, char **argv)
+{
+  bool needs_help = false;
+  ptpprobe_hist_t hist;
+
+  // Parse the command.
+  if (argc > 1)
+  {
+    if (!strcasecmp(argv[1], "reset"))
+    {
+      ptpprobe_reset();
+      return true;
+    }
+    needs_help = true;
+  }
+
+  // Print help.
+  if (needs_help)
+  {
+    shell_puts("Usage:\n");
+    shell_printf("    %s [reset]\n", argv[0]);
+    return true;
+  }
+
+  // Print the statistics of each stage.
+  shell_puts("stage       count    min ns   mean ns    max ns\n");
+  for (uint32_t i = 0; i < PTPPROBE_STAGE_COUNT; ++i)
+  {
+    ptpprobe_get((ptpprobe_stage_t) i, &hist);
+    shell_printf("%-8s %8u %9u %9u %9u\n", ptpprobe_names[i], (unsigned) hist.count,
+                 (unsigned) hist.min, hist.count ? (unsigned) (hist.sum / hist.count) : 0u,
+                 (unsigned) hist.max);
+  }
+
+  // Print the histogram of each stage. Bucket limits are in microseconds.
+  shell_puts("\nus     ");
+  for (uint32_t j = 0; j < PTPPROBE_BUCKET_COUNT - 1; ++j) shell_printf(" <%-5u", 1u << j);
+  shell_puts(" more\n");
+  for (uint32_t i = 0; i < PTPPROBE_STAGE_COUNT; ++i)
+  {
+    ptpprobe_get((ptpprobe_stage_t) i, &hist);
+    shell_printf("%-7s", ptpprobe_names[i]);
+    for (uint32_t j = 0; j < PTPPROBE_BUCKET_COUNT; ++j) shell_printf(" %6u", (unsigned) hist.buckets[j]);
+    shell_puts("\n");
+  }
+
+  return true;
+}
+
+// Initialize the PTP latency probes.
+void ptpprobe_init(void)
+{
+  // Start with empty histograms.
+  memset(ptpprobe_hists, 0, sizeof(ptpprobe_hists));
+
+  // Initialize the shell command.
+  shell_add_command("ptplat", ptpprobe_shell_command);
+}
@@ -0,0 +1,52 @@
+#ifndef __PTPPROBE_H__
+#define __PTPPROBE_H__
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Stages of a received PTP message. Each measures the time from the previous
+// stage, the first from the hardware receive timestamp.
+typedef enum
+{
+  PTPPROBE_STAGE_IRQ = 0,     // Hardware timestamp to Ethernet interrupt.
+  PTPPROBE_STAGE_INPUT,       // Ethernet interrupt to Ethernet link input.
+  PTPPROBE_STAGE_ENQUEUE,     // Ethernet link input to PTP queue.
+  PTPPROBE_STAGE_DEQUEUE,     // PTP queue to PTP thread.
+  PTPPROBE_STAGE_SERVO,       // PTP thread to servo update.
+  PTPPROBE_STAGE_COUNT
+} ptpprobe_stage_t;
+
+// Number of histogram buckets. The first bucket counts latencies under one
+// microsecond, each following bucket doubles the upper limit and the last
+// counts everything longer.
+#define PTPPROBE_BUCKET_COUNT     16
+
+// Latency histogram of a stage in nanoseconds.
+typedef struct ptpprobe_hist_s
+{
+  uint32_t count;
+  uint32_t min;
+  uint32_t max;
+  uint64_t sum;
+  uint32_t buckets[PTPPROBE_BUCKET_COUNT];
+} ptpprobe_hist_t;
+
+void ptpprobe_init(void);
+void ptpprobe_irq(void);
+void ptpprobe_linkinput(void);
+void ptpprobe_input(int32_t time_sec, uint32_t time_subsec);
+uint32_t ptpprobe_enqueue(void);
+void ptpprobe_dequeue(uint32_t stamp);
+void ptpprobe_servo(void);
+void ptpprobe_get(ptpprobe_stage_t stage, ptpprobe_hist_t *hist);
+void ptpprobe_reset(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif  // __PTPPROBE_H__
@@ -12,6 +12,12 @@
 // Indicates when system time becomes valid.
 static bool systime_valid = false;
 
+// Coarse system time latched on each OS tick. Two copies are kept and the
+// sequence selects the latest, so a reader that interrupts an update reads
+// the copy not being written and never waits on the writer.
+static volatile uint32_t systime_coarse_seq = 0;
+static volatile int64_t systime_coarse[2];
+
 // Name of days.
 static char *days[7] = {"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" };
 
@@ -87,6 +93,39 @@ int64_t systime_get(void)
   return systime;
 }
 
+// Latch the coarse system time. Called from the OS tick interrupt.
+void systime_tick(void)
+{
+  uint32_t seq = systime_coarse_seq + 1;
+
+  // The Ethernet clock is not running until system time is initialized.
+  if (!systime_valid) return;
+
+  // Write the copy not being read and then publish it.
+  systime_coarse[seq & 1] = systime_get();
+  __DMB();
+  systime_coarse_seq = seq;
+}
+
+// Get the system time as nanoseconds since 1970 as of the last OS tick. This
+// is cheaper than systime_get() for callers that do not need nanoseconds.
+int64_t systime_get_coarse(void)
+{
+  uint32_t seq;
+  int64_t systime;
+
+  // Retry if the copy was rewritten while being read.
+  do
+  {
+    seq = systime_coarse_seq;
+    __DMB();
+    systime = systime_coarse[seq & 1];
+    __DMB();
+  } while (seq != systime_coarse_seq);
+
+  return systime;
+}
+
 // Set the system time as nanoseconds since 1970.
 void systime_set(int64_t systime)
 {
@@ -148,13 +187,15 @@ size_t systime_log(char *buffer, size_t buflen)
 {
   time_t seconds1970;
   struct tm now;
-  ptptime_t ptptime;
 
-  // Get the ethernet time values.
-  ethptp_get_time(&ptptime);
+  // Get the seconds since 1970 (Unix epoch). Log times need no more than
+  // the coarse time.
+  seconds1970 = (time_t) (systime_get_coarse() / 1000000000);
 
-  // Get the seconds since 1970 (Unix epoch).
-  seconds1970 = (time_t) ptptime.tv_sec;
+#ifdef USE_SYSTIME_GPS_EPOCH
+  // Adjust back to time since 1970 (Unix epoch).
+  seconds1970 += 315964800;
+#endif
 
   // Break the seconds to a time structure.
   _localtime_r(&seconds1970, &now);
@@ -12,6 +12,8 @@ extern "C" {
 void systime_init(void);
 bool systime_is_valid(void);
 int64_t systime_get(void);
+int64_t systime_get_coarse(void);
+void systime_tick(void);
 void systime_set(int64_t systime);
 void systime_adjust(int32_t adjustment);
 size_t systime_str(char *buffer, size_t buflen);
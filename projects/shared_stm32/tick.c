@@ -1,6 +1,7 @@
 #include "cmsis_os2.h"
 #include "rtx_lib.h"
 #include "tick.h"
+#include "systime.h"
 #include "shell.h"
 #include CMSIS_device_header
 
@@ -103,6 +104,9 @@ void OS_Tick_AcknowledgeIRQ(void)
   total_count++;
   if (osRtxThreadGetRunning() == osRtxInfo.thread.idle) idle_count++;
 
+  // Latch the coarse system time.
+  systime_tick();
+
   (void) SysTick->CTRL;
 }
 